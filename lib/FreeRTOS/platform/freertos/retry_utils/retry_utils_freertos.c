@@ -99,3 +99,78 @@ void RetryUtils_ParamsReset( RetryUtilsParams_t * pRetryParams )
 }
 
 /*-----------------------------------------------------------*/
+
+void RetryUtils_JitterParamsReset( RetryUtilsJitterParams_t * pRetryParams )
+{
+    if( pRetryParams->baseBackoffMs == 0U )
+    {
+        pRetryParams->baseBackoffMs = RETRY_UTILS_BASE_BACKOFF_MS;
+    }
+
+    if( pRetryParams->maxBackoffMs < pRetryParams->baseBackoffMs )
+    {
+        pRetryParams->maxBackoffMs = ( RETRY_UTILS_MAX_BACKOFF_MS > pRetryParams->baseBackoffMs ) ?
+                                     RETRY_UTILS_MAX_BACKOFF_MS : pRetryParams->baseBackoffMs;
+    }
+
+    /* Reset attempts done to zero so that the next retry cycle can start. */
+    pRetryParams->attemptsDone = 0;
+
+    /* The first delay is picked between the base value and three times the base value. */
+    pRetryParams->lastBackoffMs = pRetryParams->baseBackoffMs;
+}
+
+/*-----------------------------------------------------------*/
+
+RetryUtilsStatus_t RetryUtils_DecorrelatedBackoffAndSleep( RetryUtilsJitterParams_t * pRetryParams,
+                                                           uint32_t * pBackoffMs )
+{
+    RetryUtilsStatus_t status = RetryUtilsRetriesExhausted;
+    uint32_t backOffDelayMs = 0;
+    uint32_t upperBoundMs;
+
+    /* If pRetryParams->maxRetryAttempts is set to 0, try forever. */
+    if( ( pRetryParams->attemptsDone < pRetryParams->maxRetryAttempts ) ||
+        ( 0U == pRetryParams->maxRetryAttempts ) )
+    {
+        /* Upper bound of three times the previous delay, without overflowing past the max delay. */
+        if( pRetryParams->lastBackoffMs > ( pRetryParams->maxBackoffMs / 3U ) )
+        {
+            upperBoundMs = pRetryParams->maxBackoffMs;
+        }
+        else
+        {
+            upperBoundMs = 3U * pRetryParams->lastBackoffMs;
+        }
+
+        /* Choose a random value for back-off time between the base and the upper bound. */
+        backOffDelayMs = pRetryParams->baseBackoffMs +
+                         ( uxRand() % ( upperBoundMs - pRetryParams->baseBackoffMs + 1U ) );
+
+        /*  Wait for backoff time to expire for the next retry. */
+        vTaskDelay( pdMS_TO_TICKS( backOffDelayMs ) );
+
+        /* Increment backoff counts. */
+        pRetryParams->attemptsDone++;
+        pRetryParams->lastBackoffMs = backOffDelayMs;
+
+        status = RetryUtilsSuccess;
+    }
+    else
+    {
+        /* When max retry attempts are exhausted, let application know by
+         * returning RetryUtilsRetriesExhausted. Application may choose to
+         * restart the retry process after calling RetryUtils_JitterParamsReset(). */
+        status = RetryUtilsRetriesExhausted;
+        RetryUtils_JitterParamsReset( pRetryParams );
+    }
+
+    if( pBackoffMs != NULL )
+    {
+        *pBackoffMs = backOffDelayMs;
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
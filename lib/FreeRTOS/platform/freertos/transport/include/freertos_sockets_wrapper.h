@@ -90,4 +90,18 @@ void Sockets_Disconnect( Socket_t tcpSocket );
  */
 void Sockets_SetReceiveTimeout( Socket_t tcpSocket, uint32_t timeoutMS );
 
+#if ( ipconfigSOCKET_HAS_USER_WAKE_CALLBACK == 1 )
+
+/**
+ * @brief Register a callback invoked from the IP task whenever the socket has
+ * an event of interest (data received, space freed in the send buffer or the
+ * connection state changed).
+ *
+ * @param[in] tcpSocket The socket descriptor.
+ * @param[in] wakeupCallback Callback to invoke, NULL to unregister.
+ */
+    void Sockets_SetWakeupCallback( Socket_t tcpSocket,
+                                    SocketWakeupCallback_t wakeupCallback );
+#endif
+
 #endif /* ifndef FREERTOS_SOCKETS_WRAPPER_H_ */
@@ -211,4 +211,33 @@ int32_t TLS_FreeRTOS_send( const NetworkContext_t * pNetworkContext,
 
 void TLS_FreeRTOS_SetRecvTimeout( NetworkContext_t * pNetworkContext, uint32_t timeoutMS );
 
+/**
+ * @brief Check, without blocking, whether a call to #TLS_FreeRTOS_recv would
+ * make progress.
+ *
+ * Returns pdTRUE when decrypted bytes are already buffered by mbed TLS, when
+ * the TCP socket holds unread bytes, or when the connection is no longer
+ * established (so that the caller reads and observes the error).
+ *
+ * @param[in] pNetworkContext The network context.
+ *
+ * @return pdTRUE if receive should be called, pdFALSE otherwise.
+ */
+BaseType_t TLS_FreeRTOS_IsDataAvailable( const NetworkContext_t * pNetworkContext );
+
+#if ( ipconfigSOCKET_HAS_USER_WAKE_CALLBACK == 1 )
+
+/**
+ * @brief Register a callback called by the IP task on socket activity.
+ *
+ * The callback runs in the context of the IP task and must only signal the
+ * task that owns the connection.
+ *
+ * @param[in] pNetworkContext The network context.
+ * @param[in] wakeupCallback Callback, or NULL to unregister.
+ */
+    void TLS_FreeRTOS_SetWakeupCallback( NetworkContext_t * pNetworkContext,
+                                         SocketWakeupCallback_t wakeupCallback );
+#endif
+
 #endif /* ifndef TLS_FREERTOS_H_ */
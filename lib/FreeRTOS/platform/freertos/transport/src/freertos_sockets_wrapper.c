@@ -192,3 +192,20 @@ void Sockets_SetReceiveTimeout( Socket_t tcpSocket, uint32_t timeoutMS )
 }
 
 /*-----------------------------------------------------------*/
+
+#if ( ipconfigSOCKET_HAS_USER_WAKE_CALLBACK == 1 )
+
+    void Sockets_SetWakeupCallback( Socket_t tcpSocket,
+                                    SocketWakeupCallback_t wakeupCallback )
+    {
+        /* The socket option takes the callback itself as the option value. */
+        ( void ) FreeRTOS_setsockopt( tcpSocket,
+                                      0,
+                                      FREERTOS_SO_WAKEUP_CALLBACK,
+                                      ( void * ) wakeupCallback,
+                                      sizeof( void * ) );
+    }
+
+#endif /* if ( ipconfigSOCKET_HAS_USER_WAKE_CALLBACK == 1 ) */
+
+/*-----------------------------------------------------------*/
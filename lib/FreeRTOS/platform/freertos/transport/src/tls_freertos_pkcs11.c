@@ -45,6 +45,7 @@
 
 /* FreeRTOS includes. */
 #include "FreeRTOS.h"
+#include "task.h"
 
 /* FreeRTOS+TCP includes. */
 #include "FreeRTOS_IP.h"
@@ -82,6 +83,13 @@ static const char * pNoHighLevelMbedTlsCodeStr = "<No-High-Level-Error-Code>";
  */
 static const char * pNoLowLevelMbedTlsCodeStr = "<No-Low-Level-Error-Code>";
 
+/**
+ * @brief Number of connections using mbedTLS. The mutex functions of mbedTLS are global, so they are
+ * only set by the first connection and cleared by the last one, for instance when the MQTT connection
+ * and the OTA HTTP download are open at the same time.
+ */
+static UBaseType_t mbedtlsUsers = 0U;
+
 /**
  * @brief Utility for converting the high-level code in an mbedTLS error to string,
  * if the code-contains a high-level code; otherwise, using a default string.
@@ -135,6 +143,11 @@ static TlsTransportStatus_t tlsSetup( NetworkContext_t * pNetworkContext,
  */
 static TlsTransportStatus_t initMbedtls( void );
 
+/**
+ * @brief Releases mbedTLS once the last connection using it is closed.
+ */
+static void freeMbedtls( void );
+
 /*-----------------------------------------------------------*/
 
 /**
@@ -472,10 +485,18 @@ static TlsTransportStatus_t initMbedtls( void )
     TlsTransportStatus_t returnStatus = TLS_TRANSPORT_SUCCESS;
 
     /* Set the mutex functions for mbed TLS thread safety. */
-    mbedtls_threading_set_alt( mbedtls_platform_mutex_init,
-                               mbedtls_platform_mutex_free,
-                               mbedtls_platform_mutex_lock,
-                               mbedtls_platform_mutex_unlock );
+    taskENTER_CRITICAL();
+
+    if( mbedtlsUsers == 0U )
+    {
+        mbedtls_threading_set_alt( mbedtls_platform_mutex_init,
+                                   mbedtls_platform_mutex_free,
+                                   mbedtls_platform_mutex_lock,
+                                   mbedtls_platform_mutex_unlock );
+    }
+
+    mbedtlsUsers++;
+    taskEXIT_CRITICAL();
 
     if( returnStatus == TLS_TRANSPORT_SUCCESS )
     {
@@ -487,6 +508,24 @@ static TlsTransportStatus_t initMbedtls( void )
 
 /*-----------------------------------------------------------*/
 
+static void freeMbedtls( void )
+{
+    /* Clear the mutex functions for mbed TLS thread safety. */
+    taskENTER_CRITICAL();
+
+    configASSERT( mbedtlsUsers > 0U );
+    mbedtlsUsers--;
+
+    if( mbedtlsUsers == 0U )
+    {
+        mbedtls_threading_free_alt();
+    }
+
+    taskEXIT_CRITICAL();
+}
+
+/*-----------------------------------------------------------*/
+
 static int generateRandomBytes( void * pvCtx,
                                     unsigned char * pucRandom,
                                     size_t xRandomLength )
@@ -796,6 +835,7 @@ TlsTransportStatus_t TLS_FreeRTOS_Connect( NetworkContext_t * pNetworkContext,
 {
     TlsTransportStatus_t returnStatus = TLS_TRANSPORT_SUCCESS;
     BaseType_t socketStatus = 0;
+    BaseType_t isMbedtlsInitialized = pdFALSE;
 
     if( ( pNetworkContext == NULL ) ||
         ( pHostName == NULL ) ||
@@ -840,6 +880,7 @@ TlsTransportStatus_t TLS_FreeRTOS_Connect( NetworkContext_t * pNetworkContext,
     if( returnStatus == TLS_TRANSPORT_SUCCESS )
     {
         returnStatus = initMbedtls();
+        isMbedtlsInitialized = ( returnStatus == TLS_TRANSPORT_SUCCESS ) ? pdTRUE : pdFALSE;
     }
 
     /* Perform TLS handshake. */
@@ -856,6 +897,11 @@ TlsTransportStatus_t TLS_FreeRTOS_Connect( NetworkContext_t * pNetworkContext,
         {
             ( void ) FreeRTOS_closesocket( pNetworkContext->tcpSocket );
         }
+
+        if( isMbedtlsInitialized == pdTRUE )
+        {
+            freeMbedtls();
+        }
     }
     else
     {
@@ -906,8 +952,7 @@ void TLS_FreeRTOS_Disconnect( NetworkContext_t * pNetworkContext )
     /* Free mbed TLS contexts. */
     sslContextFree( &( pNetworkContext->sslContext ) );
 
-    /* Clear the mutex functions for mbed TLS thread safety. */
-    mbedtls_threading_free_alt();
+    freeMbedtls();
 }
 
 /*-----------------------------------------------------------*/
@@ -993,3 +1038,43 @@ void TLS_FreeRTOS_SetRecvTimeout( NetworkContext_t * pNetworkContext, uint32_t t
 {
 	Sockets_SetReceiveTimeout( pNetworkContext->tcpSocket, timeoutMS );
 }
+
+/*-----------------------------------------------------------*/
+
+BaseType_t TLS_FreeRTOS_IsDataAvailable( const NetworkContext_t * pNetworkContext )
+{
+    BaseType_t isAvailable = pdFALSE;
+
+    if( mbedtls_ssl_get_bytes_avail( &( pNetworkContext->sslContext.context ) ) > 0U )
+    {
+        isAvailable = pdTRUE;
+    }
+    else if( FreeRTOS_recvcount( pNetworkContext->tcpSocket ) != 0 )
+    {
+        /* Unread bytes or an error reported by the socket. */
+        isAvailable = pdTRUE;
+    }
+    else if( FreeRTOS_issocketconnected( pNetworkContext->tcpSocket ) != pdTRUE )
+    {
+        /* Let the reader observe the closed connection. */
+        isAvailable = pdTRUE;
+    }
+    else
+    {
+        /* Empty else marker. */
+    }
+
+    return isAvailable;
+}
+
+/*-----------------------------------------------------------*/
+
+#if ( ipconfigSOCKET_HAS_USER_WAKE_CALLBACK == 1 )
+
+    void TLS_FreeRTOS_SetWakeupCallback( NetworkContext_t * pNetworkContext,
+                                         SocketWakeupCallback_t wakeupCallback )
+    {
+        Sockets_SetWakeupCallback( pNetworkContext->tcpSocket, wakeupCallback );
+    }
+
+#endif /* if ( ipconfigSOCKET_HAS_USER_WAKE_CALLBACK == 1 ) */
@@ -188,6 +188,21 @@
  */
 #define MAX_JITTER_VALUE_SECONDS         5U
 
+/**
+ * @brief Default base value in milliseconds of the decorrelated jitter backoff.
+ */
+#ifndef RETRY_UTILS_BASE_BACKOFF_MS
+    #define RETRY_UTILS_BASE_BACKOFF_MS    100U
+#endif
+
+/**
+ * @brief Default max backoff value in milliseconds of the decorrelated jitter
+ * backoff.
+ */
+#ifndef RETRY_UTILS_MAX_BACKOFF_MS
+    #define RETRY_UTILS_MAX_BACKOFF_MS    30000U
+#endif
+
 /**
  * @brief Status for @ref RetryUtils_BackoffAndSleep.
  */
@@ -220,6 +235,51 @@ typedef struct RetryUtilsParams
     uint32_t nextJitterMax;
 } RetryUtilsParams_t;
 
+/**
+ * @brief Represents parameters required for the decorrelated jitter retry
+ * logic, which works in milliseconds.
+ *
+ * Each delay is picked at random between the base value and three times the
+ * previous delay, capped to the max value:
+ *
+ * > sleep_ms = min( max_ms, random_between( base_ms, 3 * previous_sleep_ms ) )
+ *
+ * Consecutive delays are not tied to the attempt count, which spreads the
+ * reconnections of many clients better than plain exponential backoff while
+ * keeping the first retries in the range of the base value.
+ */
+typedef struct RetryUtilsJitterParams
+{
+    /**
+     * @brief Max number of retry attempts. Set this value to 0 if the client must
+     * retry forever.
+     */
+    uint32_t maxRetryAttempts;
+
+    /**
+     * @brief The cumulative count of backoff delay cycles completed
+     * for retries.
+     */
+    uint32_t attemptsDone;
+
+    /**
+     * @brief The smallest backoff delay in milliseconds, set to
+     * #RETRY_UTILS_BASE_BACKOFF_MS by @ref RetryUtils_JitterParamsReset when 0.
+     */
+    uint32_t baseBackoffMs;
+
+    /**
+     * @brief The largest backoff delay in milliseconds, set to
+     * #RETRY_UTILS_MAX_BACKOFF_MS by @ref RetryUtils_JitterParamsReset when 0.
+     */
+    uint32_t maxBackoffMs;
+
+    /**
+     * @brief The backoff delay of the previous retry attempt in milliseconds.
+     */
+    uint32_t lastBackoffMs;
+} RetryUtilsJitterParams_t;
+
 
 /**
  * @brief Resets the retry timeout value and number of attempts.
@@ -242,4 +302,28 @@ void RetryUtils_ParamsReset( RetryUtilsParams_t * pRetryParams );
  */
 RetryUtilsStatus_t RetryUtils_BackoffAndSleep( RetryUtilsParams_t * pRetryParams );
 
+/**
+ * @brief Resets the number of attempts and the previous delay of the
+ * decorrelated jitter backoff. The application sets
+ * @ref RetryUtilsJitterParams_t.maxRetryAttempts and optionally the base and
+ * max delays before calling this function.
+ *
+ * @param[in, out] pRetryParams Structure containing the retry parameters.
+ */
+void RetryUtils_JitterParamsReset( RetryUtilsJitterParams_t * pRetryParams );
+
+/**
+ * @brief Decorrelated jitter backoff function with millisecond granularity.
+ * This function will block the calling task for a random delay between the
+ * base delay and three times the previous delay, capped to the max delay.
+ *
+ * @param[in, out] pRetryParams Structure containing retry parameters.
+ * @param[out] pBackoffMs Optional, set to the delay slept in milliseconds.
+ *
+ * @return #RetryUtilsSuccess after a successful sleep, #RetryUtilsRetriesExhausted
+ * when all attempts are exhausted.
+ */
+RetryUtilsStatus_t RetryUtils_DecorrelatedBackoffAndSleep( RetryUtilsJitterParams_t * pRetryParams,
+                                                           uint32_t * pBackoffMs );
+
 #endif /* ifndef RETRY_UTILS_H_ */
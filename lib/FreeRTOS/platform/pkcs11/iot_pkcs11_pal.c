@@ -41,8 +41,9 @@
 #include "core_pkcs11_config.h"
 #include "tls_freertos_pkcs11.h"
 
-/* Flash write */
+/* Flash storage */
 #include "mflash_file.h"
+#include "kv_store.h"
 
 /* C runtime includes. */
 #include <stdio.h>
@@ -68,7 +69,8 @@ enum eObjectHandles
     eAwsThingEndpoint
 };
 
-/* Flash structure */
+/* Sector per file layout used by earlier versions, whose files are moved to the
+ * key/value store the first time it is mounted. */
 mflash_file_t g_cert_files[] =
 {
     { .path = pkcs11palFILE_NAME_CLIENT_CERTIFICATE,
@@ -90,6 +92,27 @@ mflash_file_t g_cert_files[] =
 };
 
 
+/*-----------------------------------------------------------*/
+
+/* Copies the files stored by earlier versions to the key/value store, unless
+ * the store already holds a newer value. The files are left in place. */
+static void prvMigrateLegacyFiles( void )
+{
+    mflash_file_t * pxFile;
+    uint8_t * pucData = NULL;
+    uint32_t ulDataSize = 0;
+
+    for( pxFile = g_cert_files; pxFile->path[ 0 ] != '\0'; pxFile++ )
+    {
+        if( ( KVStore_Get( pxFile->path, NULL, 0, NULL ) == KVStoreNotFound ) &&
+            ( pdTRUE == mflash_read_file( pxFile->path, &pucData, &ulDataSize ) ) )
+        {
+            /* A file which does not fit is dropped, as it is when saved. */
+            ( void ) KVStore_Set( pxFile->path, pucData, ulDataSize );
+        }
+    }
+}
+
 /*-----------------------------------------------------------*/
 
 /* Converts a label to its respective filename and handle. */
@@ -175,7 +198,7 @@ CK_OBJECT_HANDLE PKCS11_PAL_SaveObject( CK_ATTRIBUTE_PTR pxLabel,
 
     if( xHandle != eInvalidHandle )
     {
-        if( pdFALSE == mflash_save_file( pcFileName, pucData, ulDataSize ) )
+        if( KVStoreSuccess != KVStore_Set( pcFileName, pucData, ulDataSize ) )
         {
             xHandle = eInvalidHandle;
         }
@@ -208,8 +231,12 @@ CK_OBJECT_HANDLE PKCS11_PAL_FindObject( uint8_t * pLabel,
     /* Translate from the PKCS#11 label to local storage file name. */
     prvLabelToFilenameHandle( pLabel, &pcFileName, &xHandle );
 
-    /*TODO: check if file actually there.
-     * Note: g_cert_files only seems to check if the entry in the array is present */
+    /* The object exists only if its file is in the store. */
+    if( ( xHandle != eInvalidHandle ) &&
+        ( KVStoreNotFound == KVStore_Get( pcFileName, NULL, 0, NULL ) ) )
+    {
+        xHandle = eInvalidHandle;
+    }
 
     return xHandle;
 }
@@ -247,6 +274,7 @@ CK_RV PKCS11_PAL_GetObjectValue( CK_OBJECT_HANDLE xHandle,
 {
     char * pcFileName = NULL;
     CK_RV ulReturn = CKR_OK;
+    size_t xValueLength = 0;
 
     if( xHandle == eAwsDeviceCertificate )
     {
@@ -284,11 +312,35 @@ CK_RV PKCS11_PAL_GetObjectValue( CK_OBJECT_HANDLE xHandle,
         ulReturn = CKR_KEY_HANDLE_INVALID;
     }
 
-    if( pdFALSE == mflash_read_file( pcFileName, ppucData, pulDataSize ) )
+    /* The value is copied out of the store, whose records move when their
+     * sectors are reclaimed. */
+    if( ( ulReturn == CKR_OK ) &&
+        ( KVStoreBufferTooSmall != KVStore_Get( pcFileName, NULL, 0, &xValueLength ) ) )
     {
         ulReturn = CKR_FUNCTION_FAILED;
     }
 
+    if( ulReturn == CKR_OK )
+    {
+        /* Freed by PKCS11_PAL_GetObjectValueCleanup(). */
+        *ppucData = pvPortMalloc( ( xValueLength > 0 ) ? xValueLength : 1 );
+
+        if( *ppucData == NULL )
+        {
+            ulReturn = CKR_DEVICE_MEMORY;
+        }
+        else if( KVStoreSuccess != KVStore_Get( pcFileName, *ppucData, xValueLength, &xValueLength ) )
+        {
+            vPortFree( *ppucData );
+            *ppucData = NULL;
+            ulReturn = CKR_FUNCTION_FAILED;
+        }
+        else
+        {
+            *pulDataSize = xValueLength;
+        }
+    }
+
     return ulReturn;
 }
 
@@ -303,12 +355,13 @@ CK_RV PKCS11_PAL_GetObjectValue( CK_OBJECT_HANDLE xHandle,
 void PKCS11_PAL_GetObjectValueCleanup( uint8_t * pucData,
                                        uint32_t ulDataSize )
 {
-    /* Unused parameters. */
-    ( void ) pucData;
+    /* Unused parameter. */
     ( void ) ulDataSize;
 
-    /* Since no buffer was allocated on heap, there is no cleanup
-     * to be done. */
+    if( pucData != NULL )
+    {
+        vPortFree( pucData );
+    }
 }
 
 
@@ -328,10 +381,15 @@ CK_RV PKCS11_PAL_Initialize( void )
     if( !mflash_is_initialized() )
     {
         /* Initialize flash storage. */
-        if( pdTRUE != mflash_init( g_cert_files, 1 ) )
+        if( ( pdTRUE != mflash_init( g_cert_files, 1 ) ) ||
+            ( pdTRUE != KVStore_Init() ) )
         {
             xResult = CKR_GENERAL_ERROR;
         }
+        else
+        {
+            prvMigrateLegacyFiles();
+        }
     }
 
     return xResult;
@@ -65,14 +65,21 @@ static struct boot_image_header *boot_get_image_header(const void *addr)
 
 
 static int boot_image_validate(const void *addr)
+{
+    return boot_image_check(addr, (void *)BOOT_EXEC_IMAGE_ADDR);
+}
+
+
+/* Validates the boot image at given address and checks that it is linked to be executed at 'load_addr' */
+int32_t boot_image_check(const void *img, const void *load_addr)
 {
     struct boot_image_header *bih;
 
     /* get the image header */
-    bih = boot_get_image_header(addr);
+    bih = boot_get_image_header(img);
 
     /* check load address */
-    if (bih == NULL || bih->load_address != BOOT_EXEC_IMAGE_ADDR)
+    if (bih == NULL || bih->load_address != (uint32_t)load_addr)
     {
         return -1;
     }
@@ -81,6 +88,26 @@ static int boot_image_validate(const void *addr)
 }
 
 
+/* Returns the length of the valid boot image at given address, 0 if the image is not valid */
+static uint32_t boot_image_length(const void *img)
+{
+    struct boot_image_header *bih;
+
+    bih = boot_get_image_header(img);
+    if (bih == NULL || bih->image_length == 0)
+        return 0;
+
+    return bih->image_length + 4;
+}
+
+
+/* Returns the address of the image being executed, from the vector table set up by 'boot_app_exec' */
+void *boot_exec_image(void)
+{
+    return (void *)SCB->VTOR;
+}
+
+
 /* Validates boot image and copies it to given address of FLASH, returns number of bytes copied upon success */
 static int32_t boot_image_copy(void *flash_dst, const void *img)
 {
@@ -193,13 +220,43 @@ int32_t boot_update_request(void *update_img, void *backup_storage)
     return boot_ucb_write(&ucb);
 }
 
+/* Schedules an update executed in place from its slot for next reboot, 'update_img' has to be linked
+ * at its own address. The executing image stays in its slot for rollback, so no image is copied.
+ */
+int32_t boot_slot_request(void *update_img)
+{
+    struct boot_ucb ucb;
+    void *exec_img = boot_exec_image();
+
+    /* the update has to be executable in place, and not overwrite the executing image */
+    if ((update_img == exec_img) || (0 != boot_image_check(update_img, update_img)))
+    {
+        return -1;
+    }
+
+    /* prepare and write update control block */
+    memset((void *)&ucb, 0xFF, sizeof(ucb));
+    ucb.signature = BOOT_UCB_SIGNATURE;
+    ucb.version = BOOT_UCB_VERSION;
+    ucb.flags &= ~BOOT_UCB_FLAG_SLOTS;
+    ucb.state = BOOT_STATE_NEW;
+    ucb.update_img = update_img;
+    ucb.update_img_size = boot_image_length(update_img);
+    ucb.rollback_img = exec_img;
+    ucb.rollback_img_size = boot_image_length(exec_img);
+
+    /* store update control block in FLASH and return */
+    return boot_ucb_write(&ucb);
+}
+
 /* Once update image is running and approved, overwrite the rollback image */
 int32_t boot_overwrite_rollback(void)
 {
     struct boot_ucb ucb;
     int32_t result = 0;
 
-    if (boot_ucb_read(&ucb) == 0 && ucb.rollback_img != NULL)
+    /* images executed in place keep the previous image in its slot, nothing to overwrite */
+    if (boot_ucb_read(&ucb) == 0 && ucb.rollback_img != NULL && (ucb.flags & BOOT_UCB_FLAG_SLOTS) != 0)
     {
         result = boot_image_copy(ucb.rollback_img, ucb.update_img);
     }
@@ -275,6 +332,107 @@ void boot_wdtdis(void)
 }
 
 
+/* Executes the selected image, with the watchdog enabled while the image is pending commit */
+static void boot_exec(void *exec_image, const struct boot_ucb *ucbp)
+{
+    DbgConsole_Flush();
+
+    if (exec_image != NULL)
+    {
+        PRINTF(BOOT_PROMPT_STRING "About to execute application...\r\n");
+        if (ucbp->state == BOOT_STATE_PENDING_COMMIT)
+        {
+            /* enable watchdog */
+            PRINTF(BOOT_PROMPT_STRING "Enabling watchdog...\r\n");
+            boot_wdten();
+        }
+        boot_app_exec(exec_image);
+        PRINTF(BOOT_PROMPT_STRING "Application exec failed.\r\n");
+    }
+    else
+    {
+        PRINTF(BOOT_PROMPT_STRING "No valid image to boot.\r\n");
+    }
+
+    DbgConsole_Flush();
+}
+
+
+/* Processes an update control block of images executed in place and returns the image to execute.
+ * Activation, commit and rollback only change the update control block.
+ */
+static void *boot_run_slots(struct boot_ucb *ucbp)
+{
+    void *exec_image = ucbp->update_img;
+
+    switch (ucbp->state)
+    {
+    case BOOT_STATE_VOID:
+        /* the committed image, or the image rolled back to */
+        break;
+
+    case BOOT_STATE_NEW:
+        if (0 != boot_image_check(ucbp->update_img, ucbp->update_img))
+        {
+            /* the update image is invalid, keep executing the current image */
+            PRINTF(BOOT_PROMPT_STRING "Invalid update image!\r\n");
+            ucbp->update_img = ucbp->rollback_img;
+            ucbp->update_img_size = ucbp->rollback_img_size;
+            ucbp->state = BOOT_STATE_VOID;
+        }
+        else
+        {
+            PRINTF(BOOT_PROMPT_STRING "Testing update in slot %p\r\n", ucbp->update_img);
+            ucbp->state = BOOT_STATE_PENDING_COMMIT;
+        }
+        if (boot_ucb_write(ucbp) != 0)
+        {
+            PRINTF(BOOT_PROMPT_STRING "ERROR writing update control block\r\n");
+        }
+        exec_image = ucbp->update_img;
+        break;
+
+    /* reboot from test mode or image explicitly rejected, rollback */
+    case BOOT_STATE_PENDING_COMMIT:
+    case BOOT_STATE_INVALID:
+        PRINTF(BOOT_PROMPT_STRING "Rolling back to image in slot %p\r\n", ucbp->rollback_img);
+        ucbp->update_img = ucbp->rollback_img;
+        ucbp->update_img_size = ucbp->rollback_img_size;
+        ucbp->rollback_img = NULL;
+        ucbp->rollback_img_size = 0;
+        ucbp->state = BOOT_STATE_VOID;
+        if (boot_ucb_write(ucbp) != 0)
+        {
+            PRINTF(BOOT_PROMPT_STRING "ERROR writing update control block\r\n");
+        }
+        exec_image = ucbp->update_img;
+        break;
+
+    default:
+        PRINTF(BOOT_PROMPT_STRING "Unexpected state, executing default image\r\n");
+        exec_image = (void *)BOOT_EXEC_IMAGE_ADDR;
+        break;
+    }
+
+    /* last resort, any image linked for the slot it is in */
+    if (exec_image == NULL || 0 != boot_image_check(exec_image, exec_image))
+    {
+        PRINTF(BOOT_PROMPT_STRING "Slot image not valid, looking for a valid one...\r\n");
+        exec_image = NULL;
+        if (0 == boot_image_check((void *)BOOT_SLOT_A_ADDR, (void *)BOOT_SLOT_A_ADDR))
+        {
+            exec_image = (void *)BOOT_SLOT_A_ADDR;
+        }
+        else if (0 == boot_image_check((void *)BOOT_SLOT_B_ADDR, (void *)BOOT_SLOT_B_ADDR))
+        {
+            exec_image = (void *)BOOT_SLOT_B_ADDR;
+        }
+    }
+
+    return exec_image;
+}
+
+
 /* Bootloader entry point */
 int32_t boot_run(void)
 {
@@ -283,9 +441,20 @@ int32_t boot_run(void)
 
     PRINTF("\r\nSPIFI bootloader " BOOT_VERSION_STRING "\r\n");
 
+    /* switch to the quad commands to copy and to execute the images faster,
+     * "mflash_nor.o" must be placed to SRAM along with "mflash_drv.o" */
+    mflash_drv_init();
+
     /* load update control block */
     boot_ucb_read(&ucb);
 
+    if ((ucb.flags & BOOT_UCB_FLAG_SLOTS) == 0)
+    {
+        exec_image = boot_run_slots(&ucb);
+        boot_exec(exec_image, &ucb);
+        return -1;
+    }
+
     /* update control block is present, process it */
     switch (ucb.state)
     {
@@ -370,25 +539,6 @@ int32_t boot_run(void)
         break;
     }
 
-    DbgConsole_Flush();
-
-    if (exec_image != NULL)
-    {
-        PRINTF(BOOT_PROMPT_STRING "About to execute application...\r\n");
-        if (ucb.state == BOOT_STATE_PENDING_COMMIT)
-        {
-            /* enable watchdog */
-            PRINTF(BOOT_PROMPT_STRING "Enabling watchdog...\r\n");
-            boot_wdten();
-        }
-        boot_app_exec((void *)BOOT_EXEC_IMAGE_ADDR);
-        PRINTF(BOOT_PROMPT_STRING "Application exec failed.\r\n");
-    }
-    else
-    {
-        PRINTF(BOOT_PROMPT_STRING "No valid image to boot.\r\n");
-    }
-
-    DbgConsole_Flush();
+    boot_exec(exec_image, &ucb);
     return -1;
 }
@@ -44,6 +44,13 @@
 /* Adress where XIP image is flashed and executed */
 #define BOOT_EXEC_IMAGE_ADDR (BOOT_FLASH_BASE + BOOT_RESERVED_AREA)
 
+/* Size of an image slot. Images linked at the address of a slot are executed in place from it */
+#define BOOT_SLOT_SIZE (0x200000)
+
+/* Image slots: the first one is the execution address of images installed by copy */
+#define BOOT_SLOT_A_ADDR (BOOT_EXEC_IMAGE_ADDR)
+#define BOOT_SLOT_B_ADDR (BOOT_EXEC_IMAGE_ADDR + BOOT_SLOT_SIZE)
+
 /* Address of update controll block structure */
 #define BOOT_UCB_ADDR (BOOT_FLASH_BASE + BOOT_RESERVED_AREA - MFLASH_SECTOR_SIZE)
 #define BOOT_UCB_SIGNATURE 0x4243552A
@@ -55,17 +62,23 @@
 #define BOOT_STATE_INVALID             0xFF000000
 #define BOOT_STATE_VOID                0x00000000
 
+/* Update control block flags, a flag is active when its bit is cleared as erased FLASH reads as ones.
+ * BOOT_UCB_FLAG_SLOTS: the images are executed in place from their slot. The update is activated,
+ * committed and rolled back by writing the update control block, without copying any image. In the
+ * void state 'update_img' is the image to execute. */
+#define BOOT_UCB_FLAG_SLOTS 0x00000001
+
 /* Update control block structure */
 struct boot_ucb
 {
   uint32_t signature;
   uint32_t version;
-  uint32_t flags; /* reserved, not used in the current version */
+  uint32_t flags;
   uint32_t state;
   void *update_img;
-  uint32_t update_img_size; /* reserved, not used in the current version */
+  uint32_t update_img_size; /* image length, with BOOT_UCB_FLAG_SLOTS only */
   void *rollback_img;
-  uint32_t rollback_img_size; /* reserved, not used in the current version */
+  uint32_t rollback_img_size; /* image length, with BOOT_UCB_FLAG_SLOTS only */
 };
 
 
@@ -105,7 +118,10 @@ extern int32_t boot_ucb_write(const struct boot_ucb *ucbp);
 extern int32_t boot_ucb_erase(void);
 
 extern int32_t boot_update_request(void *update_img, void *backup_storage);
+extern int32_t boot_slot_request(void *update_img);
 extern int32_t boot_overwrite_rollback(void);
+extern int32_t boot_image_check(const void *img, const void *load_addr);
+extern void *boot_exec_image(void);
 extern void boot_cpureset(void);
 extern void boot_wdtdis(void);
 
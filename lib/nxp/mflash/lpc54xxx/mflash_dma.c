@@ -0,0 +1,157 @@
+/*
+ * Copyright 2017 NXP
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "mflash_dma.h"
+#include <stddef.h>
+
+/* Start the transfer of the next chunk of the copy */
+static void mflash_dma_start(mflash_dma_t *dma)
+{
+    uint32_t max = MFLASH_DMA_MAX_COUNT * dma->width;
+
+    dma->chunk = (dma->remaining < max) ? dma->remaining : max;
+    dma->transfers++;
+    dma->ops->start(dma->dst, dma->src, dma->chunk / dma->width, dma->width);
+}
+
+void mflash_dma_init(mflash_dma_t *dma, const mflash_dma_ops_t *ops)
+{
+    dma->ops       = ops;
+    dma->dst       = NULL;
+    dma->src       = NULL;
+    dma->remaining = 0;
+    dma->chunk     = 0;
+    dma->width     = 1;
+    dma->status    = kMflashDma_Idle;
+    dma->held      = false;
+    dma->deferred  = false;
+    dma->transfers = 0;
+    dma->errors    = 0;
+}
+
+bool mflash_dma_copy(mflash_dma_t *dma, void *dst, const void *src, uint32_t len)
+{
+    uintptr_t align = (uintptr_t)dst | (uintptr_t)src | len;
+
+    if (dma->status == kMflashDma_Busy)
+    {
+        return false;
+    }
+
+    if (len == 0)
+    {
+        dma->status = kMflashDma_Done;
+        return true;
+    }
+
+    /* Items as wide as all addresses allow, the controller only moves aligned items */
+    dma->width     = (0 == (align % 4)) ? 4 : ((0 == (align % 2)) ? 2 : 1);
+    dma->dst       = (uint8_t *)dst;
+    dma->src       = (const uint8_t *)src;
+    dma->remaining = len;
+    dma->status    = kMflashDma_Busy;
+
+    if (dma->held)
+    {
+        dma->deferred = true;
+    }
+    else
+    {
+        mflash_dma_start(dma);
+    }
+
+    return true;
+}
+
+bool mflash_dma_complete(mflash_dma_t *dma, bool error)
+{
+    /* Late interrupt of an aborted copy */
+    if (dma->status != kMflashDma_Busy)
+    {
+        return false;
+    }
+
+    if (error)
+    {
+        dma->status = kMflashDma_Error;
+        dma->errors++;
+        return true;
+    }
+
+    dma->dst += dma->chunk;
+    dma->src += dma->chunk;
+    dma->remaining -= dma->chunk;
+    dma->chunk = 0;
+
+    if (dma->remaining == 0)
+    {
+        dma->status = kMflashDma_Done;
+        return true;
+    }
+
+    if (dma->held)
+    {
+        dma->deferred = true;
+    }
+    else
+    {
+        mflash_dma_start(dma);
+    }
+
+    return false;
+}
+
+void mflash_dma_abort(mflash_dma_t *dma)
+{
+    if (dma->status != kMflashDma_Busy)
+    {
+        return;
+    }
+
+    if (dma->chunk != 0)
+    {
+        dma->ops->abort();
+    }
+
+    dma->chunk    = 0;
+    dma->deferred = false;
+    dma->status   = kMflashDma_Error;
+    dma->errors++;
+}
+
+void mflash_dma_hold(mflash_dma_t *dma)
+{
+    dma->held = true;
+
+    /* The end of the transfer is reported once interrupts are enabled again */
+    if (dma->chunk != 0)
+    {
+        while (dma->ops->busy())
+        {
+        }
+    }
+}
+
+void mflash_dma_release(mflash_dma_t *dma)
+{
+    dma->held = false;
+
+    if (dma->deferred)
+    {
+        dma->deferred = false;
+        mflash_dma_start(dma);
+    }
+}
+
+bool mflash_dma_stalled(mflash_dma_t *dma, uint32_t *progress)
+{
+    bool stalled = (dma->status == kMflashDma_Busy) && (false == dma->held) && (false == dma->deferred) &&
+                   (dma->transfers == *progress);
+
+    *progress = dma->transfers;
+
+    return stalled;
+}
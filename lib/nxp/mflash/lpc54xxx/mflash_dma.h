@@ -0,0 +1,85 @@
+/*
+ * Copyright 2017 NXP
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef __MFLASH_DMA_H__
+#define __MFLASH_DMA_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Copies of the flash to RAM split in DMA transfers, independent of the DMA registers.
+ * 'mflash_drv.c' runs them on a channel of the DMA controller, a model of the controller
+ * can run them on a host by providing its own 'mflash_dma_ops_t'. Only called while the flash
+ * is in memory mode, the code does not need to be placed in SRAM. */
+
+/* Largest number of items moved by one transfer of the controller */
+#ifndef MFLASH_DMA_MAX_COUNT
+#define MFLASH_DMA_MAX_COUNT (1024)
+#endif
+
+/* State of the copy */
+typedef enum _mflash_dma_status
+{
+    kMflashDma_Idle = 0, /* no copy started yet */
+    kMflashDma_Busy,     /* transfers in progress */
+    kMflashDma_Done,     /* all bytes copied */
+    kMflashDma_Error,    /* a transfer failed or the copy was aborted */
+} mflash_dma_status_t;
+
+/* Operations of the controller */
+typedef struct _mflash_dma_ops
+{
+    /* Start moving 'count' items of 'width' bytes (1, 2 or 4) from 'src' to 'dst',
+     * the end of the transfer is reported with 'mflash_dma_complete' */
+    void (*start)(void *dst, const void *src, uint32_t count, uint32_t width);
+    /* Whether the transfer started last is still running */
+    bool (*busy)(void);
+    /* Stop the transfer in progress, no completion is reported for it */
+    void (*abort)(void);
+} mflash_dma_ops_t;
+
+/* Copy in progress */
+typedef struct _mflash_dma
+{
+    const mflash_dma_ops_t *ops;
+    uint8_t *dst;            /* where the next transfer writes */
+    const uint8_t *src;      /* where the next transfer reads */
+    uint32_t remaining;      /* bytes not yet transferred, including the transfer running */
+    uint32_t chunk;          /* bytes of the transfer running, 0 when none is */
+    uint32_t width;          /* item size, the largest one 'src', 'dst' and the length are aligned to */
+    volatile uint8_t status; /* mflash_dma_status_t */
+    bool held;               /* no transfer is started while set */
+    bool deferred;           /* the next transfer starts on release */
+    uint32_t transfers;      /* transfers started */
+    uint32_t errors;         /* copies failed or aborted */
+} mflash_dma_t;
+
+/* Use the controller 'ops', no copy in progress */
+void mflash_dma_init(mflash_dma_t *dma, const mflash_dma_ops_t *ops);
+
+/* Start copying 'len' bytes from 'src' to 'dst', returns false when a copy is still in progress.
+ * The status turns to done or error once the copy is over. */
+bool mflash_dma_copy(mflash_dma_t *dma, void *dst, const void *src, uint32_t len);
+
+/* Called from the interrupt of the controller at the end of a transfer, with 'error' set when
+ * it failed. Starts the next transfer, unless held. Returns true when the copy is over. */
+bool mflash_dma_complete(mflash_dma_t *dma, bool error);
+
+/* Stop the copy in progress, which ends with an error. Called with the interrupt of the
+ * controller masked. */
+void mflash_dma_abort(mflash_dma_t *dma);
+
+/* Keep the controller off the flash while it is in command mode: wait for the end of the
+ * transfer running and start no other one until released. Called with interrupts masked. */
+void mflash_dma_hold(mflash_dma_t *dma);
+void mflash_dma_release(mflash_dma_t *dma);
+
+/* Called when the copy did not end in time, with the interrupt of the controller masked.
+ * Returns true when no transfer started since the count 'progress' was taken, which is updated.
+ * A copy held off the flash, an erase lasting longer than any timeout, is not stalled. */
+bool mflash_dma_stalled(mflash_dma_t *dma, uint32_t *progress);
+
+#endif
@@ -6,17 +6,20 @@
 
 #include "fsl_spifi.h"
 #include "mflash_drv.h"
+#include "mflash_nor.h"
 #include "pin_mux.h"
 #include <stdbool.h>
+#include <string.h>
 
-/* Command ID */
-#define COMMAND_NUM (6)
-#define READ (0)
-#define PROGRAM_PAGE (1)
-#define GET_STATUS (2)
-#define ERASE_SECTOR (3)
-#define WRITE_ENABLE (4)
-#define WRITE_REGISTER (5)
+#if MFLASH_SUSPEND_ENABLE || MFLASH_DMA_ENABLE
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#endif
+
+#if MFLASH_DMA_ENABLE
+#include "mflash_dma.h"
+#endif
 
 //#ifdef XIP_IMAGE
 //#warning NOTE: MFLASH driver expects that application runs from XIP
@@ -32,41 +35,335 @@
  * improve copy operation */
 static uint32_t g_flashm_sector[MFLASH_SECTOR_SIZE / sizeof(uint32_t)];
 
-/* Commands definition, taken from SPIFI demo */
-static spifi_command_t command[COMMAND_NUM] = {
-    /* read */
-    {MFLASH_PAGE_SIZE, false, kSPIFI_DataInput, 1, kSPIFI_CommandAllSerial, kSPIFI_CommandOpcodeAddrThreeBytes, 0x0B},
-    /* program */
-    {MFLASH_PAGE_SIZE, false, kSPIFI_DataOutput, 0, kSPIFI_CommandAllSerial, kSPIFI_CommandOpcodeAddrThreeBytes, 0x2},
-    /* status */
-    {1, false, kSPIFI_DataInput, 0, kSPIFI_CommandAllSerial, kSPIFI_CommandOpcodeOnly, 0x05},
-    /* erase */
-    {0, false, kSPIFI_DataOutput, 0, kSPIFI_CommandAllSerial, kSPIFI_CommandOpcodeAddrThreeBytes, 0x20},
-    /* write enable */
-    {0, false, kSPIFI_DataOutput, 0, kSPIFI_CommandAllSerial, kSPIFI_CommandOpcodeOnly, 0x06},
-    /* write register */
-    {4, false, kSPIFI_DataOutput, 0, kSPIFI_CommandAllSerial, kSPIFI_CommandOpcodeOnly, 0x01}};
-
-/* Wait until command finishes */
-static inline void mflash_drv_check_if_finish(void)
-{
-    uint8_t val = 0;
-    do
-    {
-        SPIFI_SetCommand(MFLASH_SPIFI, &command[GET_STATUS]);
-        while ((MFLASH_SPIFI->STAT & SPIFI_STAT_INTRQ_MASK) == 0U)
+/* Temporary page storage used by 'mflash_drv_program', kept apart from the sector
+ * storage so that programming does not interfere with a sector update */
+static uint32_t g_flashm_page[MFLASH_PAGE_SIZE / sizeof(uint32_t)];
+
+/* SPIFI formats of the command lines, not 'const' to be in RAM since they are read in command mode */
+static spifi_command_format_t g_spifi_format[] = {
+    [kMflashNor_1_1_1] = kSPIFI_CommandAllSerial,
+    [kMflashNor_1_1_4] = kSPIFI_CommandDataQuad,
+    [kMflashNor_1_4_4] = kSPIFI_CommandOpcodeSerial,
+};
+
+/* Translate a flash command to the SPIFI */
+static void mflash_spifi_command_of(const mflash_nor_cmd_t *cmd, spifi_command_t *spifi_cmd)
+{
+    spifi_cmd->dataLen           = cmd->data_len;
+    spifi_cmd->isPollMode        = false;
+    spifi_cmd->direction         = cmd->data_out ? kSPIFI_DataOutput : kSPIFI_DataInput;
+    spifi_cmd->intermediateBytes = cmd->dummy_len;
+    spifi_cmd->format            = g_spifi_format[cmd->lines];
+    spifi_cmd->type              = kSPIFI_CommandOpcodeOnly;
+    spifi_cmd->opcode            = cmd->opcode;
+
+    if (cmd->addr_len != 0)
+    {
+        spifi_cmd->type = kSPIFI_CommandOpcodeAddrThreeBytes;
+    }
+}
+
+static void mflash_spifi_reset(void)
+{
+    SPIFI_ResetCommand(MFLASH_SPIFI);
+}
+
+static void mflash_spifi_set_quad(bool quad)
+{
+    if (quad)
+    {
+        MFLASH_SPIFI->CTRL &= ~SPIFI_CTRL_DUAL_MASK;
+    }
+    else
+    {
+        MFLASH_SPIFI->CTRL |= SPIFI_CTRL_DUAL(kSPIFI_DualMode);
+    }
+}
+
+static void mflash_spifi_command(const mflash_nor_cmd_t *cmd, uint32_t addr)
+{
+    spifi_command_t spifi_cmd;
+
+    mflash_spifi_command_of(cmd, &spifi_cmd);
+    if (cmd->addr_len != 0)
+    {
+        SPIFI_SetCommandAddress(MFLASH_SPIFI, addr);
+    }
+    if (cmd->dummy_len != 0)
+    {
+        SPIFI_SetIntermediateData(MFLASH_SPIFI, 0);
+    }
+    SPIFI_SetCommand(MFLASH_SPIFI, &spifi_cmd);
+}
+
+static void mflash_spifi_write(const uint8_t *data, uint32_t len)
+{
+    uint32_t i = 0;
+
+    /* Store 4B in each loop when the data are aligned, as pages are */
+    if (0 == ((uint32_t)data % sizeof(uint32_t)))
+    {
+        for (; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t))
+        {
+            SPIFI_WriteData(MFLASH_SPIFI, *(const uint32_t *)(data + i));
+        }
+    }
+
+    for (; i < len; i++)
+    {
+        SPIFI_WriteDataByte(MFLASH_SPIFI, data[i]);
+    }
+}
+
+static void mflash_spifi_read(uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        data[i] = SPIFI_ReadDataByte(MFLASH_SPIFI);
+    }
+}
+
+static void mflash_spifi_wait(void)
+{
+    while ((MFLASH_SPIFI->STAT & SPIFI_STAT_INTRQ_MASK) == 0U)
+    {
+    }
+}
+
+static void mflash_spifi_memory_mode(const mflash_nor_cmd_t *cmd)
+{
+    spifi_command_t spifi_cmd;
+
+    mflash_spifi_command_of(cmd, &spifi_cmd);
+    SPIFI_SetIntermediateData(MFLASH_SPIFI, 0);
+    SPIFI_SetMemoryCommand(MFLASH_SPIFI, &spifi_cmd);
+}
+
+/* Set when the interrupts masked by the operation in progress were enabled before */
+static bool g_mflash_interruptible;
+
+#if MFLASH_SUSPEND_ENABLE
+/* Serializes the erases and programs, the other tasks run while they are suspended */
+static SemaphoreHandle_t g_mflash_mutex;
+#endif
+
+/* Set when the operation in progress holds 'g_mflash_mutex' */
+static bool g_mflash_locked;
+
+/* Set while an erase or a program is in progress, the flash being read by the other tasks
+ * only while the operation is suspended, with the data it changes undefined */
+static volatile bool g_mflash_busy;
+
+static bool mflash_spifi_pending(void)
+{
+    return g_mflash_interruptible && (0 != (SCB->ICSR & (SCB_ICSR_ISRPENDING_Msk | SCB_ICSR_PENDSTSET_Msk)));
+}
+
+static void mflash_spifi_service(void)
+{
+    __asm("cpsie i");
+    /* Flush pipeline to allow pending interrupts take place */
+    __ISB();
+    __asm("cpsid i");
+}
+
+static uint32_t mflash_spifi_timestamp(void)
+{
+    return DWT->CYCCNT;
+}
+
+static uint32_t mflash_spifi_elapsed_us(uint32_t since)
+{
+    return (DWT->CYCCNT - since) / (SystemCoreClock / 1000000U);
+}
+
+/* Command sequences of the flash run over the SPIFI, not 'const' to be in RAM since it is read in command mode */
+static mflash_nor_ops_t g_mflash_spifi_ops = {
+    .reset       = mflash_spifi_reset,
+    .set_quad    = mflash_spifi_set_quad,
+    .command     = mflash_spifi_command,
+    .write       = mflash_spifi_write,
+    .read        = mflash_spifi_read,
+    .wait        = mflash_spifi_wait,
+    .memory_mode = mflash_spifi_memory_mode,
+    .pending     = mflash_spifi_pending,
+    .service     = mflash_spifi_service,
+    .timestamp   = mflash_spifi_timestamp,
+    .elapsed_us  = mflash_spifi_elapsed_us,
+};
+
+static mflash_nor_t g_mflash_nor;
+
+#if MFLASH_DMA_ENABLE
+/* Descriptor of a DMA channel in the table the controller reads */
+typedef struct _mflash_dma_descriptor
+{
+    uint32_t xfercfg;
+    uint32_t src_end; /* address of the last item read */
+    uint32_t dst_end; /* address of the last item written */
+    uint32_t link;
+} mflash_dma_descriptor_t;
+
+/* Table of the descriptors, only the entries up to the channel used are needed */
+SDK_ALIGN(static mflash_dma_descriptor_t g_mflash_dma_table[MFLASH_DMA_CHANNEL + 1],
+          FSL_FEATURE_DMA_DESCRIPTOR_ALIGN_SIZE);
+
+#define MFLASH_DMA_CHANNEL_MASK (1UL << MFLASH_DMA_CHANNEL)
+
+static void mflash_dma0_start(void *dst, const void *src, uint32_t count, uint32_t width)
+{
+    mflash_dma_descriptor_t *descriptor = &g_mflash_dma_table[MFLASH_DMA_CHANNEL];
+
+    /* Memory to memory, started by software, interrupt A at the end */
+    descriptor->src_end = (uint32_t)src + (count - 1) * width;
+    descriptor->dst_end = (uint32_t)dst + (count - 1) * width;
+    descriptor->link    = 0;
+
+    MFLASH_DMA->CHANNEL[MFLASH_DMA_CHANNEL].CFG = 0;
+    MFLASH_DMA->COMMON[0].ENABLESET             = MFLASH_DMA_CHANNEL_MASK;
+    MFLASH_DMA->CHANNEL[MFLASH_DMA_CHANNEL].XFERCFG =
+        DMA_CHANNEL_XFERCFG_CFGVALID_MASK | DMA_CHANNEL_XFERCFG_SWTRIG_MASK | DMA_CHANNEL_XFERCFG_CLRTRIG_MASK |
+        DMA_CHANNEL_XFERCFG_SETINTA_MASK | DMA_CHANNEL_XFERCFG_WIDTH(width >> 1) | DMA_CHANNEL_XFERCFG_SRCINC(1) |
+        DMA_CHANNEL_XFERCFG_DSTINC(1) | DMA_CHANNEL_XFERCFG_XFERCOUNT(count - 1);
+}
+
+static bool mflash_dma0_busy(void)
+{
+    return (MFLASH_DMA->COMMON[0].BUSY & MFLASH_DMA_CHANNEL_MASK) != 0;
+}
+
+static void mflash_dma0_abort(void)
+{
+    MFLASH_DMA->COMMON[0].ENABLECLR = MFLASH_DMA_CHANNEL_MASK;
+    while (mflash_dma0_busy())
+    {
+    }
+    MFLASH_DMA->COMMON[0].ABORT = MFLASH_DMA_CHANNEL_MASK;
+    MFLASH_DMA->COMMON[0].INTA  = MFLASH_DMA_CHANNEL_MASK;
+}
+
+/* Copies of the flash run on the DMA controller */
+static const mflash_dma_ops_t g_mflash_dma0_ops = {
+    .start = mflash_dma0_start,
+    .busy  = mflash_dma0_busy,
+    .abort = mflash_dma0_abort,
+};
+
+static mflash_dma_t g_mflash_dma;
+
+/* Serializes the reads, given by the interrupt at the end of a copy */
+static SemaphoreHandle_t g_mflash_dma_mutex;
+static SemaphoreHandle_t g_mflash_dma_done;
+
+void DMA0_DriverIRQHandler(void)
+{
+    BaseType_t woken = pdFALSE;
+    bool error       = (MFLASH_DMA->COMMON[0].ERRINT & MFLASH_DMA_CHANNEL_MASK) != 0;
+
+    if (error || (MFLASH_DMA->COMMON[0].INTA & MFLASH_DMA_CHANNEL_MASK) != 0)
+    {
+        MFLASH_DMA->COMMON[0].ERRINT = MFLASH_DMA_CHANNEL_MASK;
+        MFLASH_DMA->COMMON[0].INTA   = MFLASH_DMA_CHANNEL_MASK;
+
+        if (mflash_dma_complete(&g_mflash_dma, error))
         {
+            (void)xSemaphoreGiveFromISR(g_mflash_dma_done, &woken);
         }
-        val = SPIFI_ReadDataByte(MFLASH_SPIFI);
-    } while (val & 0x1);
+    }
+
+    portYIELD_FROM_ISR(woken);
+    SDK_ISR_EXIT_BARRIER;
+}
+
+/* Set up the DMA controller once, reads are copied with the CPU if it fails */
+static void mflash_drv_dma_init(void)
+{
+    if (g_mflash_dma.ops != NULL)
+    {
+        return;
+    }
+
+    g_mflash_dma_mutex = xSemaphoreCreateMutex();
+    g_mflash_dma_done  = xSemaphoreCreateBinary();
+    if ((g_mflash_dma_mutex == NULL) || (g_mflash_dma_done == NULL))
+    {
+        return;
+    }
+
+    CLOCK_EnableClock(kCLOCK_Dma);
+    MFLASH_DMA->SRAMBASE           = (uint32_t)g_mflash_dma_table;
+    MFLASH_DMA->CTRL               = DMA_CTRL_ENABLE_MASK;
+    MFLASH_DMA->COMMON[0].INTENSET = MFLASH_DMA_CHANNEL_MASK;
+
+    /* Gives the semaphore, must not be above the FreeRTOS API priority */
+    NVIC_SetPriority(DMA0_IRQn, configLIBRARY_LOWEST_INTERRUPT_PRIORITY);
+    NVIC_EnableIRQ(DMA0_IRQn);
+
+    mflash_dma_init(&g_mflash_dma, &g_mflash_dma0_ops);
 }
+#endif
 
 /* return offset from sector */
 static void mflash_drv_read_mode(void)
 {
     /* Switch back to read mode */
-    SPIFI_ResetCommand(MFLASH_SPIFI);
-    SPIFI_SetMemoryCommand(MFLASH_SPIFI, &command[READ]);
+    mflash_nor_read_mode(&g_mflash_nor);
+}
+
+/* Disable interrupts for an erase or a program, the flash cannot be read in command mode.
+ * If they were enabled, the waiting interrupts are served in the middle of the operation,
+ * and the tasks they wake run from the suspended flash. The other tasks wait on the mutex
+ * to start another operation */
+static uint32_t mflash_drv_enter(void)
+{
+    uint32_t primask = __get_PRIMASK();
+
+#if MFLASH_SUSPEND_ENABLE
+    if ((primask == 0) && (g_mflash_mutex != NULL) && (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING))
+    {
+        (void)xSemaphoreTake(g_mflash_mutex, portMAX_DELAY);
+        g_mflash_locked = true;
+    }
+#endif
+
+    __asm("cpsid i");
+    g_mflash_busy = true;
+
+#if MFLASH_DMA_ENABLE
+    /* The DMA controller reads the flash, which is about to switch to command mode */
+    mflash_dma_hold(&g_mflash_dma);
+#endif
+
+    g_mflash_interruptible = (primask == 0);
+
+    return primask;
+}
+
+/* Restore interrupts after an erase or a program */
+static void mflash_drv_exit(uint32_t primask)
+{
+    g_mflash_interruptible = false;
+    g_mflash_busy          = false;
+
+#if MFLASH_DMA_ENABLE
+    mflash_dma_release(&g_mflash_dma);
+#endif
+
+    if (primask == 0)
+    {
+        __asm("cpsie i");
+    }
+
+    /* Flush pipeline to allow pending interrupts take place */
+    __ISB();
+
+#if MFLASH_SUSPEND_ENABLE
+    if (g_mflash_locked)
+    {
+        g_mflash_locked = false;
+        (void)xSemaphoreGive(g_mflash_mutex);
+    }
+#endif
 }
 
 /* Initialize SPIFI & flash peripheral,
@@ -76,7 +373,8 @@ static int32_t mflash_drv_init_internal(void)
     /* NOTE: Multithread access is not supported for SRAM target.
      *       XIP target MUST be protected by disabling global interrupts
      *       since all ISR (and API that is used inside) is placed at XIP.
-     *       It is necessary to place at least "mflash_drv_drv.o", "fsl_spifi.o" to SRAM */
+     *       It is necessary to place at least "mflash_drv_drv.o", "mflash_nor.o", "fsl_spifi.o" to SRAM.
+     *       Erases and programs let interrupts in while the flash is suspended, see 'mflash_drv_enter' */
     /* disable interrupts when running from XIP
      * TODO: store/restore previous PRIMASK on stack to avoid
      * failure in case of nested critical sections !! */
@@ -86,6 +384,11 @@ static int32_t mflash_drv_init_internal(void)
 
     spifi_config_t config = {0};
 
+#if MFLASH_DMA_ENABLE
+    /* Not again in the middle of a read */
+    mflash_dma_hold(&g_mflash_dma);
+#endif
+
 #ifndef XIP_IMAGE
     uint32_t sourceClockFreq;
     BOARD_InitSPIFI();
@@ -119,8 +422,27 @@ static int32_t mflash_drv_init_internal(void)
                          SPIFI_CTRL_PRFTCH_DIS(config.disableCachePrefech) | SPIFI_CTRL_DUAL(config.dualMode) |
                          SPIFI_CTRL_RFCLK(config.isReadFullClockCycle) | SPIFI_CTRL_FBCLK(config.isFeedbackClock);
 
+    /* Time base of the interrupt latency */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+#ifdef XIP_IMAGE
+    mflash_nor_init(&g_mflash_nor, &g_mflash_spifi_ops, true);
+#else
+    mflash_nor_init(&g_mflash_nor, &g_mflash_spifi_ops, false);
+#endif
+    g_mflash_nor.serve = (MFLASH_SUSPEND_ENABLE != 0);
+    mflash_nor_probe(&g_mflash_nor);
+#if MFLASH_QUAD_ENABLE
+    /* Keep the serial commands unless the quad ones read the start of the flash, which holds the boot image, right */
+    mflash_nor_probe_quad(&g_mflash_nor, 0);
+#endif
     mflash_drv_read_mode();
 
+#if MFLASH_DMA_ENABLE
+    mflash_dma_release(&g_mflash_dma);
+#endif
+
     if (primask == 0)
     {
         __asm("cpsie i");
@@ -135,71 +457,84 @@ int32_t mflash_drv_init(void)
     volatile int32_t result;
     /* Necessary to have double wrapper call in non_xip memory */
     result = mflash_drv_init_internal();
+#if MFLASH_SUSPEND_ENABLE
+    if (g_mflash_mutex == NULL)
+    {
+        g_mflash_mutex = xSemaphoreCreateMutex();
+    }
+#endif
+#if MFLASH_DMA_ENABLE
+    mflash_drv_dma_init();
+#endif
     return result;
 }
 
-/* Internal - erase single sector */
-static int32_t mflash_drv_sector_erase(uint32_t sector_addr)
+/* Internal - erase the sector or block at 'addr' with the erase command 'erase_cmd' */
+static int32_t mflash_drv_unit_erase(uint32_t addr, mflash_nor_erase_t erase_cmd)
 {
-    uint32_t primask = __get_PRIMASK();
+    uint32_t primask = mflash_drv_enter();
 
-    __asm("cpsid i");
-
-    /* Reset the SPIFI to switch to command mode */
-    SPIFI_ResetCommand(MFLASH_SPIFI);
-
-    /* Write enable */
-    SPIFI_SetCommand(MFLASH_SPIFI, &command[WRITE_ENABLE]);
-    /* Set address */
-    SPIFI_SetCommandAddress(MFLASH_SPIFI, sector_addr);
-    /* Erase sector */
-    SPIFI_SetCommand(MFLASH_SPIFI, &command[ERASE_SECTOR]);
-    /* Check if finished */
-    mflash_drv_check_if_finish();
+    /* Erase sector or block */
+    mflash_nor_erase(&g_mflash_nor, addr, erase_cmd);
     /* Switch to read mode to enable interrupts as soon ass possible */
     mflash_drv_read_mode();
 
-    if (primask == 0)
+    mflash_drv_exit(primask);
+
+    return 0;
+}
+
+/* Internal - erase single sector */
+static int32_t mflash_drv_sector_erase(uint32_t sector_addr)
+{
+    return mflash_drv_unit_erase(sector_addr, kMflashNor_EraseSector);
+}
+
+/* Internal - check whether 'len' bytes at 'addr' are erased */
+static bool mflash_drv_is_blank(uint32_t addr, uint32_t len)
+{
+    for (uint32_t i = 0; i < len / sizeof(uint32_t); i++)
     {
-        __asm("cpsie i");
+        if (0xFFFFFFFF != *((uint32_t *)(addr) + i))
+        {
+            return false;
+        }
     }
 
-    /* Flush pipeline to allow pending interrupts take place */
-    __ISB();
-
-    return 0;
+    return true;
 }
 
 /* Internal - write single page */
 static int32_t mflash_drv_page_program(uint32_t page_addr, const uint32_t *page_data)
 {
-    uint32_t primask = __get_PRIMASK();
-
-    __asm("cpsid i");
+    uint32_t primask = mflash_drv_enter();
 
     /* Program page */
-    SPIFI_ResetCommand(MFLASH_SPIFI);
-    SPIFI_SetCommand(MFLASH_SPIFI, &command[WRITE_ENABLE]);
-    SPIFI_SetCommandAddress(MFLASH_SPIFI, page_addr);
-    SPIFI_SetCommand(MFLASH_SPIFI, &command[PROGRAM_PAGE]);
+    mflash_nor_program(&g_mflash_nor, page_addr, (const uint8_t *)page_data, MFLASH_PAGE_SIZE);
+    /* Switch to read mode to enable interrupts as soon ass possible */
+    mflash_drv_read_mode();
 
-    /* Store 4B in each loop. Sector has always 4B alignment and size multiple of 4 */
-    for (uint32_t i = 0; i < MFLASH_PAGE_SIZE / sizeof(page_data[0]); i++)
-    {
-        SPIFI_WriteData(MFLASH_SPIFI, page_data[i]);
-    }
+    mflash_drv_exit(primask);
 
-    mflash_drv_check_if_finish();
+    return 0;
+}
+
+/* Internal - program 'len' bytes from RAM within a single page, starting at 'addr' */
+static int32_t mflash_drv_page_program_partial(uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    uint32_t primask;
+
+    /* Programming must not wrap around the page boundary */
+    if ((len == 0) || ((addr % MFLASH_PAGE_SIZE) + len > MFLASH_PAGE_SIZE))
+        return -1;
+
+    primask = mflash_drv_enter();
+
+    mflash_nor_program(&g_mflash_nor, addr, data, len);
     /* Switch to read mode to enable interrupts as soon ass possible */
     mflash_drv_read_mode();
 
-    if (primask == 0)
-    {
-        __asm("cpsie i");
-    }
-
-    /* Flush pipeline to allow pending interrupts take place */
-    __ISB();
+    mflash_drv_exit(primask);
 
     return 0;
 }
@@ -361,13 +696,9 @@ int32_t mflash_drv_erase_internal(void *addr, uint32_t len)
     while (len)
     {
         /* Perform blank-check of the sector and erase it if necessary */
-        for (uint32_t i = 0; i < MFLASH_SECTOR_SIZE / sizeof(uint32_t); i++)
+        if (false == mflash_drv_is_blank(sector_addr, MFLASH_SECTOR_SIZE))
         {
-            if (0xFFFFFFFF != *((uint32_t *)(sector_addr) + i))
-            {
-                mflash_drv_sector_erase(sector_addr);
-                break;
-            }
+            mflash_drv_sector_erase(sector_addr);
         }
         sector_addr += MFLASH_SECTOR_SIZE;
         len -= MFLASH_SECTOR_SIZE;
@@ -376,49 +707,163 @@ int32_t mflash_drv_erase_internal(void *addr, uint32_t len)
     return 0;
 }
 
+/* Erase the largest unit of flash at 'addr' within 'len' bytes and 'max_unit', cannot be invoked
+ * directly, requires calling wrapper in non XIP memory */
+int32_t mflash_drv_erase_step_internal(void *addr, uint32_t len, uint32_t max_unit)
+{
+    uint32_t unit_addr           = (uint32_t)addr;
+    uint32_t unit_size           = MFLASH_SECTOR_SIZE;
+    mflash_nor_erase_t erase_cmd = kMflashNor_EraseSector;
+
+    /* Address not aligned to sector boundary */
+    if (false == mflash_drv_is_sector_aligned(unit_addr))
+        return -1;
+
+    /* Length is not aligned to sector size */
+    if ((0 == len) || (0 != len % MFLASH_SECTOR_SIZE))
+        return -1;
+
+    /* A block erase takes much less time than erasing its sectors one by one */
+    if ((0 == unit_addr % MFLASH_BLOCK64_SIZE) && (len >= MFLASH_BLOCK64_SIZE) && (max_unit >= MFLASH_BLOCK64_SIZE))
+    {
+        unit_size = MFLASH_BLOCK64_SIZE;
+        erase_cmd = kMflashNor_EraseBlock64;
+    }
+    else if ((0 == unit_addr % MFLASH_BLOCK32_SIZE) && (len >= MFLASH_BLOCK32_SIZE) &&
+             (max_unit >= MFLASH_BLOCK32_SIZE))
+    {
+        unit_size = MFLASH_BLOCK32_SIZE;
+        erase_cmd = kMflashNor_EraseBlock32;
+    }
+
+    if (false == mflash_drv_is_blank(unit_addr, unit_size))
+    {
+        mflash_drv_unit_erase(unit_addr, erase_cmd);
+    }
+
+    return (int32_t)unit_size;
+}
+
+/* Program data to erased flash, cannot be invoked directly, requires calling wrapper in non XIP memory */
+static int32_t mflash_drv_program_internal(void *any_addr, const uint8_t *data, uint32_t data_len)
+{
+    uint32_t addr = (uint32_t)any_addr;
+    uint32_t to_program;
+    /* Staging buffer, source data may be located in XIP which is not readable in command mode */
+    uint8_t *page_buffer = (uint8_t *)g_flashm_page;
+
+    while (data_len)
+    {
+        /* Program up to the end of the current page */
+        to_program = MFLASH_PAGE_SIZE - (addr % MFLASH_PAGE_SIZE);
+        if (to_program > data_len)
+            to_program = data_len;
+
+        memcpy(page_buffer, data, to_program);
+
+        if (0 != mflash_drv_page_program_partial(addr, page_buffer, to_program))
+            return -1;
+
+        addr += to_program;
+        data += to_program;
+        data_len -= to_program;
+    }
+
+    return 0;
+}
+
+/* Internal - whether 'len' bytes at 'data' lie in the flash, which cannot be read in command mode */
+static bool mflash_drv_is_in_flash(const uint8_t *data, uint32_t len)
+{
+    return ((uint32_t)data <= FSL_FEATURE_SPIFI_END_ADDR) && ((uint32_t)data + len > FSL_FEATURE_SPIFI_START_ADDR);
+}
+
+/* Internal - check whether 'len' bytes of 'data' are all 0xFF */
+static bool mflash_drv_is_blank_data(const uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        if (0xFF != data[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Internal - write whole sectors at sector aligned 'addr', without reading back their old content:
+ * erase them with the largest blocks, and program the pages straight from 'data' */
+static int32_t mflash_drv_bulk_write(uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    const uint8_t *sector_data;
+    int32_t step;
+
+    for (uint32_t offset = 0; offset < len; offset += (uint32_t)step)
+    {
+        step = mflash_drv_erase_step_internal((void *)(addr + offset), len - offset, MFLASH_BLOCK64_SIZE);
+        if (step <= 0)
+            return -2;
+    }
+
+    for (uint32_t offset = 0; offset < len; offset += MFLASH_SECTOR_SIZE)
+    {
+        /* Source data located in XIP are staged through RAM, a sector at a time to let the DMA copy them */
+        sector_data = data + offset;
+        if (mflash_drv_is_in_flash(sector_data, MFLASH_SECTOR_SIZE))
+        {
+            if (0 != mflash_drv_read(g_flashm_sector, sector_data, MFLASH_SECTOR_SIZE))
+                return -2;
+            sector_data = (const uint8_t *)g_flashm_sector;
+        }
+
+        for (uint32_t page = 0; page < MFLASH_SECTOR_SIZE; page += MFLASH_PAGE_SIZE)
+        {
+            /* Skip programming of blank pages */
+            if (mflash_drv_is_blank_data(sector_data + page, MFLASH_PAGE_SIZE))
+                continue;
+
+            if (0 != mflash_drv_page_program_partial(addr + offset + page, sector_data + page, MFLASH_PAGE_SIZE))
+                return -2;
+        }
+    }
+
+    return 0;
+}
+
 /* Write data to flash, cannot be invoked directly, requires calling wrapper in non XIP memory */
 int32_t mflash_drv_write_internal(void *any_addr, const uint8_t *data, uint32_t data_len)
 {
-    uint32_t sect_size = MFLASH_SECTOR_SIZE;
-    /* Interval <0, sector_size) */
-    uint32_t to_write = 0;
-    /* Interval (data_len, 0>  */
-    uint32_t to_remain = data_len;
-    int32_t result     = 0;
-
-    for (
-        /* Calculate address of first sector */
-        uint32_t sect_a = mflash_drv_addr_to_sector_addr((uint32_t)any_addr),
-                 /* and first sector offset */
-        sect_of = mflash_drv_addr_to_sector_of((uint32_t)any_addr),
-                 /* and set first data offset to 0*/
-        data_of = 0;
-        /* Continue until sector address exceed target adddress + data_length */
-        sect_a < ((uint32_t)any_addr) + data_len;
-        /* Move to next sector */
-        sect_a += sect_size,
-                 /* and move pointer to data */
-        data_of += to_write)
-    {
-        /* If remaining data is exceed 'sector_size', write 'sector_size' length */
-        if (to_remain > sect_size - sect_of)
+    uint32_t addr = (uint32_t)any_addr;
+    uint32_t sect_of;
+    uint32_t to_write;
+    int32_t result;
+
+    while (data_len)
+    {
+        sect_of = mflash_drv_addr_to_sector_of(addr);
+
+        if ((0 == sect_of) && (data_len >= MFLASH_SECTOR_SIZE))
         {
-            to_write  = sect_size - sect_of;
-            to_remain = to_remain - to_write;
+            /* Whole sectors are overwritten, their old content is not needed */
+            to_write = data_len - (data_len % MFLASH_SECTOR_SIZE);
+            result   = mflash_drv_bulk_write(addr, data, to_write);
         }
-        /* else write remaining data length */
         else
         {
-            to_write  = to_remain;
-            to_remain = 0;
+            /* Part of a sector, merged with its old content */
+            to_write = MFLASH_SECTOR_SIZE - sect_of;
+            if (to_write > data_len)
+                to_write = data_len;
+            result = mflash_drv_sector_update(mflash_drv_addr_to_sector_addr(addr), sect_of, data, to_write);
         }
 
-        /* Write at 'sect_a' sector, starting at 'sect_of' using '&data[data_of]' of length 'to_write' */
-        result = mflash_drv_sector_update(sect_a, sect_of, data + data_of, to_write);
         if (0 != result)
             return -1;
-        /* Only first sector is allowed to have an offset */
-        sect_of = 0;
+
+        addr += to_write;
+        data += to_write;
+        data_len -= to_write;
     }
 
     return 0;
@@ -426,6 +871,7 @@ int32_t mflash_drv_write_internal(void *any_addr, const uint8_t *data, uint32_t
 
 /* Calling wrapper for 'mflash_drv_write_internal'.
  * Write 'data' of 'data_len' to 'any_addr' - which doesn't have to be sector aligned.
+ * Sectors fully covered by 'data' are erased with block erases and programmed without reading them back.
  * NOTE: Don't try to store constant data that are located in XIP !!
  */
 int32_t mflash_drv_write(void *any_addr, const uint8_t *data, uint32_t data_len)
@@ -435,6 +881,112 @@ int32_t mflash_drv_write(void *any_addr, const uint8_t *data, uint32_t data_len)
     return result;
 }
 
+/* Calling wrapper for 'mflash_drv_erase_internal'.
+ * Erase 'len' bytes at 'addr', both have to be sector aligned.
+ */
+int32_t mflash_drv_erase(void *addr, uint32_t len)
+{
+    volatile int32_t result;
+    result = mflash_drv_erase_internal(addr, len);
+    return result;
+}
+
+/* Calling wrapper for 'mflash_drv_erase_step_internal'.
+ * Erase the 64 KB block, 32 KB block or sector at sector aligned 'addr', the largest one
+ * aligned at 'addr' and not longer than 'len' nor 'max_unit'. Returns the number of bytes
+ * erased or found blank, to be added to 'addr' for the next step.
+ */
+int32_t mflash_drv_erase_step(void *addr, uint32_t len, uint32_t max_unit)
+{
+    volatile int32_t result;
+    result = mflash_drv_erase_step_internal(addr, len, max_unit);
+    return result;
+}
+
+/* Calling wrapper for 'mflash_drv_program_internal'.
+ * Program 'data' of 'data_len' to 'any_addr' - which doesn't have to be page aligned.
+ * Unlike 'mflash_drv_write', sectors are neither read back nor erased.
+ */
+int32_t mflash_drv_program(void *any_addr, const uint8_t *data, uint32_t data_len)
+{
+    volatile int32_t result;
+    result = mflash_drv_program_internal(any_addr, data, data_len);
+    return result;
+}
+
+/* API - copy 'len' bytes of the flash at 'flash_addr' to 'dst', with the DMA controller when
+ * called from a task for a large copy, otherwise with the CPU */
+int32_t mflash_drv_read(void *dst, const void *flash_addr, uint32_t len)
+{
+#if MFLASH_DMA_ENABLE
+    int32_t result = 0;
+    uint32_t progress;
+#endif
+
+#if MFLASH_SUSPEND_ENABLE
+    /* A task running while an erase or a program is suspended waits for its end, the data could be
+     * the ones it changes */
+    if (g_mflash_busy && (g_mflash_mutex != NULL) && (__get_IPSR() == 0) &&
+        (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING))
+    {
+        (void)xSemaphoreTake(g_mflash_mutex, portMAX_DELAY);
+        (void)xSemaphoreGive(g_mflash_mutex);
+    }
+#endif
+
+#if MFLASH_DMA_ENABLE
+    if ((len >= MFLASH_DMA_MIN_SIZE) && (g_mflash_dma.ops != NULL) && (__get_PRIMASK() == 0) &&
+        (__get_IPSR() == 0) && (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING))
+    {
+        (void)xSemaphoreTake(g_mflash_dma_mutex, portMAX_DELAY);
+        /* Drop the signal of a copy which timed out */
+        (void)xSemaphoreTake(g_mflash_dma_done, 0);
+
+        taskENTER_CRITICAL();
+        (void)mflash_dma_copy(&g_mflash_dma, dst, flash_addr, len);
+        progress = g_mflash_dma.transfers;
+        taskEXIT_CRITICAL();
+
+        /* A 64 KB block erase holds the transfers for longer than the timeout, the copy is
+         * only aborted when it did not progress */
+        while (pdTRUE != xSemaphoreTake(g_mflash_dma_done, pdMS_TO_TICKS(MFLASH_DMA_TIMEOUT_MS)))
+        {
+            /* The interrupt of the controller is masked, the copy cannot end meanwhile */
+            taskENTER_CRITICAL();
+            if (mflash_dma_stalled(&g_mflash_dma, &progress))
+            {
+                mflash_dma_abort(&g_mflash_dma);
+            }
+            taskEXIT_CRITICAL();
+
+            if (g_mflash_dma.status != kMflashDma_Busy)
+            {
+                break;
+            }
+        }
+
+        if (g_mflash_dma.status != kMflashDma_Done)
+        {
+            result = -1;
+        }
+
+        (void)xSemaphoreGive(g_mflash_dma_mutex);
+        return result;
+    }
+#endif
+
+    memcpy(dst, flash_addr, len);
+    return 0;
+}
+
+/* API - longest time interrupts waited for an erase or a program, in microseconds,
+ * and number of erases and programs suspended to serve them */
+void mflash_drv_get_stats(uint32_t *max_latency_us, uint32_t *suspends)
+{
+    *max_latency_us = g_mflash_nor.max_latency_us;
+    *suspends       = g_mflash_nor.suspends;
+}
+
 #if 0
 /* Dummy test to prove functionality */
 volatile uint32_t lock2 = 1;
@@ -23,10 +23,68 @@
 #define MFLASH_PAGE_SIZE (256)
 #endif
 
+#ifndef MFLASH_BLOCK32_SIZE
+#define MFLASH_BLOCK32_SIZE (0x8000)
+#endif
+
+#ifndef MFLASH_BLOCK64_SIZE
+#define MFLASH_BLOCK64_SIZE (0x10000)
+#endif
+
 #ifndef MFLASH_SPIFI
 #define MFLASH_SPIFI SPIFI0
 #endif
 
+/* Switch to the quad read and program commands when the flash supports them */
+#ifndef MFLASH_QUAD_ENABLE
+#define MFLASH_QUAD_ENABLE (1)
+#endif
+
+/* Serve interrupts in the middle of erases and programs, suspending them when the interrupts
+ * read the flash (XIP). The tasks woken by the interrupts run while the operation is suspended,
+ * and wait on a FreeRTOS mutex to start another one, so it is only enabled by default in FreeRTOS
+ * builds: a build without it, such as the bootloader, keeps the interrupts masked for the whole
+ * operation */
+#ifndef MFLASH_SUSPEND_ENABLE
+#if defined(FSL_RTOS_FREE_RTOS)
+#define MFLASH_SUSPEND_ENABLE (1)
+#else
+#define MFLASH_SUSPEND_ENABLE (0)
+#endif
+#endif
+
+/* Copy large reads of the flash to RAM with the DMA controller, the calling task blocking
+ * until the copy is over so that the CPU runs the other tasks meanwhile. Needs FreeRTOS,
+ * like MFLASH_SUSPEND_ENABLE, so it is only enabled by default in FreeRTOS builds; without it
+ * 'mflash_drv_read' copies with the CPU and the DMA interrupt handler is not built */
+#ifndef MFLASH_DMA_ENABLE
+#if defined(FSL_RTOS_FREE_RTOS)
+#define MFLASH_DMA_ENABLE (1)
+#else
+#define MFLASH_DMA_ENABLE (0)
+#endif
+#endif
+
+#ifndef MFLASH_DMA
+#define MFLASH_DMA DMA0
+#endif
+
+/* Channel of the DMA controller used for the reads */
+#ifndef MFLASH_DMA_CHANNEL
+#define MFLASH_DMA_CHANNEL (0)
+#endif
+
+/* Reads shorter than this are copied with the CPU, faster than switching tasks */
+#ifndef MFLASH_DMA_MIN_SIZE
+#define MFLASH_DMA_MIN_SIZE (512)
+#endif
+
+/* Longest time a read waits for the DMA controller to make progress before it is aborted.
+ * The time its transfers are held off the flash by an erase or a program is not counted */
+#ifndef MFLASH_DMA_TIMEOUT_MS
+#define MFLASH_DMA_TIMEOUT_MS (100)
+#endif
+
 #ifndef MFLASH_BAUDRATE
 #define MFLASH_BAUDRATE (96000000)
 #endif
@@ -49,4 +107,27 @@ static inline uint32_t mflash_drv_addr_to_sector_of(uint32_t addr)
 int32_t mflash_drv_init(void);
 int32_t mflash_drv_write(void *any_addr, const uint8_t *data, uint32_t data_len);
 
+/* Erase 'len' bytes at sector aligned 'addr', skipping sectors which are already blank */
+int32_t mflash_drv_erase(void *addr, uint32_t len);
+
+/* Erase the largest block or sector at sector aligned 'addr' which fits in 'len' bytes and is
+ * not larger than 'max_unit', unless it is already blank. Returns the number of bytes erased,
+ * negative on error. Lets a caller erase a large area step by step, giving way to other tasks
+ * in between; a background caller passes MFLASH_SECTOR_SIZE to keep each step short. */
+int32_t mflash_drv_erase_step(void *addr, uint32_t len, uint32_t max_unit);
+
+/* Program 'data' of 'data_len' to 'any_addr' without reading back the sectors.
+ * Only clears bits: the area must be erased, or programmed with a value having
+ * a subset of its bits set. Intended for append-only storage. */
+int32_t mflash_drv_program(void *any_addr, const uint8_t *data, uint32_t data_len);
+
+/* Copy 'len' bytes of the memory mapped flash at 'flash_addr' to 'dst' in RAM.
+ * Called from a task, large copies are done by the DMA controller while the task is blocked.
+ * Returns 0 on success, negative when the DMA transfer failed. */
+int32_t mflash_drv_read(void *dst, const void *flash_addr, uint32_t len);
+
+/* Get the longest time in microseconds interrupts waited for an erase or a program,
+ * and the number of erases and programs suspended to serve interrupts */
+void mflash_drv_get_stats(uint32_t *max_latency_us, uint32_t *suspends);
+
 #endif
@@ -0,0 +1,286 @@
+/*
+ * Copyright 2017 NXP
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "mflash_nor.h"
+#include <stddef.h>
+
+/* Status register bits */
+#define STATUS_WIP (0x01)
+
+/* Flash family */
+typedef struct _mflash_nor_vendor
+{
+    uint8_t manufacturer_id;
+    uint8_t qe_read_opcode;  /* reads the register holding the quad enable bit */
+    uint8_t qe_write_opcode; /* writes it */
+    uint8_t qe_mask;
+    uint8_t cfg_read_opcode; /* when not 0, reads the byte written after it, which must be kept */
+    mflash_nor_cmd_t program;
+    uint8_t suspend_opcode;  /* suspends an erase or a program */
+    uint8_t resume_opcode;   /* resumes it, ignored when nothing is suspended */
+} mflash_nor_vendor_t;
+
+/* Commands shared by all flashes. The tables are read in command mode, when the flash cannot be read:
+ * they are not 'const' so that they are placed in RAM with the data, whatever the link script */
+static mflash_nor_cmd_t g_read_serial   = {0x0B, 3, 1, kMflashNor_1_1_1, false, 0};
+static mflash_nor_cmd_t g_read_quad     = {0xEB, 3, 3, kMflashNor_1_4_4, false, 0};
+static mflash_nor_cmd_t g_program       = {0x02, 3, 0, kMflashNor_1_1_1, true, 0};
+static mflash_nor_cmd_t g_status        = {0x05, 0, 0, kMflashNor_1_1_1, false, 1};
+static mflash_nor_cmd_t g_write_enable  = {0x06, 0, 0, kMflashNor_1_1_1, true, 0};
+static mflash_nor_cmd_t g_read_jedec_id = {0x9F, 0, 0, kMflashNor_1_1_1, false, 3};
+static mflash_nor_cmd_t g_erase[]       = {
+    [kMflashNor_EraseSector]  = {0x20, 3, 0, kMflashNor_1_1_1, true, 0},
+    [kMflashNor_EraseBlock32] = {0x52, 3, 0, kMflashNor_1_1_1, true, 0},
+    [kMflashNor_EraseBlock64] = {0xD8, 3, 0, kMflashNor_1_1_1, true, 0},
+};
+
+/* Known flash families, all of them read with 0xEB and 6 dummy clocks in quad mode */
+static mflash_nor_vendor_t g_vendor[] = {
+    /* Macronix, quad enable in the status register, written along with the configuration register */
+    {0xC2, 0x05, 0x01, 0x40, 0x15, {0x38, 3, 0, kMflashNor_1_4_4, true, 0}, 0xB0, 0x30},
+    /* Winbond, quad enable in the status register 2 */
+    {0xEF, 0x35, 0x31, 0x02, 0x00, {0x32, 3, 0, kMflashNor_1_1_4, true, 0}, 0x75, 0x7A},
+    /* GigaDevice, same as Winbond */
+    {0xC8, 0x35, 0x31, 0x02, 0x00, {0x32, 3, 0, kMflashNor_1_1_4, true, 0}, 0x75, 0x7A},
+};
+
+/* Run a command without address transferring 'len' bytes */
+static void mflash_nor_register(mflash_nor_t *nor, uint8_t opcode, bool out, uint8_t *data, uint32_t len)
+{
+    mflash_nor_cmd_t cmd = {opcode, 0, 0, kMflashNor_1_1_1, out, (uint16_t)len};
+
+    nor->ops->command(&cmd, 0);
+    if (out)
+    {
+        nor->ops->write(data, len);
+    }
+    else
+    {
+        nor->ops->wait();
+        nor->ops->read(data, len);
+    }
+}
+
+/* Whether the flash is still programming or erasing */
+static bool mflash_nor_busy(mflash_nor_t *nor)
+{
+    uint8_t status;
+
+    nor->ops->command(&g_status, 0);
+    nor->ops->wait();
+    nor->ops->read(&status, 1);
+
+    return (status & STATUS_WIP) != 0;
+}
+
+/* Wait until the flash is done programming or erasing */
+static void mflash_nor_wait_ready(mflash_nor_t *nor)
+{
+    while (mflash_nor_busy(nor))
+    {
+    }
+}
+
+/* The waiting interrupts are served, or about to be once the operation is done */
+static void mflash_nor_served(mflash_nor_t *nor)
+{
+    uint32_t latency_us;
+
+    if (nor->waiting)
+    {
+        latency_us   = nor->ops->elapsed_us(nor->waiting_since);
+        nor->waiting = false;
+
+        if (latency_us > nor->max_latency_us)
+        {
+            nor->max_latency_us = latency_us;
+        }
+    }
+}
+
+/* Let the waiting interrupts run, the flash being readable or not read by them */
+static void mflash_nor_service(mflash_nor_t *nor)
+{
+    mflash_nor_served(nor);
+    nor->ops->service();
+}
+
+/* Wait until the flash is done with the erase or the program, serving the interrupts meanwhile */
+static void mflash_nor_wait_done(mflash_nor_t *nor)
+{
+    uint32_t resumed = nor->ops->timestamp();
+
+    nor->waiting = false;
+
+    while (mflash_nor_busy(nor))
+    {
+        if (false == nor->ops->pending())
+        {
+            continue;
+        }
+
+        if (false == nor->waiting)
+        {
+            nor->waiting       = true;
+            nor->waiting_since = nor->ops->timestamp();
+        }
+
+        if (false == nor->serve)
+        {
+            continue;
+        }
+
+        if (false == nor->xip)
+        {
+            /* The flash is not read by the interrupts, they can run while it is busy */
+            mflash_nor_service(nor);
+        }
+        else if ((nor->vendor != NULL) && (nor->ops->elapsed_us(resumed) >= MFLASH_NOR_RESUME_TIME_US))
+        {
+            /* Suspend, wait for the flash to be readable and serve the interrupts in memory mode.
+             * If the operation ended in the meantime, the resume is ignored and the flash not busy */
+            mflash_nor_register(nor, nor->vendor->suspend_opcode, true, NULL, 0);
+            mflash_nor_wait_ready(nor);
+            mflash_nor_read_mode(nor);
+            mflash_nor_service(nor);
+            nor->ops->reset();
+            mflash_nor_register(nor, nor->vendor->resume_opcode, true, NULL, 0);
+            resumed = nor->ops->timestamp();
+            nor->suspends++;
+        }
+    }
+
+    mflash_nor_served(nor);
+}
+
+/* Set the quad enable bit if needed, returns false if it does not stick */
+static bool mflash_nor_quad_enable(mflash_nor_t *nor, const mflash_nor_vendor_t *vendor)
+{
+    uint8_t reg[2];
+    uint32_t len = 1;
+
+    mflash_nor_register(nor, vendor->qe_read_opcode, false, &reg[0], 1);
+    if (reg[0] & vendor->qe_mask)
+    {
+        return true;
+    }
+
+    if (vendor->cfg_read_opcode != 0)
+    {
+        mflash_nor_register(nor, vendor->cfg_read_opcode, false, &reg[1], 1);
+        len = 2;
+    }
+    reg[0] |= vendor->qe_mask;
+
+    /* Non volatile, only written the first time */
+    nor->ops->command(&g_write_enable, 0);
+    mflash_nor_register(nor, vendor->qe_write_opcode, true, reg, len);
+    mflash_nor_wait_ready(nor);
+
+    mflash_nor_register(nor, vendor->qe_read_opcode, false, &reg[0], 1);
+    return (reg[0] & vendor->qe_mask) != 0;
+}
+
+void mflash_nor_init(mflash_nor_t *nor, const mflash_nor_ops_t *ops, bool xip)
+{
+    nor->ops            = ops;
+    nor->read           = g_read_serial;
+    nor->program        = g_program;
+    nor->vendor         = NULL;
+    nor->quad           = false;
+    nor->xip            = xip;
+    nor->serve          = true;
+    nor->waiting        = false;
+    nor->max_latency_us = 0;
+    nor->suspends       = 0;
+}
+
+void mflash_nor_probe(mflash_nor_t *nor)
+{
+    nor->ops->reset();
+    mflash_nor_register(nor, g_read_jedec_id.opcode, false, nor->jedec_id, sizeof(nor->jedec_id));
+
+    for (uint32_t i = 0; i < sizeof(g_vendor) / sizeof(g_vendor[0]); i++)
+    {
+        if (g_vendor[i].manufacturer_id == nor->jedec_id[0])
+        {
+            nor->vendor = &g_vendor[i];
+            break;
+        }
+    }
+}
+
+bool mflash_nor_probe_quad(mflash_nor_t *nor, uint32_t check_offset)
+{
+    const mflash_nor_vendor_t *vendor = nor->vendor;
+    mflash_nor_cmd_t check_cmd;
+    uint8_t serial_data[MFLASH_NOR_CHECK_SIZE];
+    uint8_t quad_data[MFLASH_NOR_CHECK_SIZE];
+
+    nor->ops->reset();
+    if ((vendor == NULL) || (false == mflash_nor_quad_enable(nor, vendor)))
+    {
+        return false;
+    }
+
+    /* Read the same bytes with both commands, a wrong number of dummy clocks or
+     * a line not connected shows as a difference */
+    check_cmd          = g_read_serial;
+    check_cmd.data_len = sizeof(serial_data);
+    nor->ops->command(&check_cmd, check_offset);
+    nor->ops->wait();
+    nor->ops->read(serial_data, sizeof(serial_data));
+
+    nor->ops->set_quad(true);
+    check_cmd          = g_read_quad;
+    check_cmd.data_len = sizeof(quad_data);
+    nor->ops->command(&check_cmd, check_offset);
+    nor->ops->wait();
+    nor->ops->read(quad_data, sizeof(quad_data));
+
+    /* No library call, the code in flash cannot be fetched in command mode */
+    for (uint32_t i = 0; i < sizeof(serial_data); i++)
+    {
+        if (serial_data[i] != quad_data[i])
+        {
+            nor->ops->set_quad(false);
+            return false;
+        }
+    }
+
+    nor->read    = g_read_quad;
+    nor->program = vendor->program;
+    nor->quad    = true;
+
+    return true;
+}
+
+void mflash_nor_read_mode(mflash_nor_t *nor)
+{
+    nor->ops->reset();
+    nor->ops->memory_mode(&nor->read);
+}
+
+void mflash_nor_erase(mflash_nor_t *nor, uint32_t addr, mflash_nor_erase_t unit)
+{
+    nor->ops->reset();
+    nor->ops->command(&g_write_enable, 0);
+    nor->ops->command(&g_erase[unit], addr);
+    mflash_nor_wait_done(nor);
+}
+
+void mflash_nor_program(mflash_nor_t *nor, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    mflash_nor_cmd_t program_cmd = nor->program;
+
+    program_cmd.data_len = (uint16_t)len;
+
+    nor->ops->reset();
+    nor->ops->command(&g_write_enable, 0);
+    nor->ops->command(&program_cmd, addr);
+    nor->ops->write(data, len);
+    mflash_nor_wait_done(nor);
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2017 NXP
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef __MFLASH_NOR_H__
+#define __MFLASH_NOR_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Command sequences of the serial NOR flash, independent of the SPIFI registers.
+ * 'mflash_drv.c' runs them over the SPIFI, a model of the controller and the flash
+ * can run them on a host by providing its own 'mflash_nor_ops_t'. */
+
+/* Number of bytes read back to check the quad read command */
+#ifndef MFLASH_NOR_CHECK_SIZE
+#define MFLASH_NOR_CHECK_SIZE (32)
+#endif
+
+/* Shortest time the flash erases or programs after a resume before it is suspended again,
+ * interrupts coming faster would otherwise keep an erase from progressing */
+#ifndef MFLASH_NOR_RESUME_TIME_US
+#define MFLASH_NOR_RESUME_TIME_US (100)
+#endif
+
+/* Lines used by the opcode, the address with the intermediate bytes, and the data */
+typedef enum _mflash_nor_lines
+{
+    kMflashNor_1_1_1 = 0, /* all serial */
+    kMflashNor_1_1_4,     /* data on four lines */
+    kMflashNor_1_4_4,     /* address, intermediate bytes and data on four lines */
+} mflash_nor_lines_t;
+
+/* Erase units */
+typedef enum _mflash_nor_erase
+{
+    kMflashNor_EraseSector = 0,
+    kMflashNor_EraseBlock32,
+    kMflashNor_EraseBlock64,
+} mflash_nor_erase_t;
+
+/* Command of the flash */
+typedef struct _mflash_nor_cmd
+{
+    uint8_t opcode;
+    uint8_t addr_len;  /* 0 or 3 bytes of address */
+    uint8_t dummy_len; /* intermediate bytes, sent on the address lines */
+    uint8_t lines;     /* mflash_nor_lines_t */
+    bool data_out;     /* data are written to the flash */
+    uint16_t data_len;
+} mflash_nor_cmd_t;
+
+/* Operations of the controller */
+typedef struct _mflash_nor_ops
+{
+    /* Leave memory mode, back to command mode */
+    void (*reset)(void);
+    /* Use four lines for the non serial fields when 'quad' is set, two otherwise */
+    void (*set_quad)(bool quad);
+    /* Start 'cmd', at 'addr' when it has an address */
+    void (*command)(const mflash_nor_cmd_t *cmd, uint32_t addr);
+    /* Transfer the data of the command */
+    void (*write)(const uint8_t *data, uint32_t len);
+    void (*read)(uint8_t *data, uint32_t len);
+    /* Wait for the end of the command */
+    void (*wait)(void);
+    /* Enter memory mode, reading the flash with 'cmd' */
+    void (*memory_mode)(const mflash_nor_cmd_t *cmd);
+    /* Whether interrupts are waiting to be served during an erase or a program */
+    bool (*pending)(void);
+    /* Let the waiting interrupts run */
+    void (*service)(void);
+    /* Time base, 'elapsed_us' gives the microseconds since 'timestamp' returned 'since' */
+    uint32_t (*timestamp)(void);
+    uint32_t (*elapsed_us)(uint32_t since);
+} mflash_nor_ops_t;
+
+struct _mflash_nor_vendor;
+
+/* Flash driven by the sequences */
+typedef struct _mflash_nor
+{
+    const mflash_nor_ops_t *ops;
+    mflash_nor_cmd_t read;    /* memory mode read */
+    mflash_nor_cmd_t program; /* page program, 'data_len' set per page */
+    uint8_t jedec_id[3];
+    const struct _mflash_nor_vendor *vendor; /* NULL when the flash is not known */
+    bool quad;
+    bool xip;                /* interrupts read the flash, which is suspended while they run */
+    bool serve;              /* interrupts are served during erases and programs, otherwise only measured */
+    bool waiting;            /* interrupts are waiting, since 'waiting_since' */
+    uint32_t waiting_since;
+    uint32_t max_latency_us; /* longest wait of the interrupts during an erase or a program */
+    uint32_t suspends;       /* erases and programs suspended to serve interrupts */
+} mflash_nor_t;
+
+/* Use the serial read and program commands, 'xip' tells whether interrupts read the flash.
+ * Interrupts are served during erases and programs, unless 'serve' is cleared afterwards. */
+void mflash_nor_init(mflash_nor_t *nor, const mflash_nor_ops_t *ops, bool xip);
+
+/* Read the JEDEC ID, an erase or a program is only suspended on a known flash.
+ * Leaves the controller in command mode. */
+void mflash_nor_probe(mflash_nor_t *nor);
+
+/* For a known flash, set its quad enable bit and switch to the quad read and program
+ * commands. The quad read must return the same 'MFLASH_NOR_CHECK_SIZE' bytes at
+ * 'check_offset' as the serial read, otherwise the serial commands are kept.
+ * Returns true when the quad commands are used. Leaves the controller in command mode. */
+bool mflash_nor_probe_quad(mflash_nor_t *nor, uint32_t check_offset);
+
+/* Switch back to memory mode */
+void mflash_nor_read_mode(mflash_nor_t *nor);
+
+/* While an erase or a program is in progress, the waiting interrupts are served as soon as
+ * the flash is suspended, or right away when they do not read the flash. Called with
+ * interrupts masked, and with no other erase or program possible until they return: the
+ * interrupts, and the tasks they switch to, only read the flash. */
+
+/* Erase the unit at 'addr' and wait for the end of the erase */
+void mflash_nor_erase(mflash_nor_t *nor, uint32_t addr, mflash_nor_erase_t unit);
+
+/* Program 'len' bytes within the page of 'addr' and wait for the end of the program */
+void mflash_nor_program(mflash_nor_t *nor, uint32_t addr, const uint8_t *data, uint32_t len);
+
+#endif
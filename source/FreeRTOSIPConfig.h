@@ -224,6 +224,10 @@ extern UBaseType_t uxRand();
 /* Use the TCP socket wake context with a callback. */
 #define ipconfigSOCKET_HAS_USER_WAKE_CALLBACK_WITH_CONTEXT    ( 1 )
 
+/* Let the MQTT agent register a wake-up callback on its socket so that it
+ * sleeps until data arrives instead of polling the connection. */
+#define ipconfigSOCKET_HAS_USER_WAKE_CALLBACK                 ( 1 )
+
 /* USE_WIN: Let TCP use windowing mechanism. */
 #define ipconfigUSE_TCP_WIN                                   ( 1 )
 
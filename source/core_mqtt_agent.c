@@ -28,8 +28,30 @@
  * MQTT agent contains a dedicated FreeRTOS task which runs in a loop and process MQTT operations from
  * application tasks. A queue is used by the application tasks to enqueue an MQTT operation to be picked
  * up by the MQTT agent task. MQTT agent task calls the corresponding MQTT library API and adds it to a pending
- * operations list if the operation requires an acknowledgment. It receives MQTT packets from the network, if there
- * are no operations in queue to be processed.
+ * operations list if the operation requires an acknowledgment.
+ * The agent task blocks on its task notification and is only woken up when an operation is enqueued or
+ * when the TCP/IP stack signals activity on the MQTT socket. Incoming packets are processed only when the
+ * transport reports data is available, and keep alive pings are sent by the agent itself, so the agent does
+ * not poll the connection while idle.
+ * Publishes are serialized into a cork buffer which is written to the transport in one call, so that a
+ * burst of small publishes marked with moreFollows ends up in a single TLS record and TCP segment. The
+ * cork buffer is a publish buffer lent by the pool while publishes are corked.
+ * Large payloads can be written by the producer directly into an agent publish buffer reserved with
+ * MQTTAgent_ReservePublish(). The agent serializes the packet header in the headroom in front of the
+ * payload and hands header and payload to the transport in one write, without copying the payload.
+ * Operations are enqueued on a control lane or a bulk lane, each with its own queue. The control lane
+ * is serviced first, with a weight that guarantees the bulk lane still gets a share of the agent.
+ * When the connection is lost the agent keeps the QoS1 publishes waiting for their PUBACK, fails the
+ * other operations, and sends the kept publishes again once the application reconnects the context
+ * and calls MQTTAgent_Resume().
+ * Producers can also allocate their operations from a pool owned by the agent. The completion of a pooled
+ * operation is posted to a queue or signalled with a task notification instead of a callback, so that a
+ * producer can keep several operations in flight without blocking on each one.
+ * The agent reads the fixed header of each incoming packet itself. A publish larger than the network
+ * buffer is not passed to the library: its payload is read in fragments through the network buffer and
+ * handed to the stream handler routed for its topic, so that the buffer does not have to be sized for the
+ * largest publish. Other packets are processed by MQTT_ProcessLoop(), which reads the fixed header again
+ * from the agent receive function.
  */
 
 
@@ -46,6 +68,22 @@
 
 #include "core_mqtt_agent.h"
 
+/* Publish state records, restored for replayed publishes when the session is not resumed. */
+#include "core_mqtt_state.h"
+
+/* Transport used by the agent to wait for incoming data. */
+#include "tls_freertos_pkcs11.h"
+
+/* Stream handlers receiving the publishes larger than the network buffer. */
+#include "mqtt_subscription_router.h"
+
+/* The agent sleeps until the IP task calls it back on socket activity. The callback only wakes the
+ * single agent task, whose handle is kept in xAgentTask, so the _WITH_CONTEXT variant, which passes
+ * a user context to the callback, is not needed. */
+#if ( ipconfigSOCKET_HAS_USER_WAKE_CALLBACK != 1 )
+    #error "The MQTT agent requires ipconfigSOCKET_HAS_USER_WAKE_CALLBACK set to 1 in FreeRTOSIPConfig.h."
+#endif
+
 /**
  * @brief Task priority for MQTT agent is set to higher priority than other tasks.
  */
@@ -58,32 +96,453 @@
 #define MQTT_AGENT_TASK_STACK_SIZE              ( 2048 )
 
 /**
- * @brief Maximum number of concurrent operations for MQTT agent.
+ * @brief Length of the queue of the control lane, used for latency sensitive operations.
+ */
+#ifndef MQTT_AGENT_CONTROL_QUEUE_LENGTH
+    #define MQTT_AGENT_CONTROL_QUEUE_LENGTH    ( 5 )
+#endif
+
+/**
+ * @brief Length of the queue of the bulk lane, used for telemetry.
+ */
+#ifndef MQTT_AGENT_BULK_QUEUE_LENGTH
+    #define MQTT_AGENT_BULK_QUEUE_LENGTH    ( 8 )
+#endif
+
+/**
+ * @brief Number of control operations processed in a row before one waiting bulk operation is processed.
+ */
+#ifndef MQTT_AGENT_CONTROL_LANE_WEIGHT
+    #define MQTT_AGENT_CONTROL_LANE_WEIGHT    ( 4U )
+#endif
+
+/**
+ * @brief Maximum number of operations waiting for an acknowledgment from the broker (the in-flight window).
+ * QoS1/QoS2 publishes, subscribes and unsubscribes each hold an entry until their ACK is received.
+ * Must be a power of two. Defaults to the number of publish state records of coreMQTT, since
+ * QoS1/QoS2 publishes beyond that count would be rejected by the library.
+ */
+#ifndef MQTT_AGENT_MAX_INFLIGHT_OPERATIONS
+    #define MQTT_AGENT_MAX_INFLIGHT_OPERATIONS    ( MQTT_STATE_ARRAY_MAX_COUNT )
+#endif
+
+#if ( ( MQTT_AGENT_MAX_INFLIGHT_OPERATIONS & ( MQTT_AGENT_MAX_INFLIGHT_OPERATIONS - 1U ) ) != 0U )
+    #error "MQTT_AGENT_MAX_INFLIGHT_OPERATIONS must be a power of two."
+#endif
+
+/**
+ * @brief Number of slots in the pending operations table.
+ * The table is kept at most half full so that linear probe sequences stay short.
+ */
+#define MQTT_AGENT_PENDING_TABLE_SIZE           ( 2U * MQTT_AGENT_MAX_INFLIGHT_OPERATIONS )
+
+/**
+ * @brief Number of in-flight window entries that bulk operations cannot take, so that control operations
+ * are not rejected while telemetry fills the window.
+ */
+#ifndef MQTT_AGENT_CONTROL_RESERVED_INFLIGHT
+    #define MQTT_AGENT_CONTROL_RESERVED_INFLIGHT    ( 4U )
+#endif
+
+/**
+ * @brief Maps a packet identifier to its home slot in the pending operations table.
+ * Packet identifiers are allocated sequentially by coreMQTT, so the low bits spread well.
+ */
+#define MQTT_AGENT_PENDING_SLOT( packetId )    ( ( size_t ) ( packetId ) & ( MQTT_AGENT_PENDING_TABLE_SIZE - 1U ) )
+
+/**
+ * @brief Timeout passed to MQTT_ProcessLoop when data is available on the connection.
+ * A zero timeout makes the library read exactly one packet without waiting for more.
+ */
+#define MQTT_AGENT_PROCESS_LOOP_TIMEOUT_MS      ( 0U )
+
+/**
+ * @brief Time to wait for a ping response before the connection is considered lost.
+ */
+#ifndef MQTT_PINGRESP_TIMEOUT_MS
+    #define MQTT_PINGRESP_TIMEOUT_MS    ( 500U )
+#endif
+
+/**
+ * @brief Milliseconds per second.
  */
-#define MQTT_AGENT_MAX_CONCURRENT_OPERATIONS    ( 5 )
+#define MQTT_AGENT_MS_PER_SECOND                ( 1000U )
 
 /**
- * @brief Maximum polling interval for the agent. The agent will be listening on incoming messages during
- * this interval.
+ * @brief Number of bytes of serialized publishes coalesced into one transport write.
+ * With the 1200 bytes MTU, a full cork plus the TLS record overhead still fits in one TCP segment.
  */
-#define MQTT_AGENT_MAX_POLLING_INTERVAL_MS      ( 500 )
+#ifndef MQTT_AGENT_CORK_BUFFER_SIZE
+    #define MQTT_AGENT_CORK_BUFFER_SIZE    ( 1024U )
+#endif
 
 /**
- * @brief Function used to add a MQTT operation to the pending list for receiving ACKS from broker.
+ * @brief Maximum number of publishes held in the cork buffer before it is flushed.
+ */
+#ifndef MQTT_AGENT_CORK_MAX_PUBLISHES
+    #define MQTT_AGENT_CORK_MAX_PUBLISHES    ( 32U )
+#endif
+
+/**
+ * @brief Maximum time the first publish of a batch is held in the cork buffer waiting for more.
+ */
+#ifndef MQTT_AGENT_CORK_TIMEOUT_MS
+    #define MQTT_AGENT_CORK_TIMEOUT_MS    ( 20U )
+#endif
+
+/**
+ * @brief Number of publish buffers available to MQTTAgent_ReservePublish(). One of them is lent to the
+ * agent as cork buffer while publishes are corked.
+ */
+#ifndef MQTT_AGENT_PUBLISH_BUFFER_COUNT
+    #define MQTT_AGENT_PUBLISH_BUFFER_COUNT    ( 2U )
+#endif
+
+/**
+ * @brief Size of each publish buffer, including the headroom for the packet header and topic.
+ */
+#ifndef MQTT_AGENT_PUBLISH_BUFFER_SIZE
+    #define MQTT_AGENT_PUBLISH_BUFFER_SIZE    ( 4096U )
+#endif
+
+#if ( MQTT_AGENT_CORK_BUFFER_SIZE > MQTT_AGENT_PUBLISH_BUFFER_SIZE )
+    #error "Publishes are corked in a publish buffer, MQTT_AGENT_CORK_BUFFER_SIZE must fit in it."
+#endif
+
+/**
+ * @brief Maximum size of the fixed header of an MQTT packet: the type byte and up to four bytes of
+ * remaining length.
+ */
+#define MQTT_AGENT_FIXED_HEADER_MAX_SIZE        ( 5U )
+
+/**
+ * @brief Longest topic read ahead of the payload of an incoming publish, to find whether the publish
+ * is streamed or read into a loaned buffer. AWS IoT topics are at most 256 bytes.
+ */
+#ifndef MQTT_AGENT_TOPIC_PEEK_SIZE
+    #define MQTT_AGENT_TOPIC_PEEK_SIZE    ( 256U )
+#endif
+
+/**
+ * @brief Maximum time without receiving any byte while reading the rest of a streamed publish.
+ */
+#ifndef MQTT_AGENT_STREAM_RECV_TIMEOUT_MS
+    #define MQTT_AGENT_STREAM_RECV_TIMEOUT_MS    ( 5000U )
+#endif
+
+/**
+ * @brief Number of operations in the pool used by MQTTAgent_AllocateOperation().
+ */
+#ifndef MQTT_AGENT_OPERATION_POOL_SIZE
+    #define MQTT_AGENT_OPERATION_POOL_SIZE    ( 8U )
+#endif
+
+/**
+ * @brief Operation of the pool, with the publish information and completion target owned by the pool.
+ * The operation is the first member so that a pointer to the operation is a pointer to the entry.
+ */
+typedef struct MQTTAgentPoolEntry
+{
+    MQTTOperation_t operation;
+    MQTTPublishInfo_t publishInfo;
+    MQTTAgentCompletionTarget_t target;
+    volatile MQTTStatus_t status;
+    volatile BaseType_t isComplete;
+    BaseType_t isAllocated;
+} MQTTAgentPoolEntry_t;
+
+/**
+ * @brief Function used to add a MQTT operation to the pending table for receiving ACKS from broker.
+ * The operation is stored in the slot indexed by its packet identifier, probing linearly on collisions.
  *
  * @param[in] pOperation Pointer to the operation pending.
- * @return pdTRUE if the operation was enqueued, pdFALSE if max pending operations are reached.
+ * @return pdTRUE if the operation was added, pdFALSE if the table is full.
  */
 static BaseType_t addPendingOperation( MQTTOperation_t * pOperation );
 
 /**
  * @brief Pops pending MQTT operation with the packet identifier.
+ * Removal shifts back the following entries of the probe sequence so that no tombstones are needed.
  *
  * @param[in] packetIndentifier The packet identifier for the pending MQTT operation.
  * @return Pointer to the MQTT operation poped, NULL if there are no operations with that packet identifier.
  */
 static MQTTOperation_t * getPendingOperation( uint16_t packetIdentifier );
 
+/**
+ * @brief Checks if an operation holds an entry in the in-flight window until acknowledged.
+ *
+ * @param[in] pOperation The operation to check.
+ * @return pdTRUE if an ACK is expected from the broker for this operation.
+ */
+static BaseType_t prvOperationNeedsAck( const MQTTOperation_t * pOperation );
+
+/**
+ * @brief Reserves an entry in the in-flight window for an operation being enqueued.
+ *
+ * @param[in] lane The lane the operation is enqueued on.
+ * @return pdTRUE if the entry was reserved, pdFALSE if the window is full for the lane.
+ */
+static BaseType_t prvReserveInflightEntry( MQTTAgentLane_t lane );
+
+/**
+ * @brief Receives the next operation to process from the lanes.
+ * The control lane is served first, except that after MQTT_AGENT_CONTROL_LANE_WEIGHT control operations
+ * in a row a waiting bulk operation is served.
+ *
+ * @param[out] ppOperation Set to the received operation.
+ * @return pdTRUE if an operation was received, pdFALSE if both lanes are empty.
+ */
+static BaseType_t prvReceiveOperation( MQTTOperation_t ** ppOperation );
+
+/**
+ * @brief Returns an entry reserved with prvReserveInflightEntry() to the in-flight window.
+ */
+static void prvReleaseInflightEntry( void );
+
+/**
+ * @brief Completes an operation which requires an ACK: either adds it to the pending table or,
+ * if sending failed, releases its window entry and invokes the callback with the error.
+ *
+ * @param[in] pOperation The operation sent.
+ * @param[in] packetIdentifier Packet identifier used for the operation.
+ * @param[in] mqttStatus Status returned by the MQTT library when sending the operation.
+ */
+static void prvTrackOperation( MQTTOperation_t * pOperation,
+                               uint16_t packetIdentifier,
+                               MQTTStatus_t mqttStatus );
+
+/**
+ * @brief Invokes the callback of a completed operation and returns its publish buffer, if any, to the pool.
+ *
+ * @param[in] pOperation The completed operation.
+ * @param[in] status Status of the operation.
+ */
+static void prvCompleteOperation( MQTTOperation_t * pOperation,
+                                  MQTTStatus_t status );
+
+/**
+ * @brief Finds the publish buffer holding a payload reserved with MQTTAgent_ReservePublish().
+ *
+ * @param[in] pPayload Payload pointer.
+ * @return Index of the publish buffer, or -1 if the payload is not in a publish buffer.
+ */
+static int32_t prvGetPublishBufferIndex( const void * pPayload );
+
+/**
+ * @brief Finds the pool entry of an operation allocated with MQTTAgent_AllocateOperation().
+ *
+ * @param[in] pOperation Operation pointer.
+ * @return The pool entry, or NULL if the operation is not from the pool.
+ */
+static MQTTAgentPoolEntry_t * prvGetPoolEntry( const MQTTOperation_t * pOperation );
+
+/**
+ * @brief Callback of pooled operations, which reports the completion to the target of the entry.
+ *
+ * @param[in] pOperation Pooled operation.
+ * @param[in] status Status of the operation.
+ */
+static void prvPooledOperationCallback( MQTTOperation_t * pOperation,
+                                        MQTTStatus_t status );
+
+/**
+ * @brief Writes all the bytes of a buffer to the transport.
+ *
+ * @param[in] pData Bytes to write.
+ * @param[in] length Number of bytes to write.
+ * @return MQTTSuccess, or MQTTSendFailed if the transport failed.
+ */
+static MQTTStatus_t prvTransportWriteAll( const uint8_t * pData,
+                                          size_t length );
+
+/**
+ * @brief Transport send function installed in the MQTT context by the agent.
+ * While the agent is corking, data is appended to the cork buffer. Otherwise, any corked data is
+ * flushed first so that packets stay in order, and the data is passed to the transport.
+ * While the agent sends a publish whose payload is in a publish buffer, the header is copied in front
+ * of the payload and written together with it.
+ *
+ * @param[in] pNetworkContext The network context.
+ * @param[in] pBuffer Buffer containing the bytes to send.
+ * @param[in] bytesToSend Number of bytes to send from the buffer.
+ * @return Number of bytes accepted, or a negative value on error.
+ */
+static int32_t prvCorkedSend( NetworkContext_t * pNetworkContext,
+                              const void * pBuffer,
+                              size_t bytesToSend );
+
+/**
+ * @brief Writes the content of the cork buffer to the transport and completes corked QoS0 publishes.
+ *
+ * @return MQTTSuccess, or MQTTSendFailed if the transport failed.
+ */
+static MQTTStatus_t prvFlushCork( void );
+
+/**
+ * @brief Borrows a free publish buffer from the pool to cork publishes in, unless one is already held.
+ *
+ * @return pdTRUE if a cork buffer is held, pdFALSE if all the publish buffers are in use.
+ */
+static BaseType_t prvAcquireCorkBuffer( void );
+
+/**
+ * @brief Returns the cork buffer to the publish buffer pool once it is empty and no publish is being corked.
+ */
+static void prvReleaseCorkBuffer( void );
+
+/**
+ * @brief Publishes through the cork buffer and flushes it when the batch ends or a limit is reached.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @param[in] pOperation The publish operation.
+ * @return MQTTSuccess, or the error returned while flushing the cork buffer.
+ */
+static MQTTStatus_t prvCorkedPublish( MQTTContext_t * pMQTTContext,
+                                      MQTTOperation_t * pOperation );
+
+/**
+ * @brief Executes a single MQTT operation dequeued from the operations queue.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @param[in] pOperation The operation to execute.
+ * @return MQTTSuccess, or the error returned while flushing the cork buffer.
+ */
+static MQTTStatus_t prvProcessOperation( MQTTContext_t * pMQTTContext,
+                                         MQTTOperation_t * pOperation );
+
+/**
+ * @brief Receives and processes all packets currently available on the connection.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @return MQTTSuccess or the error returned by MQTT_ProcessLoop.
+ */
+static MQTTStatus_t prvProcessIncomingPackets( MQTTContext_t * pMQTTContext );
+
+/**
+ * @brief Reads the fixed header of an incoming packet and processes the packet.
+ * The topic of a publish is read too. Publishes larger than the network buffer, and publishes on a
+ * route with a loan handler, are streamed with prvStreamPublish(). Other packets are processed by
+ * MQTT_ProcessLoop() after the bytes already read are queued for prvReplayRecv().
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @return MQTTSuccess, or the error returned while receiving or processing the packet.
+ */
+static MQTTStatus_t prvReceivePacket( MQTTContext_t * pMQTTContext );
+
+/**
+ * @brief Reads the rest of a publish whose topic was read and passes its payload to the stream handler
+ * of its topic, then acknowledges a QoS1 publish. The payload is read into the buffer loaned by the
+ * loan handler of the route if it has one, otherwise it is passed in fragments read into the network buffer.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @param[in] pPacketInfo Type and remaining length of the publish.
+ * @param[in] pTopicName Topic of the publish.
+ * @param[in] topicLength Length of the topic.
+ * @param[in] pRoute Stream route of the topic, or NULL to discard the payload.
+ * @return MQTTSuccess, or the error returned while receiving or acknowledging the publish.
+ */
+static MQTTStatus_t prvStreamPublish( MQTTContext_t * pMQTTContext,
+                                      const MQTTPacketInfo_t * pPacketInfo,
+                                      const char * pTopicName,
+                                      uint16_t topicLength,
+                                      const MQTTRouteStream_t * pRoute );
+
+/**
+ * @brief Reads exactly the requested number of bytes from the transport.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @param[out] pBuffer Buffer receiving the bytes.
+ * @param[in] length Number of bytes to read.
+ * @return MQTTSuccess, or MQTTRecvFailed if the transport failed or no byte was received for
+ * MQTT_AGENT_STREAM_RECV_TIMEOUT_MS.
+ */
+static MQTTStatus_t prvRecvExact( MQTTContext_t * pMQTTContext,
+                                  uint8_t * pBuffer,
+                                  size_t length );
+
+/**
+ * @brief Transport receive function installed in the MQTT context by the agent.
+ * Returns the bytes of the packet already read by prvReceivePacket() before reading from the transport.
+ *
+ * @param[in] pNetworkContext The network context.
+ * @param[out] pBuffer Buffer receiving the bytes.
+ * @param[in] bytesToRecv Number of bytes requested.
+ * @return Number of bytes received, or a negative value on error.
+ */
+static int32_t prvReplayRecv( NetworkContext_t * pNetworkContext,
+                              void * pBuffer,
+                              size_t bytesToRecv );
+
+/**
+ * @brief Sends a keep alive ping when due and computes how long the agent can sleep.
+ *
+ * coreMQTT only manages keep alive from within MQTT_ProcessLoop, which the agent calls only when
+ * data is available. This function mirrors the library behavior so that the connection is kept
+ * alive while the agent is blocked.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @param[out] pWaitTicks Ticks the agent can block before keep alive needs attention again.
+ * @return MQTTSuccess, MQTTKeepAliveTimeout if no ping response was received in time, or the
+ * error returned by MQTT_Ping.
+ */
+static MQTTStatus_t prvManageKeepAlive( MQTTContext_t * pMQTTContext,
+                                        TickType_t * pWaitTicks );
+
+/**
+ * @brief Stops using a lost connection: discards the corked data, fails the operations which cannot be
+ * replayed and invokes the connection lost callback.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @param[in] status Error which caused the loss of the connection.
+ */
+static void prvHandleConnectionLoss( MQTTContext_t * pMQTTContext,
+                                     MQTTStatus_t status );
+
+/**
+ * @brief Completes an operation dequeued while the agent is disconnected.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @param[in] pOperation The operation dequeued.
+ */
+static void prvFailOperation( MQTTContext_t * pMQTTContext,
+                              MQTTOperation_t * pOperation );
+
+/**
+ * @brief Writes again a QoS1 publish waiting for its PUBACK, with its original packet identifier.
+ * The packet is serialized without going through MQTT_Publish(), which would reject the packet
+ * identifier as already in use by the state records.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @param[in] pOperation The pending publish.
+ * @return MQTTSuccess, or the error returned while serializing or writing the packet.
+ */
+static MQTTStatus_t prvResendPublish( MQTTContext_t * pMQTTContext,
+                                      MQTTOperation_t * pOperation );
+
+/**
+ * @brief Starts using the reconnected context and sends again the pending QoS1 publishes.
+ *
+ * @param[in] pMQTTContext The MQTT context used by the agent.
+ * @param[in] sessionPresent Session present flag of the CONNACK.
+ * @return MQTTSuccess, or the error returned while sending a publish.
+ */
+static MQTTStatus_t prvResumeSession( MQTTContext_t * pMQTTContext,
+                                      BaseType_t sessionPresent );
+
+/**
+ * @brief Records the time taken to write the first publish after a connection loss.
+ */
+static void prvRecordPublishWritten( void );
+
+/**
+ * @brief Callback invoked by the TCP/IP task on activity on the MQTT socket.
+ * Wakes up the agent task.
+ *
+ * @param[in] xSocket The socket with activity.
+ */
+static void prvSocketWakeupCallback( Socket_t xSocket );
+
 /**
  * @brief Main agent task loop.
  * Agent runs in a loop processing MQTT operations from application tasks. It exits loop on explicitly calling
@@ -94,199 +553,1607 @@ static MQTTOperation_t * getPendingOperation( uint16_t packetIdentifier );
 static void prvMQTTAgentLoop( void * pParams );
 
 /**
- * @brief The default operation used when there are no other operations in queue.
+ * @brief The operation used to stop the agent.
  */
-static MQTTOperation_t receiveOP =
+static MQTTOperation_t stopOP =
 {
-    .type = MQTT_OP_RECEIVE
+    .type = MQTT_OP_STOP
 };
 
-/**
- * @brief Queue used to receive MQTT operations to be processed by MQTT agent.
- */
-static QueueHandle_t xOperationsQueue;
+/**
+ * @brief Queues, one per lane, used to receive MQTT operations to be processed by MQTT agent.
+ */
+static QueueHandle_t xOperationsQueue[ MQTTAgentNumLanes ];
+
+/**
+ * @brief Number of control operations processed since the last bulk operation.
+ */
+static uint32_t controlServedCount = 0U;
+
+/**
+ * @brief Handle of the agent task, notified to wake up the agent.
+ */
+static TaskHandle_t xAgentTask = NULL;
+
+/**
+ * @brief Open addressing table of pending MQTT operations that require an ACK to be received from broker,
+ * keyed by packet identifier. Accessed only from the agent task.
+ */
+static MQTTOperation_t * pendingOperations[ MQTT_AGENT_PENDING_TABLE_SIZE ];
+
+/**
+ * @brief Number of in-flight window entries reserved by MQTTAgent_Enqueue() and not yet released.
+ * Updated from application tasks and the agent task inside critical sections.
+ */
+static volatile uint32_t inflightReserved = 0U;
+
+/**
+ * @brief Statistics of the in-flight window.
+ */
+static MQTTAgentStats_t agentStats = { 0 };
+
+/**
+ * @brief Transport send function replaced by prvCorkedSend() in the MQTT context.
+ */
+static TransportSend_t transportSend = NULL;
+
+/**
+ * @brief Transport receive function replaced by prvReplayRecv() in the MQTT context.
+ */
+static TransportRecv_t transportRecv = NULL;
+
+/**
+ * @brief Start of the incoming packet, read by the agent and returned again to the library: the fixed
+ * header and, for a publish, the topic length and the topic.
+ */
+static uint8_t replayBuffer[ MQTT_AGENT_FIXED_HEADER_MAX_SIZE + 2U + MQTT_AGENT_TOPIC_PEEK_SIZE ];
+
+/**
+ * @brief Number of bytes in replayBuffer.
+ */
+static size_t replayLength = 0U;
+
+/**
+ * @brief Number of bytes of replayBuffer already returned to the library.
+ */
+static size_t replayOffset = 0U;
+
+/**
+ * @brief Network context of the connection used by the agent.
+ */
+static NetworkContext_t * pAgentNetworkContext = NULL;
+
+/**
+ * @brief Publish buffer holding serialized publishes until they are written in one transport call,
+ * NULL while no publish is corked.
+ */
+static uint8_t * pCorkBuffer = NULL;
+
+/**
+ * @brief Index of the publish buffer lent as cork buffer.
+ */
+static size_t corkBufferIndex = 0U;
+
+/**
+ * @brief Number of bytes in the cork buffer.
+ */
+static size_t corkLength = 0U;
+
+/**
+ * @brief Number of publishes serialized in the cork buffer.
+ */
+static uint32_t corkPublishCount = 0U;
+
+/**
+ * @brief Tick count when the first publish was added to an empty cork buffer.
+ */
+static TickType_t corkStartTicks = 0U;
+
+/**
+ * @brief Set by the agent while serializing a publish, so that prvCorkedSend() corks the data.
+ */
+static BaseType_t isCorking = pdFALSE;
+
+/**
+ * @brief QoS0 publishes in the cork buffer, completed once the buffer is written to the transport.
+ */
+static MQTTOperation_t * corkedOperations[ MQTT_AGENT_CORK_MAX_PUBLISHES ];
+
+/**
+ * @brief Number of entries in corkedOperations.
+ */
+static size_t corkedOperationCount = 0U;
+
+/**
+ * @brief Publish buffers in which producers write payloads in place.
+ */
+static uint8_t publishBuffers[ MQTT_AGENT_PUBLISH_BUFFER_COUNT ][ MQTT_AGENT_PUBLISH_BUFFER_SIZE ];
+
+/**
+ * @brief Offset of the payload in each publish buffer, 0 when the buffer is free.
+ * The bytes before the payload are the headroom for the packet header.
+ */
+static size_t publishBufferHeadroom[ MQTT_AGENT_PUBLISH_BUFFER_COUNT ];
+
+/**
+ * @brief Counting semaphore tracking the free publish buffers.
+ */
+static SemaphoreHandle_t xPublishBufferSemaphore = NULL;
+
+/**
+ * @brief Operations allocated with MQTTAgent_AllocateOperation().
+ */
+static MQTTAgentPoolEntry_t operationPool[ MQTT_AGENT_OPERATION_POOL_SIZE ];
+
+/**
+ * @brief Counting semaphore tracking the free operations of the pool.
+ */
+static SemaphoreHandle_t xOperationPoolSemaphore = NULL;
+
+/**
+ * @brief Number of operations allocated from the pool.
+ */
+static uint32_t pooledOperationsInUse = 0U;
+
+/**
+ * @brief Payload of the in-place publish being sent by the agent, NULL otherwise.
+ */
+static const uint8_t * pInPlacePayload = NULL;
+
+/**
+ * @brief Headroom in front of pInPlacePayload.
+ */
+static size_t inPlaceHeadroom = 0U;
+
+/**
+ * @brief Length of the header of the in-place publish copied in front of the payload and not yet written.
+ */
+static size_t inPlaceHeaderLength = 0U;
+
+/**
+ * @brief Variable used to check if the agent is running.
+ */
+static BaseType_t isAgentRunning = pdFALSE;
+
+/**
+ * @brief Set by the agent task when a stop operation is processed.
+ */
+static BaseType_t isStopRequested = pdFALSE;
+
+/**
+ * @brief Set while the agent is using the connection.
+ */
+static volatile BaseType_t isConnected = pdFALSE;
+
+/**
+ * @brief Set by MQTTAgent_Suspend() to make the agent stop using the connection.
+ */
+static volatile BaseType_t isSuspendRequested = pdFALSE;
+
+/**
+ * @brief Set by MQTTAgent_Resume() to make the agent use the reconnected context.
+ */
+static volatile BaseType_t isResumeRequested = pdFALSE;
+
+/**
+ * @brief Session present flag passed to MQTTAgent_Resume().
+ */
+static BaseType_t resumeSessionPresent = pdFALSE;
+
+/**
+ * @brief Callback invoked when the agent stops using the connection.
+ */
+static MQTTAgentConnectionLostCallback_t connectionLostCallback = NULL;
+
+/**
+ * @brief Tick count when the connection was lost, valid while isRecoveryTimed is set.
+ */
+static TickType_t connectionLostTicks = 0U;
+
+/**
+ * @brief Set from a connection loss until the first publish is written on the new connection.
+ */
+static BaseType_t isRecoveryTimed = pdFALSE;
+
+
+static BaseType_t addPendingOperation( MQTTOperation_t * pOperation )
+{
+    size_t index = MQTT_AGENT_PENDING_SLOT( pOperation->packetIdentifier );
+    size_t probes = 0;
+    BaseType_t result = pdFALSE;
+
+    for( probes = 0; probes < MQTT_AGENT_PENDING_TABLE_SIZE; probes++ )
+    {
+        if( pendingOperations[ index ] == NULL )
+        {
+            pendingOperations[ index ] = pOperation;
+            result = pdTRUE;
+            break;
+        }
+
+        index = ( index + 1U ) & ( MQTT_AGENT_PENDING_TABLE_SIZE - 1U );
+    }
+
+    if( result == pdTRUE )
+    {
+        agentStats.pendingOperations++;
+
+        if( probes > agentStats.maxProbeLength )
+        {
+            agentStats.maxProbeLength = probes;
+        }
+    }
+
+    return result;
+}
+
+static MQTTOperation_t * getPendingOperation( uint16_t packetIdentifier )
+{
+    size_t index = MQTT_AGENT_PENDING_SLOT( packetIdentifier );
+    size_t next, home;
+    size_t probes = 0;
+    MQTTOperation_t * pOperation = NULL;
+
+    for( probes = 0; probes < MQTT_AGENT_PENDING_TABLE_SIZE; probes++ )
+    {
+        if( pendingOperations[ index ] == NULL )
+        {
+            /* End of the probe sequence, the packet identifier is not pending. */
+            break;
+        }
+
+        if( pendingOperations[ index ]->packetIdentifier == packetIdentifier )
+        {
+            pOperation = pendingOperations[ index ];
+            pendingOperations[ index ] = NULL;
+            break;
+        }
+
+        index = ( index + 1U ) & ( MQTT_AGENT_PENDING_TABLE_SIZE - 1U );
+    }
+
+    if( pOperation != NULL )
+    {
+        agentStats.pendingOperations--;
+
+        /* Shift back the entries following the removed one whose home slot is at or before the hole,
+         * so that lookups do not stop early at the emptied slot. */
+        next = ( index + 1U ) & ( MQTT_AGENT_PENDING_TABLE_SIZE - 1U );
+
+        while( pendingOperations[ next ] != NULL )
+        {
+            home = MQTT_AGENT_PENDING_SLOT( pendingOperations[ next ]->packetIdentifier );
+
+            if( ( ( next - home ) & ( MQTT_AGENT_PENDING_TABLE_SIZE - 1U ) ) >=
+                ( ( next - index ) & ( MQTT_AGENT_PENDING_TABLE_SIZE - 1U ) ) )
+            {
+                pendingOperations[ index ] = pendingOperations[ next ];
+                pendingOperations[ next ] = NULL;
+                index = next;
+            }
+
+            next = ( next + 1U ) & ( MQTT_AGENT_PENDING_TABLE_SIZE - 1U );
+        }
+    }
+
+    return pOperation;
+}
+
+static BaseType_t prvOperationNeedsAck( const MQTTOperation_t * pOperation )
+{
+    BaseType_t result = pdFALSE;
+
+    switch( pOperation->type )
+    {
+        case MQTT_OP_PUBLISH:
+            result = ( pOperation->info.pPublishInfo->qos != MQTTQoS0 ) ? pdTRUE : pdFALSE;
+            break;
+
+        case MQTT_OP_SUBSCRIBE:
+        case MQTT_OP_UNSUBSCRIBE:
+            result = pdTRUE;
+            break;
+
+        default:
+            break;
+    }
+
+    return result;
+}
+
+static BaseType_t prvReserveInflightEntry( MQTTAgentLane_t lane )
+{
+    BaseType_t result = pdFALSE;
+    uint32_t limit = MQTT_AGENT_MAX_INFLIGHT_OPERATIONS;
+
+    if( lane != MQTTAgentLaneControl )
+    {
+        limit -= MQTT_AGENT_CONTROL_RESERVED_INFLIGHT;
+    }
+
+    taskENTER_CRITICAL();
+    {
+        if( inflightReserved < limit )
+        {
+            inflightReserved++;
+            result = pdTRUE;
+
+            if( inflightReserved > agentStats.inflightHighWatermark )
+            {
+                agentStats.inflightHighWatermark = inflightReserved;
+            }
+        }
+        else
+        {
+            agentStats.windowFullCount++;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    return result;
+}
+
+static BaseType_t prvReceiveOperation( MQTTOperation_t ** ppOperation )
+{
+    BaseType_t received = pdFALSE;
+
+    if( controlServedCount < MQTT_AGENT_CONTROL_LANE_WEIGHT )
+    {
+        received = xQueueReceive( xOperationsQueue[ MQTTAgentLaneControl ], ppOperation, 0 );
+    }
+
+    if( received == pdTRUE )
+    {
+        controlServedCount++;
+    }
+    else
+    {
+        received = xQueueReceive( xOperationsQueue[ MQTTAgentLaneBulk ], ppOperation, 0 );
+
+        if( received == pdTRUE )
+        {
+            controlServedCount = 0U;
+        }
+        else
+        {
+            /* Bulk lane empty, the control lane weight does not apply. */
+            received = xQueueReceive( xOperationsQueue[ MQTTAgentLaneControl ], ppOperation, 0 );
+            controlServedCount = ( received == pdTRUE ) ? 1U : 0U;
+        }
+    }
+
+    return received;
+}
+
+static void prvReleaseInflightEntry( void )
+{
+    taskENTER_CRITICAL();
+    {
+        configASSERT( inflightReserved > 0U );
+        inflightReserved--;
+    }
+    taskEXIT_CRITICAL();
+}
+
+static void prvTrackOperation( MQTTOperation_t * pOperation,
+                               uint16_t packetIdentifier,
+                               MQTTStatus_t mqttStatus )
+{
+    if( mqttStatus == MQTTSuccess )
+    {
+        pOperation->packetIdentifier = packetIdentifier;
+
+        /* The window reservation taken at enqueue guarantees a free slot. */
+        ( void ) addPendingOperation( pOperation );
+    }
+    else
+    {
+        prvReleaseInflightEntry();
+        prvCompleteOperation( pOperation, mqttStatus );
+    }
+}
+
+static void prvCompleteOperation( MQTTOperation_t * pOperation,
+                                  MQTTStatus_t status )
+{
+    int32_t bufferIndex = -1;
+
+    if( pOperation->type == MQTT_OP_PUBLISH )
+    {
+        bufferIndex = prvGetPublishBufferIndex( pOperation->info.pPublishInfo->pPayload );
+    }
+
+    pOperation->callback( pOperation, status );
+
+    /* The buffer is kept until the operation completes so that the payload stays valid for the
+     * whole life of the operation. */
+    if( bufferIndex >= 0 )
+    {
+        taskENTER_CRITICAL();
+        {
+            publishBufferHeadroom[ bufferIndex ] = 0U;
+        }
+        taskEXIT_CRITICAL();
+
+        ( void ) xSemaphoreGive( xPublishBufferSemaphore );
+    }
+}
+
+static int32_t prvGetPublishBufferIndex( const void * pPayload )
+{
+    const uint8_t * pBytes = ( const uint8_t * ) pPayload;
+    int32_t bufferIndex = -1;
+    size_t offset;
+
+    if( ( pBytes >= &publishBuffers[ 0 ][ 0 ] ) &&
+        ( pBytes < &publishBuffers[ MQTT_AGENT_PUBLISH_BUFFER_COUNT - 1U ][ MQTT_AGENT_PUBLISH_BUFFER_SIZE ] ) )
+    {
+        offset = ( size_t ) ( pBytes - &publishBuffers[ 0 ][ 0 ] );
+        bufferIndex = ( int32_t ) ( offset / MQTT_AGENT_PUBLISH_BUFFER_SIZE );
+    }
+
+    return bufferIndex;
+}
+
+static MQTTAgentPoolEntry_t * prvGetPoolEntry( const MQTTOperation_t * pOperation )
+{
+    const MQTTAgentPoolEntry_t * pEntry = ( const MQTTAgentPoolEntry_t * ) pOperation;
+    MQTTAgentPoolEntry_t * pPoolEntry = NULL;
+
+    if( ( pEntry >= &operationPool[ 0 ] ) &&
+        ( pEntry < &operationPool[ MQTT_AGENT_OPERATION_POOL_SIZE ] ) )
+    {
+        pPoolEntry = &operationPool[ pEntry - &operationPool[ 0 ] ];
+    }
+
+    return pPoolEntry;
+}
+
+static void prvPooledOperationCallback( MQTTOperation_t * pOperation,
+                                        MQTTStatus_t status )
+{
+    MQTTAgentPoolEntry_t * pEntry = prvGetPoolEntry( pOperation );
+    MQTTAgentCompletion_t completion;
+
+    configASSERT( pEntry != NULL );
+
+    pEntry->status = status;
+    pEntry->isComplete = pdTRUE;
+
+    if( pEntry->target.completionQueue != NULL )
+    {
+        completion.pOperation = pOperation;
+        completion.status = status;
+        completion.pUserContext = pEntry->target.pUserContext;
+
+        /* The agent must not block on a producer. A lost completion can still be found with
+         * MQTTAgent_GetOperationStatus(). */
+        if( xQueueSend( pEntry->target.completionQueue, &completion, 0U ) != pdTRUE )
+        {
+            taskENTER_CRITICAL();
+            {
+                agentStats.completionQueueFullCount++;
+            }
+            taskEXIT_CRITICAL();
+        }
+    }
+
+    if( pEntry->target.notifyTask != NULL )
+    {
+        ( void ) xTaskNotify( pEntry->target.notifyTask, pEntry->target.notifyBits, eSetBits );
+    }
+}
+
+static MQTTStatus_t prvTransportWriteAll( const uint8_t * pData,
+                                          size_t length )
+{
+    MQTTStatus_t mqttStatus = MQTTSuccess;
+    size_t bytesWritten = 0U;
+    int32_t bytesSent;
+
+    while( bytesWritten < length )
+    {
+        bytesSent = transportSend( pAgentNetworkContext,
+                                   &pData[ bytesWritten ],
+                                   length - bytesWritten );
+
+        if( bytesSent <= 0 )
+        {
+            PRINTF( "MQTT agent failed to write %u bytes, status = %d.\r\n",
+                    ( unsigned int ) ( length - bytesWritten ),
+                    ( int ) bytesSent );
+            mqttStatus = MQTTSendFailed;
+            break;
+        }
+
+        bytesWritten += ( size_t ) bytesSent;
+    }
+
+    return mqttStatus;
+}
+
+static int32_t prvCorkedSend( NetworkContext_t * pNetworkContext,
+                              const void * pBuffer,
+                              size_t bytesToSend )
+{
+    int32_t bytesSent = ( int32_t ) bytesToSend;
+
+    if( pInPlacePayload != NULL )
+    {
+        if( ( const uint8_t * ) pBuffer != pInPlacePayload )
+        {
+            /* The header is serialized by the MQTT library in one piece; place it right in front of the
+             * payload. The headroom was sized for the payload length given when the buffer was reserved,
+             * so a producer which changed the publish since may not leave room for the header. */
+            if( ( inPlaceHeaderLength != 0U ) || ( bytesToSend > inPlaceHeadroom ) )
+            {
+                PRINTF( "MQTT agent publish header of %u bytes does not fit in the %u bytes of headroom.\r\n",
+                        ( unsigned int ) bytesToSend,
+                        ( unsigned int ) inPlaceHeadroom );
+                bytesSent = -1;
+            }
+            else
+            {
+                memcpy( ( void * ) ( pInPlacePayload - bytesToSend ), pBuffer, bytesToSend );
+                inPlaceHeaderLength = bytesToSend;
+            }
+        }
+        else
+        {
+            if( prvTransportWriteAll( pInPlacePayload - inPlaceHeaderLength,
+                                      inPlaceHeaderLength + bytesToSend ) != MQTTSuccess )
+            {
+                bytesSent = -1;
+            }
+
+            inPlaceHeaderLength = 0U;
+        }
+    }
+    else if( ( isCorking == pdTRUE ) && ( ( corkLength + bytesToSend ) > MQTT_AGENT_CORK_BUFFER_SIZE ) )
+    {
+        if( prvFlushCork() != MQTTSuccess )
+        {
+            bytesSent = -1;
+        }
+    }
+
+    if( ( bytesSent < 0 ) || ( pInPlacePayload != NULL ) )
+    {
+        /* Error flushing the corked data, or in-place publish already handled. */
+    }
+    else if( ( isCorking == pdTRUE ) && ( ( corkLength + bytesToSend ) <= MQTT_AGENT_CORK_BUFFER_SIZE ) )
+    {
+        if( corkLength == 0U )
+        {
+            corkStartTicks = xTaskGetTickCount();
+        }
+
+        memcpy( &pCorkBuffer[ corkLength ], pBuffer, bytesToSend );
+        corkLength += bytesToSend;
+    }
+    else
+    {
+        /* Not corking, or the data does not fit in the cork buffer at all. Keep packets in order. */
+        if( corkLength > 0U )
+        {
+            if( prvFlushCork() != MQTTSuccess )
+            {
+                bytesSent = -1;
+            }
+        }
+
+        if( bytesSent >= 0 )
+        {
+            bytesSent = transportSend( pNetworkContext, pBuffer, bytesToSend );
+        }
+    }
+
+    return bytesSent;
+}
+
+static MQTTStatus_t prvFlushCork( void )
+{
+    MQTTStatus_t mqttStatus;
+    size_t index;
+
+    mqttStatus = prvTransportWriteAll( pCorkBuffer, corkLength );
+
+    corkLength = 0U;
+    corkPublishCount = 0U;
+    prvReleaseCorkBuffer();
+
+    /* QoS0 publishes are complete once written to the transport. Reset the list before invoking
+     * the callbacks since they may enqueue new operations. */
+    index = corkedOperationCount;
+    corkedOperationCount = 0U;
+
+    while( index > 0U )
+    {
+        index--;
+        prvCompleteOperation( corkedOperations[ index ], mqttStatus );
+    }
+
+    return mqttStatus;
+}
+
+static BaseType_t prvAcquireCorkBuffer( void )
+{
+    size_t index;
+
+    if( ( pCorkBuffer == NULL ) && ( xSemaphoreTake( xPublishBufferSemaphore, 0U ) == pdTRUE ) )
+    {
+        taskENTER_CRITICAL();
+        {
+            for( index = 0; index < MQTT_AGENT_PUBLISH_BUFFER_COUNT; index++ )
+            {
+                if( publishBufferHeadroom[ index ] == 0U )
+                {
+                    /* Any non-zero headroom marks the buffer in use, no payload points into it. */
+                    publishBufferHeadroom[ index ] = MQTT_AGENT_PUBLISH_BUFFER_SIZE;
+                    break;
+                }
+            }
+        }
+        taskEXIT_CRITICAL();
+
+        /* The semaphore count guarantees a free buffer. */
+        configASSERT( index < MQTT_AGENT_PUBLISH_BUFFER_COUNT );
+
+        corkBufferIndex = index;
+        pCorkBuffer = publishBuffers[ index ];
+    }
+
+    return ( pCorkBuffer != NULL ) ? pdTRUE : pdFALSE;
+}
+
+static void prvReleaseCorkBuffer( void )
+{
+    /* Kept while serializing a publish, a flush in the middle of it is followed by more data. */
+    if( ( pCorkBuffer != NULL ) && ( corkLength == 0U ) && ( isCorking == pdFALSE ) )
+    {
+        pCorkBuffer = NULL;
+
+        taskENTER_CRITICAL();
+        {
+            publishBufferHeadroom[ corkBufferIndex ] = 0U;
+        }
+        taskEXIT_CRITICAL();
+
+        ( void ) xSemaphoreGive( xPublishBufferSemaphore );
+    }
+}
+
+static MQTTStatus_t prvCorkedPublish( MQTTContext_t * pMQTTContext,
+                                      MQTTOperation_t * pOperation )
+{
+    uint16_t packetIdentifier = 0;
+    MQTTStatus_t mqttStatus;
+    MQTTStatus_t flushStatus = MQTTSuccess;
+    int32_t bufferIndex = prvGetPublishBufferIndex( pOperation->info.pPublishInfo->pPayload );
+
+    if( pOperation->info.pPublishInfo->qos != MQTTQoS0 )
+    {
+        packetIdentifier = MQTT_GetPacketId( pMQTTContext );
+    }
+
+    if( bufferIndex >= 0 )
+    {
+        /* In-place payload: bypass the cork buffer, after writing out what it holds to keep packets in order. */
+        if( corkLength > 0U )
+        {
+            flushStatus = prvFlushCork();
+        }
+
+        pInPlacePayload = ( const uint8_t * ) pOperation->info.pPublishInfo->pPayload;
+        inPlaceHeadroom = publishBufferHeadroom[ bufferIndex ];
+        inPlaceHeaderLength = 0U;
+
+        mqttStatus = MQTT_Publish( pMQTTContext, pOperation->info.pPublishInfo, packetIdentifier );
+
+        /* The header is written with the payload; a publish without payload leaves it pending. */
+        if( ( mqttStatus == MQTTSuccess ) && ( inPlaceHeaderLength > 0U ) )
+        {
+            mqttStatus = prvTransportWriteAll( pInPlacePayload - inPlaceHeaderLength, inPlaceHeaderLength );
+        }
+
+        pInPlacePayload = NULL;
+        inPlaceHeaderLength = 0U;
+    }
+    else
+    {
+        /* Without a free publish buffer to cork in, the publish is written to the transport directly. */
+        isCorking = prvAcquireCorkBuffer();
+        mqttStatus = MQTT_Publish( pMQTTContext, pOperation->info.pPublishInfo, packetIdentifier );
+        isCorking = pdFALSE;
+
+        if( ( mqttStatus == MQTTSuccess ) && ( corkLength > 0U ) )
+        {
+            corkPublishCount++;
+        }
+
+        /* The publish was too large to cork, or failed. */
+        prvReleaseCorkBuffer();
+    }
+
+    if( mqttStatus == MQTTSuccess )
+    {
+        prvRecordPublishWritten();
+    }
+
+    if( pOperation->info.pPublishInfo->qos != MQTTQoS0 )
+    {
+        prvTrackOperation( pOperation, packetIdentifier, mqttStatus );
+    }
+    else if( ( mqttStatus == MQTTSuccess ) && ( corkLength > 0U ) )
+    {
+        /* Completed when the cork buffer is written. */
+        corkedOperations[ corkedOperationCount ] = pOperation;
+        corkedOperationCount++;
+    }
+    else
+    {
+        /* Failed, or written to the transport without going through the cork buffer. */
+        prvCompleteOperation( pOperation, mqttStatus );
+    }
+
+    if( ( corkLength > 0U ) &&
+        ( ( pOperation->moreFollows == pdFALSE ) ||
+          ( corkPublishCount >= MQTT_AGENT_CORK_MAX_PUBLISHES ) ||
+          ( corkedOperationCount >= MQTT_AGENT_CORK_MAX_PUBLISHES ) ) )
+    {
+        flushStatus = prvFlushCork();
+    }
+
+    return flushStatus;
+}
+
+static MQTTStatus_t prvProcessOperation( MQTTContext_t * pMQTTContext,
+                                         MQTTOperation_t * pOperation )
+{
+    uint16_t packetIdentifier = 0;
+    MQTTStatus_t mqttStatus;
+    MQTTStatus_t result = MQTTSuccess;
+
+    switch( pOperation->type )
+    {
+        case MQTT_OP_PUBLISH:
+            result = prvCorkedPublish( pMQTTContext, pOperation );
+            break;
+
+        case MQTT_OP_SUBSCRIBE:
+            packetIdentifier = MQTT_GetPacketId( pMQTTContext );
+            mqttStatus = MQTT_Subscribe( pMQTTContext,
+                                         pOperation->info.subscriptionInfo.pSubscriptionList,
+                                         pOperation->info.subscriptionInfo.numSubscriptions,
+                                         packetIdentifier );
+
+            prvTrackOperation( pOperation, packetIdentifier, mqttStatus );
+
+            break;
+
+        case MQTT_OP_UNSUBSCRIBE:
+            packetIdentifier = MQTT_GetPacketId( pMQTTContext );
+            mqttStatus = MQTT_Unsubscribe( pMQTTContext,
+                                           pOperation->info.subscriptionInfo.pSubscriptionList,
+                                           pOperation->info.subscriptionInfo.numSubscriptions,
+                                           packetIdentifier );
+
+            prvTrackOperation( pOperation, packetIdentifier, mqttStatus );
+
+            break;
+
+        case MQTT_OP_STOP:
+            /* Write out publishes still corked before stopping. */
+            if( corkLength > 0U )
+            {
+                ( void ) prvFlushCork();
+            }
+
+            /* Reset the operations queues to empty state to stop the agent. */
+            xQueueReset( xOperationsQueue[ MQTTAgentLaneControl ] );
+            xQueueReset( xOperationsQueue[ MQTTAgentLaneBulk ] );
+            isStopRequested = pdTRUE;
+
+            if( pOperation->callback != NULL )
+            {
+                pOperation->callback( pOperation, MQTTSuccess );
+            }
+
+            break;
+
+        default:
+            break;
+    }
+
+    return result;
+}
+
+static MQTTStatus_t prvProcessIncomingPackets( MQTTContext_t * pMQTTContext )
+{
+    MQTTStatus_t mqttStatus = MQTTSuccess;
+
+    /* Drain everything that is already buffered by the socket or by TLS. The notification
+     * is only given once per burst, so stopping after one packet could strand data. */
+    while( ( mqttStatus == MQTTSuccess ) &&
+           ( TLS_FreeRTOS_IsDataAvailable( pMQTTContext->transportInterface.pNetworkContext ) == pdTRUE ) )
+    {
+        mqttStatus = prvReceivePacket( pMQTTContext );
+    }
+
+    return mqttStatus;
+}
+
+static MQTTStatus_t prvReceivePacket( MQTTContext_t * pMQTTContext )
+{
+    MQTTStatus_t mqttStatus;
+    MQTTPacketInfo_t packetInfo = { 0 };
+    size_t remainingLength;
+    size_t headerLength;
+    uint8_t encodedByte;
+    uint16_t topicLength = 0U;
+    const char * pTopicName = NULL;
+    MQTTRouteStream_t route = { 0 };
+    BaseType_t hasRoute = pdFALSE;
+    BaseType_t isStreamed = pdFALSE;
+
+    mqttStatus = MQTT_GetIncomingPacketTypeAndLength( transportRecv, pAgentNetworkContext, &packetInfo );
+
+    if( mqttStatus == MQTTNoDataAvailable )
+    {
+        /* The data available did not complete a TLS record yet. */
+        mqttStatus = MQTTSuccess;
+    }
+    else if( mqttStatus == MQTTSuccess )
+    {
+        /* Encode the fixed header again, to know its size and to hand it back to the library. */
+        replayBuffer[ 0 ] = packetInfo.type;
+        replayLength = 1U;
+        remainingLength = packetInfo.remainingLength;
+
+        do
+        {
+            encodedByte = ( uint8_t ) ( remainingLength % 128U );
+            remainingLength = remainingLength / 128U;
+
+            if( remainingLength > 0U )
+            {
+                encodedByte |= 0x80U;
+            }
+
+            replayBuffer[ replayLength ] = encodedByte;
+            replayLength++;
+        } while( ( remainingLength > 0U ) && ( replayLength < MQTT_AGENT_FIXED_HEADER_MAX_SIZE ) );
+
+        headerLength = replayLength;
+
+        if( ( ( packetInfo.type & 0xF0U ) == MQTT_PACKET_TYPE_PUBLISH ) && ( packetInfo.remainingLength >= 2U ) )
+        {
+            /* Read the topic of the publish to find its stream route, the library gets it back otherwise. */
+            mqttStatus = prvRecvExact( pMQTTContext, &replayBuffer[ replayLength ], 2U );
+
+            if( mqttStatus == MQTTSuccess )
+            {
+                topicLength = ( uint16_t ) ( ( ( uint16_t ) replayBuffer[ replayLength ] << 8 ) | replayBuffer[ replayLength + 1U ] );
+                replayLength += 2U;
+
+                if( ( topicLength <= MQTT_AGENT_TOPIC_PEEK_SIZE ) && ( ( 2U + topicLength ) <= packetInfo.remainingLength ) )
+                {
+                    mqttStatus = prvRecvExact( pMQTTContext, &replayBuffer[ replayLength ], topicLength );
+                    pTopicName = ( const char * ) &replayBuffer[ replayLength ];
+                    replayLength += topicLength;
+                }
+            }
+
+            if( ( mqttStatus == MQTTSuccess ) && ( pTopicName != NULL ) )
+            {
+                hasRoute = MQTTRouter_FindStreamRoute( pTopicName, topicLength, &route );
+            }
+
+            /* QoS2 publishes need the PUBREC and PUBREL exchange of the library, they are only streamed
+             * when too large for the network buffer, and then discarded. */
+            if( ( headerLength + packetInfo.remainingLength ) > pMQTTContext->networkBuffer.size )
+            {
+                isStreamed = pdTRUE;
+            }
+            else if( ( hasRoute == pdTRUE ) && ( route.loanHandler != NULL ) &&
+                     ( ( ( packetInfo.type >> 1U ) & 0x03U ) != ( uint8_t ) MQTTQoS2 ) )
+            {
+                isStreamed = pdTRUE;
+            }
+            else
+            {
+                /* Empty else marker. */
+            }
+        }
+
+        if( mqttStatus != MQTTSuccess )
+        {
+            PRINTF( "MQTT agent failed to read the topic of a publish, status = %d.\r\n", mqttStatus );
+        }
+        else if( isStreamed == pdTRUE )
+        {
+            if( pTopicName == NULL )
+            {
+                PRINTF( "MQTT agent cannot stream a publish with topic length %u.\r\n", ( unsigned int ) topicLength );
+                mqttStatus = MQTTBadResponse;
+            }
+            else
+            {
+                mqttStatus = prvStreamPublish( pMQTTContext,
+                                               &packetInfo,
+                                               pTopicName,
+                                               topicLength,
+                                               ( hasRoute == pdTRUE ) ? &route : NULL );
+            }
+        }
+        else
+        {
+            replayOffset = 0U;
+            mqttStatus = MQTT_ProcessLoop( pMQTTContext, MQTT_AGENT_PROCESS_LOOP_TIMEOUT_MS );
+        }
+
+        replayLength = 0U;
+    }
+    else
+    {
+        PRINTF( "MQTT agent failed to read a packet header, status = %d.\r\n", mqttStatus );
+    }
+
+    return mqttStatus;
+}
+
+static MQTTStatus_t prvStreamPublish( MQTTContext_t * pMQTTContext,
+                                      const MQTTPacketInfo_t * pPacketInfo,
+                                      const char * pTopicName,
+                                      uint16_t topicLength,
+                                      const MQTTRouteStream_t * pRoute )
+{
+    MQTTStatus_t mqttStatus = MQTTSuccess;
+    uint8_t * pBuffer = pMQTTContext->networkBuffer.pBuffer;
+    size_t bufferSize = pMQTTContext->networkBuffer.size;
+    uint8_t field[ 2 ];
+    uint16_t packetIdentifier = 0U;
+    size_t variableHeaderLength;
+    size_t chunkLength;
+    MQTTRouteFragment_t fragment = { 0 };
+    MQTTRouteStreamHandler_t streamHandler = NULL;
+    void * pHandlerContext = NULL;
+    uint8_t * pLoanedBuffer = NULL;
+    uint8_t ackPacket[ MQTT_PUBLISH_ACK_PACKET_SIZE ];
+    MQTTFixedBuffer_t ackBuffer;
+
+    fragment.qos = ( MQTTQoS_t ) ( ( pPacketInfo->type >> 1U ) & 0x03U );
+    variableHeaderLength = sizeof( field ) + topicLength + ( ( fragment.qos != MQTTQoS0 ) ? sizeof( field ) : 0U );
+
+    if( ( fragment.qos > MQTTQoS2 ) || ( variableHeaderLength > pPacketInfo->remainingLength ) )
+    {
+        PRINTF( "MQTT agent cannot stream a malformed publish.\r\n" );
+        mqttStatus = MQTTBadResponse;
+    }
+
+    if( ( mqttStatus == MQTTSuccess ) && ( fragment.qos != MQTTQoS0 ) )
+    {
+        mqttStatus = prvRecvExact( pMQTTContext, field, sizeof( field ) );
+        packetIdentifier = ( uint16_t ) ( ( ( uint16_t ) field[ 0 ] << 8 ) | field[ 1 ] );
+    }
+
+    if( mqttStatus == MQTTSuccess )
+    {
+        fragment.pTopicName = pTopicName;
+        fragment.topicNameLength = topicLength;
+        fragment.payloadLength = pPacketInfo->remainingLength - variableHeaderLength;
+
+        /* QoS2 would need the PUBREC and PUBREL exchange of the library, the payload is discarded. */
+        if( ( fragment.qos == MQTTQoS2 ) || ( pRoute == NULL ) )
+        {
+            PRINTF( "MQTT agent discards a %u bytes publish on %.*s.\r\n",
+                    ( unsigned int ) fragment.payloadLength,
+                    topicLength,
+                    pTopicName );
+        }
+        else
+        {
+            streamHandler = pRoute->streamHandler;
+            pHandlerContext = pRoute->pHandlerContext;
+
+            if( pRoute->loanHandler != NULL )
+            {
+                pLoanedBuffer = pRoute->loanHandler( &fragment, pHandlerContext );
+            }
+        }
+    }
+
+    if( ( mqttStatus == MQTTSuccess ) && ( pLoanedBuffer != NULL ) )
+    {
+        /* The payload goes straight from the connection to the buffer of the handler. */
+        mqttStatus = prvRecvExact( pMQTTContext, pLoanedBuffer, fragment.payloadLength );
+
+        if( mqttStatus == MQTTSuccess )
+        {
+            fragment.pData = pLoanedBuffer;
+            fragment.dataLength = fragment.payloadLength;
+            streamHandler( &fragment, pHandlerContext );
+            fragment.offset = fragment.payloadLength;
+        }
+    }
+
+    while( ( mqttStatus == MQTTSuccess ) && ( fragment.offset < fragment.payloadLength ) )
+    {
+        chunkLength = fragment.payloadLength - fragment.offset;
+
+        if( chunkLength > bufferSize )
+        {
+            chunkLength = bufferSize;
+        }
+
+        mqttStatus = prvRecvExact( pMQTTContext, pBuffer, chunkLength );
+
+        if( ( mqttStatus == MQTTSuccess ) && ( streamHandler != NULL ) )
+        {
+            fragment.pData = pBuffer;
+            fragment.dataLength = chunkLength;
+            streamHandler( &fragment, pHandlerContext );
+        }
+
+        fragment.offset += chunkLength;
+    }
+
+    if( ( mqttStatus != MQTTSuccess ) && ( streamHandler != NULL ) )
+    {
+        fragment.pData = NULL;
+        fragment.dataLength = 0U;
+        fragment.isAborted = pdTRUE;
+        streamHandler( &fragment, pHandlerContext );
+    }
+
+    if( ( mqttStatus == MQTTSuccess ) && ( fragment.qos == MQTTQoS1 ) )
+    {
+        ackBuffer.pBuffer = ackPacket;
+        ackBuffer.size = sizeof( ackPacket );
+        mqttStatus = MQTT_SerializeAck( &ackBuffer, MQTT_PACKET_TYPE_PUBACK, packetIdentifier );
+
+        if( mqttStatus == MQTTSuccess )
+        {
+            mqttStatus = prvTransportWriteAll( ackPacket, sizeof( ackPacket ) );
+        }
+
+        if( mqttStatus == MQTTSuccess )
+        {
+            pMQTTContext->lastPacketTime = pMQTTContext->getTime();
+        }
+    }
+
+    taskENTER_CRITICAL();
+    {
+        if( pLoanedBuffer != NULL )
+        {
+            agentStats.loanedPublishes++;
+        }
+        else if( streamHandler != NULL )
+        {
+            agentStats.streamedPublishes++;
+        }
+        else
+        {
+            agentStats.discardedPublishes++;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    return mqttStatus;
+}
+
+static MQTTStatus_t prvRecvExact( MQTTContext_t * pMQTTContext,
+                                  uint8_t * pBuffer,
+                                  size_t length )
+{
+    MQTTStatus_t mqttStatus = MQTTSuccess;
+    size_t bytesReceived = 0U;
+    uint32_t lastProgressMs = pMQTTContext->getTime();
+    int32_t result;
+
+    while( ( mqttStatus == MQTTSuccess ) && ( bytesReceived < length ) )
+    {
+        result = transportRecv( pAgentNetworkContext, &pBuffer[ bytesReceived ], length - bytesReceived );
+
+        if( result < 0 )
+        {
+            mqttStatus = MQTTRecvFailed;
+        }
+        else if( result > 0 )
+        {
+            bytesReceived += ( size_t ) result;
+            lastProgressMs = pMQTTContext->getTime();
+        }
+        else if( ( pMQTTContext->getTime() - lastProgressMs ) >= MQTT_AGENT_STREAM_RECV_TIMEOUT_MS )
+        {
+            PRINTF( "MQTT agent timed out reading %u bytes.\r\n", ( unsigned int ) ( length - bytesReceived ) );
+            mqttStatus = MQTTRecvFailed;
+        }
+        else
+        {
+            /* Empty else marker. */
+        }
+    }
+
+    return mqttStatus;
+}
+
+static int32_t prvReplayRecv( NetworkContext_t * pNetworkContext,
+                              void * pBuffer,
+                              size_t bytesToRecv )
+{
+    int32_t bytesReceived;
+    size_t bytesToCopy;
+
+    if( replayOffset < replayLength )
+    {
+        bytesToCopy = replayLength - replayOffset;
+
+        if( bytesToCopy > bytesToRecv )
+        {
+            bytesToCopy = bytesToRecv;
+        }
+
+        memcpy( pBuffer, &replayBuffer[ replayOffset ], bytesToCopy );
+        replayOffset += bytesToCopy;
+        bytesReceived = ( int32_t ) bytesToCopy;
+    }
+    else
+    {
+        bytesReceived = transportRecv( pNetworkContext, pBuffer, bytesToRecv );
+    }
+
+    return bytesReceived;
+}
+
+static MQTTStatus_t prvManageKeepAlive( MQTTContext_t * pMQTTContext,
+                                        TickType_t * pWaitTicks )
+{
+    MQTTStatus_t mqttStatus = MQTTSuccess;
+    uint32_t nowMs = pMQTTContext->getTime();
+    uint32_t keepAliveMs = ( uint32_t ) pMQTTContext->keepAliveIntervalSec * MQTT_AGENT_MS_PER_SECOND;
+    uint32_t elapsedMs;
+    uint32_t waitMs;
+
+    if( keepAliveMs == 0U )
+    {
+        /* Keep alive disabled, only operations or socket activity wake up the agent. */
+        *pWaitTicks = portMAX_DELAY;
+    }
+    else
+    {
+        if( pMQTTContext->waitingForPingResp == true )
+        {
+            elapsedMs = nowMs - pMQTTContext->pingReqSendTimeMs;
+
+            if( elapsedMs >= MQTT_PINGRESP_TIMEOUT_MS )
+            {
+                mqttStatus = MQTTKeepAliveTimeout;
+                waitMs = 0U;
+            }
+            else
+            {
+                waitMs = MQTT_PINGRESP_TIMEOUT_MS - elapsedMs;
+            }
+        }
+        else
+        {
+            elapsedMs = nowMs - pMQTTContext->lastPacketTime;
+
+            if( elapsedMs >= keepAliveMs )
+            {
+                mqttStatus = MQTT_Ping( pMQTTContext );
+                waitMs = MQTT_PINGRESP_TIMEOUT_MS;
+            }
+            else
+            {
+                waitMs = keepAliveMs - elapsedMs;
+            }
+        }
+
+        /* Round up so that the agent does not wake up a tick early and go back to sleep. */
+        *pWaitTicks = pdMS_TO_TICKS( waitMs ) + 1U;
+    }
+
+    return mqttStatus;
+}
+
+static void prvHandleConnectionLoss( MQTTContext_t * pMQTTContext,
+                                     MQTTStatus_t status )
+{
+    MQTTOperation_t * pOperation;
+    size_t index;
+
+    TLS_FreeRTOS_SetWakeupCallback( pMQTTContext->transportInterface.pNetworkContext, NULL );
+
+    /* Corked data was not written, the QoS0 publishes it holds are lost. */
+    corkLength = 0U;
+    corkPublishCount = 0U;
+    prvReleaseCorkBuffer();
+    index = corkedOperationCount;
+    corkedOperationCount = 0U;
+
+    while( index > 0U )
+    {
+        index--;
+        prvCompleteOperation( corkedOperations[ index ], status );
+    }
+
+    /* Only QoS1 publishes are sent again after reconnecting; the owners of the other operations
+     * waiting for an ACK are told to retry them. Removal shifts entries back into the current slot,
+     * so the slot is checked again until it holds a kept publish or is empty. */
+    for( index = 0U; index < MQTT_AGENT_PENDING_TABLE_SIZE; index++ )
+    {
+        while( ( pendingOperations[ index ] != NULL ) &&
+               ( ( pendingOperations[ index ]->type != MQTT_OP_PUBLISH ) ||
+                 ( pendingOperations[ index ]->info.pPublishInfo->qos != MQTTQoS1 ) ) )
+        {
+            pOperation = getPendingOperation( pendingOperations[ index ]->packetIdentifier );
+            prvReleaseInflightEntry();
+            prvCompleteOperation( pOperation, status );
+        }
+    }
+
+    isConnected = pdFALSE;
+    agentStats.connectionLossCount++;
+    connectionLostTicks = xTaskGetTickCount();
+    isRecoveryTimed = pdTRUE;
+
+    PRINTF( "MQTT agent lost the connection, status = %d, %u publishes to replay.\r\n",
+            status,
+            ( unsigned int ) agentStats.pendingOperations );
+
+    if( connectionLostCallback != NULL )
+    {
+        connectionLostCallback( status );
+    }
+}
+
+static void prvFailOperation( MQTTContext_t * pMQTTContext,
+                              MQTTOperation_t * pOperation )
+{
+    if( pOperation->type == MQTT_OP_STOP )
+    {
+        ( void ) prvProcessOperation( pMQTTContext, pOperation );
+    }
+    else
+    {
+        if( prvOperationNeedsAck( pOperation ) == pdTRUE )
+        {
+            prvReleaseInflightEntry();
+        }
+
+        prvCompleteOperation( pOperation, MQTTSendFailed );
+    }
+}
+
+static MQTTStatus_t prvResendPublish( MQTTContext_t * pMQTTContext,
+                                      MQTTOperation_t * pOperation )
+{
+    MQTTPublishInfo_t * pPublishInfo = pOperation->info.pPublishInfo;
+    MQTTStatus_t mqttStatus;
+    size_t remainingLength = 0U;
+    size_t packetSize = 0U;
+    size_t headerSize = 0U;
 
-/**
- * @brief Static array used to keep track of pending MQTT operations that require an ACK to be received from broker.
- */
-static MQTTOperation_t * pendingOperations[ MQTT_AGENT_MAX_CONCURRENT_OPERATIONS ];
+    mqttStatus = MQTT_GetPublishPacketSize( pPublishInfo, &remainingLength, &packetSize );
 
-/**
- * @brief Variable used to check if the agent is running.
- */
-static BaseType_t isAgentRunning = pdFALSE;
+    if( mqttStatus == MQTTSuccess )
+    {
+        /* The network buffer is free, the agent task is the only user of the context. */
+        mqttStatus = MQTT_SerializePublishHeader( pPublishInfo,
+                                                  pOperation->packetIdentifier,
+                                                  remainingLength,
+                                                  &pMQTTContext->networkBuffer,
+                                                  &headerSize );
+    }
 
+    if( mqttStatus == MQTTSuccess )
+    {
+        mqttStatus = prvTransportWriteAll( pMQTTContext->networkBuffer.pBuffer, headerSize );
+    }
 
-static BaseType_t addPendingOperation( MQTTOperation_t * pOperation )
-{
-    size_t index = 0;
-    BaseType_t result = pdFALSE;
+    if( ( mqttStatus == MQTTSuccess ) && ( pPublishInfo->payloadLength > 0U ) )
+    {
+        mqttStatus = prvTransportWriteAll( ( const uint8_t * ) pPublishInfo->pPayload, pPublishInfo->payloadLength );
+    }
 
-    for( index = 0; index < MQTT_AGENT_MAX_CONCURRENT_OPERATIONS; index++ )
+    if( mqttStatus == MQTTSuccess )
     {
-        if( pendingOperations[ index ] == NULL )
-        {
-            pendingOperations[ index ] = pOperation;
-            result = pdTRUE;
-            break;
-        }
+        pMQTTContext->lastPacketTime = pMQTTContext->getTime();
     }
 
-    return result;
+    return mqttStatus;
 }
 
-static MQTTOperation_t * getPendingOperation( uint16_t packetIdentifier )
+static MQTTStatus_t prvResumeSession( MQTTContext_t * pMQTTContext,
+                                      BaseType_t sessionPresent )
 {
-    size_t index = 0;
-    MQTTOperation_t * pOperation = NULL;
+    MQTTStatus_t mqttStatus = MQTTSuccess;
+    MQTTPublishState_t publishState;
+    MQTTOperation_t * pOperation;
+    size_t index;
+
+    if( sessionPresent == pdFALSE )
+    {
+        /* The broker started a new session: forget the packet identifiers of the old one, and reserve
+         * again those of the publishes sent again so that their PUBACKs are accepted. */
+        memset( pMQTTContext->outgoingPublishRecords, 0x00, sizeof( pMQTTContext->outgoingPublishRecords ) );
+        memset( pMQTTContext->incomingPublishRecords, 0x00, sizeof( pMQTTContext->incomingPublishRecords ) );
+    }
 
+    pMQTTContext->waitingForPingResp = false;
 
-    for( index = 0; index < MQTT_AGENT_MAX_CONCURRENT_OPERATIONS; index++ )
+    for( index = 0U; ( index < MQTT_AGENT_PENDING_TABLE_SIZE ) && ( mqttStatus == MQTTSuccess ); index++ )
     {
-        if( ( pendingOperations[ index ] != NULL ) &&
-            ( pendingOperations[ index ]->packetIdentifier == packetIdentifier ) )
+        pOperation = pendingOperations[ index ];
+
+        if( pOperation != NULL )
         {
-            pOperation = pendingOperations[ index ];
-            pendingOperations[ index ] = NULL;
-            break;
+            if( sessionPresent == pdFALSE )
+            {
+                mqttStatus = MQTT_ReserveState( pMQTTContext, pOperation->packetIdentifier, MQTTQoS1 );
+
+                if( mqttStatus == MQTTSuccess )
+                {
+                    mqttStatus = MQTT_UpdateStatePublish( pMQTTContext,
+                                                          pOperation->packetIdentifier,
+                                                          MQTT_SEND,
+                                                          MQTTQoS1,
+                                                          &publishState );
+                }
+            }
+
+            /* DUP tells the broker it may have received the publish already in this session. */
+            pOperation->info.pPublishInfo->dup = ( sessionPresent == pdTRUE ) ? true : false;
+
+            if( mqttStatus == MQTTSuccess )
+            {
+                mqttStatus = prvResendPublish( pMQTTContext, pOperation );
+            }
+
+            if( mqttStatus == MQTTSuccess )
+            {
+                agentStats.replayedPublishes++;
+                prvRecordPublishWritten();
+            }
         }
     }
 
-    return pOperation;
+    TLS_FreeRTOS_SetWakeupCallback( pMQTTContext->transportInterface.pNetworkContext,
+                                    prvSocketWakeupCallback );
+    isConnected = pdTRUE;
+
+    return mqttStatus;
+}
+
+static void prvRecordPublishWritten( void )
+{
+    if( isRecoveryTimed == pdTRUE )
+    {
+        isRecoveryTimed = pdFALSE;
+        agentStats.lastRecoveryMs = ( uint32_t ) ( ( xTaskGetTickCount() - connectionLostTicks ) * portTICK_PERIOD_MS );
+        PRINTF( "MQTT agent first publish %u ms after the connection loss.\r\n", ( unsigned int ) agentStats.lastRecoveryMs );
+    }
 }
 
+static void prvSocketWakeupCallback( Socket_t xSocket )
+{
+    ( void ) xSocket;
+
+    /* Called from the IP task, so the task level API is used. */
+    if( xAgentTask != NULL )
+    {
+        ( void ) xTaskNotifyGive( xAgentTask );
+    }
+}
 
 static void prvMQTTAgentLoop( void * pParams )
 {
-    BaseType_t status;
     MQTTOperation_t * pOperation;
-    uint16_t packetIdentifier = 0;
     MQTTContext_t * pMQTTContext = ( MQTTContext_t * ) pParams;
-    MQTTStatus_t mqttStatus;
+    MQTTStatus_t mqttStatus = MQTTSuccess;
+    TickType_t waitTicks = 0;
+    TickType_t corkTicks = 0;
+    TickType_t corkTimeoutTicks = pdMS_TO_TICKS( MQTT_AGENT_CORK_TIMEOUT_MS );
 
     isAgentRunning = pdTRUE;
 
+    TLS_FreeRTOS_SetWakeupCallback( pMQTTContext->transportInterface.pNetworkContext,
+                                    prvSocketWakeupCallback );
+
     for( ; ; )
     {
-        status = xQueueReceive( xOperationsQueue, &pOperation, 1 );
-
-        if( status == pdTRUE )
+        if( isConnected == pdTRUE )
         {
-            switch( pOperation->type )
+            /* Execute all the operations enqueued by application tasks. */
+            while( ( isStopRequested == pdFALSE ) &&
+                   ( mqttStatus == MQTTSuccess ) &&
+                   ( prvReceiveOperation( &pOperation ) == pdTRUE ) )
             {
-                case MQTT_OP_RECEIVE:
-                    mqttStatus = MQTT_ProcessLoop( pMQTTContext, MQTT_AGENT_MAX_POLLING_INTERVAL_MS );
-                    configASSERT( mqttStatus == MQTTSuccess );
-                    xQueueSend( xOperationsQueue, &pOperation, 1 );
-                    break;
-
-                case MQTT_OP_PUBLISH:
-
-                    if( pOperation->info.pPublishInfo->qos != MQTTQoS0 )
-                    {
-                        packetIdentifier = MQTT_GetPacketId( pMQTTContext );
-                    }
-                    else
-                    {
-                        packetIdentifier = 0;
-                    }
-
-                    mqttStatus = MQTT_Publish( pMQTTContext, pOperation->info.pPublishInfo, packetIdentifier );
-
-                    if( ( mqttStatus != MQTTSuccess ) || ( pOperation->info.pPublishInfo->qos == MQTTQoS0 ) )
-                    {
-                        pOperation->callback( pOperation, mqttStatus );
-                    }
-                    else
-                    {
-                        pOperation->packetIdentifier = packetIdentifier;
-                        configASSERT( addPendingOperation( pOperation ) == pdTRUE );
-                    }
+                mqttStatus = prvProcessOperation( pMQTTContext, pOperation );
+            }
 
-                    break;
+            if( isStopRequested == pdTRUE )
+            {
+                break;
+            }
 
-                case MQTT_OP_SUBSCRIBE:
-                    packetIdentifier = MQTT_GetPacketId( pMQTTContext );
-                    mqttStatus = MQTT_Subscribe( pMQTTContext,
-                                                 pOperation->info.subscriptionInfo.pSubscriptionList,
-                                                 pOperation->info.subscriptionInfo.numSubscriptions,
-                                                 packetIdentifier );
-
-                    if( mqttStatus != MQTTSuccess )
-                    {
-                        pOperation->callback( pOperation, mqttStatus );
-                    }
-                    else
-                    {
-                        pOperation->packetIdentifier = packetIdentifier;
-                        configASSERT( addPendingOperation( pOperation ) == pdTRUE );
-                    }
+            if( ( mqttStatus == MQTTSuccess ) && ( isSuspendRequested == pdTRUE ) )
+            {
+                /* The link was reported down outside of the agent. */
+                mqttStatus = MQTTRecvFailed;
+            }
 
-                    break;
+            if( mqttStatus == MQTTSuccess )
+            {
+                mqttStatus = prvProcessIncomingPackets( pMQTTContext );
+            }
 
-                case MQTT_OP_UNSUBSCRIBE:
-                    packetIdentifier = MQTT_GetPacketId( pMQTTContext );
-                    mqttStatus = MQTT_Unsubscribe( pMQTTContext,
-                                                   pOperation->info.subscriptionInfo.pSubscriptionList,
-                                                   pOperation->info.subscriptionInfo.numSubscriptions,
-                                                   packetIdentifier );
-
-                    if( mqttStatus != MQTTSuccess )
-                    {
-                        pOperation->callback( pOperation, mqttStatus );
-                    }
-                    else
-                    {
-                        pOperation->packetIdentifier = packetIdentifier;
-                        configASSERT( addPendingOperation( pOperation ) == pdTRUE );
-                    }
+            if( mqttStatus == MQTTSuccess )
+            {
+                mqttStatus = prvManageKeepAlive( pMQTTContext, &waitTicks );
+            }
 
-                    break;
+            /* Flush a batch whose producer did not complete it in time, otherwise sleep no longer than
+             * its deadline. */
+            if( ( mqttStatus == MQTTSuccess ) && ( corkLength > 0U ) )
+            {
+                corkTicks = xTaskGetTickCount() - corkStartTicks;
 
-                case MQTT_OP_STOP:
-                    /* Reset the operations queue to empty state to stop the agent. */
-                    xQueueReset( xOperationsQueue );
-                    pOperation->callback( pOperation, MQTTSuccess );
-                    break;
+                if( corkTicks >= corkTimeoutTicks )
+                {
+                    mqttStatus = prvFlushCork();
+                }
+                else if( ( corkTimeoutTicks - corkTicks ) < waitTicks )
+                {
+                    waitTicks = corkTimeoutTicks - corkTicks;
+                }
+                else
+                {
+                    /* Keep alive is due before the batch deadline. */
+                }
+            }
 
-                default:
-                    break;
+            if( mqttStatus != MQTTSuccess )
+            {
+                PRINTF( "MQTT agent failed to process the connection, status = %d.\r\n", mqttStatus );
+                prvHandleConnectionLoss( pMQTTContext, mqttStatus );
+                mqttStatus = MQTTSuccess;
+                waitTicks = portMAX_DELAY;
             }
         }
         else
         {
-            break;
+            /* Complete what is enqueued while disconnected, so that producers can store or retry it
+             * instead of filling the queues. */
+            while( ( isStopRequested == pdFALSE ) &&
+                   ( prvReceiveOperation( &pOperation ) == pdTRUE ) )
+            {
+                prvFailOperation( pMQTTContext, pOperation );
+            }
+
+            if( isStopRequested == pdTRUE )
+            {
+                break;
+            }
+
+            isSuspendRequested = pdFALSE;
+            waitTicks = portMAX_DELAY;
+
+            if( isResumeRequested == pdTRUE )
+            {
+                isResumeRequested = pdFALSE;
+                mqttStatus = prvResumeSession( pMQTTContext, resumeSessionPresent );
+
+                if( mqttStatus != MQTTSuccess )
+                {
+                    PRINTF( "MQTT agent failed to resume the session, status = %d.\r\n", mqttStatus );
+                    prvHandleConnectionLoss( pMQTTContext, mqttStatus );
+                    mqttStatus = MQTTSuccess;
+                }
+                else
+                {
+                    /* Process what was received and enqueued meanwhile right away. */
+                    waitTicks = 0U;
+                }
+            }
         }
+
+        /* Block until an operation is enqueued, the socket has activity or keep alive is due. */
+        ( void ) ulTaskNotifyTake( pdTRUE, waitTicks );
     }
 
-    vQueueDelete( xOperationsQueue );
+    TLS_FreeRTOS_SetWakeupCallback( pMQTTContext->transportInterface.pNetworkContext, NULL );
+
+    vQueueDelete( xOperationsQueue[ MQTTAgentLaneControl ] );
+    vQueueDelete( xOperationsQueue[ MQTTAgentLaneBulk ] );
 
+    xAgentTask = NULL;
     isAgentRunning = pdFALSE;
 
     vTaskDelete( NULL );
 }
 
-BaseType_t MQTTAgent_Init( MQTTContext_t * pMqttContext )
+BaseType_t MQTTAgent_Init( MQTTContext_t * pMqttContext,
+                           MQTTAgentConnectionLostCallback_t lostCallback )
 {
     BaseType_t result = pdTRUE;
-    MQTTOperation_t * pOperation = &receiveOP;
 
     memset( pendingOperations, 0x00, sizeof( pendingOperations ) );
+    memset( &agentStats, 0x00, sizeof( agentStats ) );
+    inflightReserved = 0U;
+    isStopRequested = pdFALSE;
+    isConnected = pdTRUE;
+    isSuspendRequested = pdFALSE;
+    isResumeRequested = pdFALSE;
+    isRecoveryTimed = pdFALSE;
+    connectionLostCallback = lostCallback;
+
+    /* Route the MQTT library writes through the cork buffer. */
+    corkLength = 0U;
+    corkPublishCount = 0U;
+    corkedOperationCount = 0U;
+    isCorking = pdFALSE;
+    pAgentNetworkContext = pMqttContext->transportInterface.pNetworkContext;
+
+    if( pMqttContext->transportInterface.send != prvCorkedSend )
+    {
+        transportSend = pMqttContext->transportInterface.send;
+        pMqttContext->transportInterface.send = prvCorkedSend;
+    }
 
-    if( result == pdTRUE )
+    /* Route the MQTT library reads through the fixed header read by the agent. */
+    replayLength = 0U;
+    replayOffset = 0U;
+
+    if( pMqttContext->transportInterface.recv != prvReplayRecv )
+    {
+        transportRecv = pMqttContext->transportInterface.recv;
+        pMqttContext->transportInterface.recv = prvReplayRecv;
+    }
+
+    if( ( result == pdTRUE ) && ( xPublishBufferSemaphore == NULL ) )
+    {
+        /* Publish buffers outlive a stop of the agent, as producers may still hold them. */
+        memset( publishBufferHeadroom, 0x00, sizeof( publishBufferHeadroom ) );
+        xPublishBufferSemaphore = xSemaphoreCreateCounting( MQTT_AGENT_PUBLISH_BUFFER_COUNT,
+                                                            MQTT_AGENT_PUBLISH_BUFFER_COUNT );
+
+        if( xPublishBufferSemaphore == NULL )
+        {
+            PRINTF( "MQTT Agent failed to create the publish buffer semaphore.\r\n" );
+            result = pdFALSE;
+        }
+    }
+
+    if( ( result == pdTRUE ) && ( xOperationPoolSemaphore == NULL ) )
     {
-        xOperationsQueue = xQueueCreate( MQTT_AGENT_MAX_CONCURRENT_OPERATIONS, sizeof( MQTTOperation_t * ) );
+        /* Like the publish buffers, pooled operations outlive a stop of the agent. */
+        memset( operationPool, 0x00, sizeof( operationPool ) );
+        xOperationPoolSemaphore = xSemaphoreCreateCounting( MQTT_AGENT_OPERATION_POOL_SIZE,
+                                                            MQTT_AGENT_OPERATION_POOL_SIZE );
 
-        if( xOperationsQueue == NULL )
+        if( xOperationPoolSemaphore == NULL )
         {
-            PRINTF( "MQTT Agent failed to create the queue.\r\n" );
+            PRINTF( "MQTT Agent failed to create the operation pool semaphore.\r\n" );
             result = pdFALSE;
         }
     }
 
     if( result == pdTRUE )
     {
-        result = xQueueSend( xOperationsQueue, &pOperation, 1 );
+        controlServedCount = 0U;
+        xOperationsQueue[ MQTTAgentLaneControl ] = xQueueCreate( MQTT_AGENT_CONTROL_QUEUE_LENGTH, sizeof( MQTTOperation_t * ) );
+        xOperationsQueue[ MQTTAgentLaneBulk ] = xQueueCreate( MQTT_AGENT_BULK_QUEUE_LENGTH, sizeof( MQTTOperation_t * ) );
+
+        if( ( xOperationsQueue[ MQTTAgentLaneControl ] == NULL ) ||
+            ( xOperationsQueue[ MQTTAgentLaneBulk ] == NULL ) )
+        {
+            PRINTF( "MQTT Agent failed to create the queues.\r\n" );
+            result = pdFALSE;
+        }
     }
 
     if( result == pdTRUE )
@@ -296,7 +2163,7 @@ BaseType_t MQTTAgent_Init( MQTTContext_t * pMqttContext )
                                     MQTT_AGENT_TASK_STACK_SIZE,
                                     pMqttContext,
                                     MQTT_AGENT_TASK_PRIORITY | portPRIVILEGE_BIT,
-                                    NULL ) ) != pdTRUE )
+                                    &xAgentTask ) ) != pdTRUE )
         {
             PRINTF( "Failed to create MQTT Agent task.\r\n" );
         }
@@ -324,7 +2191,8 @@ BaseType_t MQTTAgent_ProcessEvent( MQTTContext_t * pMQTTContext,
 
                 if( pOperation != NULL )
                 {
-                    pOperation->callback( pOperation, MQTTSuccess );
+                    prvReleaseInflightEntry();
+                    prvCompleteOperation( pOperation, MQTTSuccess );
                     result = pdTRUE;
                 }
 
@@ -340,11 +2208,7 @@ BaseType_t MQTTAgent_ProcessEvent( MQTTContext_t * pMQTTContext,
 
 void MQTTAgent_Stop( void )
 {
-    MQTTOperation_t operation = { 0 };
-
-    operation.type = MQTT_OP_STOP;
-
-    xQueueSend( xOperationsQueue, &operation, portMAX_DELAY );
+    ( void ) MQTTAgent_EnqueueOnLane( &stopOP, MQTTAgentLaneControl, portMAX_DELAY );
 
     while( isAgentRunning == pdTRUE )
     {
@@ -353,8 +2217,267 @@ void MQTTAgent_Stop( void )
 }
 
 
-BaseType_t MQTTAgent_Enqueue( MQTTOperation_t * pOperation,
-                              TickType_t timeoutTicks )
+void MQTTAgent_Suspend( void )
+{
+    isSuspendRequested = pdTRUE;
+
+    if( xAgentTask != NULL )
+    {
+        ( void ) xTaskNotifyGive( xAgentTask );
+    }
+}
+
+void MQTTAgent_Resume( BaseType_t sessionPresent )
+{
+    resumeSessionPresent = sessionPresent;
+    isResumeRequested = pdTRUE;
+
+    if( xAgentTask != NULL )
+    {
+        ( void ) xTaskNotifyGive( xAgentTask );
+    }
+}
+
+BaseType_t MQTTAgent_IsConnected( void )
+{
+    return isConnected;
+}
+
+MQTTAgentStatus_t MQTTAgent_Enqueue( MQTTOperation_t * pOperation,
+                                     TickType_t timeoutTicks )
+{
+    return MQTTAgent_EnqueueOnLane( pOperation, MQTTAgentLaneBulk, timeoutTicks );
+}
+
+MQTTAgentStatus_t MQTTAgent_EnqueueOnLane( MQTTOperation_t * pOperation,
+                                           MQTTAgentLane_t lane,
+                                           TickType_t timeoutTicks )
+{
+    MQTTAgentStatus_t status = MQTTAgentSuccess;
+    BaseType_t needsAck = prvOperationNeedsAck( pOperation );
+
+    configASSERT( lane < MQTTAgentNumLanes );
+
+    if( ( needsAck == pdTRUE ) && ( prvReserveInflightEntry( lane ) != pdTRUE ) )
+    {
+        /* Do not block the caller: the window only opens when the broker acknowledges, which can
+         * take much longer than the queue timeout. */
+        status = MQTTAgentWindowFull;
+    }
+
+    if( status == MQTTAgentSuccess )
+    {
+        if( xQueueSend( xOperationsQueue[ lane ], &pOperation, timeoutTicks ) == pdTRUE )
+        {
+            ( void ) xTaskNotifyGive( xAgentTask );
+        }
+        else
+        {
+            taskENTER_CRITICAL();
+            {
+                agentStats.laneFullCount[ lane ]++;
+            }
+            taskEXIT_CRITICAL();
+
+            if( needsAck == pdTRUE )
+            {
+                prvReleaseInflightEntry();
+            }
+
+            status = MQTTAgentQueueFull;
+        }
+    }
+
+    return status;
+}
+
+MQTTAgentStatus_t MQTTAgent_EnqueueBatch( MQTTOperation_t * const pOperations[],
+                                          size_t numOperations,
+                                          TickType_t timeoutTicks,
+                                          size_t * pNumEnqueued )
+{
+    MQTTAgentStatus_t status = MQTTAgentSuccess;
+    size_t index;
+
+    for( index = 0; ( index < numOperations ) && ( status == MQTTAgentSuccess ); index++ )
+    {
+        /* Every publish but the last one tells the agent to keep the data corked. If the batch is cut
+         * short, the cork timeout flushes what was already enqueued. */
+        pOperations[ index ]->moreFollows = ( index < ( numOperations - 1U ) ) ? pdTRUE : pdFALSE;
+
+        status = MQTTAgent_Enqueue( pOperations[ index ], timeoutTicks );
+    }
+
+    if( pNumEnqueued != NULL )
+    {
+        *pNumEnqueued = ( status == MQTTAgentSuccess ) ? index : ( index - 1U );
+    }
+
+    return status;
+}
+
+MQTTAgentStatus_t MQTTAgent_ReservePublish( MQTTPublishInfo_t * pPublishInfo,
+                                            size_t payloadLength,
+                                            uint8_t ** ppPayload,
+                                            TickType_t timeoutTicks )
+{
+    MQTTAgentStatus_t status = MQTTAgentSuccess;
+    size_t remainingLength = 0U;
+    size_t packetSize = 0U;
+    size_t headroom = 0U;
+    size_t index;
+
+    /* Size the headroom for the header of the largest payload, a shorter payload only shrinks it. */
+    pPublishInfo->pPayload = NULL;
+    pPublishInfo->payloadLength = payloadLength;
+
+    if( MQTT_GetPublishPacketSize( pPublishInfo, &remainingLength, &packetSize ) != MQTTSuccess )
+    {
+        status = MQTTAgentNoMemory;
+    }
+    else
+    {
+        headroom = packetSize - payloadLength;
+
+        if( packetSize > MQTT_AGENT_PUBLISH_BUFFER_SIZE )
+        {
+            status = MQTTAgentNoMemory;
+        }
+    }
+
+    if( status == MQTTAgentSuccess )
+    {
+        if( xSemaphoreTake( xPublishBufferSemaphore, timeoutTicks ) != pdTRUE )
+        {
+            status = MQTTAgentNoMemory;
+        }
+    }
+
+    if( status == MQTTAgentSuccess )
+    {
+        taskENTER_CRITICAL();
+        {
+            for( index = 0; index < MQTT_AGENT_PUBLISH_BUFFER_COUNT; index++ )
+            {
+                if( publishBufferHeadroom[ index ] == 0U )
+                {
+                    publishBufferHeadroom[ index ] = headroom;
+                    break;
+                }
+            }
+        }
+        taskEXIT_CRITICAL();
+
+        /* The semaphore count guarantees a free buffer. */
+        configASSERT( index < MQTT_AGENT_PUBLISH_BUFFER_COUNT );
+
+        *ppPayload = &publishBuffers[ index ][ headroom ];
+        pPublishInfo->pPayload = *ppPayload;
+    }
+
+    return status;
+}
+
+void MQTTAgent_ReleasePublish( MQTTPublishInfo_t * pPublishInfo )
+{
+    int32_t bufferIndex = prvGetPublishBufferIndex( pPublishInfo->pPayload );
+
+    if( bufferIndex >= 0 )
+    {
+        taskENTER_CRITICAL();
+        {
+            publishBufferHeadroom[ bufferIndex ] = 0U;
+        }
+        taskEXIT_CRITICAL();
+
+        ( void ) xSemaphoreGive( xPublishBufferSemaphore );
+        pPublishInfo->pPayload = NULL;
+    }
+}
+
+MQTTOperation_t * MQTTAgent_AllocateOperation( const MQTTAgentCompletionTarget_t * pTarget,
+                                               TickType_t timeoutTicks )
+{
+    MQTTAgentPoolEntry_t * pEntry = NULL;
+    size_t index;
+
+    configASSERT( pTarget != NULL );
+
+    if( ( xOperationPoolSemaphore != NULL ) &&
+        ( xSemaphoreTake( xOperationPoolSemaphore, timeoutTicks ) == pdTRUE ) )
+    {
+        taskENTER_CRITICAL();
+        {
+            for( index = 0; index < MQTT_AGENT_OPERATION_POOL_SIZE; index++ )
+            {
+                if( operationPool[ index ].isAllocated == pdFALSE )
+                {
+                    operationPool[ index ].isAllocated = pdTRUE;
+                    pooledOperationsInUse++;
+                    break;
+                }
+            }
+        }
+        taskEXIT_CRITICAL();
+
+        /* The semaphore count guarantees a free operation. */
+        configASSERT( index < MQTT_AGENT_OPERATION_POOL_SIZE );
+
+        pEntry = &operationPool[ index ];
+        memset( &pEntry->operation, 0x00, sizeof( pEntry->operation ) );
+        memset( &pEntry->publishInfo, 0x00, sizeof( pEntry->publishInfo ) );
+        pEntry->target = *pTarget;
+        pEntry->status = MQTTSuccess;
+        pEntry->isComplete = pdFALSE;
+
+        pEntry->operation.type = MQTT_OP_PUBLISH;
+        pEntry->operation.info.pPublishInfo = &pEntry->publishInfo;
+        pEntry->operation.callback = prvPooledOperationCallback;
+    }
+
+    return ( pEntry != NULL ) ? &pEntry->operation : NULL;
+}
+
+BaseType_t MQTTAgent_GetOperationStatus( const MQTTOperation_t * pOperation,
+                                         MQTTStatus_t * pStatus )
+{
+    MQTTAgentPoolEntry_t * pEntry = prvGetPoolEntry( pOperation );
+    BaseType_t isComplete = pdFALSE;
+
+    configASSERT( pEntry != NULL );
+
+    if( pEntry->isComplete == pdTRUE )
+    {
+        *pStatus = pEntry->status;
+        isComplete = pdTRUE;
+    }
+
+    return isComplete;
+}
+
+void MQTTAgent_ReleaseOperation( MQTTOperation_t * pOperation )
+{
+    MQTTAgentPoolEntry_t * pEntry = prvGetPoolEntry( pOperation );
+
+    configASSERT( ( pEntry != NULL ) && ( pEntry->isAllocated == pdTRUE ) );
+
+    taskENTER_CRITICAL();
+    {
+        pEntry->isAllocated = pdFALSE;
+        pooledOperationsInUse--;
+    }
+    taskEXIT_CRITICAL();
+
+    ( void ) xSemaphoreGive( xOperationPoolSemaphore );
+}
+
+void MQTTAgent_GetStats( MQTTAgentStats_t * pStats )
 {
-    return xQueueSend( xOperationsQueue, &pOperation, timeoutTicks );
+    taskENTER_CRITICAL();
+    {
+        *pStats = agentStats;
+        pStats->inflightOperations = inflightReserved;
+        pStats->pooledOperations = pooledOperationsInUse;
+    }
+    taskEXIT_CRITICAL();
 }
@@ -39,6 +39,10 @@
 /* MQTT library include */
 #include "core_mqtt.h"
 
+/* FreeRTOS includes for the completion targets of pooled operations. */
+#include "task.h"
+#include "queue.h"
+
 /**
  * @brief Forward declaration of MQTT operation struct.
  * The struct is used by the application to enqueue an MQTT operation to be processed
@@ -57,6 +61,16 @@ struct MQTTOperation;
 typedef void ( * MQTTOperationStatusCallback_t ) ( struct MQTTOperation * pOperation,
                                                    MQTTStatus_t status );
 
+/**
+ * @brief Callback invoked by the MQTT agent when it stops using the connection, either because an
+ * error was detected on it or because MQTTAgent_Suspend() was called.
+ * The callback is invoked from the agent task, and should only notify the task in charge of
+ * reconnecting.
+ *
+ * @param[in] status Error which caused the loss of the connection.
+ */
+typedef void ( * MQTTAgentConnectionLostCallback_t ) ( MQTTStatus_t status );
+
 /**
  * @brief Definitions for all MQTT operation types handled by the MQTT agent.
  */
@@ -65,10 +79,53 @@ typedef enum MQTTOperationType
     MQTT_OP_PUBLISH = 0,
     MQTT_OP_SUBSCRIBE,
     MQTT_OP_UNSUBSCRIBE,
-    MQTT_OP_RECEIVE,
     MQTT_OP_STOP
 } MQTTOperationType_t;
 
+/**
+ * @brief Status returned when enqueuing an operation with the MQTT agent.
+ */
+typedef enum MQTTAgentStatus
+{
+    MQTTAgentSuccess = 0, /**< The operation was enqueued. */
+    MQTTAgentQueueFull,   /**< The operations queue stayed full for the whole timeout. */
+    MQTTAgentWindowFull,  /**< Too many operations are waiting for an ACK, retry once some are acknowledged. */
+    MQTTAgentNoMemory     /**< No publish buffer was available in time, or the packet does not fit in one. */
+} MQTTAgentStatus_t;
+
+/**
+ * @brief Lanes on which operations are enqueued with the agent.
+ * Each lane has its own queue and depth. The control lane is serviced first; the bulk lane is
+ * guaranteed one operation after a run of control operations so that it is not starved.
+ */
+typedef enum MQTTAgentLane
+{
+    MQTTAgentLaneControl = 0, /**< Latency sensitive operations such as OTA job messages and subscriptions. */
+    MQTTAgentLaneBulk,        /**< Telemetry and other throughput oriented publishes. */
+    MQTTAgentNumLanes
+} MQTTAgentLane_t;
+
+/**
+ * @brief Statistics of the operations waiting for an acknowledgment from the broker.
+ */
+typedef struct MQTTAgentStats
+{
+    uint32_t inflightOperations;    /**< Operations currently holding an in-flight window entry. */
+    uint32_t inflightHighWatermark; /**< Highest number of in-flight operations since initialization. */
+    uint32_t pendingOperations;     /**< Operations sent and waiting for their ACK in the pending table. */
+    uint32_t windowFullCount;       /**< Number of enqueue attempts rejected with #MQTTAgentWindowFull. */
+    uint32_t maxProbeLength;        /**< Longest probe sequence used to insert into the pending table. */
+    uint32_t laneFullCount[ MQTTAgentNumLanes ]; /**< Number of enqueue attempts which timed out on a full lane. */
+    uint32_t connectionLossCount;   /**< Number of times the agent stopped using a lost connection. */
+    uint32_t replayedPublishes;     /**< QoS1 publishes sent again after a reconnection. */
+    uint32_t lastRecoveryMs;        /**< Time from the last connection loss to the first publish written on the new connection. */
+    uint32_t pooledOperations;      /**< Operations currently allocated from the operation pool. */
+    uint32_t completionQueueFullCount; /**< Completions of pooled operations which did not fit in their completion queue. */
+    uint32_t streamedPublishes;     /**< Incoming publishes larger than the network buffer passed to a stream handler in fragments. */
+    uint32_t loanedPublishes;       /**< Incoming publishes read into a buffer loaned by the loan handler of their route. */
+    uint32_t discardedPublishes;    /**< Incoming publishes larger than the network buffer with no stream handler. */
+} MQTTAgentStats_t;
+
 /**
  * @brief Structure used to hold parameters for MQTT operation enqueued with the agent.
  */
@@ -91,28 +148,188 @@ typedef struct MQTTOperation
     MQTTOperationInfo_t info;
     MQTTOperationStatusCallback_t callback;
     uint16_t packetIdentifier;
+
+    /**
+     * @brief Publishes only: set to pdTRUE to tell the agent that more publishes follow, so that the
+     * serialized packet is kept in the cork buffer and written together with the next ones. The buffer
+     * is written once a publish with pdFALSE is processed, when it is full, or after a short timeout.
+     * A QoS0 callback is invoked only once the packet is written to the transport.
+     */
+    BaseType_t moreFollows;
 } MQTTOperation_t;
 
+/**
+ * @brief Completion of a pooled operation, posted to the completion queue given at allocation.
+ */
+typedef struct MQTTAgentCompletion
+{
+    MQTTOperation_t * pOperation; /**< Completed operation, to release with MQTTAgent_ReleaseOperation(). */
+    MQTTStatus_t status;          /**< Status of the operation. */
+    void * pUserContext;          /**< Context given at allocation. */
+} MQTTAgentCompletion_t;
+
+/**
+ * @brief How the completion of a pooled operation is reported to its owner.
+ * Both a task notification and a completion queue can be used; the agent never blocks on either.
+ */
+typedef struct MQTTAgentCompletionTarget
+{
+    TaskHandle_t notifyTask;       /**< Optional, task notified with notifyBits set on completion. */
+    uint32_t notifyBits;           /**< Bits set in the notification value of notifyTask. */
+    QueueHandle_t completionQueue; /**< Optional, queue of #MQTTAgentCompletion_t receiving the completion. */
+    void * pUserContext;           /**< Passed back in the completion. */
+} MQTTAgentCompletionTarget_t;
+
 /**
  * @brief Initializes Agent task and creates the queue for MQTT operations.
- * Enqueues an MQTT receive operation by default.
- * The API should be called after an MQTT connection is established.
+ * The agent registers a wake up callback on the connection socket and only runs when
+ * an operation is enqueued, data is received or a keep alive ping is due.
+ * The API should be called after an MQTT connection is established over the TLS transport.
  *
  * @param[in] pContext The corteMQTT library MQTT context.
+ * @param[in] connectionLostCallback Optional, invoked when the agent stops using the connection.
  * @return pdTRUE if the initialization was successful.
  *
  */
-BaseType_t MQTTAgent_Init( MQTTContext_t * pContext );
+BaseType_t MQTTAgent_Init( MQTTContext_t * pContext,
+                           MQTTAgentConnectionLostCallback_t connectionLostCallback );
+
+/**
+ * @brief Tells the agent that the connection is lost, for instance on a network down event.
+ * The agent stops using the connection and invokes the connection lost callback. Until
+ * MQTTAgent_Resume() is called, enqueued operations are completed with MQTTSendFailed, and
+ * QoS1 publishes waiting for their PUBACK are kept to be sent again.
+ */
+void MQTTAgent_Suspend( void );
+
+/**
+ * @brief Tells the agent that the MQTT context is connected again.
+ * Must be called once MQTT_Connect() succeeded on the context passed to MQTTAgent_Init(), with the
+ * same network context. The agent sends again the QoS1 publishes which were waiting for their
+ * PUBACK, with the same packet identifiers, and with the DUP flag set if the broker resumed the session.
+ * Subscribes and unsubscribes which were waiting for their ACK were completed with MQTTSendFailed
+ * when the connection was lost.
+ *
+ * @param[in] sessionPresent Session present flag of the CONNACK.
+ */
+void MQTTAgent_Resume( BaseType_t sessionPresent );
+
+/**
+ * @brief Checks if the agent is using a connection.
+ *
+ * @return pdTRUE if the agent is connected.
+ */
+BaseType_t MQTTAgent_IsConnected( void );
 
 /*
- * @brief Enqueues an MQTT operation to be executed in agent context.
+ * @brief Enqueues an MQTT operation on the bulk lane to be executed in agent context.
  * Result of the operation will be available using MQTTOperationStatusCallback_t.
+ * Operations which require an ACK from the broker (QoS1/QoS2 publish, subscribe and unsubscribe)
+ * are admitted only while the in-flight window has room; the API does not block on the window.
  * @param[in] pOperation Pointer to the structure containing operation type and params.
  * @param[in] timeoutTicks Timeout in ticks API blocks for enqueue operation to succeed.
- * @return pdTRUE If the operation was successfully enqueued with the agent.
+ * @return MQTTAgentSuccess if the operation was successfully enqueued with the agent,
+ * MQTTAgentWindowFull if the in-flight window is full and the operation should be retried later,
+ * MQTTAgentQueueFull if the queue stayed full for timeoutTicks.
+ */
+MQTTAgentStatus_t MQTTAgent_Enqueue( MQTTOperation_t * pOperation,
+                                     TickType_t timeoutTicks );
+
+/*
+ * @brief Enqueues an MQTT operation on the given lane. Same as MQTTAgent_Enqueue() otherwise.
+ * Bulk lane operations cannot use the last few in-flight window entries, which are kept for
+ * the control lane.
+ * @param[in] pOperation Pointer to the structure containing operation type and params.
+ * @param[in] lane Lane to enqueue the operation on.
+ * @param[in] timeoutTicks Timeout in ticks API blocks for the lane queue to have room.
+ * @return Same as MQTTAgent_Enqueue().
+ */
+MQTTAgentStatus_t MQTTAgent_EnqueueOnLane( MQTTOperation_t * pOperation,
+                                           MQTTAgentLane_t lane,
+                                           TickType_t timeoutTicks );
+
+/*
+ * @brief Enqueues a group of publish operations on the bulk lane to be written to the connection in one
+ * transport write.
+ * The operations are enqueued in order with moreFollows set on all but the last one. Each operation
+ * keeps its own callback and, for QoS1/QoS2, its own packet identifier.
+ * @param[in] pOperations Array of pointers to the publish operations.
+ * @param[in] numOperations Number of operations in the array, at least one.
+ * @param[in] timeoutTicks Timeout in ticks API blocks for each enqueue operation to succeed.
+ * @param[out] pNumEnqueued Optional, number of operations enqueued before an error.
+ * @return MQTTAgentSuccess if all operations were enqueued, otherwise the status of the
+ * first operation which could not be enqueued.
+ */
+MQTTAgentStatus_t MQTTAgent_EnqueueBatch( MQTTOperation_t * const pOperations[],
+                                          size_t numOperations,
+                                          TickType_t timeoutTicks,
+                                          size_t * pNumEnqueued );
+
+/*
+ * @brief Reserves an agent publish buffer so that the producer can write a payload in place.
+ * The topic and QoS of the publish must be set before the call and must not change afterwards.
+ * On success pPublishInfo->pPayload points to the reserved payload area. The producer writes at
+ * most payloadLength bytes to *ppPayload, may lower pPublishInfo->payloadLength, and then enqueues
+ * a publish operation with pPublishInfo. The agent writes the header and the payload to the
+ * transport in one call without copying the payload, and frees the buffer when the operation
+ * completes, after invoking its callback.
+ * @param[in,out] pPublishInfo Publish information with topic and QoS set.
+ * @param[in] payloadLength Maximum length of the payload.
+ * @param[out] ppPayload Set to the payload area to write into.
+ * @param[in] timeoutTicks Timeout in ticks to wait for a free buffer.
+ * @return MQTTAgentSuccess, or MQTTAgentNoMemory if no buffer was free in time or the packet is
+ * larger than a publish buffer.
+ */
+MQTTAgentStatus_t MQTTAgent_ReservePublish( MQTTPublishInfo_t * pPublishInfo,
+                                            size_t payloadLength,
+                                            uint8_t ** ppPayload,
+                                            TickType_t timeoutTicks );
+
+/*
+ * @brief Frees a publish buffer reserved with MQTTAgent_ReservePublish() which is not going to be
+ * published, for instance because enqueuing the operation failed.
+ * @param[in,out] pPublishInfo Publish information pointing to the reserved payload.
+ */
+void MQTTAgent_ReleasePublish( MQTTPublishInfo_t * pPublishInfo );
+
+/*
+ * @brief Allocates an operation from the pool owned by the agent, so that the producer does not have
+ * to keep its own operation alive until the operation completes.
+ * The operation comes with a publish information structure owned by the pool: info.pPublishInfo
+ * points to it and can be filled in place. The callback of the operation is set by the agent and must
+ * not be changed. On completion, the status is posted to the completion queue and the notify task is
+ * notified, as given in pTarget. The producer can therefore keep many operations in flight, collect
+ * their results later and release each one with MQTTAgent_ReleaseOperation().
+ * Must be called after MQTTAgent_Init().
+ * @param[in] pTarget Completion target, copied.
+ * @param[in] timeoutTicks Timeout in ticks to wait for a free operation.
+ * @return The operation, or NULL if none was free in time.
+ */
+MQTTOperation_t * MQTTAgent_AllocateOperation( const MQTTAgentCompletionTarget_t * pTarget,
+                                               TickType_t timeoutTicks );
+
+/*
+ * @brief Gets the status of a pooled operation, for producers notified through a task notification.
+ * @param[in] pOperation Operation allocated with MQTTAgent_AllocateOperation().
+ * @param[out] pStatus Status of the operation, set only if it completed.
+ * @return pdTRUE if the operation completed.
+ */
+BaseType_t MQTTAgent_GetOperationStatus( const MQTTOperation_t * pOperation,
+                                         MQTTStatus_t * pStatus );
+
+/*
+ * @brief Returns a pooled operation to the pool.
+ * The operation must have completed, or must not have been enqueued.
+ * @param[in] pOperation Operation allocated with MQTTAgent_AllocateOperation().
+ */
+void MQTTAgent_ReleaseOperation( MQTTOperation_t * pOperation );
+
+/**
+ * @brief Gets a snapshot of the in-flight window statistics.
+ *
+ * @param[out] pStats Structure filled with the statistics.
  */
-BaseType_t MQTTAgent_Enqueue( MQTTOperation_t * pOperation,
-                              TickType_t timeoutTicks );
+void MQTTAgent_GetStats( MQTTAgentStats_t * pStats );
 
 /*
  * @brief Handler invoked for incoming MQTT packets to the MQTT agent.
@@ -97,8 +97,9 @@
  * <b>Default value:</b> `10`
  */
 #ifndef MQTT_STATE_ARRAY_MAX_COUNT
-    /* Default value for the maximum acknowledgment pending PUBLISH messages. */
-    #define MQTT_STATE_ARRAY_MAX_COUNT    ( 10U )
+    /* Maximum acknowledgment pending PUBLISH messages. This also sizes the in-flight window
+     * of the MQTT agent, and must be a power of two for it. */
+    #define MQTT_STATE_ARRAY_MAX_COUNT    ( 64U )
 #endif
 
 /**
@@ -0,0 +1,55 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Implementation of the CRC32 (IEEE 802.3), with a half byte table which keeps the code small.
+ */
+
+#include "crc32.h"
+
+uint32_t ulCrc32( uint32_t crc,
+                  const uint8_t * pData,
+                  uint32_t length )
+{
+    /* Half byte table of the reflected polynomial 0xEDB88320. */
+    static const uint32_t crcTable[ 16 ] =
+    {
+        0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL, 0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+        0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL, 0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL
+    };
+    uint32_t i;
+
+    /* The register is kept inverted between the buffers. */
+    crc = ~crc;
+
+    for( i = 0U; i < length; i++ )
+    {
+        crc ^= pData[ i ];
+        crc = ( crc >> 4 ) ^ crcTable[ crc & 0x0FU ];
+        crc = ( crc >> 4 ) ^ crcTable[ crc & 0x0FU ];
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,48 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Header file of the CRC32 (IEEE 802.3) shared by the OTA PAL and the key/value store.
+ */
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+
+/**
+ * @brief Extends the CRC32 (IEEE 802.3) of the bytes preceding a buffer with the buffer, so that the
+ * CRC of data held in several buffers is computed one buffer after the other.
+ *
+ * @param[in] crc CRC of the preceding bytes, 0 for the first buffer.
+ * @param[in] pData Buffer.
+ * @param[in] length Length of the buffer.
+ * @return CRC of the preceding bytes and the buffer.
+ */
+uint32_t ulCrc32( uint32_t crc,
+                  const uint8_t * pData,
+                  uint32_t length );
+
+#endif /* CRC32_H */
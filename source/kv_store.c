@@ -0,0 +1,1250 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Implementation of the key/value store.
+ * Each sector of the region starts with a header holding a magic, the number of times the sector was
+ * erased, and a sequence number. The sequence number is left erased while the sector is free, and is
+ * programmed one above the newest sector when the sector is opened for records, so that the log order
+ * is found after a reset. Each of these words is followed by a word programmed after it, the magic
+ * after the erase count and the complement of the sequence number after it, so that a header whose
+ * programming was interrupted is recognized and the sector formatted again. Records follow the sector header and never span two sectors. A record is
+ * written in three steps: its header with the CRC of the record, its key and value, and finally its
+ * commit word; a record without commit word, or whose CRC does not match, is ignored. Removing a key
+ * appends a deletion record. The newest record of a key is the current one, its address is kept in
+ * a RAM hash index built when the store is mounted, and its value is read through the memory mapped
+ * flash. The oldest sector of the log is reclaimed by copying its current records to the newest one
+ * and erasing it; as no older sector remains, its deletion records are dropped. Free sectors are
+ * opened least erased first.
+ */
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+#include "fsl_debug_console.h"
+
+#include "mflash_drv.h"
+#include "crc32.h"
+
+#include "kv_store.h"
+
+/**
+ * @brief Number of sectors of the store region.
+ */
+#define KV_STORE_NUM_SECTORS           ( KV_STORE_SIZE / MFLASH_SECTOR_SIZE )
+
+#if ( ( KV_STORE_BASE_ADDR % MFLASH_SECTOR_SIZE ) != 0 ) || ( ( KV_STORE_SIZE % MFLASH_SECTOR_SIZE ) != 0 )
+    #error "KV_STORE_BASE_ADDR and KV_STORE_SIZE must be aligned to MFLASH_SECTOR_SIZE."
+#endif
+
+#if ( KV_STORE_SIZE < ( 3 * MFLASH_SECTOR_SIZE ) )
+    #error "KV_STORE_SIZE must be at least three sectors."
+#endif
+
+#if ( KV_STORE_MAX_KEY_LENGTH == 0 ) || ( KV_STORE_MAX_KEY_LENGTH > 254 )
+    #error "KV_STORE_MAX_KEY_LENGTH must be between 1 and 254."
+#endif
+
+/**
+ * @brief Magic at the start of every sector formatted by the store.
+ */
+#define KV_STORE_SECTOR_MAGIC          ( 0x4B565354U )
+
+/**
+ * @brief Value of the commit word of a completely written record.
+ */
+#define KV_STORE_RECORD_COMMITTED      ( 0x5AA5C33CU )
+
+/**
+ * @brief Value of an erased flash word, also the sequence number of a free sector.
+ */
+#define KV_STORE_ERASED_WORD           ( 0xFFFFFFFFU )
+
+/**
+ * @brief Key length read from an erased record header, marking the end of the records of a sector.
+ */
+#define KV_STORE_ERASED_LENGTH         ( 0xFFU )
+
+/**
+ * @brief Number of entries of the RAM index, twice the number of keys to keep the probes short.
+ */
+#define KV_STORE_INDEX_SIZE            ( 2U * KV_STORE_MAX_KEYS )
+
+/**
+ * @brief Record address of an index entry never used since the store was mounted, ending a probe.
+ */
+#define KV_STORE_INDEX_FREE            ( 0U )
+
+/**
+ * @brief Record address of an index entry whose key was removed, skipped by a probe.
+ */
+#define KV_STORE_INDEX_REMOVED         ( 1U )
+
+/**
+ * @brief Header at the start of every sector of the store.
+ */
+typedef struct KVStoreSectorHeader
+{
+    uint32_t magic;         /**< Programmed after the erase count. */
+    uint32_t eraseCount;    /**< Number of times the sector was erased by the store. */
+    uint32_t sequence;      /**< Erased while the sector is free, programmed when it is opened. */
+    uint32_t sequenceCheck; /**< Complement of the sequence number, programmed after it. */
+} KVStoreSectorHeader_t;
+
+/**
+ * @brief Header of a record, followed by the key and the value.
+ * All fields are naturally aligned so that the header is 12 bytes without padding.
+ */
+typedef struct KVStoreRecordHeader
+{
+    uint8_t keyLength;
+    uint8_t isDeleted;    /**< 1 for a deletion record, which has no value. */
+    uint16_t valueLength;
+    uint32_t crc;         /**< CRC32 of the lengths, the key and the value. */
+    uint32_t commit;      /**< Programmed once the key and value are written. */
+} KVStoreRecordHeader_t;
+
+/**
+ * @brief State of a sector, mirroring its header.
+ */
+typedef struct KVStoreSector
+{
+    uint32_t sequence;
+    uint32_t eraseCount;
+} KVStoreSector_t;
+
+/**
+ * @brief Entry of the RAM index.
+ */
+typedef struct KVStoreIndexEntry
+{
+    uint32_t hash;          /**< Hash of the key, compared before the key itself. */
+    uint32_t recordAddress; /**< Current record of the key, or KV_STORE_INDEX_FREE or KV_STORE_INDEX_REMOVED. */
+} KVStoreIndexEntry_t;
+
+/**
+ * @brief Gets the memory mapped address of a sector of the store.
+ *
+ * @param[in] sector Index of the sector in the store.
+ * @return Address of the sector.
+ */
+static uint32_t prvSectorAddress( uint32_t sector );
+
+/**
+ * @brief Gets the size of a record, rounded up to a word so that all record headers are aligned.
+ *
+ * @param[in] keyLength Length of the key.
+ * @param[in] valueLength Length of the value.
+ * @return Size of the record in flash.
+ */
+static uint32_t prvRecordSize( uint32_t keyLength,
+                               uint32_t valueLength );
+
+/**
+ * @brief Computes the CRC of a record.
+ *
+ * @param[in] pHeader Header of the record, its CRC and commit word are ignored.
+ * @param[in] pKey Key of the record.
+ * @param[in] pValue Value of the record.
+ * @return CRC32 (IEEE 802.3) of the lengths, the key and the value.
+ */
+static uint32_t prvRecordCrc( const KVStoreRecordHeader_t * pHeader,
+                              const uint8_t * pKey,
+                              const uint8_t * pValue );
+
+/**
+ * @brief Computes the hash of a key.
+ *
+ * @param[in] pKey Key.
+ * @param[in] keyLength Length of the key.
+ * @return FNV-1a hash of the key.
+ */
+static uint32_t prvHashKey( const uint8_t * pKey,
+                            uint32_t keyLength );
+
+/**
+ * @brief Gets the record at an offset of a sector and moves the offset past it.
+ *
+ * @param[in] sector Index of the sector.
+ * @param[in,out] pOffset Offset of the record in the sector.
+ * @return The record, or NULL if there are no more records in the sector.
+ */
+static const KVStoreRecordHeader_t * prvNextRecord( uint32_t sector,
+                                                    uint32_t * pOffset );
+
+/**
+ * @brief Checks if a record is completely written and intact.
+ *
+ * @param[in] pRecord Record to check.
+ * @return pdTRUE if the record is valid.
+ */
+static BaseType_t prvIsValid( const KVStoreRecordHeader_t * pRecord );
+
+/**
+ * @brief Finds the index entry of a key.
+ *
+ * @param[in] pKey Key.
+ * @param[in] keyLength Length of the key.
+ * @param[in] hash Hash of the key.
+ * @return The entry, or NULL if the key is not in the index.
+ */
+static KVStoreIndexEntry_t * prvIndexFind( const uint8_t * pKey,
+                                           uint32_t keyLength,
+                                           uint32_t hash );
+
+/**
+ * @brief Makes a record the current one of its key, or removes the key for a deletion record,
+ * and updates the number of keys and of live bytes.
+ *
+ * @param[in] pRecord Newest record of the key.
+ * @return pdFALSE if the key is new and the index is full.
+ */
+static BaseType_t prvIndexUpdate( const KVStoreRecordHeader_t * pRecord );
+
+/**
+ * @brief Counts the free sectors.
+ *
+ * @return Number of free sectors.
+ */
+static uint32_t prvCountFreeSectors( void );
+
+/**
+ * @brief Gets the number of bytes used by records which are no longer current, including the end of
+ * the sectors left unused, which reclaiming the sectors can recover.
+ *
+ * @return Number of bytes.
+ */
+static uint32_t prvDeadBytes( void );
+
+/**
+ * @brief Erases a sector and programs its header to make it free.
+ *
+ * @param[in] sector Index of the sector.
+ * @param[in] eraseCount Number of erases of the sector, including this one.
+ * @return pdTRUE if the sector was formatted.
+ */
+static BaseType_t prvFormatSector( uint32_t sector,
+                                   uint32_t eraseCount );
+
+/**
+ * @brief Opens the least erased free sector as the head of the log, programming its sequence number.
+ *
+ * @return KVStoreSuccess if a sector was opened, KVStoreFull if no sector is free.
+ */
+static KVStoreStatus_t prvOpenSector( void );
+
+/**
+ * @brief Reclaims the oldest sector of the log, copying its current records to the head of the log
+ * and erasing it. Needs a free sector when the oldest sector is the head.
+ *
+ * @return KVStoreSuccess if the sector was reclaimed.
+ */
+static KVStoreStatus_t prvCompactSector( void );
+
+/**
+ * @brief Appends a record to the head of the log, opening a new head sector if the record does not
+ * fit. One free sector is kept to reclaim the others, unless the record is copied by a reclaim.
+ *
+ * @param[in] pHeader Header of the record, with its CRC. Its commit word is ignored.
+ * @param[in] pKey Key of the record.
+ * @param[in] pValue Value of the record.
+ * @param[in] isCompacting pdTRUE when the record is copied by a reclaim.
+ * @param[out] pRecordAddress Address of the record written.
+ * @return KVStoreSuccess if the record was written.
+ */
+static KVStoreStatus_t prvWriteRecord( const KVStoreRecordHeader_t * pHeader,
+                                       const uint8_t * pKey,
+                                       const uint8_t * pValue,
+                                       BaseType_t isCompacting,
+                                       uint32_t * pRecordAddress );
+
+/**
+ * @brief Appends a record for a key and updates the index.
+ *
+ * @param[in] pKey Null terminated key.
+ * @param[in] pValue Value, ignored for a deletion record.
+ * @param[in] valueLength Length of the value.
+ * @param[in] isDeleted pdTRUE to append a deletion record.
+ * @return KVStoreSuccess if the record was written.
+ */
+static KVStoreStatus_t prvAppend( const char * pKey,
+                                  const void * pValue,
+                                  size_t valueLength,
+                                  BaseType_t isDeleted );
+
+/**
+ * @brief Task reclaiming the oldest sectors while few sectors are free.
+ *
+ * @param[in] pvParameters Unused.
+ */
+static void prvCompactTask( void * pvParameters );
+
+/**
+ * @brief Mutex protecting the log state, the index and the flash accesses of the store.
+ */
+static SemaphoreHandle_t xStoreMutex = NULL;
+
+/**
+ * @brief Task reclaiming the sectors.
+ */
+static TaskHandle_t xCompactTask = NULL;
+
+/**
+ * @brief Set once the store is mounted.
+ */
+static BaseType_t isMounted = pdFALSE;
+
+/**
+ * @brief State of the sectors of the store.
+ */
+static KVStoreSector_t sectors[ KV_STORE_NUM_SECTORS ];
+
+/**
+ * @brief RAM index of the keys.
+ */
+static KVStoreIndexEntry_t keyIndex[ KV_STORE_INDEX_SIZE ];
+
+/**
+ * @brief Sector of the log records are appended to.
+ */
+static uint32_t headSector = 0U;
+
+/**
+ * @brief Offset in the head sector of the next record.
+ */
+static uint32_t headOffset = 0U;
+
+/**
+ * @brief Sequence number of the head sector.
+ */
+static uint32_t headSequence = 0U;
+
+/**
+ * @brief Number of keys in the index.
+ */
+static uint32_t keyCount = 0U;
+
+/**
+ * @brief Size of the current records of the keys.
+ */
+static uint32_t liveBytes = 0U;
+
+/**
+ * @brief Number of sectors reclaimed since the store was mounted.
+ */
+static uint32_t compactions = 0U;
+
+/**
+ * @brief Bytes of replaced records when reclaiming a whole round of sectors did not free any, as the
+ * end of the sectors is left unused by large records. Sectors are then reclaimed again only once more
+ * records were replaced.
+ */
+static uint32_t stalledDeadBytes = 0U;
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvSectorAddress( uint32_t sector )
+{
+    return KV_STORE_BASE_ADDR + ( sector * MFLASH_SECTOR_SIZE );
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvRecordSize( uint32_t keyLength,
+                               uint32_t valueLength )
+{
+    uint32_t size = sizeof( KVStoreRecordHeader_t ) + keyLength + valueLength;
+
+    return ( size + ( sizeof( uint32_t ) - 1U ) ) & ~( sizeof( uint32_t ) - 1U );
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvRecordCrc( const KVStoreRecordHeader_t * pHeader,
+                              const uint8_t * pKey,
+                              const uint8_t * pValue )
+{
+    uint32_t crc;
+
+    /* The lengths and deletion flag are the first four bytes of the header. */
+    crc = ulCrc32( 0U, ( const uint8_t * ) pHeader, 4U );
+    crc = ulCrc32( crc, pKey, pHeader->keyLength );
+
+    return ulCrc32( crc, pValue, pHeader->valueLength );
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvHashKey( const uint8_t * pKey,
+                            uint32_t keyLength )
+{
+    uint32_t hash = 2166136261UL;
+    uint32_t i;
+
+    for( i = 0U; i < keyLength; i++ )
+    {
+        hash ^= pKey[ i ];
+        hash *= 16777619UL;
+    }
+
+    return hash;
+}
+
+/*-----------------------------------------------------------*/
+
+static const KVStoreRecordHeader_t * prvNextRecord( uint32_t sector,
+                                                    uint32_t * pOffset )
+{
+    const KVStoreRecordHeader_t * pRecord = NULL;
+    uint32_t recordSize;
+
+    if( ( *pOffset + sizeof( KVStoreRecordHeader_t ) ) <= MFLASH_SECTOR_SIZE )
+    {
+        pRecord = ( const KVStoreRecordHeader_t * ) ( prvSectorAddress( sector ) + *pOffset );
+
+        if( pRecord->keyLength == KV_STORE_ERASED_LENGTH )
+        {
+            /* Erased flash, no more records in the sector. */
+            pRecord = NULL;
+        }
+        else
+        {
+            recordSize = prvRecordSize( pRecord->keyLength, pRecord->valueLength );
+
+            if( ( pRecord->keyLength == 0U ) || ( pRecord->keyLength > KV_STORE_MAX_KEY_LENGTH ) ||
+                ( recordSize > ( MFLASH_SECTOR_SIZE - *pOffset ) ) )
+            {
+                /* Corrupted lengths, ignore the rest of the sector. */
+                pRecord = NULL;
+            }
+            else
+            {
+                *pOffset += recordSize;
+            }
+        }
+    }
+
+    return pRecord;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvIsValid( const KVStoreRecordHeader_t * pRecord )
+{
+    const uint8_t * pKey = ( const uint8_t * ) &pRecord[ 1 ];
+
+    return ( ( pRecord->commit == KV_STORE_RECORD_COMMITTED ) &&
+             ( pRecord->crc == prvRecordCrc( pRecord, pKey, &pKey[ pRecord->keyLength ] ) ) ) ? pdTRUE : pdFALSE;
+}
+
+/*-----------------------------------------------------------*/
+
+static KVStoreIndexEntry_t * prvIndexFind( const uint8_t * pKey,
+                                           uint32_t keyLength,
+                                           uint32_t hash )
+{
+    KVStoreIndexEntry_t * pEntry = NULL;
+    const KVStoreRecordHeader_t * pRecord;
+    uint32_t slot = hash % KV_STORE_INDEX_SIZE;
+    uint32_t probes;
+
+    for( probes = 0U; ( probes < KV_STORE_INDEX_SIZE ) && ( pEntry == NULL ); probes++ )
+    {
+        if( keyIndex[ slot ].recordAddress == KV_STORE_INDEX_FREE )
+        {
+            break;
+        }
+
+        if( ( keyIndex[ slot ].recordAddress != KV_STORE_INDEX_REMOVED ) && ( keyIndex[ slot ].hash == hash ) )
+        {
+            pRecord = ( const KVStoreRecordHeader_t * ) keyIndex[ slot ].recordAddress;
+
+            if( ( pRecord->keyLength == keyLength ) && ( memcmp( &pRecord[ 1 ], pKey, keyLength ) == 0 ) )
+            {
+                pEntry = &keyIndex[ slot ];
+            }
+        }
+
+        slot = ( slot + 1U ) % KV_STORE_INDEX_SIZE;
+    }
+
+    return pEntry;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvIndexUpdate( const KVStoreRecordHeader_t * pRecord )
+{
+    const uint8_t * pKey = ( const uint8_t * ) &pRecord[ 1 ];
+    uint32_t hash = prvHashKey( pKey, pRecord->keyLength );
+    KVStoreIndexEntry_t * pEntry = prvIndexFind( pKey, pRecord->keyLength, hash );
+    const KVStoreRecordHeader_t * pPrevious;
+    BaseType_t result = pdTRUE;
+    uint32_t slot;
+
+    if( pEntry != NULL )
+    {
+        pPrevious = ( const KVStoreRecordHeader_t * ) pEntry->recordAddress;
+        liveBytes -= prvRecordSize( pPrevious->keyLength, pPrevious->valueLength );
+
+        if( pRecord->isDeleted != 0U )
+        {
+            pEntry->recordAddress = KV_STORE_INDEX_REMOVED;
+            keyCount--;
+        }
+        else
+        {
+            pEntry->recordAddress = ( uint32_t ) pRecord;
+            liveBytes += prvRecordSize( pRecord->keyLength, pRecord->valueLength );
+        }
+    }
+    else if( pRecord->isDeleted == 0U )
+    {
+        if( keyCount >= KV_STORE_MAX_KEYS )
+        {
+            result = pdFALSE;
+        }
+        else
+        {
+            /* The index has more entries than keys, an unused entry is always found. */
+            slot = hash % KV_STORE_INDEX_SIZE;
+
+            while( ( keyIndex[ slot ].recordAddress != KV_STORE_INDEX_FREE ) &&
+                   ( keyIndex[ slot ].recordAddress != KV_STORE_INDEX_REMOVED ) )
+            {
+                slot = ( slot + 1U ) % KV_STORE_INDEX_SIZE;
+            }
+
+            keyIndex[ slot ].hash = hash;
+            keyIndex[ slot ].recordAddress = ( uint32_t ) pRecord;
+            keyCount++;
+            liveBytes += prvRecordSize( pRecord->keyLength, pRecord->valueLength );
+        }
+    }
+    else
+    {
+        /* Deletion of a key which is not in the store. */
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvCountFreeSectors( void )
+{
+    uint32_t sector;
+    uint32_t count = 0U;
+
+    for( sector = 0U; sector < KV_STORE_NUM_SECTORS; sector++ )
+    {
+        if( sectors[ sector ].sequence == KV_STORE_ERASED_WORD )
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvDeadBytes( void )
+{
+    uint32_t sector;
+    uint32_t usedBytes = 0U;
+
+    for( sector = 0U; sector < KV_STORE_NUM_SECTORS; sector++ )
+    {
+        if( sector == headSector )
+        {
+            usedBytes += headOffset - sizeof( KVStoreSectorHeader_t );
+        }
+        else if( ( sectors[ sector ].sequence != KV_STORE_ERASED_WORD ) && ( sectors[ sector ].sequence != 0U ) )
+        {
+            usedBytes += MFLASH_SECTOR_SIZE - sizeof( KVStoreSectorHeader_t );
+        }
+        else
+        {
+            /* Free sector, or sector left unusable by a flash error. */
+        }
+    }
+
+    return usedBytes - liveBytes;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvFormatSector( uint32_t sector,
+                                   uint32_t eraseCount )
+{
+    uint32_t magic = KV_STORE_SECTOR_MAGIC;
+    uint32_t sectorAddress = prvSectorAddress( sector );
+    BaseType_t result = pdFALSE;
+
+    /* Until it is formatted, the sector is neither free nor part of the log. A sequence number of 0
+     * is never programmed, the sector is formatted again at the next mount if this one fails. */
+    sectors[ sector ].sequence = 0U;
+    sectors[ sector ].eraseCount = eraseCount;
+
+    if( ( mflash_drv_erase( ( void * ) sectorAddress, MFLASH_SECTOR_SIZE ) == 0 ) &&
+        ( mflash_drv_program( ( void * ) ( sectorAddress + offsetof( KVStoreSectorHeader_t, eraseCount ) ),
+                              ( const uint8_t * ) &eraseCount, sizeof( eraseCount ) ) == 0 ) &&
+        ( mflash_drv_program( ( void * ) ( sectorAddress + offsetof( KVStoreSectorHeader_t, magic ) ),
+                              ( const uint8_t * ) &magic, sizeof( magic ) ) == 0 ) )
+    {
+        sectors[ sector ].sequence = KV_STORE_ERASED_WORD;
+        result = pdTRUE;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static KVStoreStatus_t prvOpenSector( void )
+{
+    KVStoreStatus_t status = KVStoreFull;
+    uint32_t sequence = headSequence + 1U;
+    uint32_t sequenceCheck = ~sequence;
+    uint32_t sector;
+    uint32_t freeSector = KV_STORE_NUM_SECTORS;
+
+    for( sector = 0U; sector < KV_STORE_NUM_SECTORS; sector++ )
+    {
+        if( ( sectors[ sector ].sequence == KV_STORE_ERASED_WORD ) &&
+            ( ( freeSector == KV_STORE_NUM_SECTORS ) || ( sectors[ sector ].eraseCount < sectors[ freeSector ].eraseCount ) ) )
+        {
+            freeSector = sector;
+        }
+    }
+
+    if( freeSector != KV_STORE_NUM_SECTORS )
+    {
+        status = KVStoreFlashError;
+        sectors[ freeSector ].sequence = sequence;
+
+        /* The sequence number and its complement are the words of the header left erased by the format. */
+        if( ( mflash_drv_program( ( void * ) ( prvSectorAddress( freeSector ) + offsetof( KVStoreSectorHeader_t, sequence ) ),
+                                  ( const uint8_t * ) &sequence, sizeof( sequence ) ) == 0 ) &&
+            ( mflash_drv_program( ( void * ) ( prvSectorAddress( freeSector ) + offsetof( KVStoreSectorHeader_t, sequenceCheck ) ),
+                                  ( const uint8_t * ) &sequenceCheck, sizeof( sequenceCheck ) ) == 0 ) )
+        {
+            headSector = freeSector;
+            headSequence = sequence;
+            headOffset = sizeof( KVStoreSectorHeader_t );
+            status = KVStoreSuccess;
+        }
+        else
+        {
+            sectors[ freeSector ].sequence = 0U;
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static KVStoreStatus_t prvCompactSector( void )
+{
+    KVStoreStatus_t status = KVStoreSuccess;
+    const KVStoreRecordHeader_t * pRecord;
+    KVStoreIndexEntry_t * pEntry;
+    const uint8_t * pKey;
+    uint32_t victim = KV_STORE_NUM_SECTORS;
+    uint32_t sector;
+    uint32_t offset = sizeof( KVStoreSectorHeader_t );
+    uint32_t recordAddress;
+
+    for( sector = 0U; sector < KV_STORE_NUM_SECTORS; sector++ )
+    {
+        if( ( sectors[ sector ].sequence != KV_STORE_ERASED_WORD ) && ( sectors[ sector ].sequence != 0U ) &&
+            ( ( victim == KV_STORE_NUM_SECTORS ) || ( sectors[ sector ].sequence < sectors[ victim ].sequence ) ) )
+        {
+            victim = sector;
+        }
+    }
+
+    if( victim == headSector )
+    {
+        status = prvOpenSector();
+    }
+
+    /* Copy the current records, a reset before the erase leaves both copies, the newer one winning. */
+    while( ( status == KVStoreSuccess ) && ( ( pRecord = prvNextRecord( victim, &offset ) ) != NULL ) )
+    {
+        if( ( pRecord->commit == KV_STORE_RECORD_COMMITTED ) && ( pRecord->isDeleted == 0U ) )
+        {
+            pKey = ( const uint8_t * ) &pRecord[ 1 ];
+            pEntry = prvIndexFind( pKey, pRecord->keyLength, prvHashKey( pKey, pRecord->keyLength ) );
+
+            if( ( pEntry != NULL ) && ( pEntry->recordAddress == ( uint32_t ) pRecord ) )
+            {
+                status = prvWriteRecord( pRecord, pKey, &pKey[ pRecord->keyLength ], pdTRUE, &recordAddress );
+
+                if( status == KVStoreSuccess )
+                {
+                    pEntry->recordAddress = recordAddress;
+                }
+            }
+        }
+    }
+
+    if( status == KVStoreSuccess )
+    {
+        if( prvFormatSector( victim, sectors[ victim ].eraseCount + 1U ) == pdTRUE )
+        {
+            compactions++;
+        }
+        else
+        {
+            PRINTF( "KV store: failed to erase sector at 0x%08x.\r\n", ( unsigned int ) prvSectorAddress( victim ) );
+            status = KVStoreFlashError;
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static KVStoreStatus_t prvWriteRecord( const KVStoreRecordHeader_t * pHeader,
+                                       const uint8_t * pKey,
+                                       const uint8_t * pValue,
+                                       BaseType_t isCompacting,
+                                       uint32_t * pRecordAddress )
+{
+    KVStoreStatus_t status = KVStoreSuccess;
+    KVStoreRecordHeader_t header = *pHeader;
+    uint32_t recordSize = prvRecordSize( pHeader->keyLength, pHeader->valueLength );
+    uint32_t reservedSectors = ( isCompacting == pdTRUE ) ? 0U : 1U;
+    uint32_t compactSteps = 0U;
+    uint32_t recordStart;
+    uint32_t commit = KV_STORE_RECORD_COMMITTED;
+    int32_t flashResult;
+
+    while( ( status == KVStoreSuccess ) && ( ( headOffset + recordSize ) > MFLASH_SECTOR_SIZE ) )
+    {
+        if( prvCountFreeSectors() > reservedSectors )
+        {
+            status = prvOpenSector();
+        }
+        else if( ( isCompacting == pdFALSE ) && ( compactSteps < KV_STORE_NUM_SECTORS ) )
+        {
+            /* The background reclaim did not keep up, reclaim the oldest sector now. */
+            status = prvCompactSector();
+            compactSteps++;
+        }
+        else
+        {
+            if( isCompacting == pdFALSE )
+            {
+                stalledDeadBytes = prvDeadBytes();
+            }
+
+            status = KVStoreFull;
+        }
+    }
+
+    if( status == KVStoreSuccess )
+    {
+        header.commit = KV_STORE_ERASED_WORD;
+        recordStart = prvSectorAddress( headSector ) + headOffset;
+
+        /* The space is used as soon as the header is programmed, even if a later step fails. */
+        headOffset += recordSize;
+
+        flashResult = mflash_drv_program( ( void * ) recordStart, ( const uint8_t * ) &header, sizeof( header ) );
+
+        if( flashResult == 0 )
+        {
+            flashResult = mflash_drv_program( ( void * ) ( recordStart + sizeof( header ) ), pKey, header.keyLength );
+        }
+
+        if( ( flashResult == 0 ) && ( header.valueLength != 0U ) )
+        {
+            flashResult = mflash_drv_program( ( void * ) ( recordStart + sizeof( header ) + header.keyLength ),
+                                              pValue,
+                                              header.valueLength );
+        }
+
+        if( flashResult == 0 )
+        {
+            flashResult = mflash_drv_program( ( void * ) ( recordStart + offsetof( KVStoreRecordHeader_t, commit ) ),
+                                              ( const uint8_t * ) &commit,
+                                              sizeof( commit ) );
+        }
+
+        if( flashResult == 0 )
+        {
+            *pRecordAddress = recordStart;
+        }
+        else
+        {
+            status = KVStoreFlashError;
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static KVStoreStatus_t prvAppend( const char * pKey,
+                                  const void * pValue,
+                                  size_t valueLength,
+                                  BaseType_t isDeleted )
+{
+    KVStoreStatus_t status = KVStoreSuccess;
+    KVStoreRecordHeader_t header;
+    size_t keyLength = 0U;
+    uint32_t recordSize = 0U;
+    uint32_t recordAddress;
+    uint32_t freeSectors;
+    uint32_t freeBytes;
+
+    if( ( isMounted == pdFALSE ) || ( pKey == NULL ) || ( ( pValue == NULL ) && ( valueLength != 0U ) ) )
+    {
+        status = KVStoreBadParameter;
+    }
+    else
+    {
+        keyLength = strlen( pKey );
+        recordSize = prvRecordSize( keyLength, valueLength );
+
+        if( ( keyLength == 0U ) || ( keyLength > KV_STORE_MAX_KEY_LENGTH ) ||
+            ( recordSize > ( MFLASH_SECTOR_SIZE - sizeof( KVStoreSectorHeader_t ) ) ) )
+        {
+            status = KVStoreBadParameter;
+        }
+    }
+
+    if( status == KVStoreSuccess )
+    {
+        ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+
+        if( prvIndexFind( ( const uint8_t * ) pKey, keyLength, prvHashKey( ( const uint8_t * ) pKey, keyLength ) ) == NULL )
+        {
+            if( isDeleted == pdTRUE )
+            {
+                status = KVStoreNotFound;
+            }
+            else if( keyCount >= KV_STORE_MAX_KEYS )
+            {
+                status = KVStoreFull;
+            }
+            else
+            {
+                /* New key. */
+            }
+        }
+
+        /* Fail early rather than reclaiming every sector when the record cannot fit anyway. One free
+         * sector is kept to reclaim the others, and the end of the sectors left unused by large records
+         * cannot be reclaimed. */
+        if( status == KVStoreSuccess )
+        {
+            freeSectors = prvCountFreeSectors();
+            freeBytes = prvDeadBytes();
+            freeBytes = ( freeBytes > stalledDeadBytes ) ? ( freeBytes - stalledDeadBytes ) : 0U;
+            freeBytes += MFLASH_SECTOR_SIZE - headOffset;
+
+            if( freeSectors > 1U )
+            {
+                freeBytes += ( freeSectors - 1U ) * ( MFLASH_SECTOR_SIZE - sizeof( KVStoreSectorHeader_t ) );
+            }
+
+            if( recordSize > freeBytes )
+            {
+                status = KVStoreFull;
+            }
+        }
+
+        if( status == KVStoreSuccess )
+        {
+            memset( &header, 0xFF, sizeof( header ) );
+            header.keyLength = ( uint8_t ) keyLength;
+            header.isDeleted = ( isDeleted == pdTRUE ) ? 1U : 0U;
+            header.valueLength = ( uint16_t ) valueLength;
+            header.crc = prvRecordCrc( &header, ( const uint8_t * ) pKey, ( const uint8_t * ) pValue );
+
+            status = prvWriteRecord( &header, ( const uint8_t * ) pKey, ( const uint8_t * ) pValue, pdFALSE, &recordAddress );
+        }
+
+        if( status == KVStoreSuccess )
+        {
+            /* Room in the index was checked above. */
+            ( void ) prvIndexUpdate( ( const KVStoreRecordHeader_t * ) recordAddress );
+        }
+
+        freeSectors = prvCountFreeSectors();
+
+        ( void ) xSemaphoreGive( xStoreMutex );
+
+        if( ( freeSectors < KV_STORE_COMPACT_FREE_SECTORS ) && ( xCompactTask != NULL ) )
+        {
+            ( void ) xTaskNotifyGive( xCompactTask );
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCompactTask( void * pvParameters )
+{
+    BaseType_t isDone;
+    uint32_t freeSectors;
+    uint32_t mostFreeSectors;
+    uint32_t idleSteps;
+
+    ( void ) pvParameters;
+
+    for( ; ; )
+    {
+        ( void ) ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+
+        mostFreeSectors = 0U;
+        idleSteps = 0U;
+
+        do
+        {
+            /* The mutex is released after each sector, so that the store is never blocked for more
+             * than one erase. Reclaiming only pays off once a sector worth of records was replaced. */
+            ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+
+            freeSectors = prvCountFreeSectors();
+
+            if( freeSectors > mostFreeSectors )
+            {
+                mostFreeSectors = freeSectors;
+                idleSteps = 0U;
+            }
+
+            if( freeSectors >= KV_STORE_COMPACT_FREE_SECTORS )
+            {
+                stalledDeadBytes = 0U;
+                isDone = pdTRUE;
+            }
+            else if( prvDeadBytes() < ( stalledDeadBytes + MFLASH_SECTOR_SIZE - sizeof( KVStoreSectorHeader_t ) ) )
+            {
+                isDone = pdTRUE;
+            }
+            else if( idleSteps >= KV_STORE_NUM_SECTORS )
+            {
+                stalledDeadBytes = prvDeadBytes();
+                isDone = pdTRUE;
+            }
+            else
+            {
+                isDone = ( prvCompactSector() == KVStoreSuccess ) ? pdFALSE : pdTRUE;
+                idleSteps++;
+            }
+
+            ( void ) xSemaphoreGive( xStoreMutex );
+        } while( isDone == pdFALSE );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t KVStore_Init( void )
+{
+    BaseType_t result = pdTRUE;
+    const KVStoreSectorHeader_t * pHeader;
+    const KVStoreRecordHeader_t * pRecord;
+    BaseType_t isFormatted[ KV_STORE_NUM_SECTORS ];
+    uint32_t maxEraseCount = 0U;
+    uint32_t sector;
+    uint32_t next;
+    uint32_t offset;
+    BaseType_t isFirst = pdTRUE;
+
+    if( isMounted == pdTRUE )
+    {
+        return pdTRUE;
+    }
+
+    xStoreMutex = xSemaphoreCreateMutex();
+
+    if( xStoreMutex == NULL )
+    {
+        result = pdFALSE;
+    }
+
+    if( result == pdTRUE )
+    {
+        memset( keyIndex, 0x00, sizeof( keyIndex ) );
+        keyCount = 0U;
+        liveBytes = 0U;
+        compactions = 0U;
+        stalledDeadBytes = 0U;
+        headSequence = 0U;
+
+        for( sector = 0U; sector < KV_STORE_NUM_SECTORS; sector++ )
+        {
+            pHeader = ( const KVStoreSectorHeader_t * ) prvSectorAddress( sector );
+            isFormatted[ sector ] = pdFALSE;
+            sectors[ sector ].sequence = 0U;
+            sectors[ sector ].eraseCount = KV_STORE_ERASED_WORD;
+
+            if( pHeader->magic == KV_STORE_SECTOR_MAGIC )
+            {
+                sectors[ sector ].eraseCount = pHeader->eraseCount;
+
+                if( pHeader->eraseCount > maxEraseCount )
+                {
+                    maxEraseCount = pHeader->eraseCount;
+                }
+
+                /* A sector whose opening was interrupted has no records yet. */
+                if( ( ( pHeader->sequence == KV_STORE_ERASED_WORD ) && ( pHeader->sequenceCheck == KV_STORE_ERASED_WORD ) ) ||
+                    ( ( pHeader->sequence != 0U ) && ( pHeader->sequenceCheck == ~pHeader->sequence ) ) )
+                {
+                    sectors[ sector ].sequence = pHeader->sequence;
+                    isFormatted[ sector ] = pdTRUE;
+                }
+            }
+        }
+
+        /* Sectors never used by the store, or whose format was interrupted, lost their erase count and
+         * get the highest one. Sectors whose opening was interrupted keep theirs. */
+        for( sector = 0U; ( sector < KV_STORE_NUM_SECTORS ) && ( result == pdTRUE ); sector++ )
+        {
+            if( isFormatted[ sector ] == pdFALSE )
+            {
+                result = prvFormatSector( sector, ( ( sectors[ sector ].eraseCount != KV_STORE_ERASED_WORD ) ?
+                                                    sectors[ sector ].eraseCount : maxEraseCount ) + 1U );
+            }
+        }
+    }
+
+    if( result == pdTRUE )
+    {
+        /* Index the sectors of the log from the oldest to the newest, so that the newest record of
+         * each key is the one left in the index. */
+        do
+        {
+            next = KV_STORE_NUM_SECTORS;
+
+            for( sector = 0U; sector < KV_STORE_NUM_SECTORS; sector++ )
+            {
+                if( ( sectors[ sector ].sequence != KV_STORE_ERASED_WORD ) &&
+                    ( ( isFirst == pdTRUE ) || ( sectors[ sector ].sequence > headSequence ) ||
+                      ( ( sectors[ sector ].sequence == headSequence ) && ( sector > headSector ) ) ) &&
+                    ( ( next == KV_STORE_NUM_SECTORS ) || ( sectors[ sector ].sequence < sectors[ next ].sequence ) ) )
+                {
+                    next = sector;
+                }
+            }
+
+            if( next != KV_STORE_NUM_SECTORS )
+            {
+                isFirst = pdFALSE;
+                headSector = next;
+                headSequence = sectors[ next ].sequence;
+                offset = sizeof( KVStoreSectorHeader_t );
+
+                while( ( pRecord = prvNextRecord( next, &offset ) ) != NULL )
+                {
+                    if( ( prvIsValid( pRecord ) == pdTRUE ) && ( prvIndexUpdate( pRecord ) == pdFALSE ) )
+                    {
+                        PRINTF( "KV store: index full, record at 0x%08x ignored.\r\n", ( unsigned int ) pRecord );
+                    }
+                }
+
+                pRecord = ( const KVStoreRecordHeader_t * ) ( prvSectorAddress( next ) + offset );
+
+                if( ( ( offset + sizeof( KVStoreRecordHeader_t ) ) <= MFLASH_SECTOR_SIZE ) &&
+                    ( pRecord->keyLength != KV_STORE_ERASED_LENGTH ) )
+                {
+                    /* Corrupted record, do not append over it. */
+                    offset = MFLASH_SECTOR_SIZE;
+                }
+
+                headOffset = offset;
+            }
+        } while( next != KV_STORE_NUM_SECTORS );
+
+        if( isFirst == pdTRUE )
+        {
+            result = ( prvOpenSector() == KVStoreSuccess ) ? pdTRUE : pdFALSE;
+        }
+    }
+
+    if( ( result == pdTRUE ) && ( xCompactTask == NULL ) )
+    {
+        if( xTaskCreate( prvCompactTask,
+                         "KV_compact",
+                         KV_STORE_TASK_STACK_SIZE,
+                         NULL,
+                         KV_STORE_TASK_PRIORITY | portPRIVILEGE_BIT,
+                         &xCompactTask ) != pdPASS )
+        {
+            /* Not fatal, the sectors are then reclaimed when a record does not fit. */
+            PRINTF( "KV store: failed to create the compaction task.\r\n" );
+            xCompactTask = NULL;
+        }
+    }
+
+    if( result == pdTRUE )
+    {
+        isMounted = pdTRUE;
+        PRINTF( "KV store: %u keys, %u free sectors.\r\n", ( unsigned int ) keyCount, ( unsigned int ) prvCountFreeSectors() );
+
+        if( ( prvCountFreeSectors() < KV_STORE_COMPACT_FREE_SECTORS ) && ( xCompactTask != NULL ) )
+        {
+            ( void ) xTaskNotifyGive( xCompactTask );
+        }
+    }
+    else if( xStoreMutex != NULL )
+    {
+        vSemaphoreDelete( xStoreMutex );
+        xStoreMutex = NULL;
+    }
+    else
+    {
+        /* Nothing to release. */
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+KVStoreStatus_t KVStore_Set( const char * pKey,
+                             const void * pValue,
+                             size_t valueLength )
+{
+    return prvAppend( pKey, pValue, valueLength, pdFALSE );
+}
+
+/*-----------------------------------------------------------*/
+
+KVStoreStatus_t KVStore_Get( const char * pKey,
+                             void * pBuffer,
+                             size_t bufferSize,
+                             size_t * pValueLength )
+{
+    KVStoreStatus_t status = KVStoreSuccess;
+    const KVStoreRecordHeader_t * pRecord;
+    KVStoreIndexEntry_t * pEntry;
+    size_t keyLength = 0U;
+
+    if( ( isMounted == pdFALSE ) || ( pKey == NULL ) )
+    {
+        status = KVStoreBadParameter;
+    }
+    else
+    {
+        keyLength = strlen( pKey );
+
+        if( ( keyLength == 0U ) || ( keyLength > KV_STORE_MAX_KEY_LENGTH ) )
+        {
+            status = KVStoreBadParameter;
+        }
+    }
+
+    if( status == KVStoreSuccess )
+    {
+        /* Held while copying, a reclaim would otherwise erase the record. */
+        ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+
+        pEntry = prvIndexFind( ( const uint8_t * ) pKey, keyLength, prvHashKey( ( const uint8_t * ) pKey, keyLength ) );
+
+        if( pEntry == NULL )
+        {
+            status = KVStoreNotFound;
+        }
+        else
+        {
+            pRecord = ( const KVStoreRecordHeader_t * ) pEntry->recordAddress;
+
+            if( pValueLength != NULL )
+            {
+                *pValueLength = pRecord->valueLength;
+            }
+
+            if( ( pBuffer == NULL ) || ( bufferSize < pRecord->valueLength ) )
+            {
+                status = KVStoreBufferTooSmall;
+            }
+            else
+            {
+                memcpy( pBuffer, ( const uint8_t * ) &pRecord[ 1 ] + keyLength, pRecord->valueLength );
+            }
+        }
+
+        ( void ) xSemaphoreGive( xStoreMutex );
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+KVStoreStatus_t KVStore_Delete( const char * pKey )
+{
+    return prvAppend( pKey, NULL, 0U, pdTRUE );
+}
+
+/*-----------------------------------------------------------*/
+
+void KVStore_GetStats( KVStoreStats_t * pStats )
+{
+    uint32_t sector;
+
+    if( ( pStats != NULL ) && ( isMounted == pdTRUE ) )
+    {
+        ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+
+        pStats->keys = keyCount;
+        pStats->liveBytes = liveBytes;
+        pStats->freeSectors = prvCountFreeSectors();
+        pStats->compactions = compactions;
+        pStats->minEraseCount = UINT32_MAX;
+        pStats->maxEraseCount = 0U;
+
+        for( sector = 0U; sector < KV_STORE_NUM_SECTORS; sector++ )
+        {
+            if( sectors[ sector ].eraseCount < pStats->minEraseCount )
+            {
+                pStats->minEraseCount = sectors[ sector ].eraseCount;
+            }
+
+            if( sectors[ sector ].eraseCount > pStats->maxEraseCount )
+            {
+                pStats->maxEraseCount = sectors[ sector ].eraseCount;
+            }
+        }
+
+        ( void ) xSemaphoreGive( xStoreMutex );
+    }
+}
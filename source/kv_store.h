@@ -0,0 +1,170 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Key/value store kept in a log of records in the SPIFI flash.
+ * Setting a key appends a record, so that a write costs a few page programs instead of erasing and
+ * reprogramming a sector, and a write interrupted by a reset leaves the previous value in place.
+ * The records are indexed in RAM when the store is mounted. The sectors whose records were replaced
+ * are reclaimed in the background, the least erased sectors being reused first.
+ */
+
+#ifndef KV_STORE_H
+#define KV_STORE_H
+
+#include <stddef.h>
+
+/* FreeRTOS include. */
+#include "FreeRTOS.h"
+
+/**
+ * @brief Address of the flash region reserved for the store, aligned to a sector.
+ */
+#ifndef KV_STORE_BASE_ADDR
+    #define KV_STORE_BASE_ADDR    ( 0x10808000U )
+#endif
+
+/**
+ * @brief Size of the flash region reserved for the store, a multiple of the sector size.
+ */
+#ifndef KV_STORE_SIZE
+    #define KV_STORE_SIZE    ( 0x18000U )
+#endif
+
+/**
+ * @brief Maximum number of keys in the store, which sets the size of the RAM index.
+ */
+#ifndef KV_STORE_MAX_KEYS
+    #define KV_STORE_MAX_KEYS    ( 32U )
+#endif
+
+/**
+ * @brief Maximum length of a key, without the terminating null character.
+ */
+#ifndef KV_STORE_MAX_KEY_LENGTH
+    #define KV_STORE_MAX_KEY_LENGTH    ( 64U )
+#endif
+
+/**
+ * @brief Number of free sectors below which the sectors holding replaced records are reclaimed
+ * in the background. One free sector is always kept to reclaim the others.
+ */
+#ifndef KV_STORE_COMPACT_FREE_SECTORS
+    #define KV_STORE_COMPACT_FREE_SECTORS    ( 4U )
+#endif
+
+/**
+ * @brief Priority of the task reclaiming the sectors.
+ */
+#ifndef KV_STORE_TASK_PRIORITY
+    #define KV_STORE_TASK_PRIORITY    ( tskIDLE_PRIORITY + 1 )
+#endif
+
+/**
+ * @brief Stack size of the task reclaiming the sectors, in words.
+ */
+#ifndef KV_STORE_TASK_STACK_SIZE
+    #define KV_STORE_TASK_STACK_SIZE    ( 512U )
+#endif
+
+/**
+ * @brief Status returned by the store.
+ */
+typedef enum KVStoreStatus
+{
+    KVStoreSuccess = 0,    /**< The operation was successful. */
+    KVStoreBadParameter,   /**< The key is invalid, or the record does not fit in a sector. */
+    KVStoreNotFound,       /**< The key is not in the store. */
+    KVStoreBufferTooSmall, /**< The buffer is too small for the value, only its length is returned. */
+    KVStoreFull,           /**< There is no room left for the record, or the index is full. */
+    KVStoreFlashError      /**< Programming or erasing the flash failed. */
+} KVStoreStatus_t;
+
+/**
+ * @brief Statistics of the store.
+ */
+typedef struct KVStoreStats
+{
+    uint32_t keys;          /**< Keys currently in the store. */
+    uint32_t liveBytes;     /**< Flash used by the current records of the keys. */
+    uint32_t freeSectors;   /**< Erased sectors ready to be written. */
+    uint32_t compactions;   /**< Sectors reclaimed since the store was mounted. */
+    uint32_t minEraseCount; /**< Lowest number of erases of a sector of the store. */
+    uint32_t maxEraseCount; /**< Highest number of erases of a sector of the store. */
+} KVStoreStats_t;
+
+/**
+ * @brief Mounts the store, indexing the records found in flash, and starts the task reclaiming the
+ * sectors. Records which were not completely written when the device was reset, or whose CRC does
+ * not match, are ignored. Sectors found unformatted are erased. The flash driver must have been
+ * initialized. Does nothing when the store is already mounted.
+ *
+ * @return pdTRUE if the store was mounted.
+ */
+BaseType_t KVStore_Init( void );
+
+/**
+ * @brief Sets the value of a key, replacing its previous value.
+ *
+ * @param[in] pKey Null terminated key, up to KV_STORE_MAX_KEY_LENGTH characters.
+ * @param[in] pValue Value, can be NULL if valueLength is 0.
+ * @param[in] valueLength Length of the value.
+ * @return KVStoreSuccess if the value was stored, otherwise the reason it was not.
+ */
+KVStoreStatus_t KVStore_Set( const char * pKey,
+                             const void * pValue,
+                             size_t valueLength );
+
+/**
+ * @brief Gets a copy of the value of a key.
+ *
+ * @param[in] pKey Null terminated key.
+ * @param[out] pBuffer Buffer receiving the value, can be NULL to only get its length.
+ * @param[in] bufferSize Size of the buffer.
+ * @param[out] pValueLength Length of the value, can be NULL.
+ * @return KVStoreSuccess if the value was copied, KVStoreBufferTooSmall if the buffer is NULL or too
+ * small for the value, KVStoreNotFound if the key is not in the store.
+ */
+KVStoreStatus_t KVStore_Get( const char * pKey,
+                             void * pBuffer,
+                             size_t bufferSize,
+                             size_t * pValueLength );
+
+/**
+ * @brief Removes a key from the store.
+ *
+ * @param[in] pKey Null terminated key.
+ * @return KVStoreSuccess if the key was removed, KVStoreNotFound if it was not in the store.
+ */
+KVStoreStatus_t KVStore_Delete( const char * pKey );
+
+/**
+ * @brief Gets a snapshot of the store statistics.
+ *
+ * @param[out] pStats Structure filled with the statistics.
+ */
+void KVStore_GetStats( KVStoreStats_t * pStats );
+
+#endif /* ifndef KV_STORE_H */
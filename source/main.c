@@ -73,7 +73,11 @@
 
 #include "user/demo-restrictions.h"
 #include "ota_update.h"
+#include "ota_http.h"
 #include "core_mqtt_agent.h"
+#include "mqtt_subscription_router.h"
+#include "mqtt_offline_store.h"
+#include "mqtt_connection_supervisor.h"
 
 /*******************************************************************************
  * Definitions
@@ -94,12 +98,56 @@
 
 /**
  * @brief MQTT incoming buffer size.
- * This is the buffer size to hold an incoming packet from MQTT connection. The
- * buffer size should be set to maximum expected size as required by all MQTT applications including OTA.
+ * This is the buffer size to hold an incoming packet from MQTT connection. Publishes larger than the
+ * buffer are streamed by the MQTT agent in fragments to the stream handlers registered with the
+ * subscription router, such as the OTA data handler, and are dropped for regular handlers. The buffer
+ * size should therefore be set to the maximum expected size of the publishes with regular handlers.
  */
 
 #define MQTT_INCOMING_BUFFER_SIZE    ( 2048 )
 
+/**
+ * @brief Age in seconds after which a publish kept in the offline store is discarded.
+ */
+#define democonfigOFFLINE_STORE_RETENTION_SECONDS    ( 24U * 60U * 60U )
+
+/**
+ * @brief Time to wait for room in the MQTT agent queue before a publish is stored offline instead.
+ */
+#define democonfigPUBLISH_ENQUEUE_TIMEOUT_MS    ( 1000U )
+
+/**
+ * @brief Interval between two hello world publishes.
+ */
+#define democonfigPUBLISH_INTERVAL_MS    ( 5000U )
+
+/**
+ * @brief Number of hello world publishes which can wait for their completion at the same time.
+ * Each one holds an operation of the agent pool and a payload slot until it completes.
+ */
+#define democonfigMAX_OUTSTANDING_PUBLISHES    ( 4U )
+
+/**
+ * @brief Size of the payload slot of a hello world publish.
+ */
+#define democonfigPUBLISH_PAYLOAD_SIZE    ( 32U )
+
+/**
+ * @brief Notification bit set in the hello world task when the MQTT connection is established.
+ */
+#define HELLO_EVENT_CONNECTED       ( 1UL << 0 )
+
+/**
+ * @brief Notification bit set in the hello world task when the MQTT connection is lost.
+ */
+#define HELLO_EVENT_DISCONNECTED    ( 1UL << 1 )
+
+/**
+ * @brief Notification bit set in the hello world task when the broker did not resume the MQTT session
+ * of a reconnection, so the subscriptions it held are gone.
+ */
+#define HELLO_EVENT_SESSION_LOST    ( 1UL << 2 )
+
 /**
  * @brief ROOT CA used for mutual authentication of TLS connection with AWS IoT MQTT broker.
  * Certificate is available publicly.
@@ -137,8 +185,9 @@
 
 /**
  * @brief MQTT hello world demo task.
- * Task creates a secure TLS connection with MQTT broker, spawns OTA demo task
- * and then keeps publishing messages in a loop at regular intervals. The task never
+ * Task starts the connection supervisor, which keeps a secure TLS connection with the MQTT broker,
+ * spawns OTA demo task once connected and then keeps publishing messages in a loop at regular
+ * intervals. Messages published while disconnected are kept in the offline store. The task never
  * exits the loop.
  *
  * @param[in] pvParameters The parameters for hello world task.
@@ -156,13 +205,22 @@ static void hello_task( void * pvParameters );
 
 static uint32_t getTimeStampMs( void );
 
+/**
+ * @brief Time source of the offline store, in seconds.
+ * The demo has no wall clock, so the time since boot is used; publishes stored before a reset are
+ * then kept until the device has been up for longer than when they were stored.
+ *
+ * @return Time in seconds.
+ */
+static uint32_t getTimeSeconds( void );
+
 /**
  * @brief Callback executed when an MQTT packet is received by the library.
  * This application defined callback is registered with MQTT library and invoked
  * for every incoming packets. Callback first invokes MQTT agent handler function to
  * check for any general ACK packets for Subscribe/Publish etc.. If the packet is not
- * processed by MQTT agent, then its a publish packet and it calls each of the demos
- * MQTT handler functions.
+ * processed by MQTT agent, then its a publish packet and it is dispatched by the
+ * subscription router to the handlers the demos registered for its topic.
  *
  * @param[in] pContext The context defined by the application passed to MQTT library.
  * @param[in] pPacketInfo Pointer to the packet info structure containing details of MQTT packet.
@@ -174,16 +232,40 @@ static void eventCallback( MQTTContext_t * pContext,
                            MQTTDeserializedInfo_t * pDeserializedInfo );
 
 /**
- * @brief Callback indicating a publish has been successful.
- * Callback will be invoked by MQTT agent upon successfully publishing a message and a
- * PUBACK is received from the MQTT broker for the published message.
+ * @brief Keeps a publish which could not be sent in the offline store.
  *
- * @param[in] pOperation Pointer to the publish operation passed to the MQTT agent.
- * @param[in] The status of the MQTT operation.
+ * @param[in] pPublishInfo Publish to store.
+ * @return pdTRUE if the publish was stored.
+ */
+static BaseType_t storePublish( const MQTTPublishInfo_t * pPublishInfo );
+
+/**
+ * @brief Handles the completion of a publish enqueued by the hello world task.
+ * Stores the publish if it failed, and returns the operation to the agent pool.
  *
+ * @param[in] pCompletion Completion received from the completion queue.
+ * @param[in,out] pulSlotsInUse Bit mask of the payload slots in use, the slot of the publish is freed.
+ * @return pdTRUE if a failed publish was stored and the offline store should be drained.
  */
-static void publishCompleteCallback( struct MQTTOperation * pOperation,
-                                     MQTTStatus_t status );
+static BaseType_t handlePublishCompletion( const MQTTAgentCompletion_t * pCompletion,
+                                           uint32_t * pulSlotsInUse );
+
+/**
+ * @brief Callback invoked by the connection supervisor once the MQTT connection is established.
+ * Notifies the hello world task, which starts or resumes OTA and drains the offline store. When the
+ * broker did not resume the session, OTA subscribes to its topics again.
+ *
+ * @param[in] sessionPresent pdTRUE if the broker resumed the session.
+ * @param[in] isReconnection pdFALSE for the first connection.
+ */
+static void connectedCallback( BaseType_t sessionPresent,
+                               BaseType_t isReconnection );
+
+/**
+ * @brief Callback invoked by the connection supervisor once the MQTT connection is lost.
+ * Notifies the hello world task, which suspends OTA until the connection is back.
+ */
+static void disconnectedCallback( void );
 
 /**
  * @brief Vendor provided function to initializes the cryptographic module.
@@ -199,8 +281,7 @@ extern void printRegions( void );
 /**
  * @brief Static buffer used to receive an MQTT payload from broker.
  * The same buffer is used by all the tasks using a shared MQTT connection, to recieve the MQTT
- * payload. Hence it should be kept to the maximum expected MQTT payload size as required by all
- * applications.
+ * payload. Larger payloads are received through it in fragments, see MQTT_INCOMING_BUFFER_SIZE.
  */
 static uint8_t ucBuffer[ MQTT_INCOMING_BUFFER_SIZE ];
 
@@ -220,9 +301,9 @@ static const uint8_t ucMACAddress[ 6 ] = { 0xDE, 0xAD, 0x00, 0xBE, 0xEF, 0x01 };
 static uint32_t ulGlobalEntryTimeMs;
 
 /**
- * @brief Semaphore used to synchronize publish complete callback.
+ * @brief Handle of the hello world task, notified of the connection state changes.
  */
-static SemaphoreHandle_t xPublishCompleteSemaphore;
+static TaskHandle_t xHelloTask;
 
 
 /*******************************************************************************
@@ -254,7 +335,7 @@ int main( void )
 
     FreeRTOS_IPInit( ucIPAddress, ucNetMask, ucGatewayAddress, ucDNSServerAddress, ucMACAddress );
 
-    if( xTaskCreate( hello_task, "Hello_task", 2048, NULL, hello_task_PRIORITY | portPRIVILEGE_BIT, NULL ) !=
+    if( xTaskCreate( hello_task, "Hello_task", 2048, NULL, hello_task_PRIORITY | portPRIVILEGE_BIT, &xHelloTask ) !=
         pdPASS )
     {
         PRINTF( "Hello Task creation failed!.\n" );
@@ -293,6 +374,11 @@ static uint32_t getTimeStampMs( void )
     return ulTimeMs;
 }
 
+static uint32_t getTimeSeconds( void )
+{
+    return ( uint32_t ) ( xTaskGetTickCount() / configTICK_RATE_HZ );
+}
+
 static void eventCallback( MQTTContext_t * pContext,
                            MQTTPacketInfo_t * pPacketInfo,
                            MQTTDeserializedInfo_t * pDeserializedInfo )
@@ -301,20 +387,78 @@ static void eventCallback( MQTTContext_t * pContext,
 
     xResult = MQTTAgent_ProcessEvent( pContext, pPacketInfo, pDeserializedInfo );
 
-    #if ( OTA_UPDATE_ENABLED == 1 )
-        if( xResult == pdFALSE )
-        {
-            xResult = xOTAProcessMQTTEvent( pContext, pPacketInfo, pDeserializedInfo );
-        }
-    #endif
+    /* Handle incoming publish. The lower 4 bits of the publish packet
+     * type is used for the dup, QoS, and retain flags. Hence masking
+     * out the lower bits to check if the packet is publish. */
+    if( ( xResult == pdFALSE ) &&
+        ( ( pPacketInfo->type & 0xF0U ) == MQTT_PACKET_TYPE_PUBLISH ) &&
+        ( pDeserializedInfo->pPublishInfo != NULL ) )
+    {
+        /* Dispatch to the handlers registered by the demos, such as OTA, for the topic. */
+        xResult = MQTTRouter_Dispatch( pDeserializedInfo->pPublishInfo );
+    }
+}
+
+static BaseType_t storePublish( const MQTTPublishInfo_t * pPublishInfo )
+{
+    BaseType_t xStored = pdFALSE;
+
+    if( MQTTOfflineStore_Append( pPublishInfo ) == MQTTOfflineStoreSuccess )
+    {
+        /* Sent again with the next drain. */
+        PRINTF( "Stored helloworld.\r\n" );
+        xStored = pdTRUE;
+    }
+    else
+    {
+        PRINTF( "Dropped helloworld.\r\n" );
+    }
+
+    return xStored;
+}
+
+static BaseType_t handlePublishCompletion( const MQTTAgentCompletion_t * pCompletion,
+                                           uint32_t * pulSlotsInUse )
+{
+    BaseType_t xStored = pdFALSE;
+    uint32_t ulSlot = ( uint32_t ) ( uintptr_t ) pCompletion->pUserContext;
+
+    if( pCompletion->status == MQTTSuccess )
+    {
+        PRINTF( "Published helloworld.\r\n" );
+    }
+    else
+    {
+        /* The pooled publish information and the payload slot are still valid until released. */
+        xStored = storePublish( pCompletion->pOperation->info.pPublishInfo );
+    }
+
+    *pulSlotsInUse &= ~( 1UL << ulSlot );
+    MQTTAgent_ReleaseOperation( pCompletion->pOperation );
+
+    return xStored;
+}
+
+static void connectedCallback( BaseType_t sessionPresent,
+                               BaseType_t isReconnection )
+{
+    uint32_t ulEvents = HELLO_EVENT_CONNECTED;
 
-    /* Process any application callback here. */
+    PRINTF( "MQTT connected, session present %d.\r\n", ( int ) sessionPresent );
+
+    /* The persistent session expired on the broker, or the broker lost it. */
+    if( ( isReconnection == pdTRUE ) && ( sessionPresent == pdFALSE ) )
+    {
+        ulEvents |= HELLO_EVENT_SESSION_LOST;
+    }
+
+    ( void ) xTaskNotify( xHelloTask, ulEvents, eSetBits );
 }
 
-static void publishCompleteCallback( struct MQTTOperation * pOperation,
-                                     MQTTStatus_t status )
+static void disconnectedCallback( void )
 {
-    xSemaphoreGive( xPublishCompleteSemaphore );
+    PRINTF( "MQTT connection lost.\r\n" );
+    ( void ) xTaskNotify( xHelloTask, HELLO_EVENT_DISCONNECTED, eSetBits );
 }
 
 static void hello_task( void * pvParameters )
@@ -323,17 +467,14 @@ static void hello_task( void * pvParameters )
     TransportInterface_t xTransport = { 0 };
     MQTTFixedBuffer_t xFixedBuffer = { 0 };
     MQTTPublishInfo_t xPublishInfo = { 0 };
-    MQTTOperation_t xPublishOperation = { 0 };
-    bool bSessionPresent = true;
+    MQTTOperation_t * pxPublishOperation;
     MQTTConnectInfo_t xMQTTConnectInfo = { 0 };
     MQTTStatus_t xMQTTStatus = MQTTSuccess;
 
 
     NetworkCredentials_t xNetworkCredentials = { 0 };
-    TlsTransportStatus_t xTransportStatus = TLS_TRANSPORT_SUCCESS;
     NetworkContext_t xNetworkContext = { 0 };
-
-    HeapStats_t xHeapStats;
+    MQTTSupervisorConfig_t xSupervisorConfig = { 0 };
 
 
     CK_ULONG ulTemp = 0;
@@ -343,12 +484,40 @@ static void hello_task( void * pvParameters )
     CK_RV xPKCS11Result = CKR_OK;
 
     int32_t lCounter = 0;
-    char cPayload[ 32 ] = { 0 };
+    char cPayload[ democonfigPUBLISH_PAYLOAD_SIZE ] = { 0 };
+    char cPayloadSlots[ democonfigMAX_OUTSTANDING_PUBLISHES ][ democonfigPUBLISH_PAYLOAD_SIZE ];
+    uint32_t ulSlotsInUse = 0U;
+    uint32_t ulSlot;
     size_t xPayloadLength;
+    QueueHandle_t xCompletionQueue;
+    MQTTAgentCompletionTarget_t xCompletionTarget = { 0 };
+    MQTTAgentCompletion_t xCompletion;
+    TimeOut_t xTimeOut;
+    TickType_t xTicksToWait;
 
     BaseType_t xStatus;
+    MQTTAgentStatus_t xAgentStatus;
+    MQTTOfflineStoreConfig_t xOfflineStoreConfig = { 0 };
+    uint32_t ulEvents;
+    BaseType_t xDrainPending = pdTRUE;
+
+    #if ( OTA_UPDATE_ENABLED == 1 )
+        BaseType_t xOTAStarted = pdFALSE;
+    #endif
 
 
+    #if ( MQTT_ROUTER_BENCHMARK_ENABLED == 1 )
+        /* Runs before any route is registered as the benchmark resets the router. */
+        vMQTTRouterRunBenchmark();
+    #endif
+
+    /* Recover the publishes which could not be sent before the last reset. The flash driver is
+     * initialized by the PKCS #11 layer during provisioning. */
+    xOfflineStoreConfig.dropPolicy = MQTTOfflineStoreDropOldest;
+    xOfflineStoreConfig.retentionSeconds = democonfigOFFLINE_STORE_RETENTION_SECONDS;
+    xOfflineStoreConfig.getTime = getTimeSeconds;
+    xStatus = MQTTOfflineStore_Init( &xOfflineStoreConfig );
+    configASSERT( xStatus == pdTRUE );
 
     xNetworkCredentials.pRootCa = ( const unsigned char * ) democonfigROOT_CA_PEM;
     xNetworkCredentials.rootCaSize = sizeof( democonfigROOT_CA_PEM );
@@ -357,12 +526,6 @@ static void hello_task( void * pvParameters )
     /* Clear context. */
     memset( ( void * ) &xMQTTContext, 0x00, sizeof( MQTTContext_t ) );
 
-    while( FreeRTOS_IsNetworkUp() == pdFALSE )
-    {
-        PRINTF( "No Network yet\r\n" );
-        vTaskDelay( pdMS_TO_TICKS( 500 ) );
-    }
-
     /* Set transport interface members. */
     xTransport.pNetworkContext = &xNetworkContext;
     xTransport.send = TLS_FreeRTOS_send;
@@ -386,8 +549,9 @@ static void hello_task( void * pvParameters )
 
         xMQTTConnectInfo.clientIdentifierLength = ulThingNameLength;
 
-        /* True for creating a new session with broker, false if we want to resume an old one. */
-        xMQTTConnectInfo.cleanSession = true;
+        /* Resume the session on reconnection, so that the broker keeps the subscriptions and the
+         * unacknowledged QoS1 publishes can be sent again with the same packet identifiers. */
+        xMQTTConnectInfo.cleanSession = false;
 
         /* The following fields are optional. */
         /* Value for keep alive. */
@@ -399,86 +563,150 @@ static void hello_task( void * pvParameters )
         xMQTTConnectInfo.pPassword = "";
         xMQTTConnectInfo.passwordLength = strlen( xMQTTConnectInfo.pPassword );
 
-        FreeRTOS_debug_printf( ( "Attempting a connection\n" ) );
-        xTransportStatus = TLS_FreeRTOS_Connect( xMQTTContext.transportInterface.pNetworkContext, pcEndpoint, 8883, &xNetworkCredentials, 4000, 36000 );
-
-        if( TLS_TRANSPORT_SUCCESS == xTransportStatus )
+        /* Publishes complete asynchronously through this queue, so that the task does not wait for
+         * each one before producing the next. */
+        xCompletionQueue = xQueueCreate( democonfigMAX_OUTSTANDING_PUBLISHES, sizeof( MQTTAgentCompletion_t ) );
+        configASSERT( xCompletionQueue != NULL );
+        xCompletionTarget.completionQueue = xCompletionQueue;
+
+        /* The supervisor connects, starts the MQTT agent and reconnects whenever the connection is
+         * lost. The configuration lives on the stack of this task, which never returns. */
+        xSupervisorConfig.pMQTTContext = &xMQTTContext;
+        xSupervisorConfig.pHostName = pcEndpoint;
+        xSupervisorConfig.port = 8883;
+        xSupervisorConfig.pNetworkCredentials = &xNetworkCredentials;
+        xSupervisorConfig.pConnectInfo = &xMQTTConnectInfo;
+        xSupervisorConfig.connectedCallback = connectedCallback;
+        xSupervisorConfig.disconnectedCallback = disconnectedCallback;
+
+        xStatus = MQTTSupervisor_Start( &xSupervisorConfig );
+        configASSERT( xStatus == pdTRUE );
+
+        for( ; ; )
         {
-            /* Send the connect packet. Use 100 ms as the timeout to wait for the CONNACK packet. */
-            xMQTTStatus = MQTT_Connect( &xMQTTContext, &xMQTTConnectInfo, NULL, 100, &bSessionPresent );
+            ulEvents = 0U;
+            ( void ) xTaskNotifyWait( 0U, UINT32_MAX, &ulEvents, 0U );
 
-            TLS_FreeRTOS_SetRecvTimeout( xMQTTContext.transportInterface.pNetworkContext, 500 );
+            #if ( OTA_UPDATE_ENABLED == 1 )
+                if( ( ( ulEvents & HELLO_EVENT_DISCONNECTED ) != 0U ) && ( xOTAStarted == pdTRUE ) )
+                {
+                    ( void ) xSuspendOTAUpdate();
+                }
+            #endif
 
-            if( xMQTTStatus == MQTTSuccess )
+            if( ( ulEvents & HELLO_EVENT_CONNECTED ) != 0U )
             {
-                xStatus = MQTTAgent_Init( &xMQTTContext );
-                configASSERT( xStatus == pdTRUE );
-
-                xPublishCompleteSemaphore = xSemaphoreCreateBinary();
-                configASSERT( xPublishCompleteSemaphore != NULL );
-
                 #if ( OTA_UPDATE_ENABLED == 1 )
-                    xStatus = xStartOTAUpdateDemo();
-                    configASSERT( xStatus == pdTRUE );
+                    if( xOTAStarted == pdFALSE )
+                    {
+                        #if ( OTA_HTTP_BENCHMARK_ENABLED == 1 )
+                            /* Runs before the OTA agent, so that an OTA download does not share the link. */
+                            vOTAHttpRunBenchmark();
+                        #endif
+
+                        /* Files downloaded over HTTP come from the pre-signed S3 URL of the job,
+                         * verified with the same root CA as the broker. */
+                        xStatus = xStartOTAUpdateDemo( &xNetworkCredentials );
+                        configASSERT( xStatus == pdTRUE );
+                        xOTAStarted = pdTRUE;
+                    }
+                    else
+                    {
+                        /* Without the session, the broker does not send the job notifications anymore. */
+                        if( ( ulEvents & HELLO_EVENT_SESSION_LOST ) != 0U )
+                        {
+                            if( xResubscribeOTAUpdate() != pdTRUE )
+                            {
+                                PRINTF( "Failed to subscribe again to the OTA topics.\r\n" );
+                            }
+                        }
+
+                        ( void ) xResumeOTAUpdate();
+                    }
                 #endif
 
-                for( ; ; )
-                {
-                    xPayloadLength = snprintf( cPayload, sizeof( cPayload ), "Hello %ld", lCounter++ );
+                xDrainPending = pdTRUE;
+            }
 
-                    /* Since we requested a clean session, this must be false */
-                    assert( bSessionPresent == false );
+            /* Publish what was stored while the device was offline. */
+            if( ( xDrainPending == pdTRUE ) && ( MQTTAgent_IsConnected() == pdTRUE ) )
+            {
+                if( MQTTOfflineStore_Drain() == pdTRUE )
+                {
+                    xDrainPending = pdFALSE;
+                }
+                else
+                {
+                    PRINTF( "Offline store not fully drained.\r\n" );
+                }
+            }
 
-                    /* Do something with the connection. Publish some data. */
-                    xPublishInfo.qos = MQTTQoS0;
-                    xPublishInfo.dup = false;
-                    xPublishInfo.retain = false;
-                    xPublishInfo.pTopicName = "Test/Hello";
-                    xPublishInfo.topicNameLength = 10;
-                    xPublishInfo.pPayload = cPayload;
-                    xPublishInfo.payloadLength = xPayloadLength;
+            xPayloadLength = snprintf( cPayload, sizeof( cPayload ), "Hello %ld", lCounter++ );
 
-                    xPublishOperation.type = MQTT_OP_PUBLISH;
-                    xPublishOperation.info.pPublishInfo = &xPublishInfo;
-                    xPublishOperation.callback = publishCompleteCallback;
+            /* Do something with the connection. Publish some data. */
+            xPublishInfo.qos = MQTTQoS0;
+            xPublishInfo.dup = false;
+            xPublishInfo.retain = false;
+            xPublishInfo.pTopicName = "Test/Hello";
+            xPublishInfo.topicNameLength = 10;
+            xPublishInfo.pPayload = cPayload;
+            xPublishInfo.payloadLength = xPayloadLength;
 
-                    MQTTAgent_Enqueue( &xPublishOperation, portMAX_DELAY );
+            /* While disconnected, or when too many publishes are outstanding, the publish goes
+             * straight to the offline store. */
+            xAgentStatus = MQTTAgentQueueFull;
+            pxPublishOperation = NULL;
 
-                    xSemaphoreTake( xPublishCompleteSemaphore, portMAX_DELAY );
+            for( ulSlot = 0U; ulSlot < democonfigMAX_OUTSTANDING_PUBLISHES; ulSlot++ )
+            {
+                if( ( ulSlotsInUse & ( 1UL << ulSlot ) ) == 0U )
+                {
+                    break;
+                }
+            }
 
-                    PRINTF( "Published helloworld.\r\n" );
+            if( ( MQTTAgent_IsConnected() == pdTRUE ) && ( ulSlot < democonfigMAX_OUTSTANDING_PUBLISHES ) )
+            {
+                xCompletionTarget.pUserContext = ( void * ) ( uintptr_t ) ulSlot;
+                pxPublishOperation = MQTTAgent_AllocateOperation( &xCompletionTarget, 0U );
+            }
 
-                    vTaskDelay( pdMS_TO_TICKS( 5000 ) );
-                }
+            if( pxPublishOperation != NULL )
+            {
+                /* The payload must stay valid until the publish completes. */
+                memcpy( cPayloadSlots[ ulSlot ], cPayload, xPayloadLength );
+                *( pxPublishOperation->info.pPublishInfo ) = xPublishInfo;
+                pxPublishOperation->info.pPublishInfo->pPayload = cPayloadSlots[ ulSlot ];
 
-                vPortGetHeapStats( &xHeapStats );
-                FreeRTOS_debug_printf( ( "Available heap space              %d\n", xHeapStats.xAvailableHeapSpaceInBytes ) );
-                FreeRTOS_debug_printf( ( "Largest Free Block                %d\n", xHeapStats.xSizeOfLargestFreeBlockInBytes ) );
-                FreeRTOS_debug_printf( ( "Smallest Free Block               %d\n", xHeapStats.xSizeOfSmallestFreeBlockInBytes ) );
-                FreeRTOS_debug_printf( ( "Number of Free Blocks             %d\n", xHeapStats.xNumberOfFreeBlocks ) );
-                FreeRTOS_debug_printf( ( "Minimum Ever Free Bytes Remaining %d\n", xHeapStats.xMinimumEverFreeBytesRemaining ) );
-                FreeRTOS_debug_printf( ( "Number of Successful Allocations  %d\n", xHeapStats.xNumberOfSuccessfulAllocations ) );
-                FreeRTOS_debug_printf( ( "Number of Successful Frees        %d\n", xHeapStats.xNumberOfSuccessfulFrees ) );
+                xAgentStatus = MQTTAgent_Enqueue( pxPublishOperation, pdMS_TO_TICKS( democonfigPUBLISH_ENQUEUE_TIMEOUT_MS ) );
 
+                if( xAgentStatus == MQTTAgentSuccess )
+                {
+                    ulSlotsInUse |= ( 1UL << ulSlot );
+                }
+                else
+                {
+                    MQTTAgent_ReleaseOperation( pxPublishOperation );
+                }
+            }
 
-                /* Disconnect */
-                MQTT_Disconnect( &xMQTTContext );
+            if( ( xAgentStatus != MQTTAgentSuccess ) && ( storePublish( &xPublishInfo ) == pdTRUE ) )
+            {
+                xDrainPending = pdTRUE;
             }
 
-            TLS_FreeRTOS_Disconnect( xMQTTContext.transportInterface.pNetworkContext );
-        }
+            /* Collect the completions of the outstanding publishes until the next one is due. */
+            vTaskSetTimeOutState( &xTimeOut );
+            xTicksToWait = pdMS_TO_TICKS( democonfigPUBLISH_INTERVAL_MS );
 
-        else if( TLS_TRANSPORT_INVALID_PARAMETER == xTransportStatus )
-        {
-            FreeRTOS_debug_printf( ( "Error Connecting to server : bad parameter\n" ) );
-        }
-        else if( TLS_TRANSPORT_CONNECT_FAILURE == xTransportStatus )
-        {
-            FreeRTOS_debug_printf( ( "Error Connecting to server : connect failure\n" ) );
-        }
-        else
-        {
-            FreeRTOS_debug_printf( ( "Error Connecting to server : unknown\n" ) );
+            while( xTaskCheckForTimeOut( &xTimeOut, &xTicksToWait ) == pdFALSE )
+            {
+                if( ( xQueueReceive( xCompletionQueue, &xCompletion, xTicksToWait ) == pdTRUE ) &&
+                    ( handlePublishCompletion( &xCompletion, &ulSlotsInUse ) == pdTRUE ) )
+                {
+                    xDrainPending = pdTRUE;
+                }
+            }
         }
     }
 
@@ -528,6 +756,11 @@ void vApplicationIPNetworkEventHook( eIPCallbackEvent_t eNetworkEvent )
         FreeRTOS_inet_ntoa( ulDNSServerAddress, cBuffer );
         PRINTF( "DNS Server Address: %s\r\n\r\n\r\n", cBuffer );
     }
+    else if( eNetworkEvent == eNetworkDown )
+    {
+        /* Drop the MQTT connection now rather than when the keep alive times out. */
+        MQTTSupervisor_NotifyNetworkDown();
+    }
 }
 
 /**
@@ -544,7 +777,6 @@ uint32_t uxRand( void )
     CK_BYTE ulBytes[ sizeof( uint32_t ) ] = { 0 };
     uint32_t ulNumber = 0;
     uint32_t i = 0;
-    BaseType_t xReturn = pdFALSE;
 
     if( xSession == CK_INVALID_HANDLE )
     {
@@ -569,16 +801,11 @@ uint32_t uxRand( void )
     {
         for( i = 0; i < sizeof( uint32_t ); i++ )
         {
-            ulNumber = ( ulNumber | ( ulBytes[ i ] ) ) << i;
+            ulNumber = ( ulNumber << 8 ) | ulBytes[ i ];
         }
     }
 
-    if( xResult == CKR_OK )
-    {
-        xReturn = pdTRUE;
-    }
-
-    return xReturn;
+    return ulNumber;
 }
 
 
@@ -0,0 +1,334 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Implementation of the MQTT connection supervisor.
+ * The supervisor task blocks on its task notification while connected. The agent notifies it through
+ * the connection lost callback when it detects an error on the connection or a keep alive timeout, and
+ * the network event hook notifies it when the network goes down, in which case the agent is suspended
+ * first so that it stops using the connection. The first connection attempt after a loss is immediate;
+ * the following ones are spaced with RetryUtils_DecorrelatedBackoffAndSleep().
+ */
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "fsl_debug_console.h"
+
+#include "FreeRTOS_IP.h"
+
+#include "retry_utils.h"
+
+#include "core_mqtt_agent.h"
+#include "mqtt_connection_supervisor.h"
+
+/**
+ * @brief Task priority of the supervisor, below the agent so that the agent completes its work on a
+ * lost connection before the supervisor reconnects.
+ */
+#define MQTT_SUPERVISOR_TASK_PRIORITY            ( configMAX_PRIORITIES - 2 )
+
+/**
+ * @brief Stack size of the supervisor, enough for the TLS handshake.
+ */
+#define MQTT_SUPERVISOR_TASK_STACK_SIZE          ( 2048 )
+
+/**
+ * @brief Receive timeout of the TLS connection during the handshake.
+ */
+#define MQTT_SUPERVISOR_TLS_RECV_TIMEOUT_MS      ( 4000U )
+
+/**
+ * @brief Send timeout of the TLS connection.
+ */
+#define MQTT_SUPERVISOR_TLS_SEND_TIMEOUT_MS      ( 36000U )
+
+/**
+ * @brief Receive timeout of the TLS connection once connected.
+ */
+#define MQTT_SUPERVISOR_RECV_TIMEOUT_MS          ( 500U )
+
+/**
+ * @brief Delay between two checks of the network state while the network is down.
+ */
+#define MQTT_SUPERVISOR_NETWORK_POLL_MS          ( 100U )
+
+/**
+ * @brief Notification bit set by the agent when it stopped using the connection.
+ */
+#define MQTT_SUPERVISOR_EVENT_CONNECTION_LOST    ( 1UL << 0 )
+
+/**
+ * @brief Notification bit set when the network went down.
+ */
+#define MQTT_SUPERVISOR_EVENT_NETWORK_DOWN       ( 1UL << 1 )
+
+/**
+ * @brief Establishes the TLS connection and the MQTT connection.
+ *
+ * @param[out] pSessionPresent Set to pdTRUE if the broker resumed the session.
+ * @return pdTRUE if connected.
+ */
+static BaseType_t prvConnect( BaseType_t * pSessionPresent );
+
+/**
+ * @brief Connects, waiting for the network and backing off between failed attempts.
+ *
+ * @param[out] pSessionPresent Set to pdTRUE if the broker resumed the session.
+ */
+static void prvConnectWithBackoff( BaseType_t * pSessionPresent );
+
+/**
+ * @brief Connection lost callback registered with the agent.
+ *
+ * @param[in] status Error which caused the loss of the connection.
+ */
+static void prvConnectionLostCallback( MQTTStatus_t status );
+
+/**
+ * @brief Supervisor task.
+ *
+ * @param[in] pParams Unused.
+ */
+static void prvSupervisorTask( void * pParams );
+
+/**
+ * @brief Configuration of the supervisor.
+ */
+static const MQTTSupervisorConfig_t * pSupervisorConfig = NULL;
+
+/**
+ * @brief Handle of the supervisor task, notified on connection loss.
+ */
+static TaskHandle_t xSupervisorTask = NULL;
+
+/**
+ * @brief Statistics of the supervisor.
+ */
+static MQTTSupervisorStats_t supervisorStats = { 0 };
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvConnect( BaseType_t * pSessionPresent )
+{
+    BaseType_t result = pdFALSE;
+    TlsTransportStatus_t xTransportStatus;
+    MQTTStatus_t xMQTTStatus;
+    MQTTContext_t * pMQTTContext = pSupervisorConfig->pMQTTContext;
+    bool sessionPresent = false;
+
+    xTransportStatus = TLS_FreeRTOS_Connect( pMQTTContext->transportInterface.pNetworkContext,
+                                             pSupervisorConfig->pHostName,
+                                             pSupervisorConfig->port,
+                                             pSupervisorConfig->pNetworkCredentials,
+                                             MQTT_SUPERVISOR_TLS_RECV_TIMEOUT_MS,
+                                             MQTT_SUPERVISOR_TLS_SEND_TIMEOUT_MS );
+
+    if( xTransportStatus == TLS_TRANSPORT_SUCCESS )
+    {
+        xMQTTStatus = MQTT_Connect( pMQTTContext,
+                                    pSupervisorConfig->pConnectInfo,
+                                    NULL,
+                                    MQTT_SUPERVISOR_CONNACK_TIMEOUT_MS,
+                                    &sessionPresent );
+
+        if( xMQTTStatus == MQTTSuccess )
+        {
+            TLS_FreeRTOS_SetRecvTimeout( pMQTTContext->transportInterface.pNetworkContext,
+                                         MQTT_SUPERVISOR_RECV_TIMEOUT_MS );
+            *pSessionPresent = ( sessionPresent == true ) ? pdTRUE : pdFALSE;
+            result = pdTRUE;
+        }
+        else
+        {
+            PRINTF( "MQTT connection failed, status = %d.\r\n", xMQTTStatus );
+            TLS_FreeRTOS_Disconnect( pMQTTContext->transportInterface.pNetworkContext );
+        }
+    }
+    else
+    {
+        PRINTF( "TLS connection failed, status = %d.\r\n", xTransportStatus );
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvConnectWithBackoff( BaseType_t * pSessionPresent )
+{
+    RetryUtilsJitterParams_t xRetryParams = { 0 };
+    uint32_t ulBackoffMs = 0U;
+
+    xRetryParams.maxRetryAttempts = 0U;
+    xRetryParams.baseBackoffMs = MQTT_SUPERVISOR_BASE_BACKOFF_MS;
+    xRetryParams.maxBackoffMs = MQTT_SUPERVISOR_MAX_BACKOFF_MS;
+    RetryUtils_JitterParamsReset( &xRetryParams );
+
+    for( ; ; )
+    {
+        while( FreeRTOS_IsNetworkUp() == pdFALSE )
+        {
+            vTaskDelay( pdMS_TO_TICKS( MQTT_SUPERVISOR_NETWORK_POLL_MS ) );
+        }
+
+        supervisorStats.connectAttempts++;
+
+        if( prvConnect( pSessionPresent ) == pdTRUE )
+        {
+            break;
+        }
+
+        /* Retries forever, maxRetryAttempts is 0. */
+        ( void ) RetryUtils_DecorrelatedBackoffAndSleep( &xRetryParams, &ulBackoffMs );
+        PRINTF( "Connection retry after %u ms.\r\n", ( unsigned int ) ulBackoffMs );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvConnectionLostCallback( MQTTStatus_t status )
+{
+    ( void ) status;
+
+    ( void ) xTaskNotify( xSupervisorTask, MQTT_SUPERVISOR_EVENT_CONNECTION_LOST, eSetBits );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvSupervisorTask( void * pParams )
+{
+    BaseType_t xSessionPresent = pdFALSE;
+    BaseType_t xIsReconnection = pdFALSE;
+    BaseType_t xResult;
+    TickType_t xLostTicks = 0U;
+    uint32_t ulEvents = 0U;
+
+    ( void ) pParams;
+
+    for( ; ; )
+    {
+        prvConnectWithBackoff( &xSessionPresent );
+
+        /* Network events received while connecting are stale. */
+        ( void ) xTaskNotifyWait( 0U, UINT32_MAX, NULL, 0U );
+
+        if( xIsReconnection == pdFALSE )
+        {
+            xResult = MQTTAgent_Init( pSupervisorConfig->pMQTTContext, prvConnectionLostCallback );
+            configASSERT( xResult == pdTRUE );
+        }
+        else
+        {
+            supervisorStats.reconnections++;
+            supervisorStats.resumedSessions += ( xSessionPresent == pdTRUE ) ? 1U : 0U;
+            supervisorStats.lastReconnectMs = ( uint32_t ) ( ( xTaskGetTickCount() - xLostTicks ) * portTICK_PERIOD_MS );
+
+            PRINTF( "Reconnected in %u ms, session present = %d.\r\n",
+                    ( unsigned int ) supervisorStats.lastReconnectMs,
+                    ( int ) xSessionPresent );
+
+            MQTTAgent_Resume( xSessionPresent );
+        }
+
+        if( pSupervisorConfig->connectedCallback != NULL )
+        {
+            pSupervisorConfig->connectedCallback( xSessionPresent, xIsReconnection );
+        }
+
+        xIsReconnection = pdTRUE;
+
+        /* Wait for the agent to stop using the connection. A network down event only suspends the
+         * agent, which reports the loss once done. */
+        do
+        {
+            ( void ) xTaskNotifyWait( 0U, UINT32_MAX, &ulEvents, portMAX_DELAY );
+
+            if( ( ulEvents & MQTT_SUPERVISOR_EVENT_NETWORK_DOWN ) != 0U )
+            {
+                MQTTAgent_Suspend();
+            }
+        } while( ( ulEvents & MQTT_SUPERVISOR_EVENT_CONNECTION_LOST ) == 0U );
+
+        xLostTicks = xTaskGetTickCount();
+
+        if( pSupervisorConfig->disconnectedCallback != NULL )
+        {
+            pSupervisorConfig->disconnectedCallback();
+        }
+
+        TLS_FreeRTOS_Disconnect( pSupervisorConfig->pMQTTContext->transportInterface.pNetworkContext );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t MQTTSupervisor_Start( const MQTTSupervisorConfig_t * pConfig )
+{
+    BaseType_t result = pdFALSE;
+
+    if( ( pConfig != NULL ) && ( pConfig->pMQTTContext != NULL ) && ( xSupervisorTask == NULL ) )
+    {
+        if( pConfig->pConnectInfo->cleanSession == true )
+        {
+            PRINTF( "MQTT supervisor: clean session requested, subscriptions will not survive a reconnection.\r\n" );
+        }
+
+        pSupervisorConfig = pConfig;
+
+        if( ( result = xTaskCreate( prvSupervisorTask,
+                                    "MQTT_Supervisor",
+                                    MQTT_SUPERVISOR_TASK_STACK_SIZE,
+                                    NULL,
+                                    MQTT_SUPERVISOR_TASK_PRIORITY | portPRIVILEGE_BIT,
+                                    &xSupervisorTask ) ) != pdTRUE )
+        {
+            PRINTF( "Failed to create MQTT supervisor task.\r\n" );
+        }
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+void MQTTSupervisor_NotifyNetworkDown( void )
+{
+    if( xSupervisorTask != NULL )
+    {
+        ( void ) xTaskNotify( xSupervisorTask, MQTT_SUPERVISOR_EVENT_NETWORK_DOWN, eSetBits );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void MQTTSupervisor_GetStats( MQTTSupervisorStats_t * pStats )
+{
+    taskENTER_CRITICAL();
+    {
+        *pStats = supervisorStats;
+    }
+    taskEXIT_CRITICAL();
+}
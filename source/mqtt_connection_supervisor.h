@@ -0,0 +1,133 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Header file containing the MQTT connection supervisor APIs.
+ * The supervisor task owns the TLS and MQTT connection of an MQTT context. It connects, starts the
+ * MQTT agent on the first connection, and reconnects whenever the agent reports the connection lost
+ * or the network goes down, backing off with millisecond decorrelated jitter between attempts.
+ * Connections are made with cleanSession set to false so that the broker keeps the subscriptions,
+ * and the agent replays the QoS1 publishes which were not acknowledged before the loss. When the
+ * persistent session expired on the broker, the connected callback reports that the session is not
+ * present and the application subscribes again.
+ */
+
+#ifndef MQTT_CONNECTION_SUPERVISOR_H
+#define MQTT_CONNECTION_SUPERVISOR_H
+
+/* FreeRTOS include. */
+#include "FreeRTOS.h"
+
+/* MQTT library include */
+#include "core_mqtt.h"
+
+/* Transport include. */
+#include "tls_freertos_pkcs11.h"
+
+/**
+ * @brief Smallest delay in milliseconds between two connection attempts.
+ */
+#ifndef MQTT_SUPERVISOR_BASE_BACKOFF_MS
+    #define MQTT_SUPERVISOR_BASE_BACKOFF_MS    ( 200U )
+#endif
+
+/**
+ * @brief Largest delay in milliseconds between two connection attempts.
+ */
+#ifndef MQTT_SUPERVISOR_MAX_BACKOFF_MS
+    #define MQTT_SUPERVISOR_MAX_BACKOFF_MS    ( 30000U )
+#endif
+
+/**
+ * @brief Time to wait for the CONNACK packet.
+ */
+#ifndef MQTT_SUPERVISOR_CONNACK_TIMEOUT_MS
+    #define MQTT_SUPERVISOR_CONNACK_TIMEOUT_MS    ( 1000U )
+#endif
+
+/**
+ * @brief Callback invoked by the supervisor task once the MQTT connection is established and the agent
+ * uses it. Runs in the supervisor task and should not block for long.
+ *
+ * @param[in] sessionPresent pdTRUE if the broker resumed the session, with its subscriptions. pdFALSE
+ * on a reconnection means the subscriptions are gone and must be made again.
+ * @param[in] isReconnection pdFALSE for the first connection.
+ */
+typedef void ( * MQTTSupervisorConnectedCallback_t ) ( BaseType_t sessionPresent,
+                                                       BaseType_t isReconnection );
+
+/**
+ * @brief Callback invoked by the supervisor task once the agent stopped using a lost connection.
+ * Runs in the supervisor task and should not block for long.
+ */
+typedef void ( * MQTTSupervisorDisconnectedCallback_t ) ( void );
+
+/**
+ * @brief Configuration of the supervisor, referenced for the lifetime of the supervisor task.
+ */
+typedef struct MQTTSupervisorConfig
+{
+    MQTTContext_t * pMQTTContext;                      /**< Context initialized with MQTT_Init() over the TLS transport. */
+    const char * pHostName;                            /**< Broker endpoint. */
+    uint16_t port;                                     /**< Broker port. */
+    const NetworkCredentials_t * pNetworkCredentials;  /**< Credentials of the TLS connection. */
+    const MQTTConnectInfo_t * pConnectInfo;            /**< Connect information, cleanSession should be false. */
+    MQTTSupervisorConnectedCallback_t connectedCallback;       /**< Optional, invoked on every connection. */
+    MQTTSupervisorDisconnectedCallback_t disconnectedCallback; /**< Optional, invoked on every connection loss. */
+} MQTTSupervisorConfig_t;
+
+/**
+ * @brief Statistics of the supervisor.
+ */
+typedef struct MQTTSupervisorStats
+{
+    uint32_t connectAttempts; /**< TLS and MQTT connection attempts, successful or not. */
+    uint32_t reconnections;   /**< Connections established after a connection loss. */
+    uint32_t resumedSessions; /**< Reconnections for which the broker resumed the session. */
+    uint32_t lastReconnectMs; /**< Time from the last connection loss to the CONNACK of the new connection. */
+} MQTTSupervisorStats_t;
+
+/**
+ * @brief Creates the supervisor task, which connects and starts the MQTT agent.
+ *
+ * @param[in] pConfig Configuration of the supervisor, must stay valid.
+ * @return pdTRUE if the supervisor task was created.
+ */
+BaseType_t MQTTSupervisor_Start( const MQTTSupervisorConfig_t * pConfig );
+
+/**
+ * @brief Tells the supervisor that the network went down, so that the connection is dropped without
+ * waiting for the keep alive to time out. Can be called from the network event hook.
+ */
+void MQTTSupervisor_NotifyNetworkDown( void );
+
+/**
+ * @brief Gets a snapshot of the supervisor statistics.
+ *
+ * @param[out] pStats Structure filled with the statistics.
+ */
+void MQTTSupervisor_GetStats( MQTTSupervisorStats_t * pStats );
+
+#endif /* ifndef MQTT_CONNECTION_SUPERVISOR_H */
@@ -0,0 +1,874 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Implementation of the MQTT offline store.
+ * Each sector of the region starts with a header holding a magic and a sequence number which grows by
+ * one every time a sector is opened, so that the oldest (tail) and newest (head) sectors of the log are
+ * found after a reset by scanning the sector headers. Records follow the sector header and never span
+ * two sectors. A record is written in three steps: its header, its topic and payload, and finally its
+ * commit word; a record without commit word was interrupted by a reset and is skipped. A record is
+ * removed by programming its consumed word to zero, which only clears bits and needs no erase.
+ * Stored records are read in place through the memory mapped flash, and published from there.
+ */
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+
+#include "fsl_debug_console.h"
+
+#include "mflash_drv.h"
+
+#include "core_mqtt_agent.h"
+#include "mqtt_offline_store.h"
+
+/**
+ * @brief Number of sectors of the store region.
+ */
+#define OFFLINE_STORE_NUM_SECTORS            ( MQTT_OFFLINE_STORE_SIZE / MFLASH_SECTOR_SIZE )
+
+#if ( ( MQTT_OFFLINE_STORE_BASE_ADDR % MFLASH_SECTOR_SIZE ) != 0 ) || ( ( MQTT_OFFLINE_STORE_SIZE % MFLASH_SECTOR_SIZE ) != 0 )
+    #error "MQTT_OFFLINE_STORE_BASE_ADDR and MQTT_OFFLINE_STORE_SIZE must be aligned to MFLASH_SECTOR_SIZE."
+#endif
+
+#if ( MQTT_OFFLINE_STORE_SIZE < ( 2 * MFLASH_SECTOR_SIZE ) )
+    #error "MQTT_OFFLINE_STORE_SIZE must be at least two sectors."
+#endif
+
+/**
+ * @brief Magic at the start of every sector in use by the store.
+ */
+#define OFFLINE_STORE_SECTOR_MAGIC           ( 0x4F464653U )
+
+/**
+ * @brief Value of the commit word of a completely written record.
+ */
+#define OFFLINE_STORE_RECORD_COMMITTED       ( 0x5AA5C33CU )
+
+/**
+ * @brief Value of an erased flash word.
+ */
+#define OFFLINE_STORE_ERASED_WORD            ( 0xFFFFFFFFU )
+
+/**
+ * @brief Topic length read from an erased record header, marking the end of the records of a sector.
+ */
+#define OFFLINE_STORE_ERASED_LENGTH          ( 0xFFFFU )
+
+/**
+ * @brief Time in milliseconds the drain waits for room in the agent queue.
+ */
+#define OFFLINE_STORE_ENQUEUE_TIMEOUT_MS     ( 100U )
+
+/**
+ * @brief Delay in milliseconds before the drain retries a publish rejected by the agent.
+ */
+#define OFFLINE_STORE_RETRY_DELAY_MS         ( 50U )
+
+/**
+ * @brief Header at the start of every sector of the store.
+ */
+typedef struct OfflineStoreSectorHeader
+{
+    uint32_t magic;
+    uint32_t sequence;
+} OfflineStoreSectorHeader_t;
+
+/**
+ * @brief Header of a stored record, followed by the topic and the payload.
+ * All fields are naturally aligned so that the header is 16 bytes without padding.
+ */
+typedef struct OfflineStoreRecordHeader
+{
+    uint16_t topicLength;
+    uint16_t payloadLength;
+    uint8_t retain;
+    uint8_t reserved[ 3 ];
+    uint32_t timestamp;
+    uint32_t commit;   /**< Programmed once topic and payload are written. */
+    uint32_t consumed; /**< Programmed to zero once the record is delivered or discarded. */
+} OfflineStoreRecordHeader_t;
+
+/**
+ * @brief A stored record being published by the drain.
+ */
+typedef struct OfflineStoreDrainSlot
+{
+    MQTTOperation_t operation; /**< Must be the first member, the completion callback only gets the operation. */
+    MQTTPublishInfo_t publishInfo;
+    const OfflineStoreRecordHeader_t * pRecord; /**< NULL while the slot is free. */
+    MQTTStatus_t status;
+} OfflineStoreDrainSlot_t;
+
+/**
+ * @brief Gets the memory mapped address of a sector of the store.
+ *
+ * @param[in] sector Index of the sector in the store.
+ * @return Address of the sector.
+ */
+static uint32_t prvSectorAddress( uint32_t sector );
+
+/**
+ * @brief Gets the size of a record, rounded up to a word so that all record headers are aligned.
+ *
+ * @param[in] topicLength Length of the topic.
+ * @param[in] payloadLength Length of the payload.
+ * @return Size of the record in flash.
+ */
+static uint32_t prvRecordSize( uint32_t topicLength,
+                               uint32_t payloadLength );
+
+/**
+ * @brief Gets the record at an offset of a sector and moves the offset past it.
+ *
+ * @param[in] sector Index of the sector.
+ * @param[in,out] pOffset Offset of the record in the sector.
+ * @return The record, or NULL if there are no more records in the sector.
+ */
+static const OfflineStoreRecordHeader_t * prvNextRecord( uint32_t sector,
+                                                         uint32_t * pOffset );
+
+/**
+ * @brief Checks if a record is completely written and not yet delivered.
+ *
+ * @param[in] pRecord Record to check.
+ * @return pdTRUE if the record is pending.
+ */
+static BaseType_t prvIsPending( const OfflineStoreRecordHeader_t * pRecord );
+
+/**
+ * @brief Checks if a record is older than the configured retention.
+ *
+ * @param[in] pRecord Record to check.
+ * @return pdTRUE if the record expired.
+ */
+static BaseType_t prvIsExpired( const OfflineStoreRecordHeader_t * pRecord );
+
+/**
+ * @brief Programs the consumed word of a record to remove it from the store.
+ *
+ * @param[in] pRecord Record to remove.
+ */
+static void prvMarkConsumed( const OfflineStoreRecordHeader_t * pRecord );
+
+/**
+ * @brief Counts the pending records of a sector.
+ *
+ * @param[in] sector Index of the sector.
+ * @return Number of pending records.
+ */
+static uint32_t prvCountPending( uint32_t sector );
+
+/**
+ * @brief Erases a sector and programs its header to make it the head of the log.
+ *
+ * @param[in] sector Index of the sector.
+ * @param[in] sequence Sequence number of the sector.
+ * @return pdTRUE if the sector was opened.
+ */
+static BaseType_t prvOpenSector( uint32_t sector,
+                                 uint32_t sequence );
+
+/**
+ * @brief Moves the tail of the log past the sectors without pending records. While the store is
+ * drained, the tail is not moved past the sector the drain is reading.
+ */
+static void prvReclaimSectors( void );
+
+/**
+ * @brief Opens the sector following the head of the log, applying the drop policy if the log is full.
+ *
+ * @return MQTTOfflineStoreSuccess if a new head sector was opened.
+ */
+static MQTTOfflineStoreStatus_t prvAdvanceHead( void );
+
+/**
+ * @brief Gets the next pending record for the drain, discarding the expired records on the way.
+ *
+ * @param[in,out] pSector Sector of the drain cursor.
+ * @param[in,out] pOffset Offset of the drain cursor in its sector.
+ * @return The record, or NULL if the drain cursor reached the head of the log.
+ */
+static const OfflineStoreRecordHeader_t * prvNextPendingRecord( uint32_t * pSector,
+                                                                uint32_t * pOffset );
+
+/**
+ * @brief Callback invoked by the MQTT agent when a stored publish is acknowledged or failed.
+ *
+ * @param[in] pOperation Operation of the drain slot.
+ * @param[in] status Status of the publish.
+ */
+static void prvDrainPublishCallback( MQTTOperation_t * pOperation,
+                                     MQTTStatus_t status );
+
+/**
+ * @brief Configuration of the store.
+ */
+static MQTTOfflineStoreConfig_t storeConfig;
+
+/**
+ * @brief Mutex protecting the log state and the flash accesses of the store.
+ */
+static SemaphoreHandle_t xStoreMutex = NULL;
+
+/**
+ * @brief Queue of the indexes of the drain slots completed by the agent.
+ */
+static QueueHandle_t xDrainCompletionQueue = NULL;
+
+/**
+ * @brief Oldest sector of the log.
+ */
+static uint32_t tailSector = 0U;
+
+/**
+ * @brief Sector of the log records are appended to.
+ */
+static uint32_t headSector = 0U;
+
+/**
+ * @brief Offset in the head sector of the next record.
+ */
+static uint32_t headOffset = 0U;
+
+/**
+ * @brief Sequence number of the head sector.
+ */
+static uint32_t headSequence = 0U;
+
+/**
+ * @brief Set while the store is drained. The oldest sectors are then not dropped for new records,
+ * as the agent may be reading them.
+ */
+static BaseType_t isDraining = pdFALSE;
+
+/**
+ * @brief Sector the drain is reading, valid while the store is drained.
+ */
+static uint32_t drainSector = 0U;
+
+/**
+ * @brief Statistics of the store.
+ */
+static MQTTOfflineStoreStats_t storeStats = { 0 };
+
+/**
+ * @brief Stored publishes waiting for an acknowledgment during the drain.
+ */
+static OfflineStoreDrainSlot_t drainSlots[ MQTT_OFFLINE_STORE_DRAIN_WINDOW ];
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvSectorAddress( uint32_t sector )
+{
+    return MQTT_OFFLINE_STORE_BASE_ADDR + ( sector * MFLASH_SECTOR_SIZE );
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvRecordSize( uint32_t topicLength,
+                               uint32_t payloadLength )
+{
+    uint32_t size = sizeof( OfflineStoreRecordHeader_t ) + topicLength + payloadLength;
+
+    return ( size + ( sizeof( uint32_t ) - 1U ) ) & ~( sizeof( uint32_t ) - 1U );
+}
+
+/*-----------------------------------------------------------*/
+
+static const OfflineStoreRecordHeader_t * prvNextRecord( uint32_t sector,
+                                                         uint32_t * pOffset )
+{
+    const OfflineStoreRecordHeader_t * pRecord = NULL;
+    uint32_t recordSize;
+
+    if( ( *pOffset + sizeof( OfflineStoreRecordHeader_t ) ) <= MFLASH_SECTOR_SIZE )
+    {
+        pRecord = ( const OfflineStoreRecordHeader_t * ) ( prvSectorAddress( sector ) + *pOffset );
+
+        if( pRecord->topicLength == OFFLINE_STORE_ERASED_LENGTH )
+        {
+            /* Erased flash, no more records in the sector. */
+            pRecord = NULL;
+        }
+        else
+        {
+            recordSize = prvRecordSize( pRecord->topicLength, pRecord->payloadLength );
+
+            if( recordSize > ( MFLASH_SECTOR_SIZE - *pOffset ) )
+            {
+                /* Corrupted lengths, ignore the rest of the sector. */
+                pRecord = NULL;
+            }
+            else
+            {
+                *pOffset += recordSize;
+            }
+        }
+    }
+
+    return pRecord;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvIsPending( const OfflineStoreRecordHeader_t * pRecord )
+{
+    return ( ( pRecord->commit == OFFLINE_STORE_RECORD_COMMITTED ) &&
+             ( pRecord->consumed == OFFLINE_STORE_ERASED_WORD ) ) ? pdTRUE : pdFALSE;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvIsExpired( const OfflineStoreRecordHeader_t * pRecord )
+{
+    BaseType_t isExpired = pdFALSE;
+    uint32_t now;
+
+    if( ( storeConfig.getTime != NULL ) && ( storeConfig.retentionSeconds != 0U ) )
+    {
+        now = storeConfig.getTime();
+
+        /* A record from the future was stored with a different time base, its age is unknown. */
+        if( ( now >= pRecord->timestamp ) &&
+            ( ( now - pRecord->timestamp ) > storeConfig.retentionSeconds ) )
+        {
+            isExpired = pdTRUE;
+        }
+    }
+
+    return isExpired;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvMarkConsumed( const OfflineStoreRecordHeader_t * pRecord )
+{
+    uint32_t consumed = 0U;
+
+    if( mflash_drv_program( ( void * ) &pRecord->consumed, ( const uint8_t * ) &consumed, sizeof( consumed ) ) != 0 )
+    {
+        PRINTF( "Offline store: failed to remove record at 0x%08x.\r\n", ( unsigned int ) pRecord );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvCountPending( uint32_t sector )
+{
+    const OfflineStoreRecordHeader_t * pRecord;
+    uint32_t offset = sizeof( OfflineStoreSectorHeader_t );
+    uint32_t count = 0U;
+
+    while( ( pRecord = prvNextRecord( sector, &offset ) ) != NULL )
+    {
+        if( prvIsPending( pRecord ) == pdTRUE )
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvOpenSector( uint32_t sector,
+                                 uint32_t sequence )
+{
+    OfflineStoreSectorHeader_t header;
+    BaseType_t result = pdFALSE;
+
+    header.magic = OFFLINE_STORE_SECTOR_MAGIC;
+    header.sequence = sequence;
+
+    if( ( mflash_drv_erase( ( void * ) prvSectorAddress( sector ), MFLASH_SECTOR_SIZE ) == 0 ) &&
+        ( mflash_drv_program( ( void * ) prvSectorAddress( sector ), ( const uint8_t * ) &header, sizeof( header ) ) == 0 ) )
+    {
+        headSector = sector;
+        headSequence = sequence;
+        headOffset = sizeof( OfflineStoreSectorHeader_t );
+        result = pdTRUE;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvReclaimSectors( void )
+{
+    while( ( tailSector != headSector ) &&
+           ( ( isDraining == pdFALSE ) || ( tailSector != drainSector ) ) &&
+           ( prvCountPending( tailSector ) == 0U ) )
+    {
+        /* The sector is erased only once the head wraps onto it again. */
+        tailSector = ( tailSector + 1U ) % OFFLINE_STORE_NUM_SECTORS;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static MQTTOfflineStoreStatus_t prvAdvanceHead( void )
+{
+    MQTTOfflineStoreStatus_t status = MQTTOfflineStoreSuccess;
+    uint32_t nextSector = ( headSector + 1U ) % OFFLINE_STORE_NUM_SECTORS;
+    uint32_t droppedRecords;
+
+    if( nextSector == tailSector )
+    {
+        prvReclaimSectors();
+    }
+
+    if( nextSector == tailSector )
+    {
+        /* The log is full. Sectors the drain may be reading are never dropped. */
+        if( ( storeConfig.dropPolicy == MQTTOfflineStoreDropNewest ) || ( isDraining == pdTRUE ) )
+        {
+            status = MQTTOfflineStoreFull;
+        }
+        else
+        {
+            droppedRecords = prvCountPending( tailSector );
+            storeStats.droppedRecords += droppedRecords;
+            storeStats.pendingRecords -= droppedRecords;
+            tailSector = ( tailSector + 1U ) % OFFLINE_STORE_NUM_SECTORS;
+        }
+    }
+
+    if( status == MQTTOfflineStoreSuccess )
+    {
+        if( prvOpenSector( nextSector, headSequence + 1U ) != pdTRUE )
+        {
+            status = MQTTOfflineStoreFlashError;
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static const OfflineStoreRecordHeader_t * prvNextPendingRecord( uint32_t * pSector,
+                                                                uint32_t * pOffset )
+{
+    const OfflineStoreRecordHeader_t * pRecord = NULL;
+    BaseType_t isEnd = pdFALSE;
+
+    ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+
+    while( ( pRecord == NULL ) && ( isEnd == pdFALSE ) )
+    {
+        drainSector = *pSector;
+
+        /* Records past the head offset are still being written. */
+        if( ( *pSector == headSector ) && ( *pOffset >= headOffset ) )
+        {
+            isEnd = pdTRUE;
+        }
+        else
+        {
+            pRecord = prvNextRecord( *pSector, pOffset );
+
+            if( ( pRecord == NULL ) && ( *pSector == headSector ) )
+            {
+                /* A torn or failed append leaves no record before the head offset. */
+                isEnd = pdTRUE;
+            }
+            else if( pRecord == NULL )
+            {
+                *pSector = ( *pSector + 1U ) % OFFLINE_STORE_NUM_SECTORS;
+                *pOffset = sizeof( OfflineStoreSectorHeader_t );
+            }
+            else if( prvIsPending( pRecord ) != pdTRUE )
+            {
+                pRecord = NULL;
+            }
+            else if( prvIsExpired( pRecord ) == pdTRUE )
+            {
+                prvMarkConsumed( pRecord );
+                storeStats.expiredRecords++;
+                storeStats.pendingRecords--;
+                pRecord = NULL;
+            }
+            else
+            {
+                /* Pending record to publish. */
+            }
+        }
+    }
+
+    ( void ) xSemaphoreGive( xStoreMutex );
+
+    return pRecord;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvDrainPublishCallback( MQTTOperation_t * pOperation,
+                                     MQTTStatus_t status )
+{
+    OfflineStoreDrainSlot_t * pSlot = ( OfflineStoreDrainSlot_t * ) pOperation;
+    uint32_t index = ( uint32_t ) ( pSlot - drainSlots );
+
+    pSlot->status = status;
+
+    /* The queue has room for all the slots, this never blocks. */
+    ( void ) xQueueSend( xDrainCompletionQueue, &index, 0U );
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t MQTTOfflineStore_Init( const MQTTOfflineStoreConfig_t * pConfig )
+{
+    BaseType_t result = pdTRUE;
+    const OfflineStoreSectorHeader_t * pHeader;
+    const OfflineStoreRecordHeader_t * pRecord;
+    uint32_t minSequence = UINT32_MAX;
+    uint32_t maxSequence = 0U;
+    BaseType_t isFound = pdFALSE;
+    uint32_t sector;
+
+    if( pConfig == NULL )
+    {
+        result = pdFALSE;
+    }
+    else
+    {
+        storeConfig = *pConfig;
+        memset( &storeStats, 0x00, sizeof( storeStats ) );
+        memset( drainSlots, 0x00, sizeof( drainSlots ) );
+    }
+
+    if( ( result == pdTRUE ) && ( xStoreMutex == NULL ) )
+    {
+        xStoreMutex = xSemaphoreCreateMutex();
+        xDrainCompletionQueue = xQueueCreate( MQTT_OFFLINE_STORE_DRAIN_WINDOW, sizeof( uint32_t ) );
+
+        if( ( xStoreMutex == NULL ) || ( xDrainCompletionQueue == NULL ) )
+        {
+            result = pdFALSE;
+        }
+    }
+
+    if( result == pdTRUE )
+    {
+        /* Find the oldest and newest sectors of the log. */
+        for( sector = 0U; sector < OFFLINE_STORE_NUM_SECTORS; sector++ )
+        {
+            pHeader = ( const OfflineStoreSectorHeader_t * ) prvSectorAddress( sector );
+
+            if( pHeader->magic == OFFLINE_STORE_SECTOR_MAGIC )
+            {
+                isFound = pdTRUE;
+
+                if( pHeader->sequence < minSequence )
+                {
+                    minSequence = pHeader->sequence;
+                    tailSector = sector;
+                }
+
+                if( pHeader->sequence >= maxSequence )
+                {
+                    maxSequence = pHeader->sequence;
+                    headSector = sector;
+                }
+            }
+        }
+
+        if( isFound == pdFALSE )
+        {
+            tailSector = 0U;
+            result = prvOpenSector( 0U, 1U );
+        }
+        else
+        {
+            headSequence = maxSequence;
+
+            /* Append after the last record of the head sector, including an uncommitted one. */
+            headOffset = sizeof( OfflineStoreSectorHeader_t );
+
+            while( prvNextRecord( headSector, &headOffset ) != NULL )
+            {
+            }
+
+            pRecord = ( const OfflineStoreRecordHeader_t * ) ( prvSectorAddress( headSector ) + headOffset );
+
+            if( ( ( headOffset + sizeof( OfflineStoreRecordHeader_t ) ) <= MFLASH_SECTOR_SIZE ) &&
+                ( pRecord->topicLength != OFFLINE_STORE_ERASED_LENGTH ) )
+            {
+                /* Corrupted record, do not append over it. */
+                headOffset = MFLASH_SECTOR_SIZE;
+            }
+
+            for( sector = tailSector; sector != headSector; sector = ( sector + 1U ) % OFFLINE_STORE_NUM_SECTORS )
+            {
+                storeStats.pendingRecords += prvCountPending( sector );
+            }
+
+            storeStats.pendingRecords += prvCountPending( headSector );
+
+            prvReclaimSectors();
+        }
+    }
+
+    if( result == pdTRUE )
+    {
+        PRINTF( "Offline store: %u publishes pending.\r\n", ( unsigned int ) storeStats.pendingRecords );
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTOfflineStoreStatus_t MQTTOfflineStore_Append( const MQTTPublishInfo_t * pPublishInfo )
+{
+    MQTTOfflineStoreStatus_t status = MQTTOfflineStoreSuccess;
+    OfflineStoreRecordHeader_t header;
+    uint32_t recordSize = 0U;
+    uint32_t recordStart;
+    uint32_t commit = OFFLINE_STORE_RECORD_COMMITTED;
+    int32_t flashResult;
+
+    if( ( pPublishInfo == NULL ) || ( pPublishInfo->pTopicName == NULL ) || ( pPublishInfo->topicNameLength == 0U ) ||
+        ( ( pPublishInfo->pPayload == NULL ) && ( pPublishInfo->payloadLength != 0U ) ) )
+    {
+        status = MQTTOfflineStoreBadParameter;
+    }
+    else
+    {
+        recordSize = prvRecordSize( pPublishInfo->topicNameLength, pPublishInfo->payloadLength );
+
+        if( recordSize > ( MFLASH_SECTOR_SIZE - sizeof( OfflineStoreSectorHeader_t ) ) )
+        {
+            status = MQTTOfflineStoreBadParameter;
+        }
+    }
+
+    if( status == MQTTOfflineStoreSuccess )
+    {
+        ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+
+        if( ( headOffset + recordSize ) > MFLASH_SECTOR_SIZE )
+        {
+            status = prvAdvanceHead();
+        }
+
+        if( status == MQTTOfflineStoreSuccess )
+        {
+            memset( &header, 0xFF, sizeof( header ) );
+            header.topicLength = pPublishInfo->topicNameLength;
+            header.payloadLength = ( uint16_t ) pPublishInfo->payloadLength;
+            header.retain = ( pPublishInfo->retain == true ) ? 1U : 0U;
+            header.timestamp = ( storeConfig.getTime != NULL ) ? storeConfig.getTime() : 0U;
+
+            recordStart = prvSectorAddress( headSector ) + headOffset;
+
+            /* The space is used as soon as the header is programmed, even if a later step fails. */
+            headOffset += recordSize;
+
+            flashResult = mflash_drv_program( ( void * ) recordStart, ( const uint8_t * ) &header, sizeof( header ) );
+
+            if( flashResult == 0 )
+            {
+                flashResult = mflash_drv_program( ( void * ) ( recordStart + sizeof( header ) ),
+                                                  ( const uint8_t * ) pPublishInfo->pTopicName,
+                                                  pPublishInfo->topicNameLength );
+            }
+
+            if( ( flashResult == 0 ) && ( pPublishInfo->payloadLength > 0U ) )
+            {
+                flashResult = mflash_drv_program( ( void * ) ( recordStart + sizeof( header ) + pPublishInfo->topicNameLength ),
+                                                  ( const uint8_t * ) pPublishInfo->pPayload,
+                                                  pPublishInfo->payloadLength );
+            }
+
+            if( flashResult == 0 )
+            {
+                /* The record is valid only once the commit word is programmed. */
+                flashResult = mflash_drv_program( ( void * ) &( ( OfflineStoreRecordHeader_t * ) recordStart )->commit,
+                                                  ( const uint8_t * ) &commit,
+                                                  sizeof( commit ) );
+            }
+
+            if( flashResult == 0 )
+            {
+                storeStats.storedRecords++;
+                storeStats.pendingRecords++;
+            }
+            else
+            {
+                status = MQTTOfflineStoreFlashError;
+            }
+        }
+
+        if( status == MQTTOfflineStoreFull )
+        {
+            storeStats.droppedRecords++;
+        }
+
+        ( void ) xSemaphoreGive( xStoreMutex );
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t MQTTOfflineStore_Drain( void )
+{
+    const OfflineStoreRecordHeader_t * pRecord = NULL;
+    OfflineStoreDrainSlot_t * pSlot;
+    MQTTAgentStatus_t agentStatus;
+    uint32_t cursorSector;
+    uint32_t cursorOffset;
+    uint32_t numInflight = 0U;
+    uint32_t numRetries = 0U;
+    uint32_t index;
+    BaseType_t isFailed = pdFALSE;
+    BaseType_t isEnd = pdFALSE;
+
+    ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+    isDraining = pdTRUE;
+    cursorSector = tailSector;
+    cursorOffset = sizeof( OfflineStoreSectorHeader_t );
+    drainSector = cursorSector;
+    ( void ) xSemaphoreGive( xStoreMutex );
+
+    for( ; ; )
+    {
+        /* Keep the window full of stored publishes. */
+        while( ( isFailed == pdFALSE ) && ( isEnd == pdFALSE ) && ( numInflight < MQTT_OFFLINE_STORE_DRAIN_WINDOW ) )
+        {
+            if( pRecord == NULL )
+            {
+                pRecord = prvNextPendingRecord( &cursorSector, &cursorOffset );
+            }
+
+            if( pRecord == NULL )
+            {
+                isEnd = pdTRUE;
+                break;
+            }
+
+            for( index = 0U; drainSlots[ index ].pRecord != NULL; index++ )
+            {
+            }
+
+            pSlot = &drainSlots[ index ];
+            memset( pSlot, 0x00, sizeof( OfflineStoreDrainSlot_t ) );
+            pSlot->pRecord = pRecord;
+            pSlot->publishInfo.qos = MQTTQoS1;
+            pSlot->publishInfo.retain = ( pRecord->retain == 1U ) ? true : false;
+            pSlot->publishInfo.pTopicName = ( const char * ) &pRecord[ 1 ];
+            pSlot->publishInfo.topicNameLength = pRecord->topicLength;
+            pSlot->publishInfo.pPayload = ( ( const uint8_t * ) &pRecord[ 1 ] ) + pRecord->topicLength;
+            pSlot->publishInfo.payloadLength = pRecord->payloadLength;
+            pSlot->operation.type = MQTT_OP_PUBLISH;
+            pSlot->operation.info.pPublishInfo = &pSlot->publishInfo;
+            pSlot->operation.callback = prvDrainPublishCallback;
+
+            agentStatus = MQTTAgent_EnqueueOnLane( &pSlot->operation, MQTTAgentLaneBulk, pdMS_TO_TICKS( OFFLINE_STORE_ENQUEUE_TIMEOUT_MS ) );
+
+            if( agentStatus == MQTTAgentSuccess )
+            {
+                numInflight++;
+                numRetries = 0U;
+                pRecord = NULL;
+            }
+            else
+            {
+                pSlot->pRecord = NULL;
+
+                if( numInflight > 0U )
+                {
+                    /* Room is made as acknowledgments arrive, retry the record once one does. */
+                    break;
+                }
+                else if( numRetries < MQTT_OFFLINE_STORE_DRAIN_RETRIES )
+                {
+                    numRetries++;
+                    vTaskDelay( pdMS_TO_TICKS( OFFLINE_STORE_RETRY_DELAY_MS ) );
+                }
+                else
+                {
+                    PRINTF( "Offline store: agent busy, status %d.\r\n", agentStatus );
+                    isFailed = pdTRUE;
+                }
+            }
+        }
+
+        if( numInflight == 0U )
+        {
+            break;
+        }
+
+        /* The agent invokes the callback of every publish it accepted. */
+        ( void ) xQueueReceive( xDrainCompletionQueue, &index, portMAX_DELAY );
+        numInflight--;
+        pSlot = &drainSlots[ index ];
+
+        if( pSlot->status == MQTTSuccess )
+        {
+            ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+            prvMarkConsumed( pSlot->pRecord );
+            storeStats.deliveredRecords++;
+            storeStats.pendingRecords--;
+            ( void ) xSemaphoreGive( xStoreMutex );
+        }
+        else
+        {
+            /* The record stays in the store for the next drain. */
+            PRINTF( "Offline store: publish failed, status %d.\r\n", pSlot->status );
+            isFailed = pdTRUE;
+        }
+
+        pSlot->pRecord = NULL;
+    }
+
+    ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+    isDraining = pdFALSE;
+    prvReclaimSectors();
+    ( void ) xSemaphoreGive( xStoreMutex );
+
+    return ( isFailed == pdFALSE ) ? pdTRUE : pdFALSE;
+}
+
+/*-----------------------------------------------------------*/
+
+void MQTTOfflineStore_GetStats( MQTTOfflineStoreStats_t * pStats )
+{
+    if( pStats != NULL )
+    {
+        ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+        *pStats = storeStats;
+        ( void ) xSemaphoreGive( xStoreMutex );
+    }
+}
@@ -0,0 +1,157 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Header file containing the MQTT offline store APIs.
+ * The offline store keeps outgoing publishes in a reserved region of the SPIFI flash while the
+ * device is disconnected, and publishes them with QoS1 through the MQTT agent once connected again.
+ * The region is a log of sectors used in a ring: records are only ever appended, and a record is
+ * removed by clearing a word of its header, so that no sector is read back or erased per message.
+ * Sectors are erased only when the head of the log wraps onto them.
+ */
+
+#ifndef MQTT_OFFLINE_STORE_H
+#define MQTT_OFFLINE_STORE_H
+
+/* FreeRTOS include. */
+#include "FreeRTOS.h"
+
+/* MQTT library include */
+#include "core_mqtt.h"
+
+/**
+ * @brief Address of the flash region reserved for the store, aligned to a sector.
+ */
+#ifndef MQTT_OFFLINE_STORE_BASE_ADDR
+    #define MQTT_OFFLINE_STORE_BASE_ADDR    ( 0x10C00000U )
+#endif
+
+/**
+ * @brief Size of the flash region reserved for the store, a multiple of the sector size.
+ */
+#ifndef MQTT_OFFLINE_STORE_SIZE
+    #define MQTT_OFFLINE_STORE_SIZE    ( 0x100000U )
+#endif
+
+/**
+ * @brief Number of stored publishes the drain keeps waiting for an acknowledgment.
+ */
+#ifndef MQTT_OFFLINE_STORE_DRAIN_WINDOW
+    #define MQTT_OFFLINE_STORE_DRAIN_WINDOW    ( 8U )
+#endif
+
+/**
+ * @brief Number of times the drain retries a publish rejected because the agent queue or
+ * in-flight window is full, before giving up until the next drain.
+ */
+#ifndef MQTT_OFFLINE_STORE_DRAIN_RETRIES
+    #define MQTT_OFFLINE_STORE_DRAIN_RETRIES    ( 20U )
+#endif
+
+/**
+ * @brief Policy applied when a publish is appended to a full store.
+ */
+typedef enum MQTTOfflineStoreDropPolicy
+{
+    MQTTOfflineStoreDropOldest = 0, /**< Erase the oldest sector of the log to make room. */
+    MQTTOfflineStoreDropNewest      /**< Keep the stored publishes and reject the new one. */
+} MQTTOfflineStoreDropPolicy_t;
+
+/**
+ * @brief Status returned when appending a publish to the store.
+ */
+typedef enum MQTTOfflineStoreStatus
+{
+    MQTTOfflineStoreSuccess = 0,  /**< The publish was stored. */
+    MQTTOfflineStoreBadParameter, /**< The publish is invalid or does not fit in a sector. */
+    MQTTOfflineStoreFull,         /**< The store is full and the publish was dropped. */
+    MQTTOfflineStoreFlashError    /**< Programming or erasing the flash failed. */
+} MQTTOfflineStoreStatus_t;
+
+/**
+ * @brief Function returning the current time in seconds, used to expire stored publishes.
+ * The time should be kept across reboots, for instance a wall clock time.
+ */
+typedef uint32_t ( * MQTTOfflineStoreGetTime_t )( void );
+
+/**
+ * @brief Configuration of the store.
+ */
+typedef struct MQTTOfflineStoreConfig
+{
+    MQTTOfflineStoreDropPolicy_t dropPolicy; /**< Policy applied when the store is full. */
+    uint32_t retentionSeconds;               /**< Age after which a stored publish is discarded, 0 to keep it forever. */
+    MQTTOfflineStoreGetTime_t getTime;       /**< Time source for the retention, NULL to keep publishes forever. */
+} MQTTOfflineStoreConfig_t;
+
+/**
+ * @brief Statistics of the store since initialization.
+ */
+typedef struct MQTTOfflineStoreStats
+{
+    uint32_t pendingRecords;   /**< Publishes currently stored and not yet delivered. */
+    uint32_t storedRecords;    /**< Publishes appended to the store. */
+    uint32_t droppedRecords;   /**< Publishes lost because the store was full. */
+    uint32_t expiredRecords;   /**< Publishes discarded because they were older than the retention. */
+    uint32_t deliveredRecords; /**< Stored publishes acknowledged by the broker. */
+} MQTTOfflineStoreStats_t;
+
+/**
+ * @brief Initializes the store and recovers the publishes stored before a reset.
+ * Records which were not completely written when the device was reset are skipped.
+ * The flash driver must have been initialized.
+ *
+ * @param[in] pConfig Configuration of the store, copied.
+ * @return pdTRUE if the initialization was successful.
+ */
+BaseType_t MQTTOfflineStore_Init( const MQTTOfflineStoreConfig_t * pConfig );
+
+/**
+ * @brief Appends a publish to the store.
+ * The topic, payload and retain flag are stored; the publish is sent again with QoS1.
+ *
+ * @param[in] pPublishInfo Publish to store.
+ * @return MQTTOfflineStoreSuccess if the publish was stored, otherwise the reason it was not.
+ */
+MQTTOfflineStoreStatus_t MQTTOfflineStore_Append( const MQTTPublishInfo_t * pPublishInfo );
+
+/**
+ * @brief Publishes all the stored publishes through the MQTT agent, oldest first.
+ * Keeps up to MQTT_OFFLINE_STORE_DRAIN_WINDOW publishes waiting for their PUBACK so that the log is
+ * drained at line rate, and removes each publish from the store once it is acknowledged. Blocks the
+ * calling task until the store is empty or a publish fails. Must be called after MQTTAgent_Init().
+ *
+ * @return pdTRUE if the store was emptied, pdFALSE if a publish failed and publishes remain stored.
+ */
+BaseType_t MQTTOfflineStore_Drain( void );
+
+/**
+ * @brief Gets a snapshot of the store statistics.
+ *
+ * @param[out] pStats Structure filled with the statistics.
+ */
+void MQTTOfflineStore_GetStats( MQTTOfflineStoreStats_t * pStats );
+
+#endif /* ifndef MQTT_OFFLINE_STORE_H */
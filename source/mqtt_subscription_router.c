@@ -0,0 +1,595 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Implementation of the MQTT subscription router.
+ * Topic filters are split into levels and stored in a trie built from a static pool of nodes. Each node
+ * holds one level of a filter, its children and, if a filter ends at the node, the handler of the filter.
+ * Dispatch walks the trie along the levels of the topic of an incoming publish, following both the literal
+ * child and the `+` child at each level, and invokes the handlers of the filters ending at the last level
+ * as well as of any `#` child met on the way.
+ * A filter can instead have a stream handler, which receives the payload in fragments. Publishes which fit
+ * in the MQTT network buffer are passed to it as a single fragment by the dispatch, larger ones are streamed
+ * by the MQTT agent straight from the transport.
+ */
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "fsl_debug_console.h"
+
+#include "mqtt_subscription_router.h"
+
+/**
+ * @brief Index used for no node.
+ */
+#define ROUTER_NO_NODE               ( -1 )
+
+/**
+ * @brief Index of the root node, which holds no level.
+ */
+#define ROUTER_ROOT_NODE             ( 0 )
+
+/**
+ * @brief Maximum number of branches waiting to be explored during a dispatch.
+ * Each level can match a literal child and a `+` child.
+ */
+#define ROUTER_DISPATCH_STACK_SIZE    ( 2U * MQTT_ROUTER_MAX_LEVELS )
+
+/**
+ * @brief Node of the router trie.
+ */
+typedef struct RouterNode
+{
+    const char * pLevel;                 /**< @brief Topic level, not NULL terminated. */
+    uint16_t levelLength;                /**< @brief Length of the topic level. */
+    int16_t firstChild;                  /**< @brief First child node, or ROUTER_NO_NODE. */
+    int16_t nextSibling;                 /**< @brief Next sibling node, or ROUTER_NO_NODE. */
+    MQTTRouteHandler_t handler;          /**< @brief Handler of the filter ending at this node, or NULL. */
+    MQTTRouteStreamHandler_t streamHandler; /**< @brief Stream handler of the filter ending at this node, or NULL. */
+    MQTTRouteLoanHandler_t loanHandler;  /**< @brief Loan handler of the stream route ending at this node, or NULL. */
+    void * pHandlerContext;              /**< @brief Context passed to the handler. */
+} RouterNode_t;
+
+/**
+ * @brief Function invoked for each node whose filter matches the topic being routed.
+ *
+ * @param[in] pNode The matching node.
+ * @param[in] pVisitorContext Context given to prvMatchRoutes().
+ * @return pdTRUE if the node has a handler which was used.
+ */
+typedef BaseType_t ( * RouterVisitor_t )( const RouterNode_t * pNode,
+                                          void * pVisitorContext );
+
+/**
+ * @brief Branch of the trie waiting to be explored during a dispatch.
+ */
+typedef struct RouterCursor
+{
+    int16_t node;                        /**< @brief Node whose children are matched against the level. */
+    uint16_t levelOffset;                /**< @brief Offset in the topic of the level to match. */
+} RouterCursor_t;
+
+/**
+ * @brief Checks if a node holds the given topic level.
+ *
+ * @param[in] pNode The node.
+ * @param[in] pLevel Topic level.
+ * @param[in] levelLength Length of the topic level.
+ * @return pdTRUE if the node holds the level.
+ */
+static BaseType_t prvIsNodeLevel( const RouterNode_t * pNode,
+                                  const char * pLevel,
+                                  uint16_t levelLength );
+
+/**
+ * @brief Finds the child of a node holding the given level, or creates it.
+ *
+ * @param[in] parent Index of the parent node.
+ * @param[in] pLevel Topic level.
+ * @param[in] levelLength Length of the topic level.
+ * @return Index of the child node, or ROUTER_NO_NODE if the node pool is exhausted.
+ */
+static int16_t prvFindOrAddChild( int16_t parent,
+                                  const char * pLevel,
+                                  uint16_t levelLength );
+
+/**
+ * @brief Checks that a topic filter is valid and counts its levels.
+ *
+ * @param[in] pTopicFilter Topic filter.
+ * @param[in] topicFilterLength Length of the topic filter.
+ * @return pdTRUE if wildcards are used as full levels, `#` only as the last level, and the
+ * filter does not have more than MQTT_ROUTER_MAX_LEVELS levels.
+ */
+static BaseType_t prvIsFilterValid( const char * pTopicFilter,
+                                    uint16_t topicFilterLength );
+
+/**
+ * @brief Invokes the handler or stream handler of a node, if any.
+ *
+ * @param[in] pNode The node.
+ * @param[in] pVisitorContext The publish being dispatched.
+ * @return pdTRUE if a handler was invoked.
+ */
+static BaseType_t prvInvokeHandler( const RouterNode_t * pNode,
+                                    void * pVisitorContext );
+
+/**
+ * @brief Records the stream handler of a node in the route being looked up, if it is the first one found.
+ *
+ * @param[in] pNode The node.
+ * @param[in] pVisitorContext The #MQTTRouteStream_t being filled.
+ * @return pdTRUE if the node has a stream handler.
+ */
+static BaseType_t prvFindStreamHandler( const RouterNode_t * pNode,
+                                        void * pVisitorContext );
+
+/**
+ * @brief Registers a handler or a stream handler for a topic filter.
+ *
+ * @param[in] pTopicFilter Topic filter.
+ * @param[in] topicFilterLength Length of the topic filter.
+ * @param[in] handler Handler, or NULL for a stream route.
+ * @param[in] streamHandler Stream handler, or NULL for a regular route.
+ * @param[in] loanHandler Loan handler of a stream route, or NULL.
+ * @param[in] pHandlerContext Context passed to the handler.
+ * @return pdTRUE if the route was added.
+ */
+static BaseType_t prvAddRoute( const char * pTopicFilter,
+                               uint16_t topicFilterLength,
+                               MQTTRouteHandler_t handler,
+                               MQTTRouteStreamHandler_t streamHandler,
+                               MQTTRouteLoanHandler_t loanHandler,
+                               void * pHandlerContext );
+
+/**
+ * @brief Walks the trie along the levels of a topic and visits every node whose filter matches it.
+ *
+ * @param[in] pTopic Topic name.
+ * @param[in] topicLength Length of the topic name.
+ * @param[in] visitor Function invoked for each matching node.
+ * @param[in] pVisitorContext Context passed to the visitor.
+ * @return pdTRUE if the visitor returned pdTRUE for at least one node.
+ */
+static BaseType_t prvMatchRoutes( const char * pTopic,
+                                  uint16_t topicLength,
+                                  RouterVisitor_t visitor,
+                                  void * pVisitorContext );
+
+/**
+ * @brief Static pool of trie nodes. Node 0 is the root.
+ */
+static RouterNode_t routerNodes[ MQTT_ROUTER_MAX_NODES ] =
+{
+    [ ROUTER_ROOT_NODE ] =
+    {
+        .firstChild  = ROUTER_NO_NODE,
+        .nextSibling = ROUTER_NO_NODE
+    }
+};
+
+/**
+ * @brief Number of nodes used in the pool.
+ */
+static uint16_t routerNodeCount = 1U;
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvIsNodeLevel( const RouterNode_t * pNode,
+                                  const char * pLevel,
+                                  uint16_t levelLength )
+{
+    return ( ( pNode->levelLength == levelLength ) &&
+             ( memcmp( pNode->pLevel, pLevel, levelLength ) == 0 ) ) ? pdTRUE : pdFALSE;
+}
+
+/*-----------------------------------------------------------*/
+
+static int16_t prvFindOrAddChild( int16_t parent,
+                                  const char * pLevel,
+                                  uint16_t levelLength )
+{
+    int16_t child = routerNodes[ parent ].firstChild;
+    RouterNode_t * pNode;
+
+    while( ( child != ROUTER_NO_NODE ) &&
+           ( prvIsNodeLevel( &routerNodes[ child ], pLevel, levelLength ) != pdTRUE ) )
+    {
+        child = routerNodes[ child ].nextSibling;
+    }
+
+    if( ( child == ROUTER_NO_NODE ) && ( routerNodeCount < MQTT_ROUTER_MAX_NODES ) )
+    {
+        child = ( int16_t ) routerNodeCount;
+        pNode = &routerNodes[ child ];
+
+        pNode->pLevel = pLevel;
+        pNode->levelLength = levelLength;
+        pNode->firstChild = ROUTER_NO_NODE;
+        pNode->nextSibling = routerNodes[ parent ].firstChild;
+        pNode->handler = NULL;
+        pNode->streamHandler = NULL;
+        pNode->pHandlerContext = NULL;
+        routerNodeCount++;
+
+        /* Link the node once fully initialized, a concurrent dispatch sees either the old or the new list. */
+        routerNodes[ parent ].firstChild = child;
+    }
+
+    return child;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvIsFilterValid( const char * pTopicFilter,
+                                    uint16_t topicFilterLength )
+{
+    BaseType_t result = ( topicFilterLength > 0U ) ? pdTRUE : pdFALSE;
+    uint16_t levelStart = 0U;
+    uint16_t levelCount = 1U;
+    uint16_t index;
+    char c;
+
+    for( index = 0U; ( index < topicFilterLength ) && ( result == pdTRUE ); index++ )
+    {
+        c = pTopicFilter[ index ];
+
+        if( c == '/' )
+        {
+            levelStart = index + 1U;
+            levelCount++;
+        }
+        else if( ( c == '+' ) || ( c == '#' ) )
+        {
+            /* Wildcards must occupy a full level, and '#' must be the last level. */
+            if( ( index != levelStart ) ||
+                ( ( ( index + 1U ) < topicFilterLength ) && ( pTopicFilter[ index + 1U ] != '/' ) ) ||
+                ( ( c == '#' ) && ( ( index + 1U ) != topicFilterLength ) ) )
+            {
+                result = pdFALSE;
+            }
+        }
+        else
+        {
+            /* Empty else marker. */
+        }
+    }
+
+    if( levelCount > MQTT_ROUTER_MAX_LEVELS )
+    {
+        result = pdFALSE;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvInvokeHandler( const RouterNode_t * pNode,
+                                    void * pVisitorContext )
+{
+    BaseType_t result = pdFALSE;
+    MQTTPublishInfo_t * pPublishInfo = ( MQTTPublishInfo_t * ) pVisitorContext;
+    MQTTRouteHandler_t handler = pNode->handler;
+    MQTTRouteStreamHandler_t streamHandler = pNode->streamHandler;
+    MQTTRouteFragment_t fragment;
+
+    if( handler != NULL )
+    {
+        handler( pPublishInfo, pNode->pHandlerContext );
+        result = pdTRUE;
+    }
+    else if( streamHandler != NULL )
+    {
+        /* The whole payload is available, it is passed as a single fragment. */
+        fragment.pTopicName = pPublishInfo->pTopicName;
+        fragment.topicNameLength = pPublishInfo->topicNameLength;
+        fragment.qos = pPublishInfo->qos;
+        fragment.payloadLength = pPublishInfo->payloadLength;
+        fragment.offset = 0U;
+        fragment.pData = ( const uint8_t * ) pPublishInfo->pPayload;
+        fragment.dataLength = pPublishInfo->payloadLength;
+        fragment.isAborted = pdFALSE;
+
+        streamHandler( &fragment, pNode->pHandlerContext );
+        result = pdTRUE;
+    }
+    else
+    {
+        /* Empty else marker. */
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvFindStreamHandler( const RouterNode_t * pNode,
+                                        void * pVisitorContext )
+{
+    MQTTRouteStream_t * pLookup = ( MQTTRouteStream_t * ) pVisitorContext;
+    MQTTRouteStreamHandler_t streamHandler = pNode->streamHandler;
+    BaseType_t result = pdFALSE;
+
+    if( streamHandler != NULL )
+    {
+        if( pLookup->streamHandler == NULL )
+        {
+            pLookup->pHandlerContext = pNode->pHandlerContext;
+            pLookup->loanHandler = pNode->loanHandler;
+            pLookup->streamHandler = streamHandler;
+        }
+
+        result = pdTRUE;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+void MQTTRouter_Init( void )
+{
+    vTaskSuspendAll();
+    {
+        memset( routerNodes, 0x00, sizeof( routerNodes ) );
+        routerNodes[ ROUTER_ROOT_NODE ].firstChild = ROUTER_NO_NODE;
+        routerNodes[ ROUTER_ROOT_NODE ].nextSibling = ROUTER_NO_NODE;
+        routerNodeCount = 1U;
+    }
+    ( void ) xTaskResumeAll();
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvAddRoute( const char * pTopicFilter,
+                               uint16_t topicFilterLength,
+                               MQTTRouteHandler_t handler,
+                               MQTTRouteStreamHandler_t streamHandler,
+                               MQTTRouteLoanHandler_t loanHandler,
+                               void * pHandlerContext )
+{
+    BaseType_t result = pdTRUE;
+    int16_t node = ROUTER_ROOT_NODE;
+    uint16_t levelStart = 0U;
+    uint16_t levelEnd = 0U;
+
+    if( ( pTopicFilter == NULL ) || ( ( handler == NULL ) && ( streamHandler == NULL ) ) ||
+        ( prvIsFilterValid( pTopicFilter, topicFilterLength ) != pdTRUE ) )
+    {
+        PRINTF( "Invalid MQTT route.\r\n" );
+        result = pdFALSE;
+    }
+
+    if( result == pdTRUE )
+    {
+        /* Serialize updates of the trie with other tasks adding routes. */
+        vTaskSuspendAll();
+        {
+            while( ( node != ROUTER_NO_NODE ) && ( levelStart <= topicFilterLength ) )
+            {
+                levelEnd = levelStart;
+
+                while( ( levelEnd < topicFilterLength ) && ( pTopicFilter[ levelEnd ] != '/' ) )
+                {
+                    levelEnd++;
+                }
+
+                node = prvFindOrAddChild( node, &pTopicFilter[ levelStart ], levelEnd - levelStart );
+                levelStart = levelEnd + 1U;
+            }
+
+            if( ( node == ROUTER_NO_NODE ) ||
+                ( routerNodes[ node ].handler != NULL ) ||
+                ( routerNodes[ node ].streamHandler != NULL ) )
+            {
+                result = pdFALSE;
+            }
+            else
+            {
+                routerNodes[ node ].pHandlerContext = pHandlerContext;
+                routerNodes[ node ].loanHandler = loanHandler;
+                routerNodes[ node ].streamHandler = streamHandler;
+                routerNodes[ node ].handler = handler;
+            }
+        }
+        ( void ) xTaskResumeAll();
+
+        if( result != pdTRUE )
+        {
+            PRINTF( "Cannot add MQTT route %.*s, nodes used %u.\r\n",
+                    topicFilterLength,
+                    pTopicFilter,
+                    routerNodeCount );
+        }
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t MQTTRouter_AddRoute( const char * pTopicFilter,
+                                uint16_t topicFilterLength,
+                                MQTTRouteHandler_t handler,
+                                void * pHandlerContext )
+{
+    return prvAddRoute( pTopicFilter, topicFilterLength, handler, NULL, NULL, pHandlerContext );
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t MQTTRouter_AddStreamRoute( const char * pTopicFilter,
+                                      uint16_t topicFilterLength,
+                                      MQTTRouteStreamHandler_t streamHandler,
+                                      void * pHandlerContext )
+{
+    return prvAddRoute( pTopicFilter, topicFilterLength, NULL, streamHandler, NULL, pHandlerContext );
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t MQTTRouter_AddLoanRoute( const char * pTopicFilter,
+                                    uint16_t topicFilterLength,
+                                    MQTTRouteLoanHandler_t loanHandler,
+                                    MQTTRouteStreamHandler_t streamHandler,
+                                    void * pHandlerContext )
+{
+    BaseType_t result = pdFALSE;
+
+    if( ( loanHandler != NULL ) && ( streamHandler != NULL ) )
+    {
+        result = prvAddRoute( pTopicFilter, topicFilterLength, NULL, streamHandler, loanHandler, pHandlerContext );
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvMatchRoutes( const char * pTopic,
+                                  uint16_t topicLength,
+                                  RouterVisitor_t visitor,
+                                  void * pVisitorContext )
+{
+    BaseType_t result = pdFALSE;
+    RouterCursor_t stack[ ROUTER_DISPATCH_STACK_SIZE ];
+    size_t depth = 0U;
+    RouterCursor_t cursor;
+    uint16_t levelEnd;
+    uint16_t levelLength;
+    int16_t child;
+    int16_t grandChild;
+    BaseType_t isLastLevel;
+    BaseType_t allowWildcards;
+    const RouterNode_t * pChild;
+
+    stack[ depth ].node = ROUTER_ROOT_NODE;
+    stack[ depth ].levelOffset = 0U;
+    depth++;
+
+    while( depth > 0U )
+    {
+        depth--;
+        cursor = stack[ depth ];
+
+        levelEnd = cursor.levelOffset;
+
+        while( ( levelEnd < topicLength ) && ( pTopic[ levelEnd ] != '/' ) )
+        {
+            levelEnd++;
+        }
+
+        levelLength = levelEnd - cursor.levelOffset;
+        isLastLevel = ( levelEnd >= topicLength ) ? pdTRUE : pdFALSE;
+
+        /* Topics starting with '$' are not matched by wildcards at the first level. */
+        allowWildcards = ( ( cursor.node != ROUTER_ROOT_NODE ) ||
+                           ( topicLength == 0U ) ||
+                           ( pTopic[ 0 ] != '$' ) ) ? pdTRUE : pdFALSE;
+
+        for( child = routerNodes[ cursor.node ].firstChild; child != ROUTER_NO_NODE; child = pChild->nextSibling )
+        {
+            pChild = &routerNodes[ child ];
+
+            if( ( pChild->levelLength == 1U ) && ( pChild->pLevel[ 0 ] == '#' ) )
+            {
+                if( allowWildcards == pdTRUE )
+                {
+                    result |= visitor( pChild, pVisitorContext );
+                }
+            }
+            else if( ( ( allowWildcards == pdTRUE ) && ( pChild->levelLength == 1U ) && ( pChild->pLevel[ 0 ] == '+' ) ) ||
+                     ( prvIsNodeLevel( pChild, &pTopic[ cursor.levelOffset ], levelLength ) == pdTRUE ) )
+            {
+                if( isLastLevel == pdTRUE )
+                {
+                    result |= visitor( pChild, pVisitorContext );
+
+                    /* A '#' level also matches its parent level. */
+                    for( grandChild = pChild->firstChild;
+                         grandChild != ROUTER_NO_NODE;
+                         grandChild = routerNodes[ grandChild ].nextSibling )
+                    {
+                        if( ( routerNodes[ grandChild ].levelLength == 1U ) &&
+                            ( routerNodes[ grandChild ].pLevel[ 0 ] == '#' ) )
+                        {
+                            result |= visitor( &routerNodes[ grandChild ], pVisitorContext );
+                        }
+                    }
+                }
+                else if( depth < ROUTER_DISPATCH_STACK_SIZE )
+                {
+                    stack[ depth ].node = child;
+                    stack[ depth ].levelOffset = levelEnd + 1U;
+                    depth++;
+                }
+                else
+                {
+                    /* Cannot happen as filters are limited to MQTT_ROUTER_MAX_LEVELS levels. */
+                    configASSERT( depth < ROUTER_DISPATCH_STACK_SIZE );
+                }
+            }
+            else
+            {
+                /* Empty else marker. */
+            }
+        }
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t MQTTRouter_Dispatch( MQTTPublishInfo_t * pPublishInfo )
+{
+    return prvMatchRoutes( pPublishInfo->pTopicName,
+                           pPublishInfo->topicNameLength,
+                           prvInvokeHandler,
+                           pPublishInfo );
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t MQTTRouter_FindStreamRoute( const char * pTopicName,
+                                       uint16_t topicNameLength,
+                                       MQTTRouteStream_t * pRoute )
+{
+    MQTTRouteStream_t lookup = { 0 };
+    BaseType_t result;
+
+    result = prvMatchRoutes( pTopicName, topicNameLength, prvFindStreamHandler, &lookup );
+
+    if( result == pdTRUE )
+    {
+        *pRoute = lookup;
+    }
+
+    return result;
+}
@@ -0,0 +1,212 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Header file containing the MQTT subscription router APIs.
+ * The router maps topic filters, including the `+` and `#` wildcards, to handler functions. Filters are
+ * stored in a trie with one node per topic level, so that an incoming publish is dispatched to all the
+ * matching handlers in a single pass over its topic, whatever the number of registered filters.
+ * A filter can also be routed to a stream handler, which receives the payload in fragments so that
+ * publishes larger than the MQTT network buffer can be received, or which can loan a buffer that the
+ * MQTT agent reads the payload into without going through the network buffer.
+ */
+
+#ifndef MQTT_SUBSCRIPTION_ROUTER_H
+#define MQTT_SUBSCRIPTION_ROUTER_H
+
+/* FreeRTOS include. */
+#include "FreeRTOS.h"
+
+/* MQTT library include */
+#include "core_mqtt.h"
+
+/**
+ * @brief Maximum number of trie nodes, one per distinct topic level across all filters.
+ */
+#ifndef MQTT_ROUTER_MAX_NODES
+    #define MQTT_ROUTER_MAX_NODES    ( 48U )
+#endif
+
+/**
+ * @brief Maximum number of levels of a topic filter.
+ */
+#ifndef MQTT_ROUTER_MAX_LEVELS
+    #define MQTT_ROUTER_MAX_LEVELS    ( 8U )
+#endif
+
+/**
+ * @brief Handler invoked by the router for an incoming publish matching its topic filter.
+ *
+ * @param[in] pPublishInfo Deserialized publish.
+ * @param[in] pHandlerContext Context registered with the handler.
+ */
+typedef void ( * MQTTRouteHandler_t ) ( MQTTPublishInfo_t * pPublishInfo,
+                                        void * pHandlerContext );
+
+/**
+ * @brief Fragment of the payload of an incoming publish, passed to a stream handler.
+ * Fragments of a publish are passed in order, the first one with offset 0 and the last one ending at
+ * payloadLength. The data is only valid during the call.
+ */
+typedef struct MQTTRouteFragment
+{
+    const char * pTopicName;  /**< Topic of the publish. */
+    uint16_t topicNameLength; /**< Length of the topic. */
+    MQTTQoS_t qos;            /**< QoS of the publish. */
+    size_t payloadLength;     /**< Length of the whole payload. */
+    size_t offset;            /**< Offset of the fragment in the payload. */
+    const uint8_t * pData;    /**< Bytes of the fragment. */
+    size_t dataLength;        /**< Length of the fragment. */
+    BaseType_t isAborted;     /**< pdTRUE, with no data, if the rest of the publish will not be received. */
+} MQTTRouteFragment_t;
+
+/**
+ * @brief Handler invoked by the router or the MQTT agent for each fragment of an incoming publish
+ * matching its topic filter.
+ * @param[in] pFragment Fragment of the publish.
+ * @param[in] pHandlerContext Context registered with the handler.
+ */
+typedef void ( * MQTTRouteStreamHandler_t ) ( const MQTTRouteFragment_t * pFragment,
+                                              void * pHandlerContext );
+
+/**
+ * @brief Handler invoked by the MQTT agent before reading the payload of an incoming publish matching its
+ * topic filter, to loan the buffer the payload is read into.
+ * When a buffer is loaned, the stream handler then receives the whole payload as a single fragment
+ * whose data is the loaned buffer, or an aborted fragment if the publish could not be read. The buffer
+ * stays owned by the handlers, which release it once they are done with it.
+ *
+ * @param[in] pFragment Publish about to be read, with no data.
+ * @param[in] pHandlerContext Context registered with the handler.
+ * @return A buffer of at least pFragment->payloadLength bytes, or NULL to receive the payload in fragments.
+ */
+typedef uint8_t * ( * MQTTRouteLoanHandler_t ) ( const MQTTRouteFragment_t * pFragment,
+                                                 void * pHandlerContext );
+
+/**
+ * @brief Stream route of a topic, found by MQTTRouter_FindStreamRoute().
+ */
+typedef struct MQTTRouteStream
+{
+    MQTTRouteStreamHandler_t streamHandler; /**< Stream handler of the route. */
+    MQTTRouteLoanHandler_t loanHandler;     /**< Loan handler of the route, or NULL. */
+    void * pHandlerContext;                 /**< Context passed to the handlers. */
+} MQTTRouteStream_t;
+
+/**
+ * @brief Clears all the routes.
+ */
+void MQTTRouter_Init( void );
+
+/**
+ * @brief Registers a handler for a topic filter.
+ * The filter string is referenced by the router and must stay valid as long as the route exists.
+ * Routes can be added while publishes are being dispatched; a new route becomes visible atomically.
+ *
+ * @param[in] pTopicFilter Topic filter, which can contain the `+` and `#` wildcards.
+ * @param[in] topicFilterLength Length of the topic filter.
+ * @param[in] handler Handler invoked for matching publishes.
+ * @param[in] pHandlerContext Context passed to the handler.
+ * @return pdTRUE if the route was added, pdFALSE if the filter is invalid, already has a handler,
+ * or there are not enough nodes left.
+ */
+BaseType_t MQTTRouter_AddRoute( const char * pTopicFilter,
+                                uint16_t topicFilterLength,
+                                MQTTRouteHandler_t handler,
+                                void * pHandlerContext );
+
+/**
+ * @brief Registers a stream handler for a topic filter. Same as MQTTRouter_AddRoute() otherwise.
+ * Publishes which fit in the MQTT network buffer are passed to the handler as a single fragment;
+ * larger ones are passed in fragments as they are read from the connection.
+ * @param[in] pTopicFilter Topic filter, which can contain the `+` and `#` wildcards.
+ * @param[in] topicFilterLength Length of the topic filter.
+ * @param[in] streamHandler Stream handler invoked for matching publishes.
+ * @param[in] pHandlerContext Context passed to the handler.
+ * @return Same as MQTTRouter_AddRoute().
+ */
+BaseType_t MQTTRouter_AddStreamRoute( const char * pTopicFilter,
+                                      uint16_t topicFilterLength,
+                                      MQTTRouteStreamHandler_t streamHandler,
+                                      void * pHandlerContext );
+
+/**
+ * @brief Registers a stream handler with a loan handler for a topic filter. Same as
+ * MQTTRouter_AddStreamRoute() otherwise.
+ * The MQTT agent reads matching publishes, whatever their size, into the buffer loaned by the loan
+ * handler, which saves copying the payload out of the network buffer.
+ * @param[in] pTopicFilter Topic filter, which can contain the `+` and `#` wildcards.
+ * @param[in] topicFilterLength Length of the topic filter.
+ * @param[in] loanHandler Loan handler invoked for matching publishes.
+ * @param[in] streamHandler Stream handler invoked for matching publishes.
+ * @param[in] pHandlerContext Context passed to the handlers.
+ * @return Same as MQTTRouter_AddRoute().
+ */
+BaseType_t MQTTRouter_AddLoanRoute( const char * pTopicFilter,
+                                    uint16_t topicFilterLength,
+                                    MQTTRouteLoanHandler_t loanHandler,
+                                    MQTTRouteStreamHandler_t streamHandler,
+                                    void * pHandlerContext );
+
+/**
+ * @brief Dispatches an incoming publish to the handlers of all the matching topic filters.
+ * Follows the MQTT matching rules: `+` matches one level, `#` matches the parent level and any number
+ * of sub levels, and wildcards at the first level do not match topics starting with `$`.
+ *
+ * @param[in] pPublishInfo Deserialized publish.
+ * @return pdTRUE if at least one handler was invoked.
+ */
+BaseType_t MQTTRouter_Dispatch( MQTTPublishInfo_t * pPublishInfo );
+
+/**
+ * @brief Finds the stream route of a topic, used to stream a publish too large to be dispatched or to
+ * read a publish into a loaned buffer. Only the first matching stream route receives the fragments.
+ * @param[in] pTopicName Topic of the publish.
+ * @param[in] topicNameLength Length of the topic.
+ * @param[out] pRoute Set to the handlers of the stream route.
+ * @return pdTRUE if a stream route matches the topic.
+ */
+BaseType_t MQTTRouter_FindStreamRoute( const char * pTopicName,
+                                       uint16_t topicNameLength,
+                                       MQTTRouteStream_t * pRoute );
+
+/**
+ * @brief Flag which enables the router dispatch benchmark.
+ * When enabled, vMQTTRouterRunBenchmark() measures the dispatch cost of the router against chained
+ * MQTT_MatchTopic() calls for an increasing number of filters and prints the results.
+ */
+#ifndef MQTT_ROUTER_BENCHMARK_ENABLED
+    #define MQTT_ROUTER_BENCHMARK_ENABLED    ( 0 )
+#endif
+
+#if ( MQTT_ROUTER_BENCHMARK_ENABLED == 1 )
+
+/**
+ * @brief Runs the router dispatch benchmark. Resets the routes registered with the router.
+ */
+    void vMQTTRouterRunBenchmark( void );
+#endif
+
+#endif /* ifndef MQTT_SUBSCRIPTION_ROUTER_H */
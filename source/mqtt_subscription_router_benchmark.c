@@ -0,0 +1,234 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Benchmark of the MQTT subscription router.
+ * Registers an increasing number of topic filters shaped like the AWS IoT job and stream filters, and
+ * measures with the DWT cycle counter the cost of dispatching a publish which matches the last filter,
+ * using the router and using one MQTT_MatchTopic() call per filter as done before the router.
+ * Enable with MQTT_ROUTER_BENCHMARK_ENABLED and call vMQTTRouterRunBenchmark() from a task.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "fsl_device_registers.h"
+#include "fsl_debug_console.h"
+
+#include "mqtt_subscription_router.h"
+
+#if ( MQTT_ROUTER_BENCHMARK_ENABLED == 1 )
+
+/**
+ * @brief Largest number of filters registered by the benchmark.
+ */
+    #define BENCHMARK_MAX_FILTERS       ( 32U )
+
+/**
+ * @brief Number of dispatches measured for each number of filters.
+ */
+    #define BENCHMARK_ITERATIONS        ( 200U )
+
+/**
+ * @brief Size of the storage of each generated filter.
+ */
+    #define BENCHMARK_FILTER_SIZE       ( 48U )
+
+/**
+ * @brief Topic of the publish dispatched, matching the last filter registered.
+ */
+    #define BENCHMARK_TOPIC_FORMAT      "$aws/things/thing/streams/s%u/data/cbor"
+
+/**
+ * @brief Format of the generated filters.
+ */
+    #define BENCHMARK_FILTER_FORMAT     "$aws/things/+/streams/s%u/data/cbor"
+
+/**
+ * @brief Handler registered for all filters, counts invocations.
+ *
+ * @param[in] pPublishInfo Deserialized publish.
+ * @param[in] pHandlerContext Unused.
+ */
+    static void prvBenchmarkHandler( MQTTPublishInfo_t * pPublishInfo,
+                                     void * pHandlerContext );
+
+/**
+ * @brief Measures the average cycles of a dispatch with chained MQTT_MatchTopic() calls.
+ *
+ * @param[in] pPublishInfo Publish to dispatch.
+ * @param[in] numFilters Number of filters to match against.
+ * @return Average number of cycles per dispatch.
+ */
+    static uint32_t prvMeasureChainedMatch( MQTTPublishInfo_t * pPublishInfo,
+                                            uint32_t numFilters );
+
+/**
+ * @brief Measures the average cycles of a dispatch with the router.
+ *
+ * @param[in] pPublishInfo Publish to dispatch.
+ * @return Average number of cycles per dispatch.
+ */
+    static uint32_t prvMeasureRouterDispatch( MQTTPublishInfo_t * pPublishInfo );
+
+/**
+ * @brief Storage of the generated filters, referenced by the router.
+ */
+    static char benchmarkFilters[ BENCHMARK_MAX_FILTERS ][ BENCHMARK_FILTER_SIZE ];
+
+/**
+ * @brief Number of handler invocations.
+ */
+    static volatile uint32_t benchmarkHits = 0U;
+
+/*-----------------------------------------------------------*/
+
+    static void prvBenchmarkHandler( MQTTPublishInfo_t * pPublishInfo,
+                                     void * pHandlerContext )
+    {
+        ( void ) pPublishInfo;
+        ( void ) pHandlerContext;
+
+        benchmarkHits++;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static uint32_t prvMeasureChainedMatch( MQTTPublishInfo_t * pPublishInfo,
+                                            uint32_t numFilters )
+    {
+        uint32_t iteration;
+        uint32_t index;
+        uint32_t startCycles;
+        bool isMatched;
+
+        startCycles = DWT->CYCCNT;
+
+        for( iteration = 0U; iteration < BENCHMARK_ITERATIONS; iteration++ )
+        {
+            isMatched = false;
+
+            for( index = 0U; ( index < numFilters ) && ( isMatched == false ); index++ )
+            {
+                ( void ) MQTT_MatchTopic( pPublishInfo->pTopicName,
+                                          pPublishInfo->topicNameLength,
+                                          benchmarkFilters[ index ],
+                                          ( uint16_t ) strlen( benchmarkFilters[ index ] ),
+                                          &isMatched );
+            }
+
+            if( isMatched == true )
+            {
+                prvBenchmarkHandler( pPublishInfo, NULL );
+            }
+        }
+
+        return ( DWT->CYCCNT - startCycles ) / BENCHMARK_ITERATIONS;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static uint32_t prvMeasureRouterDispatch( MQTTPublishInfo_t * pPublishInfo )
+    {
+        uint32_t iteration;
+        uint32_t startCycles;
+
+        startCycles = DWT->CYCCNT;
+
+        for( iteration = 0U; iteration < BENCHMARK_ITERATIONS; iteration++ )
+        {
+            ( void ) MQTTRouter_Dispatch( pPublishInfo );
+        }
+
+        return ( DWT->CYCCNT - startCycles ) / BENCHMARK_ITERATIONS;
+    }
+
+/*-----------------------------------------------------------*/
+
+    void vMQTTRouterRunBenchmark( void )
+    {
+        MQTTPublishInfo_t publishInfo = { 0 };
+        char topic[ BENCHMARK_FILTER_SIZE ];
+        uint32_t numFilters;
+        uint32_t index;
+        uint32_t chainedCycles;
+        uint32_t routerCycles;
+        BaseType_t routeAdded;
+
+        /* Enable the cycle counter. */
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0U;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+        for( index = 0U; index < BENCHMARK_MAX_FILTERS; index++ )
+        {
+            ( void ) snprintf( benchmarkFilters[ index ], BENCHMARK_FILTER_SIZE, BENCHMARK_FILTER_FORMAT, ( unsigned int ) index );
+        }
+
+        PRINTF( "MQTT router benchmark, average cycles per dispatch:\r\n" );
+        PRINTF( "filters  chained MQTT_MatchTopic  router\r\n" );
+
+        for( numFilters = 1U; numFilters <= BENCHMARK_MAX_FILTERS; numFilters *= 2U )
+        {
+            MQTTRouter_Init();
+
+            for( index = 0U; index < numFilters; index++ )
+            {
+                routeAdded = MQTTRouter_AddRoute( benchmarkFilters[ index ],
+                                                  ( uint16_t ) strlen( benchmarkFilters[ index ] ),
+                                                  prvBenchmarkHandler,
+                                                  NULL );
+                configASSERT( routeAdded == pdTRUE );
+                ( void ) routeAdded;
+            }
+
+            ( void ) snprintf( topic, sizeof( topic ), BENCHMARK_TOPIC_FORMAT, ( unsigned int ) ( numFilters - 1U ) );
+            publishInfo.pTopicName = topic;
+            publishInfo.topicNameLength = ( uint16_t ) strlen( topic );
+
+            /* Run with the scheduler suspended so that context switches do not skew the measurement. */
+            vTaskSuspendAll();
+            {
+                benchmarkHits = 0U;
+                chainedCycles = prvMeasureChainedMatch( &publishInfo, numFilters );
+                routerCycles = prvMeasureRouterDispatch( &publishInfo );
+            }
+            ( void ) xTaskResumeAll();
+
+            configASSERT( benchmarkHits == ( 2U * BENCHMARK_ITERATIONS ) );
+
+            PRINTF( "%7u  %23u  %6u\r\n",
+                    ( unsigned int ) numFilters,
+                    ( unsigned int ) chainedCycles,
+                    ( unsigned int ) routerCycles );
+        }
+
+        MQTTRouter_Init();
+    }
+
+#endif /* if ( MQTT_ROUTER_BENCHMARK_ENABLED == 1 ) */
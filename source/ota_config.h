@@ -57,6 +57,15 @@
 
 #include "logging_stack.h"
 
+#include <stdint.h>
+
+/**
+ * @brief Gets the number of blocks of the next stream request, defined by the OTA demo in ota_update.c.
+ *
+ * @return Number of blocks, 1 to otaconfigREQUEST_WINDOW_MAX.
+ */
+uint32_t ulOTAGetRequestWindow( void );
+
 /**
  * @brief The number of words allocated to the stack for the OTA agent.
  */
@@ -113,8 +122,18 @@
  *  how many data blocks response is expected for each data requests.
  *  Please note that this must be set larger than zero.
  *
+ *  The demo adapts the number of blocks to the link, see the request window in ota_update.c. The
+ *  OTA agent reads it when it sends a request and when it starts counting the blocks to receive
+ *  before sending the next one, so the window follows the request cycle of the agent. It changes
+ *  when a request is sent, and applies to the request after it.
+ *
+ */
+#define otaconfigMAX_NUM_BLOCKS_REQUEST        ( ulOTAGetRequestWindow() )
+
+/**
+ * @brief The largest number of data blocks of the request window.
  */
-#define otaconfigMAX_NUM_BLOCKS_REQUEST        4U
+#define otaconfigREQUEST_WINDOW_MAX            8U
 
 /**
  * @brief The maximum number of requests allowed to send without a response before we abort.
@@ -129,9 +148,11 @@
  * @brief The number of data buffers reserved by the OTA agent.
  *
  * This configurations parameter sets the maximum number of static data buffers used by
- * the OTA agent for job and file data blocks received.
+ * the OTA agent for job and file data blocks received. It holds a whole window of requested
+ * blocks, plus the block being read by the MQTT agent and a job document, so that the blocks
+ * of a window are not dropped and requested again while the OTA agent writes to flash.
  */
-#define otaconfigMAX_NUM_OTA_DATA_BUFFERS      4U
+#define otaconfigMAX_NUM_OTA_DATA_BUFFERS      ( otaconfigREQUEST_WINDOW_MAX + 2U )
 
 /**
  * @brief The protocol selected for OTA control operations.
@@ -155,7 +176,7 @@
  * Enable data over HTTP - ( OTA_DATA_OVER_HTTP)
  * Enable data over both MQTT & HTTP ( OTA_DATA_OVER_MQTT | OTA_DATA_OVER_HTTP )
  */
-#define configENABLED_DATA_PROTOCOLS           ( OTA_DATA_OVER_MQTT )
+#define configENABLED_DATA_PROTOCOLS           ( OTA_DATA_OVER_MQTT | OTA_DATA_OVER_HTTP )
 
 /**
  * @brief The preferred protocol selected for OTA data operations.
@@ -183,4 +204,23 @@
 
 #define OTA_MAX_STREAM_NAME_SIZE    ( 64 )
 
+/**
+ * @brief Size of the buffer of the pre-signed URL of files downloaded over HTTP.
+ * Pre-signed S3 URLs carry the signature and the temporary credentials in their query, and are
+ * about 1.5 KB long.
+ */
+#define OTA_MAX_URL_SIZE            ( 2048 )
+
+/**
+ * @brief Size of the buffer of the authentication scheme of the URL.
+ */
+#define OTA_MAX_AUTH_SCHEME_SIZE    ( 64 )
+
+/**
+ * @brief Number of block requests kept in flight on the connection of a download over HTTP.
+ * The blocks of a request window are downloaded one after the other, the HTTP client requests the next
+ * blocks ahead of time so that the round trip time is paid once per connection rather than once per block.
+ */
+#define OTA_HTTP_PIPELINE_DEPTH     ( 4U )
+
 #endif /* _OTA_CONFIG_H */
@@ -0,0 +1,955 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Implementation of the OTA HTTP data client.
+ * The ranges requested and not yet received are kept in a ring, oldest first, in the order of their
+ * responses on the connection. When the range asked for is the oldest one in flight, its response is
+ * read and the ring is refilled with the ranges that follow the newest one, so the server always has
+ * the next requests queued. When another range is asked for, for instance a block the OTA agent
+ * requests again after a timeout, the responses in flight are read and discarded first.
+ * Requests are written in a transmit buffer and sent together, and response bodies are read straight
+ * into the buffer of the caller past the bytes already received with the header.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "fsl_debug_console.h"
+
+#include "ota_http.h"
+
+/**
+ * @brief Size of the buffer the requests are written in before being sent.
+ */
+#define OTA_HTTP_TX_BUFFER_SIZE         ( 512U )
+
+/**
+ * @brief Size of the buffer the responses are received in, holding at least a whole header line of interest.
+ */
+#define OTA_HTTP_RX_BUFFER_SIZE         ( 512U )
+
+/**
+ * @brief Size of the header lines parsed, longer lines are truncated.
+ */
+#define OTA_HTTP_MAX_LINE_SIZE          ( 128U )
+
+/**
+ * @brief Time in milliseconds to send a request or receive a response before the connection is closed.
+ */
+#define OTA_HTTP_TIMEOUT_MS             ( 10000U )
+
+/**
+ * @brief Timeout in milliseconds of a single send or receive on the socket.
+ */
+#define OTA_HTTP_SOCKET_TIMEOUT_MS      ( 1000U )
+
+/**
+ * @brief Default port of HTTPS URLs.
+ */
+#define OTA_HTTP_DEFAULT_PORT           ( 443U )
+
+/**
+ * @brief Scheme of the URLs.
+ */
+#define OTA_HTTP_SCHEME                 "https://"
+
+/**
+ * @brief Length of the scheme of the URLs.
+ */
+#define OTA_HTTP_SCHEME_LENGTH          ( sizeof( OTA_HTTP_SCHEME ) - 1U )
+
+/**
+ * @brief Status of a partial content response.
+ */
+#define OTA_HTTP_STATUS_PARTIAL         ( 206U )
+
+/**
+ * @brief Status of a whole content response, sent by servers ignoring the range.
+ */
+#define OTA_HTTP_STATUS_OK              ( 200U )
+
+/**
+ * @brief A range requested on the connection.
+ */
+typedef struct OTAHttpRange
+{
+    uint32_t start; /**< Offset of the first byte. */
+    uint32_t end;   /**< Offset of the last byte. */
+} OTAHttpRange_t;
+
+/**
+ * @brief Header of a response.
+ */
+typedef struct OTAHttpResponse
+{
+    uint32_t status;        /**< Status code. */
+    uint32_t contentLength; /**< Length of the body. */
+    uint32_t rangeStart;    /**< First byte of the Content-Range. */
+    uint32_t rangeEnd;      /**< Last byte of the Content-Range. */
+    uint32_t fileSize;      /**< Size of the file from the Content-Range, 0 if unknown. */
+    BaseType_t hasLength;   /**< pdTRUE if the response has a Content-Length. */
+    BaseType_t keepAlive;   /**< pdFALSE if the server closes the connection after the response. */
+} OTAHttpResponse_t;
+
+/**
+ * @brief Parses an HTTPS URL into the host, port and path of the client.
+ *
+ * @param[in] pUrl URL to parse.
+ * @return pdTRUE if the URL is valid.
+ */
+static BaseType_t prvParseUrl( const char * pUrl );
+
+/**
+ * @brief Opens the connection to the server.
+ *
+ * @return pdTRUE if the connection was established.
+ */
+static BaseType_t prvConnect( void );
+
+/**
+ * @brief Closes the connection, forgetting the ranges in flight.
+ */
+static void prvCloseConnection( void );
+
+/**
+ * @brief Writes bytes in the transmit buffer, sending the buffer whenever it is full.
+ *
+ * @param[in] pData Bytes to write.
+ * @param[in] length Number of bytes.
+ * @return pdTRUE on success.
+ */
+static BaseType_t prvWrite( const void * pData,
+                            size_t length );
+
+/**
+ * @brief Sends the bytes of the transmit buffer.
+ *
+ * @return pdTRUE on success.
+ */
+static BaseType_t prvFlush( void );
+
+/**
+ * @brief Writes the request of a range in the transmit buffer and adds it to the ranges in flight.
+ *
+ * @param[in] start Offset of the first byte.
+ * @param[in] end Offset of the last byte.
+ * @return pdTRUE on success.
+ */
+static BaseType_t prvQueueRequest( uint32_t start,
+                                   uint32_t end );
+
+/**
+ * @brief Receives bytes from the connection.
+ *
+ * @param[out] pBuffer Buffer receiving the bytes.
+ * @param[in] length Size of the buffer.
+ * @return Number of bytes received, or -1 on error or timeout.
+ */
+static int32_t prvReceive( uint8_t * pBuffer,
+                           size_t length );
+
+/**
+ * @brief Reads a header line without its line ending. The part of the line beyond the buffer is dropped.
+ *
+ * @param[out] pLine Buffer receiving the NUL terminated line.
+ * @param[in] lineSize Size of the buffer.
+ * @return Length of the line, or -1 on error.
+ */
+static int32_t prvReadLine( char * pLine,
+                            size_t lineSize );
+
+/**
+ * @brief Reads bytes of a body.
+ *
+ * @param[out] pBuffer Buffer receiving the bytes, or NULL to discard them.
+ * @param[in] length Number of bytes.
+ * @return pdTRUE on success.
+ */
+static BaseType_t prvReadBody( uint8_t * pBuffer,
+                               uint32_t length );
+
+/**
+ * @brief Reads the header of a response.
+ *
+ * @param[out] pResponse Parsed header.
+ * @return pdTRUE if a valid header was read.
+ */
+static BaseType_t prvReadResponseHeader( OTAHttpResponse_t * pResponse );
+
+/**
+ * @brief Reads the response to the oldest range in flight.
+ *
+ * @param[out] pBuffer Buffer receiving the body, or NULL to discard it.
+ * @param[in] bufferSize Size of the buffer.
+ * @return Length of the body, or -1 on error.
+ */
+static int32_t prvReadResponse( uint8_t * pBuffer,
+                                uint32_t bufferSize );
+
+/**
+ * @brief Checks if a header line starts with a header name, ignoring the case.
+ *
+ * @param[in] pLine Header line.
+ * @param[in] pName Header name, in lower case and followed by a colon.
+ * @return Pointer to the value of the header, or NULL if the name does not match.
+ */
+static const char * prvHeaderValue( const char * pLine,
+                                    const char * pName );
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Host of the URL.
+ */
+static char host[ OTA_HTTP_MAX_HOST_SIZE ];
+
+/**
+ * @brief Port of the URL.
+ */
+static uint16_t port = 0U;
+
+/**
+ * @brief Path and query of the URL, pointing in the URL given to OTAHttp_Connect(), or NULL if no URL is set.
+ */
+static const char * pPath = NULL;
+
+/**
+ * @brief Credentials of the connection.
+ */
+static const NetworkCredentials_t * pNetworkCredentials = NULL;
+
+/**
+ * @brief Number of range requests kept in flight.
+ */
+static uint32_t pipelineDepth = 1U;
+
+/**
+ * @brief Connection to the server.
+ */
+static NetworkContext_t networkContext;
+
+/**
+ * @brief pdTRUE while the connection is open.
+ */
+static BaseType_t isConnected = pdFALSE;
+
+/**
+ * @brief Ranges in flight, oldest first.
+ */
+static OTAHttpRange_t inFlight[ OTA_HTTP_MAX_PIPELINE_DEPTH ];
+
+/**
+ * @brief Index of the oldest range in flight.
+ */
+static uint32_t inFlightHead = 0U;
+
+/**
+ * @brief Number of ranges in flight.
+ */
+static uint32_t inFlightCount = 0U;
+
+/**
+ * @brief Size of the file, learnt from the first response, 0 until then.
+ */
+static uint32_t fileSize = 0U;
+
+/**
+ * @brief Requests waiting to be sent.
+ */
+static uint8_t txBuffer[ OTA_HTTP_TX_BUFFER_SIZE ];
+
+/**
+ * @brief Number of bytes in the transmit buffer.
+ */
+static size_t txLength = 0U;
+
+/**
+ * @brief Bytes received and not yet parsed.
+ */
+static uint8_t rxBuffer[ OTA_HTTP_RX_BUFFER_SIZE ];
+
+/**
+ * @brief Offset of the first byte not yet parsed in the receive buffer.
+ */
+static size_t rxStart = 0U;
+
+/**
+ * @brief Number of bytes in the receive buffer.
+ */
+static size_t rxEnd = 0U;
+
+/**
+ * @brief Statistics of the client.
+ */
+static OTAHttpStats_t httpStats = { 0 };
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvParseUrl( const char * pUrl )
+{
+    BaseType_t result = pdTRUE;
+    const char * pHost;
+    const char * pHostEnd;
+    size_t hostLength;
+    uint32_t urlPort = OTA_HTTP_DEFAULT_PORT;
+
+    if( strncmp( pUrl, OTA_HTTP_SCHEME, OTA_HTTP_SCHEME_LENGTH ) != 0 )
+    {
+        PRINTF( "OTA HTTP: only %s URLs are supported.\r\n", OTA_HTTP_SCHEME );
+        result = pdFALSE;
+    }
+
+    if( result == pdTRUE )
+    {
+        pHost = &pUrl[ OTA_HTTP_SCHEME_LENGTH ];
+        hostLength = strcspn( pHost, ":/?" );
+        pHostEnd = &pHost[ hostLength ];
+
+        if( ( hostLength == 0U ) || ( hostLength >= sizeof( host ) ) )
+        {
+            PRINTF( "OTA HTTP: invalid host in URL.\r\n" );
+            result = pdFALSE;
+        }
+    }
+
+    if( ( result == pdTRUE ) && ( *pHostEnd == ':' ) )
+    {
+        urlPort = 0U;
+
+        for( pHostEnd++; ( *pHostEnd >= '0' ) && ( *pHostEnd <= '9' ) && ( urlPort <= UINT16_MAX ); pHostEnd++ )
+        {
+            urlPort = ( urlPort * 10U ) + ( uint32_t ) ( *pHostEnd - '0' );
+        }
+
+        if( ( urlPort == 0U ) || ( urlPort > UINT16_MAX ) )
+        {
+            PRINTF( "OTA HTTP: invalid port in URL.\r\n" );
+            result = pdFALSE;
+        }
+    }
+
+    if( result == pdTRUE )
+    {
+        memcpy( host, pHost, hostLength );
+        host[ hostLength ] = '\0';
+        port = ( uint16_t ) urlPort;
+
+        /* A URL without path requests the root. */
+        pPath = ( *pHostEnd == '/' ) ? pHostEnd : ( ( *pHostEnd == '\0' ) ? "/" : NULL );
+
+        if( pPath == NULL )
+        {
+            PRINTF( "OTA HTTP: invalid path in URL.\r\n" );
+            result = pdFALSE;
+        }
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvConnect( void )
+{
+    BaseType_t result = pdTRUE;
+
+    inFlightHead = 0U;
+    inFlightCount = 0U;
+    txLength = 0U;
+    rxStart = 0U;
+    rxEnd = 0U;
+
+    if( TLS_FreeRTOS_Connect( &networkContext,
+                              host,
+                              port,
+                              pNetworkCredentials,
+                              OTA_HTTP_SOCKET_TIMEOUT_MS,
+                              OTA_HTTP_SOCKET_TIMEOUT_MS ) != TLS_TRANSPORT_SUCCESS )
+    {
+        PRINTF( "OTA HTTP: failed to connect to %s:%u.\r\n", host, port );
+        result = pdFALSE;
+    }
+    else
+    {
+        isConnected = pdTRUE;
+        httpStats.connections++;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCloseConnection( void )
+{
+    if( isConnected == pdTRUE )
+    {
+        TLS_FreeRTOS_Disconnect( &networkContext );
+        isConnected = pdFALSE;
+    }
+
+    inFlightHead = 0U;
+    inFlightCount = 0U;
+    txLength = 0U;
+    rxStart = 0U;
+    rxEnd = 0U;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvFlush( void )
+{
+    BaseType_t result = pdTRUE;
+    TickType_t startTicks = xTaskGetTickCount();
+    size_t sent = 0U;
+    int32_t bytes;
+
+    while( ( result == pdTRUE ) && ( sent < txLength ) )
+    {
+        bytes = TLS_FreeRTOS_send( &networkContext, &txBuffer[ sent ], txLength - sent );
+
+        if( bytes > 0 )
+        {
+            sent += ( size_t ) bytes;
+        }
+        else if( ( bytes < 0 ) || ( ( xTaskGetTickCount() - startTicks ) > pdMS_TO_TICKS( OTA_HTTP_TIMEOUT_MS ) ) )
+        {
+            PRINTF( "OTA HTTP: failed to send requests, error %d.\r\n", bytes );
+            result = pdFALSE;
+        }
+        else
+        {
+            /* Empty else marker. */
+        }
+    }
+
+    txLength = 0U;
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvWrite( const void * pData,
+                            size_t length )
+{
+    BaseType_t result = pdTRUE;
+    const uint8_t * pBytes = ( const uint8_t * ) pData;
+    size_t chunk;
+
+    while( ( result == pdTRUE ) && ( length > 0U ) )
+    {
+        if( txLength == sizeof( txBuffer ) )
+        {
+            result = prvFlush();
+        }
+
+        chunk = sizeof( txBuffer ) - txLength;
+        chunk = ( length < chunk ) ? length : chunk;
+        memcpy( &txBuffer[ txLength ], pBytes, chunk );
+        txLength += chunk;
+        pBytes += chunk;
+        length -= chunk;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvQueueRequest( uint32_t start,
+                                   uint32_t end )
+{
+    BaseType_t result;
+    char headers[ 64 ];
+    int headersLength;
+
+    headersLength = snprintf( headers, sizeof( headers ), "\r\nRange: bytes=%u-%u\r\n\r\n",
+                              ( unsigned int ) start, ( unsigned int ) end );
+
+    /* The path is written as is, pre-signed URLs are already percent-encoded. Connections are kept
+     * alive by default in HTTP/1.1. */
+    result = ( prvWrite( "GET ", 4U ) == pdTRUE ) &&
+             ( prvWrite( pPath, strlen( pPath ) ) == pdTRUE ) &&
+             ( prvWrite( " HTTP/1.1\r\nHost: ", 17U ) == pdTRUE ) &&
+             ( prvWrite( host, strlen( host ) ) == pdTRUE ) &&
+             ( prvWrite( headers, ( size_t ) headersLength ) == pdTRUE );
+
+    if( result == pdTRUE )
+    {
+        inFlight[ ( inFlightHead + inFlightCount ) % OTA_HTTP_MAX_PIPELINE_DEPTH ].start = start;
+        inFlight[ ( inFlightHead + inFlightCount ) % OTA_HTTP_MAX_PIPELINE_DEPTH ].end = end;
+        inFlightCount++;
+        httpStats.requests++;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvReceive( uint8_t * pBuffer,
+                           size_t length )
+{
+    TickType_t startTicks = xTaskGetTickCount();
+    int32_t bytes = 0;
+
+    /* A receive also returns 0 without waiting for the socket timeout on TLS records without
+     * application data, so the timeout is checked separately. */
+    while( bytes == 0 )
+    {
+        bytes = TLS_FreeRTOS_recv( &networkContext, pBuffer, length );
+
+        if( ( bytes == 0 ) && ( ( xTaskGetTickCount() - startTicks ) > pdMS_TO_TICKS( OTA_HTTP_TIMEOUT_MS ) ) )
+        {
+            bytes = -1;
+        }
+    }
+
+    if( bytes < 0 )
+    {
+        PRINTF( "OTA HTTP: failed to receive a response, error %d.\r\n", bytes );
+        bytes = -1;
+    }
+
+    return bytes;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvReadLine( char * pLine,
+                            size_t lineSize )
+{
+    int32_t lineLength = 0;
+    int32_t bytes;
+    uint8_t c = 0U;
+
+    while( c != ( uint8_t ) '\n' )
+    {
+        if( rxStart == rxEnd )
+        {
+            bytes = prvReceive( rxBuffer, sizeof( rxBuffer ) );
+
+            if( bytes < 0 )
+            {
+                lineLength = -1;
+                break;
+            }
+
+            rxStart = 0U;
+            rxEnd = ( size_t ) bytes;
+        }
+
+        c = rxBuffer[ rxStart++ ];
+
+        if( ( c != ( uint8_t ) '\r' ) && ( c != ( uint8_t ) '\n' ) && ( ( size_t ) lineLength < ( lineSize - 1U ) ) )
+        {
+            pLine[ lineLength++ ] = ( char ) c;
+        }
+    }
+
+    if( lineLength >= 0 )
+    {
+        pLine[ lineLength ] = '\0';
+    }
+
+    return lineLength;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvReadBody( uint8_t * pBuffer,
+                               uint32_t length )
+{
+    BaseType_t result = pdTRUE;
+    uint32_t chunk;
+    int32_t bytes;
+
+    while( ( result == pdTRUE ) && ( length > 0U ) )
+    {
+        if( rxStart < rxEnd )
+        {
+            /* Bytes received with the header or with the previous response. */
+            chunk = ( uint32_t ) ( rxEnd - rxStart );
+            chunk = ( length < chunk ) ? length : chunk;
+
+            if( pBuffer != NULL )
+            {
+                memcpy( pBuffer, &rxBuffer[ rxStart ], chunk );
+                pBuffer += chunk;
+            }
+
+            rxStart += chunk;
+            length -= chunk;
+        }
+        else if( pBuffer != NULL )
+        {
+            /* The rest of the body is received in place. */
+            bytes = prvReceive( pBuffer, length );
+
+            if( bytes < 0 )
+            {
+                result = pdFALSE;
+            }
+            else
+            {
+                pBuffer += bytes;
+                length -= ( uint32_t ) bytes;
+            }
+        }
+        else
+        {
+            bytes = prvReceive( rxBuffer, sizeof( rxBuffer ) );
+
+            if( bytes < 0 )
+            {
+                result = pdFALSE;
+            }
+            else
+            {
+                rxStart = 0U;
+                rxEnd = ( size_t ) bytes;
+            }
+        }
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static const char * prvHeaderValue( const char * pLine,
+                                    const char * pName )
+{
+    const char * pValue = pLine;
+
+    while( ( *pName != '\0' ) && ( pValue != NULL ) )
+    {
+        if( ( ( *pValue >= 'A' ) && ( *pValue <= 'Z' ) ? ( *pValue + ( 'a' - 'A' ) ) : *pValue ) == *pName )
+        {
+            pValue++;
+            pName++;
+        }
+        else
+        {
+            pValue = NULL;
+        }
+    }
+
+    if( pValue != NULL )
+    {
+        while( *pValue == ' ' )
+        {
+            pValue++;
+        }
+    }
+
+    return pValue;
+}
+
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvReadResponseHeader( OTAHttpResponse_t * pResponse )
+{
+    BaseType_t result = pdTRUE;
+    char line[ OTA_HTTP_MAX_LINE_SIZE ];
+    const char * pValue;
+    unsigned int status = 0U;
+    unsigned int start;
+    unsigned int end;
+    unsigned int total;
+    unsigned int length;
+    int32_t lineLength;
+
+    memset( pResponse, 0, sizeof( OTAHttpResponse_t ) );
+    pResponse->keepAlive = pdTRUE;
+
+    if( ( prvReadLine( line, sizeof( line ) ) < 0 ) ||
+        ( sscanf( line, "HTTP/1.%*u %u", &status ) != 1 ) )
+    {
+        PRINTF( "OTA HTTP: invalid status line.\r\n" );
+        result = pdFALSE;
+    }
+
+    pResponse->status = status;
+
+    while( result == pdTRUE )
+    {
+        lineLength = prvReadLine( line, sizeof( line ) );
+
+        if( lineLength < 0 )
+        {
+            result = pdFALSE;
+        }
+        else if( lineLength == 0 )
+        {
+            /* End of the header. */
+            break;
+        }
+        else if( ( pValue = prvHeaderValue( line, "content-length:" ) ) != NULL )
+        {
+            if( sscanf( pValue, "%u", &length ) == 1 )
+            {
+                pResponse->contentLength = length;
+                pResponse->hasLength = pdTRUE;
+            }
+        }
+        else if( ( pValue = prvHeaderValue( line, "content-range:" ) ) != NULL )
+        {
+            if( sscanf( pValue, "bytes %u-%u/%u", &start, &end, &total ) == 3 )
+            {
+                pResponse->rangeStart = start;
+                pResponse->rangeEnd = end;
+                pResponse->fileSize = total;
+            }
+        }
+        else if( ( pValue = prvHeaderValue( line, "connection:" ) ) != NULL )
+        {
+            if( prvHeaderValue( pValue, "close" ) != NULL )
+            {
+                pResponse->keepAlive = pdFALSE;
+            }
+        }
+        else
+        {
+            /* Empty else marker. */
+        }
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvReadResponse( uint8_t * pBuffer,
+                                uint32_t bufferSize )
+{
+    OTAHttpResponse_t response;
+    const OTAHttpRange_t * pRange = &inFlight[ inFlightHead ];
+    uint32_t rangeLength = pRange->end - pRange->start + 1U;
+    int32_t bodyLength = -1;
+
+    inFlightHead = ( inFlightHead + 1U ) % OTA_HTTP_MAX_PIPELINE_DEPTH;
+    inFlightCount--;
+
+    if( prvReadResponseHeader( &response ) == pdTRUE )
+    {
+        httpStats.responses++;
+
+        /* The server cuts a range running past the end of the file. */
+        if( response.hasLength == pdFALSE )
+        {
+            PRINTF( "OTA HTTP: response without Content-Length.\r\n" );
+        }
+        else if( ( response.status == OTA_HTTP_STATUS_PARTIAL ) &&
+                 ( response.rangeStart == pRange->start ) &&
+                 ( response.rangeEnd <= pRange->end ) &&
+                 ( response.contentLength == ( response.rangeEnd - response.rangeStart + 1U ) ) )
+        {
+            bodyLength = ( int32_t ) response.contentLength;
+            fileSize = response.fileSize;
+        }
+        else if( ( response.status == OTA_HTTP_STATUS_OK ) &&
+                 ( pRange->start == 0U ) &&
+                 ( response.contentLength <= rangeLength ) )
+        {
+            /* The range covers the whole file. */
+            bodyLength = ( int32_t ) response.contentLength;
+            fileSize = response.contentLength;
+        }
+        else
+        {
+            PRINTF( "OTA HTTP: unexpected response %u to the range %u-%u.\r\n",
+                    response.status, pRange->start, pRange->end );
+        }
+
+        if( ( bodyLength >= 0 ) && ( pBuffer != NULL ) && ( ( uint32_t ) bodyLength > bufferSize ) )
+        {
+            bodyLength = -1;
+        }
+
+        if( ( bodyLength >= 0 ) && ( prvReadBody( pBuffer, ( uint32_t ) bodyLength ) == pdTRUE ) )
+        {
+            httpStats.bodyBytes += ( uint32_t ) bodyLength;
+        }
+        else
+        {
+            bodyLength = -1;
+        }
+
+        if( ( bodyLength < 0 ) || ( response.keepAlive == pdFALSE ) )
+        {
+            /* The connection cannot carry the responses in flight any more. */
+            prvCloseConnection();
+        }
+    }
+    else
+    {
+        prvCloseConnection();
+    }
+
+    return bodyLength;
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t OTAHttp_Connect( const char * pUrl,
+                            const NetworkCredentials_t * pCredentials,
+                            uint32_t depth )
+{
+    BaseType_t result = pdFALSE;
+
+    OTAHttp_Disconnect();
+
+    if( ( pUrl != NULL ) && ( pCredentials != NULL ) && ( prvParseUrl( pUrl ) == pdTRUE ) )
+    {
+        pNetworkCredentials = pCredentials;
+        pipelineDepth = ( depth == 0U ) ? 1U : ( ( depth > OTA_HTTP_MAX_PIPELINE_DEPTH ) ? OTA_HTTP_MAX_PIPELINE_DEPTH : depth );
+        memset( &httpStats, 0, sizeof( httpStats ) );
+        fileSize = 0U;
+
+        result = prvConnect();
+
+        if( result != pdTRUE )
+        {
+            pPath = NULL;
+        }
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+int32_t OTAHttp_GetRange( uint32_t rangeStart,
+                          uint32_t rangeEnd,
+                          uint8_t * pBuffer,
+                          uint32_t bufferSize )
+{
+    int32_t received = -1;
+    uint32_t attempt;
+    uint32_t rangeLength = rangeEnd - rangeStart + 1U;
+    uint32_t nextStart;
+    uint32_t nextEnd;
+    BaseType_t result;
+    BaseType_t isReused = pdTRUE;
+    const OTAHttpRange_t * pRange;
+
+    if( ( pPath == NULL ) || ( pBuffer == NULL ) || ( rangeEnd < rangeStart ) || ( rangeLength > bufferSize ) )
+    {
+        return -1;
+    }
+
+    /* The server cuts a range running past the end of the file, so does the range in flight. */
+    if( ( fileSize > 0U ) && ( rangeEnd >= fileSize ) )
+    {
+        rangeEnd = fileSize - 1U;
+    }
+
+    /* A server closing an idle kept alive connection is only noticed when the request fails, so the
+     * request is sent again once on a new connection. */
+    for( attempt = 0U; ( attempt < 2U ) && ( received < 0 ) && ( isReused == pdTRUE ); attempt++ )
+    {
+        result = pdTRUE;
+        isReused = isConnected;
+
+        /* Discard the responses in flight up to the range asked for. */
+        while( ( isConnected == pdTRUE ) && ( inFlightCount > 0U ) &&
+               ( ( inFlight[ inFlightHead ].start != rangeStart ) || ( inFlight[ inFlightHead ].end != rangeEnd ) ) )
+        {
+            httpStats.discarded++;
+            ( void ) prvReadResponse( NULL, 0U );
+        }
+
+        if( isConnected == pdFALSE )
+        {
+            result = prvConnect();
+        }
+
+        if( ( result == pdTRUE ) && ( inFlightCount == 0U ) )
+        {
+            result = prvQueueRequest( rangeStart, rangeEnd );
+        }
+
+        /* Request the ranges of the same size which follow, up to the end of the file once its size
+         * is known, and the range asked for only until then. */
+        while( ( result == pdTRUE ) && ( inFlightCount < pipelineDepth ) && ( fileSize > 0U ) )
+        {
+            pRange = &inFlight[ ( inFlightHead + inFlightCount - 1U ) % OTA_HTTP_MAX_PIPELINE_DEPTH ];
+            nextStart = pRange->end + 1U;
+
+            if( nextStart >= fileSize )
+            {
+                break;
+            }
+
+            nextEnd = ( ( fileSize - nextStart ) > rangeLength ) ? ( nextStart + rangeLength - 1U ) : ( fileSize - 1U );
+            result = prvQueueRequest( nextStart, nextEnd );
+        }
+
+        if( ( result == pdTRUE ) && ( txLength > 0U ) )
+        {
+            result = prvFlush();
+        }
+
+        if( result == pdTRUE )
+        {
+            received = prvReadResponse( pBuffer, bufferSize );
+        }
+        else
+        {
+            prvCloseConnection();
+        }
+    }
+
+    return received;
+}
+
+/*-----------------------------------------------------------*/
+
+void OTAHttp_Disconnect( void )
+{
+    prvCloseConnection();
+    pPath = NULL;
+    pNetworkCredentials = NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+void OTAHttp_GetStats( OTAHttpStats_t * pStats )
+{
+    *pStats = httpStats;
+}
+
+/*-----------------------------------------------------------*/
+
+uint32_t OTAHttp_GetFileSize( void )
+{
+    return fileSize;
+}
@@ -0,0 +1,148 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Header file containing the APIs of the OTA HTTP data client.
+ * The client downloads the OTA file from the pre-signed URL of the OTA job with HTTP/1.1 range
+ * requests over a TLS connection kept alive for the whole file. The blocks are asked for one at a
+ * time, so the client sends the requests for the blocks following the one asked for ahead of time,
+ * pipelined on the connection, and the next blocks are already on their way when they are asked for.
+ */
+
+#ifndef OTA_HTTP_H
+#define OTA_HTTP_H
+
+/* FreeRTOS include. */
+#include "FreeRTOS.h"
+
+/* Transport include. */
+#include "tls_freertos_pkcs11.h"
+
+/**
+ * @brief Largest number of range requests in flight on the connection.
+ */
+#ifndef OTA_HTTP_MAX_PIPELINE_DEPTH
+    #define OTA_HTTP_MAX_PIPELINE_DEPTH    ( 8U )
+#endif
+
+/**
+ * @brief Largest host name of the URL.
+ */
+#ifndef OTA_HTTP_MAX_HOST_SIZE
+    #define OTA_HTTP_MAX_HOST_SIZE    ( 128U )
+#endif
+
+/**
+ * @brief Statistics of the client since the URL was set.
+ */
+typedef struct OTAHttpStats
+{
+    uint32_t connections;   /**< TLS connections opened. */
+    uint32_t requests;      /**< Range requests sent. */
+    uint32_t responses;     /**< Responses received, including the ones discarded. */
+    uint32_t discarded;     /**< Responses to requests sent ahead of time which were not used. */
+    uint32_t bodyBytes;     /**< Bytes of file received. */
+} OTAHttpStats_t;
+
+/**
+ * @brief Sets the URL of the file and the credentials of its server, and connects to the server.
+ * The URL and the credentials are referenced until OTAHttp_Disconnect() is called.
+ *
+ * @param[in] pUrl HTTPS URL of the file, NUL terminated.
+ * @param[in] pCredentials Credentials of the TLS connection. The ALPN protocols are not used.
+ * @param[in] depth Number of range requests kept in flight, 1 to disable the pipelining.
+ * @return pdTRUE if the URL is valid and the connection was established.
+ */
+BaseType_t OTAHttp_Connect( const char * pUrl,
+                            const NetworkCredentials_t * pCredentials,
+                            uint32_t depth );
+
+/**
+ * @brief Gets a range of the file. The requests for the ranges of the same size that follow are
+ * sent ahead of time, and the connection is opened again if the server closed it.
+ *
+ * @param[in] rangeStart Offset of the first byte.
+ * @param[in] rangeEnd Offset of the last byte.
+ * @param[out] pBuffer Buffer receiving the bytes.
+ * @param[in] bufferSize Size of the buffer.
+ * @return Number of bytes received, or -1 on error.
+ */
+int32_t OTAHttp_GetRange( uint32_t rangeStart,
+                          uint32_t rangeEnd,
+                          uint8_t * pBuffer,
+                          uint32_t bufferSize );
+
+/**
+ * @brief Closes the connection and forgets the URL.
+ */
+void OTAHttp_Disconnect( void );
+
+/**
+ * @brief Gets the statistics of the client.
+ *
+ * @param[out] pStats Statistics.
+ */
+void OTAHttp_GetStats( OTAHttpStats_t * pStats );
+
+/**
+ * @brief Gets the size of the file, known once a range was received.
+ *
+ * @return Size of the file, or 0 if unknown.
+ */
+uint32_t OTAHttp_GetFileSize( void );
+
+/**
+ * @brief Flag which enables the HTTP download benchmark.
+ * When enabled, vOTAHttpRunBenchmark() downloads a file in OTA blocks with an increasing pipeline
+ * depth and prints the throughput, to compare with the throughput of the MQTT downloads that the OTA
+ * demo prints when it closes a file.
+ */
+#ifndef OTA_HTTP_BENCHMARK_ENABLED
+    #define OTA_HTTP_BENCHMARK_ENABLED    ( 0 )
+#endif
+
+#if ( OTA_HTTP_BENCHMARK_ENABLED == 1 )
+
+/**
+ * @brief URL of the file downloaded by the benchmark, served by tools/ota_http_server.py.
+ */
+    #ifndef OTA_HTTP_BENCHMARK_URL
+        #define OTA_HTTP_BENCHMARK_URL    "https://192.168.0.100:8443/image.bin"
+    #endif
+
+/**
+ * @brief Root CA of the certificate of the server, printed as a C string by tools/ota_http_server.py.
+ */
+    #ifndef OTA_HTTP_BENCHMARK_ROOT_CA_PEM
+        #error "Define OTA_HTTP_BENCHMARK_ROOT_CA_PEM with the certificate printed by tools/ota_http_server.py."
+    #endif
+
+/**
+ * @brief Runs the HTTP download benchmark. The network must be up.
+ */
+    void vOTAHttpRunBenchmark( void );
+#endif
+
+#endif /* ifndef OTA_HTTP_H */
@@ -0,0 +1,132 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/**
+ * @brief Benchmark of the OTA HTTP data client.
+ * Downloads the file served by tools/ota_http_server.py in blocks of the OTA block size, one range
+ * request per block as the OTA agent does, with an increasing number of requests in flight. Depth 1
+ * is a plain keep-alive download, waiting a round trip per block like an MQTT stream request of one
+ * block. The MQTT throughput of a real OTA job is printed by the OTA demo when the file is closed.
+ * Enable with OTA_HTTP_BENCHMARK_ENABLED and call vOTAHttpRunBenchmark() once the network is up.
+ */
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "fsl_debug_console.h"
+
+#include "ota_http.h"
+
+#if ( OTA_HTTP_BENCHMARK_ENABLED == 1 )
+
+/**
+ * @brief Size of the blocks requested, the OTA block size of otaconfigLOG2_FILE_BLOCK_SIZE.
+ */
+    #define BENCHMARK_BLOCK_SIZE         ( 1024U )
+
+/**
+ * @brief Number of pipeline depths measured.
+ */
+    #define BENCHMARK_NUM_DEPTHS         ( 4U )
+
+/**
+ * @brief Pipeline depths measured.
+ */
+    static const uint32_t benchmarkDepths[ BENCHMARK_NUM_DEPTHS ] = { 1U, 2U, 4U, 8U };
+
+/**
+ * @brief Buffer receiving the blocks.
+ */
+    static uint8_t benchmarkBlock[ BENCHMARK_BLOCK_SIZE ];
+
+/**
+ * @brief Root CA of the server.
+ */
+    static const char benchmarkRootCa[] = OTA_HTTP_BENCHMARK_ROOT_CA_PEM;
+
+/*-----------------------------------------------------------*/
+
+    void vOTAHttpRunBenchmark( void )
+    {
+        NetworkCredentials_t credentials = { 0 };
+        OTAHttpStats_t stats;
+        TickType_t startTicks;
+        uint32_t elapsedMs;
+        uint32_t offset;
+        uint32_t depthIndex;
+        int32_t received;
+
+        credentials.pRootCa = ( const unsigned char * ) benchmarkRootCa;
+        credentials.rootCaSize = sizeof( benchmarkRootCa );
+
+        PRINTF( "OTA HTTP benchmark, %u byte blocks from %s\r\n", BENCHMARK_BLOCK_SIZE, OTA_HTTP_BENCHMARK_URL );
+        PRINTF( " Depth     Bytes   Time (ms)   Throughput (B/s)   Connections   Discarded\r\n" );
+
+        for( depthIndex = 0U; depthIndex < BENCHMARK_NUM_DEPTHS; depthIndex++ )
+        {
+            startTicks = xTaskGetTickCount();
+            offset = 0U;
+            received = -1;
+
+            if( OTAHttp_Connect( OTA_HTTP_BENCHMARK_URL, &credentials, benchmarkDepths[ depthIndex ] ) == pdTRUE )
+            {
+                do
+                {
+                    received = OTAHttp_GetRange( offset,
+                                                 offset + BENCHMARK_BLOCK_SIZE - 1U,
+                                                 benchmarkBlock,
+                                                 sizeof( benchmarkBlock ) );
+
+                    if( received > 0 )
+                    {
+                        offset += ( uint32_t ) received;
+                    }
+                } while( ( received > 0 ) && ( offset < OTAHttp_GetFileSize() ) );
+            }
+
+            elapsedMs = ( uint32_t ) ( ( xTaskGetTickCount() - startTicks ) * portTICK_PERIOD_MS );
+            OTAHttp_GetStats( &stats );
+            OTAHttp_Disconnect();
+
+            if( received < 0 )
+            {
+                PRINTF( " %5u   download failed at offset %u\r\n", benchmarkDepths[ depthIndex ], offset );
+            }
+            else
+            {
+                PRINTF( " %5u   %7u   %9u   %16u   %11u   %9u\r\n",
+                        benchmarkDepths[ depthIndex ],
+                        offset,
+                        elapsedMs,
+                        ( uint32_t ) ( ( ( uint64_t ) offset * 1000U ) / ( ( elapsedMs > 0U ) ? elapsedMs : 1U ) ),
+                        stats.connections,
+                        stats.discarded );
+            }
+        }
+    }
+
+#endif /* if ( OTA_HTTP_BENCHMARK_ENABLED == 1 ) */
@@ -27,82 +27,1579 @@
  * @brief File contains OTA platform layer abstraction implementations using NXP SDK.
  */
 
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
 #include "ota_pal.h"
+#include "ota_update.h"
 #include "fsl_debug_console.h"
 #include "spifi_boot.h"
 #include "mflash_drv.h"
+#include "crc32.h"
+
+/**
+ * @brief The maximum size of each image slots.
+ * Flash memory is divided in such a way there are 3 slots one for the current image
+ * being executed, one for new image being written to and one for the backup image.
+ * An image linked for the slot it is written to is executed in place by the bootloader, which
+ * leaves the backup slot unused.
+ */
+#define OTA_IMAGE_SLOT_SIZE      ( BOOT_SLOT_SIZE )
+
+/**
+ * @brief The flash address where the new image will be written to, the image slot not executing.
+ */
+#define OTA_UPDATE_IMAGE_ADDR    ( ( ( uint32_t ) boot_exec_image() == BOOT_SLOT_B_ADDR ) ? BOOT_SLOT_A_ADDR : BOOT_SLOT_B_ADDR )
+
+/**
+ * @brief The flash address where the backup image will be stored for rollback, when the new image
+ * is installed by copy at the execution address.
+ */
+#define OTA_BACKUP_IMAGE_ADDR    ( BOOT_EXEC_IMAGE_ADDR + 2 * OTA_IMAGE_SLOT_SIZE )
+
+/**
+ * @brief Maximum size an offset of a firmware image can go in flash.
+ */
+#define OTA_MAX_IMAGE_SIZE       ( OTA_IMAGE_SLOT_SIZE )
+
+/**
+ * @brief Pointer representation of the new firmware image in flash
+ */
+#define OTA_UPDATE_IMAGE_PTR     ( ( void * ) OTA_UPDATE_IMAGE_ADDR )
+
+/**
+ * @brief Pointer representation of the backup firmware image in flash
+ */
+#define OTA_BACKUP_IMAGE_PTR     ( ( void * ) OTA_BACKUP_IMAGE_ADDR )
+
+/**
+ * @brief Flash area holding the received file while the image is rebuilt from it in the update slot:
+ * a compressed image as it is received, or a delta patch once it is closed.
+ */
+#define OTA_STAGING_ADDR          ( 0x10880000 )
+
+/**
+ * @brief Size of the staging area, a received file is never larger than an image slot.
+ */
+#define OTA_STAGING_SIZE          ( OTA_IMAGE_SLOT_SIZE )
+
+/**
+ * @brief Magic number starting a delta patch, "NXDP" in little endian. A firmware image starts with
+ * the initial stack pointer, which can never take this value.
+ */
+#define OTA_PATCH_MAGIC           ( 0x5044584EUL )
+
+/**
+ * @brief Version of the patch format, see tools/ota_delta.py.
+ */
+#define OTA_PATCH_VERSION         ( 1U )
+
+/**
+ * @brief Size of the patch header: magic, version, header size, source size and target size.
+ */
+#define OTA_PATCH_HEADER_SIZE     ( 16U )
+
+/**
+ * @brief Patch commands. COPY takes a 32 bit offset in the running image and a 32 bit length,
+ * INSERT takes a 32 bit length followed by the literal bytes, END terminates the patch.
+ */
+#define OTA_PATCH_CMD_END         ( 0x00U )
+#define OTA_PATCH_CMD_COPY        ( 0x01U )
+#define OTA_PATCH_CMD_INSERT      ( 0x02U )
+
+/**
+ * @brief Size of the chunks handed to the image digest, which tracks whole OTA blocks.
+ */
+#define OTA_DIGEST_CHUNK_SIZE     ( 1UL << otaconfigLOG2_FILE_BLOCK_SIZE )
+
+/**
+ * @brief File type set in the OTA job for an image compressed with tools/ota_compress.py.
+ * Files of any other type are written to the update slot as they are received.
+ */
+#define OTA_FILE_TYPE_LZ4         ( 1U )
+
+/**
+ * @brief Magic number starting a compressed image, "NXLZ" in little endian, followed by the 32 bit
+ * size of the image and a sequence of LZ4 blocks.
+ */
+#define OTA_LZ4_MAGIC             ( 0x5A4C584EUL )
+
+/**
+ * @brief Size of the compressed image header.
+ */
+#define OTA_LZ4_HEADER_SIZE       ( 8U )
+
+/**
+ * @brief Smallest LZ4 match, encoded as 0 in the sequence token.
+ */
+#define OTA_LZ4_MIN_MATCH         ( 4U )
+
+/**
+ * @brief Size of the bitmap of the compressed blocks received, one bit per OTA block of the largest file.
+ */
+#define OTA_LZ4_BITMAP_SIZE       ( ( OTA_MAX_IMAGE_SIZE / OTA_DIGEST_CHUNK_SIZE + 7U ) / 8U )
+
+/**
+ * @brief Number of flash sectors held by the write cache. A few blocks are requested at a time and
+ * arrive in any order within the request, so they are spread over two sectors at most.
+ */
+#ifndef OTA_WRITE_CACHE_SECTORS
+    #define OTA_WRITE_CACHE_SECTORS    ( 2U )
+#endif
+
+/**
+ * @brief Number of OTA blocks in a flash sector.
+ */
+#define OTA_BLOCKS_PER_SECTOR     ( MFLASH_SECTOR_SIZE / OTA_DIGEST_CHUNK_SIZE )
+
+#if ( ( 1UL << otaconfigLOG2_FILE_BLOCK_SIZE ) > MFLASH_SECTOR_SIZE )
+    #error "The OTA write cache needs OTA blocks no larger than a flash sector."
+#endif
+
+/**
+ * @brief Sector index of a free write cache slot.
+ */
+#define OTA_WRITE_CACHE_FREE      ( 0xFFFFFFFFUL )
+
+/**
+ * @brief Size of the bitmap of the sectors erased since the file was created, one bit per sector of a slot.
+ */
+#define OTA_ERASED_BITMAP_SIZE    ( ( OTA_IMAGE_SLOT_SIZE / MFLASH_SECTOR_SIZE + 7U ) / 8U )
+
+/**
+ * @brief Priority of the task erasing the flash area of a new file ahead of its blocks. Below the tasks
+ * receiving the file, so that the erase only uses the time they spend waiting for the network. The
+ * task erases sector by sector: a block erase would keep the flash busy for hundreds of milliseconds
+ * with the network and MQTT tasks held behind it.
+ */
+#ifndef OTA_PRE_ERASE_TASK_PRIORITY
+    #define OTA_PRE_ERASE_TASK_PRIORITY      ( tskIDLE_PRIORITY + 1 )
+#endif
+
+/**
+ * @brief Stack size of the pre-erase task, in words.
+ */
+#ifndef OTA_PRE_ERASE_TASK_STACK_SIZE
+    #define OTA_PRE_ERASE_TASK_STACK_SIZE    ( 512U )
+#endif
+
+/**
+ * @brief Flash area of the download journal, recording the blocks programmed in the flash area of
+ * the file so that a download interrupted by a reset only requests the blocks still missing.
+ */
+#define OTA_JOURNAL_ADDR          ( 0x10820000 )
+
+/**
+ * @brief Size of the download journal, whole sectors.
+ */
+#define OTA_JOURNAL_SIZE          ( 0x10000 )
+
+/**
+ * @brief Magic at the start of the journal, "NXOJ".
+ */
+#define OTA_JOURNAL_MAGIC         ( 0x4A4F584EUL )
+
+/**
+ * @brief Version of the journal format.
+ */
+#define OTA_JOURNAL_VERSION       ( 1U )
+
+/**
+ * @brief Value of the commit word of a completely written journal header.
+ */
+#define OTA_JOURNAL_COMMITTED     ( 0x5AA5C33CUL )
+
+/**
+ * @brief Value of an erased flash word.
+ */
+#define OTA_JOURNAL_ERASED_WORD   ( 0xFFFFFFFFUL )
+
+/**
+ * @brief Number of block records the journal holds after its header.
+ */
+#define OTA_JOURNAL_RECORDS       ( ( OTA_JOURNAL_SIZE - sizeof( LL_JournalHeader_t ) ) / sizeof( LL_JournalRecord_t ) )
+
+/* low level file context structure */
+typedef struct
+{
+    const OtaFileContext_t * FileXRef;
+    uint8_t * BaseAddr;
+    uint32_t Size;
+} LL_FileContext_t;
+
+/**
+ * @brief Get the low level PAL file context from OTA file context.
+ *
+ * @param[in] Pointer to OTA file context.
+ */
+static LL_FileContext_t * prvPAL_GetLLFileContext( OtaFileContext_t * const C );
+
+/**
+ * @brief Reconstructed image being written by the patch decoder, one flash sector at a time.
+ */
+typedef struct
+{
+    uint8_t * BaseAddr; /**< Start of the update slot. */
+    uint32_t Written;   /**< Bytes of the image already committed to flash. */
+    uint32_t Fill;      /**< Bytes waiting in the sector buffer. */
+} LL_ImageOutput_t;
+
+/**
+ * @brief Decompression of a compressed image into the update slot. The compressed blocks are kept in
+ * the staging area, and decoded as soon as they extend the contiguous prefix of received blocks, so
+ * the RAM used does not depend on the LZ4 window: matches are copied from the image already written.
+ */
+typedef struct
+{
+    BaseType_t IsActive;                            /**< pdTRUE while a compressed image is received. */
+    BaseType_t HasFailed;                           /**< pdTRUE once the compressed stream was found invalid. */
+    uint32_t InputSize;                             /**< Size of the compressed file. */
+    uint32_t Available;                             /**< Contiguous prefix of the compressed file received. */
+    uint32_t Consumed;                              /**< Compressed bytes decoded. */
+    uint32_t ImageSize;                             /**< Size of the image, from the header. */
+    LL_ImageOutput_t Output;                        /**< Image being written. */
+    uint8_t ReceivedBlocks[ OTA_LZ4_BITMAP_SIZE ];  /**< Compressed blocks received. */
+} LL_Decompressor_t;
+
+/**
+ * @brief Flash sector of the received file, gathering its blocks before they are written back.
+ */
+typedef struct
+{
+    uint32_t Sector;                                    /**< Sector index in the file, OTA_WRITE_CACHE_FREE if unused. */
+    uint32_t Blocks;                                    /**< Bitmap of the blocks of the sector received. */
+    uint32_t Data[ MFLASH_SECTOR_SIZE / sizeof( uint32_t ) ]; /**< Content of the sector. */
+} LL_CacheSlot_t;
+
+/**
+ * @brief Write-back cache of the received file. A sector is written back once all its blocks are
+ * received, so it is erased and programmed once instead of being read, erased and programmed again
+ * for every block. A sector evicted before it is complete stays erased, and its missing blocks are
+ * programmed in it later without a second erase.
+ */
+typedef struct
+{
+    uint8_t * BaseAddr;                             /**< Flash address of the file. */
+    uint32_t FileSize;                              /**< Size of the file, which completes its last sector. */
+    BaseType_t IsHashed;                            /**< pdTRUE to add the blocks programmed to the image digest. */
+    uint32_t SectorsErased;                         /**< Sectors erased since the file was created. */
+    uint32_t PartialWriteBacks;                     /**< Sectors evicted before they were complete. */
+    uint8_t ErasedSectors[ OTA_ERASED_BITMAP_SIZE ]; /**< Sectors erased since the file was created. */
+    LL_CacheSlot_t Slots[ OTA_WRITE_CACHE_SECTORS ]; /**< Sectors being received. */
+} LL_WriteCache_t;
+
+/**
+ * @brief Erase of the flash area of the file by a background task, with block erases, so that the
+ * sectors are blank when the write cache writes them back. The task and the write cache mark the
+ * sectors they erase in the erased sector bitmap of the cache under the mutex, so a sector programmed
+ * by the cache is never erased by the task.
+ */
+typedef struct
+{
+    SemaphoreHandle_t Mutex;      /**< Guards the erased sector bitmap and the flash erases. */
+    TaskHandle_t Task;            /**< Pre-erase task, NULL when it is not running. */
+    BaseType_t StopRequested;     /**< pdTRUE to make the task return before the end of the file. */
+    uint32_t Size;                /**< Size of the area to erase, whole sectors. */
+    uint32_t Erased;              /**< Bytes erased, or found blank, by the task. */
+} LL_PreErase_t;
+
+/**
+ * @brief Header of the download journal, identifying the file whose blocks it records.
+ */
+typedef struct
+{
+    uint32_t Magic;     /**< OTA_JOURNAL_MAGIC. */
+    uint32_t Version;   /**< OTA_JOURNAL_VERSION. */
+    uint32_t BlockSize; /**< OTA block size. */
+    uint32_t BaseAddr;  /**< Flash address the file is written to. */
+    uint32_t FileSize;  /**< Size of the file. */
+    uint32_t FileType;  /**< File type from the OTA job. */
+    uint32_t Key;       /**< CRC32 of the signature of the file, which tells the updates apart. */
+    uint32_t Commit;    /**< OTA_JOURNAL_COMMITTED once the header is written. */
+    uint32_t Closed;    /**< Erased while the download is in progress, programmed to zero when it ends. */
+} LL_JournalHeader_t;
+
+/**
+ * @brief Record of a block of the file, appended to the journal before the block is programmed.
+ * A record is thus found for every block programmed, and a block whose programming was interrupted
+ * does not match the CRC of its record.
+ */
+typedef struct
+{
+    uint32_t Offset; /**< Offset of the block in the file. */
+    uint32_t Crc;    /**< CRC32 of the block. */
+} LL_JournalRecord_t;
+
+/**
+ * @brief Download journal being appended to.
+ */
+typedef struct
+{
+    BaseType_t IsOpen;   /**< pdTRUE while the blocks programmed are recorded. */
+    uint32_t NextRecord; /**< Index of the next free record. */
+} LL_Journal_t;
+
+/**
+ * @brief Check whether the received file is a delta patch rather than a firmware image.
+ *
+ * @param[in] FileContext Low level context of the received file.
+ * @return pdTRUE if the file starts with the patch magic.
+ */
+static BaseType_t prvPAL_IsPatch( const LL_FileContext_t * FileContext );
+
+/**
+ * @brief Reconstruct the new image in the update slot from the running image and the received patch.
+ * On success the file context describes the new image, which is hashed as it is written so that
+ * its signature is verified as for a full image.
+ *
+ * @param[in] FileContext Low level context of the received patch.
+ * @return OtaPalSuccess if the image was reconstructed.
+ */
+static OtaPalStatus_t prvPAL_ApplyPatch( LL_FileContext_t * FileContext );
+
+/**
+ * @brief Move the received patch to the staging area.
+ *
+ * @param[in] FileContext Low level context of the received patch.
+ * @return 0 on success.
+ */
+static int32_t prvPAL_StagePatch( const LL_FileContext_t * FileContext );
+
+/**
+ * @brief Append bytes of the reconstructed image, writing the sector buffer to flash when full.
+ *
+ * @param[in] Output Reconstructed image.
+ * @param[in] Data Bytes to append, in RAM or memory mapped flash.
+ * @param[in] Length Number of bytes.
+ * @return 0 on success.
+ */
+static int32_t prvPAL_OutputWrite( LL_ImageOutput_t * Output,
+                                   const uint8_t * Data,
+                                   uint32_t Length );
+
+/**
+ * @brief Erase and program the sector held in the sector buffer, then add it to the image digest.
+ *
+ * @param[in] Output Reconstructed image.
+ * @return 0 on success.
+ */
+static int32_t prvPAL_OutputFlush( LL_ImageOutput_t * Output );
+
+/**
+ * @brief Copy a match of the reconstructed image, from the sector buffer or from the flash already written.
+ *
+ * @param[in] Output Reconstructed image.
+ * @param[in] Distance Distance back from the end of the image to the match.
+ * @param[in] Length Number of bytes.
+ * @return 0 on success.
+ */
+static int32_t prvPAL_OutputCopy( LL_ImageOutput_t * Output,
+                                  uint32_t Distance,
+                                  uint32_t Length );
+
+/**
+ * @brief Store a block of a compressed image in the staging area and decode the compressed data
+ * it makes available.
+ *
+ * @param[in] Offset Offset of the block in the compressed file.
+ * @param[in] Data Block received.
+ * @param[in] BlockSize Size of the block.
+ * @return 0 on success.
+ */
+static int32_t prvPAL_DecompressBlock( uint32_t Offset,
+                                       uint8_t * const Data,
+                                       uint32_t BlockSize );
+
+/**
+ * @brief Decode the LZ4 sequences fully received, leaving a partial sequence for the next block.
+ *
+ * @return 0 on success.
+ */
+static int32_t prvPAL_DecompressAvailable( void );
+
+/**
+ * @brief Read the extension bytes of an LZ4 literal or match length.
+ *
+ * @param[in] Input Compressed file in the staging area.
+ * @param[in,out] Position Position of the next byte, advanced past the length.
+ * @param[in,out] Length Length from the token, increased by the extension bytes.
+ * @return pdFALSE if the extension bytes are not all received yet.
+ */
+static BaseType_t prvPAL_Lz4ReadLength( const uint8_t * Input,
+                                        uint32_t * Position,
+                                        uint32_t * Length );
+
+/**
+ * @brief Read a little endian 32 bit value.
+ */
+static uint32_t prvPAL_Read32( const uint8_t * Data );
+
+/**
+ * @brief Empty the write cache and set it up for a new file.
+ *
+ * @param[in] BaseAddr Flash address of the file.
+ * @param[in] FileSize Size of the file.
+ * @param[in] IsHashed pdTRUE if the file is the image, added to the image digest as it is programmed.
+ */
+static void prvPAL_CacheInit( uint8_t * BaseAddr,
+                              uint32_t FileSize,
+                              BaseType_t IsHashed );
+
+/**
+ * @brief Copy a block into the sector of the write cache holding it, and write the sector back once complete.
+ * When the cache is full, the sector furthest behind is written back first.
+ *
+ * @param[in] Offset Offset of the block in the file, a multiple of the OTA block size.
+ * @param[in] Data Block received.
+ * @param[in] BlockSize Size of the block, the OTA block size except for the last block of the file.
+ * @return 0 on success.
+ */
+static int32_t prvPAL_CacheWrite( uint32_t Offset,
+                                  const uint8_t * Data,
+                                  uint32_t BlockSize );
+
+/**
+ * @brief Erase the sector of a cache slot if not erased yet, and program the blocks it received.
+ *
+ * @param[in] Slot Cache slot to write back, free afterwards.
+ * @return 0 on success.
+ */
+static int32_t prvPAL_CacheWriteBack( LL_CacheSlot_t * Slot );
+
+/**
+ * @brief Write back every sector of the write cache.
+ *
+ * @return 0 on success.
+ */
+static int32_t prvPAL_CacheFlush( void );
+
+/**
+ * @brief Start the pre-erase task over the flash area of the write cache.
+ *
+ * @param[in] FileSize Size of the file received.
+ */
+static void prvPAL_PreEraseStart( uint32_t FileSize );
+
+/**
+ * @brief Stop the pre-erase task, returning once it no longer erases the flash.
+ */
+static void prvPAL_PreEraseStop( void );
+
+/**
+ * @brief Pre-erase task, erasing the sectors of the file not erased yet one sector erase at a time.
+ *
+ * @param[in] pvParameters Unused.
+ */
+static void prvPAL_PreEraseTask( void * pvParameters );
+
+/**
+ * @brief Check whether a sector of the write cache area was erased since the file was created.
+ */
+static BaseType_t prvPAL_IsSectorErased( uint32_t Sector );
+
+/**
+ * @brief Extend the contiguous prefix of the compressed file with the blocks received, and decode it.
+ *
+ * @return 0 on success.
+ */
+static int32_t prvPAL_DecompressExtend( void );
+
+/**
+ * @brief Resume the download of the file from the journal if it records the same file, otherwise
+ * start a new journal. Called once the write cache is set up for the file.
+ *
+ * @param[in] pFileContext OTA file context, whose bitmap of the blocks to request is updated.
+ */
+static void prvPAL_JournalOpen( OtaFileContext_t * const pFileContext );
+
+/**
+ * @brief Erase the journal and write its header.
+ *
+ * @param[in] Header Header of the new journal, its commit and closed words are ignored.
+ * @return 0 on success.
+ */
+static int32_t prvPAL_JournalCreate( const LL_JournalHeader_t * Header );
+
+/**
+ * @brief Restore the blocks recorded in the journal and still intact in flash. The sectors of a
+ * block whose programming was interrupted are left to be erased again, with all their blocks.
+ *
+ * @param[in] pFileContext OTA file context, whose bitmap of the blocks to request is updated.
+ * @param[in] Header Header of the journal.
+ * @return Number of blocks restored.
+ */
+static uint32_t prvPAL_JournalRestore( OtaFileContext_t * const pFileContext,
+                                       const LL_JournalHeader_t * Header );
+
+/**
+ * @brief Record a block about to be programmed. A journal found full is closed, leaving the
+ * download to complete without being resumable.
+ *
+ * @param[in] Offset Offset of the block in the file.
+ * @param[in] Data Block to program.
+ * @param[in] Length Size of the block.
+ */
+static void prvPAL_JournalRecord( uint32_t Offset,
+                                  const uint8_t * Data,
+                                  uint32_t Length );
+
+/**
+ * @brief Mark the journal in flash as closed, so that it is not resumed.
+ */
+static void prvPAL_JournalClose( void );
+
+/**
+ * @brief Cancel an update activated but not booted yet. With images executed in place the update
+ * control block selects the update slot, so it selects the running image again before it is voided,
+ * and it is read back to check that the bootloader will not boot the cancelled image.
+ *
+ * @param[in] Ucb Update control block in the new state, updated.
+ * @return 0 on success.
+ */
+static int32_t prvPAL_CancelNewImage( struct boot_ucb * Ucb );
+
+/* Specify the OTA signature algorithm we support on this platform. */
+const char OTA_JsonFileSignatureKey[ OTA_FILE_SIG_KEY_STR_MAX_LENGTH ] = "sig-sha256-ecdsa";
+
+static LL_FileContext_t prvPAL_CurrentFileContext;
+
+/* Sector sized buffer, used both to stage the patch and to write the reconstructed image, which bounds
+ * the RAM used by a delta or compressed update whatever the size of the image. */
+static uint32_t prvPAL_SectorBuffer[ MFLASH_SECTOR_SIZE / sizeof( uint32_t ) ];
+
+static LL_Decompressor_t prvPAL_Decompressor;
+
+static LL_WriteCache_t prvPAL_WriteCache;
+
+static LL_PreErase_t prvPAL_PreErase;
+
+static LL_Journal_t prvPAL_Journal;
+
+static LL_FileContext_t * prvPAL_GetLLFileContext( OtaFileContext_t * const C )
+{
+    LL_FileContext_t * FileContext;
+
+    if( ( C == NULL ) || ( C->pFile == NULL ) )
+    {
+        return NULL;
+    }
+
+    FileContext = ( LL_FileContext_t * ) C->pFile;
+
+    if( ( FileContext == NULL ) || ( FileContext->FileXRef != C ) )
+    {
+        return NULL;
+    }
+
+    return FileContext;
+}
+
+static uint32_t prvPAL_Read32( const uint8_t * Data )
+{
+    return ( uint32_t ) Data[ 0 ] |
+           ( ( uint32_t ) Data[ 1 ] << 8 ) |
+           ( ( uint32_t ) Data[ 2 ] << 16 ) |
+           ( ( uint32_t ) Data[ 3 ] << 24 );
+}
+
+static BaseType_t prvPAL_IsPatch( const LL_FileContext_t * FileContext )
+{
+    if( FileContext->Size < OTA_PATCH_HEADER_SIZE )
+    {
+        return pdFALSE;
+    }
+
+    return ( prvPAL_Read32( FileContext->BaseAddr ) == OTA_PATCH_MAGIC ) ? pdTRUE : pdFALSE;
+}
+
+static int32_t prvPAL_StagePatch( const LL_FileContext_t * FileContext )
+{
+    uint8_t * StagingAddr = ( uint8_t * ) OTA_STAGING_ADDR;
+    uint32_t offset;
+    uint32_t length;
+
+    for( offset = 0; offset < FileContext->Size; offset += MFLASH_SECTOR_SIZE )
+    {
+        length = FileContext->Size - offset;
+
+        if( length > MFLASH_SECTOR_SIZE )
+        {
+            length = MFLASH_SECTOR_SIZE;
+        }
+
+        if( ( 0 != mflash_drv_read( prvPAL_SectorBuffer, FileContext->BaseAddr + offset, length ) ) ||
+            ( 0 != mflash_drv_erase( StagingAddr + offset, MFLASH_SECTOR_SIZE ) ) ||
+            ( 0 != mflash_drv_program( StagingAddr + offset, ( uint8_t * ) prvPAL_SectorBuffer, length ) ) )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void prvPAL_CacheInit( uint8_t * BaseAddr,
+                              uint32_t FileSize,
+                              BaseType_t IsHashed )
+{
+    LL_WriteCache_t * W = &prvPAL_WriteCache;
+    uint32_t i;
+
+    memset( W, 0, sizeof( *W ) );
+    W->BaseAddr = BaseAddr;
+    W->FileSize = FileSize;
+    W->IsHashed = IsHashed;
+
+    for( i = 0; i < OTA_WRITE_CACHE_SECTORS; i++ )
+    {
+        W->Slots[ i ].Sector = OTA_WRITE_CACHE_FREE;
+    }
+}
+
+static int32_t prvPAL_CacheWriteBack( LL_CacheSlot_t * Slot )
+{
+    LL_WriteCache_t * W = &prvPAL_WriteCache;
+    uint32_t Block;
+    uint32_t Offset;
+    uint32_t Length;
+    int32_t result = 0;
+
+    if( prvPAL_PreErase.Mutex != NULL )
+    {
+        ( void ) xSemaphoreTake( prvPAL_PreErase.Mutex, portMAX_DELAY );
+    }
+
+    if( prvPAL_IsSectorErased( Slot->Sector ) == pdFALSE )
+    {
+        result = mflash_drv_erase( W->BaseAddr + Slot->Sector * MFLASH_SECTOR_SIZE, MFLASH_SECTOR_SIZE );
+
+        if( result == 0 )
+        {
+            W->ErasedSectors[ Slot->Sector / 8U ] |= ( uint8_t ) ( 1U << ( Slot->Sector % 8U ) );
+            W->SectorsErased++;
+        }
+    }
+
+    if( prvPAL_PreErase.Mutex != NULL )
+    {
+        ( void ) xSemaphoreGive( prvPAL_PreErase.Mutex );
+    }
+
+    if( result != 0 )
+    {
+        return -1;
+    }
+
+    for( Block = 0; Block < OTA_BLOCKS_PER_SECTOR; Block++ )
+    {
+        if( ( Slot->Blocks & ( 1UL << Block ) ) != 0U )
+        {
+            Offset = Slot->Sector * MFLASH_SECTOR_SIZE + Block * OTA_DIGEST_CHUNK_SIZE;
+            Length = W->FileSize - Offset;
+
+            if( Length > OTA_DIGEST_CHUNK_SIZE )
+            {
+                Length = OTA_DIGEST_CHUNK_SIZE;
+            }
+
+            prvPAL_JournalRecord( Offset, ( uint8_t * ) Slot->Data + Block * OTA_DIGEST_CHUNK_SIZE, Length );
+
+            if( 0 != mflash_drv_program( W->BaseAddr + Offset,
+                                         ( uint8_t * ) Slot->Data + Block * OTA_DIGEST_CHUNK_SIZE,
+                                         Length ) )
+            {
+                return -1;
+            }
+
+            if( W->IsHashed == pdTRUE )
+            {
+                /* Hash the image as it is committed, rather than reading it all again when closed. */
+                vImageDigestBlockWritten( Offset, Length );
+            }
+        }
+    }
+
+    Slot->Sector = OTA_WRITE_CACHE_FREE;
+    Slot->Blocks = 0;
+
+    return 0;
+}
+
+static int32_t prvPAL_CacheWrite( uint32_t Offset,
+                                  const uint8_t * Data,
+                                  uint32_t BlockSize )
+{
+    LL_WriteCache_t * W = &prvPAL_WriteCache;
+    LL_CacheSlot_t * Slot = NULL;
+    uint32_t Sector = Offset / MFLASH_SECTOR_SIZE;
+    uint32_t Block = ( Offset % MFLASH_SECTOR_SIZE ) / OTA_DIGEST_CHUNK_SIZE;
+    uint32_t ExpectedSize;
+    uint32_t SectorBlocks;
+    uint32_t i;
+
+    ExpectedSize = ( Offset < W->FileSize ) ? ( W->FileSize - Offset ) : 0;
+
+    if( ExpectedSize > OTA_DIGEST_CHUNK_SIZE )
+    {
+        ExpectedSize = OTA_DIGEST_CHUNK_SIZE;
+    }
+
+    if( ( ( Offset % OTA_DIGEST_CHUNK_SIZE ) != 0 ) || ( BlockSize != ExpectedSize ) )
+    {
+        return -1;
+    }
+
+    for( i = 0; ( i < OTA_WRITE_CACHE_SECTORS ) && ( Slot == NULL ); i++ )
+    {
+        if( W->Slots[ i ].Sector == Sector )
+        {
+            Slot = &W->Slots[ i ];
+        }
+    }
+
+    for( i = 0; ( i < OTA_WRITE_CACHE_SECTORS ) && ( Slot == NULL ); i++ )
+    {
+        if( W->Slots[ i ].Sector == OTA_WRITE_CACHE_FREE )
+        {
+            Slot = &W->Slots[ i ];
+        }
+    }
+
+    if( Slot == NULL )
+    {
+        /* Blocks are requested in order, the sector furthest behind is the least likely to get more. */
+        Slot = &W->Slots[ 0 ];
+
+        for( i = 1; i < OTA_WRITE_CACHE_SECTORS; i++ )
+        {
+            if( W->Slots[ i ].Sector < Slot->Sector )
+            {
+                Slot = &W->Slots[ i ];
+            }
+        }
+
+        W->PartialWriteBacks++;
+
+        if( 0 != prvPAL_CacheWriteBack( Slot ) )
+        {
+            return -1;
+        }
+    }
+
+    Slot->Sector = Sector;
+    Slot->Blocks |= 1UL << Block;
+    memcpy( ( uint8_t * ) Slot->Data + Block * OTA_DIGEST_CHUNK_SIZE, Data, BlockSize );
+
+    /* Blocks of the sector within the file, fewer than a full sector at the end of the file. */
+    SectorBlocks = ( W->FileSize - Sector * MFLASH_SECTOR_SIZE + OTA_DIGEST_CHUNK_SIZE - 1U ) / OTA_DIGEST_CHUNK_SIZE;
+
+    if( SectorBlocks > OTA_BLOCKS_PER_SECTOR )
+    {
+        SectorBlocks = OTA_BLOCKS_PER_SECTOR;
+    }
+
+    if( Slot->Blocks == ( ( 1UL << SectorBlocks ) - 1UL ) )
+    {
+        return prvPAL_CacheWriteBack( Slot );
+    }
+
+    return 0;
+}
+
+static BaseType_t prvPAL_IsSectorErased( uint32_t Sector )
+{
+    return ( ( prvPAL_WriteCache.ErasedSectors[ Sector / 8U ] & ( 1U << ( Sector % 8U ) ) ) != 0U ) ? pdTRUE : pdFALSE;
+}
+
+static void prvPAL_PreEraseTask( void * pvParameters )
+{
+    LL_PreErase_t * P = &prvPAL_PreErase;
+    LL_WriteCache_t * W = &prvPAL_WriteCache;
+    TickType_t StartTicks = xTaskGetTickCount();
+    uint32_t Offset = 0;
+    uint32_t Length;
+    uint32_t Sector;
+    int32_t Step = 0;
+
+    ( void ) pvParameters;
+
+    while( ( Offset < P->Size ) && ( Step >= 0 ) )
+    {
+        ( void ) xSemaphoreTake( P->Mutex, portMAX_DELAY );
+
+        if( P->StopRequested == pdTRUE )
+        {
+            ( void ) xSemaphoreGive( P->Mutex );
+            break;
+        }
+
+        /* Sector ahead, unless the write cache erased it already. */
+        Length = 0;
+
+        if( prvPAL_IsSectorErased( Offset / MFLASH_SECTOR_SIZE ) == pdFALSE )
+        {
+            Length = MFLASH_SECTOR_SIZE;
+        }
+
+        if( Length == 0 )
+        {
+            Step = MFLASH_SECTOR_SIZE;
+        }
+        else
+        {
+            Step = mflash_drv_erase_step( W->BaseAddr + Offset, Length, MFLASH_SECTOR_SIZE );
+
+            for( Sector = Offset / MFLASH_SECTOR_SIZE; ( Step > 0 ) && ( Sector < ( Offset + Step ) / MFLASH_SECTOR_SIZE ); Sector++ )
+            {
+                W->ErasedSectors[ Sector / 8U ] |= ( uint8_t ) ( 1U << ( Sector % 8U ) );
+            }
+
+            if( Step > 0 )
+            {
+                P->Erased += ( uint32_t ) Step;
+            }
+        }
+
+        ( void ) xSemaphoreGive( P->Mutex );
+
+        Offset += ( Step > 0 ) ? ( uint32_t ) Step : 0U;
+    }
+
+    PRINTF( "[OTA-NXP] Pre-erased %u bytes in %u ms\r\n",
+            P->Erased,
+            ( uint32_t ) ( ( xTaskGetTickCount() - StartTicks ) * portTICK_PERIOD_MS ) );
+
+    ( void ) xSemaphoreTake( P->Mutex, portMAX_DELAY );
+    P->Task = NULL;
+    ( void ) xSemaphoreGive( P->Mutex );
+
+    vTaskDelete( NULL );
+}
+
+static void prvPAL_PreEraseStart( uint32_t FileSize )
+{
+    LL_PreErase_t * P = &prvPAL_PreErase;
+
+    if( P->Mutex == NULL )
+    {
+        P->Mutex = xSemaphoreCreateMutex();
+    }
+
+    if( P->Mutex != NULL )
+    {
+        P->StopRequested = pdFALSE;
+        P->Size = ( FileSize + MFLASH_SECTOR_SIZE - 1U ) & ~( ( uint32_t ) MFLASH_SECTOR_MASK );
+        P->Erased = 0;
+
+        if( xTaskCreate( prvPAL_PreEraseTask,
+                         "OTA_erase",
+                         OTA_PRE_ERASE_TASK_STACK_SIZE,
+                         NULL,
+                         OTA_PRE_ERASE_TASK_PRIORITY | portPRIVILEGE_BIT,
+                         &P->Task ) != pdPASS )
+        {
+            /* Not fatal, the write cache erases the sectors when it writes them back. */
+            PRINTF( "[OTA-NXP] Failed to create pre-erase task\r\n" );
+            P->Task = NULL;
+        }
+    }
+}
+
+static void prvPAL_PreEraseStop( void )
+{
+    LL_PreErase_t * P = &prvPAL_PreErase;
+    BaseType_t IsRunning = pdTRUE;
+
+    if( P->Mutex == NULL )
+    {
+        return;
+    }
+
+    /* The task checks the request between two erase commands. */
+    while( IsRunning == pdTRUE )
+    {
+        ( void ) xSemaphoreTake( P->Mutex, portMAX_DELAY );
+        P->StopRequested = pdTRUE;
+        IsRunning = ( P->Task != NULL ) ? pdTRUE : pdFALSE;
+        ( void ) xSemaphoreGive( P->Mutex );
+
+        if( IsRunning == pdTRUE )
+        {
+            vTaskDelay( pdMS_TO_TICKS( 10 ) );
+        }
+    }
+}
+
+static int32_t prvPAL_CacheFlush( void )
+{
+    LL_WriteCache_t * W = &prvPAL_WriteCache;
+    uint32_t i;
+
+    for( i = 0; i < OTA_WRITE_CACHE_SECTORS; i++ )
+    {
+        if( ( W->Slots[ i ].Sector != OTA_WRITE_CACHE_FREE ) && ( 0 != prvPAL_CacheWriteBack( &W->Slots[ i ] ) ) )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int32_t prvPAL_JournalCreate( const LL_JournalHeader_t * Header )
+{
+    LL_JournalHeader_t * Journal = ( LL_JournalHeader_t * ) OTA_JOURNAL_ADDR;
+    LL_JournalHeader_t Pending = *Header;
+    uint32_t Committed = OTA_JOURNAL_COMMITTED;
+    uint32_t Offset = 0;
+    int32_t Step = 0;
+
+    prvPAL_Journal.IsOpen = pdFALSE;
+    prvPAL_Journal.NextRecord = 0;
+
+    while( ( Offset < OTA_JOURNAL_SIZE ) && ( Step >= 0 ) )
+    {
+        Step = mflash_drv_erase_step( ( uint8_t * ) Journal + Offset, OTA_JOURNAL_SIZE - Offset, MFLASH_BLOCK64_SIZE );
+        Offset += ( Step > 0 ) ? ( uint32_t ) Step : 0U;
+    }
+
+    /* The header is only valid once its commit word is programmed after the rest of it. */
+    Pending.Commit = OTA_JOURNAL_ERASED_WORD;
+    Pending.Closed = OTA_JOURNAL_ERASED_WORD;
+
+    if( ( Step < 0 ) ||
+        ( 0 != mflash_drv_program( Journal, ( const uint8_t * ) &Pending, sizeof( Pending ) ) ) ||
+        ( 0 != mflash_drv_program( &Journal->Commit, ( const uint8_t * ) &Committed, sizeof( Committed ) ) ) )
+    {
+        return -1;
+    }
+
+    prvPAL_Journal.IsOpen = pdTRUE;
+
+    return 0;
+}
+
+static uint32_t prvPAL_JournalRestore( OtaFileContext_t * const pFileContext,
+                                       const LL_JournalHeader_t * Header )
+{
+    LL_WriteCache_t * W = &prvPAL_WriteCache;
+    const LL_JournalRecord_t * Records = ( const LL_JournalRecord_t * ) ( OTA_JOURNAL_ADDR + sizeof( LL_JournalHeader_t ) );
+    uint8_t DroppedSectors[ OTA_ERASED_BITMAP_SIZE ];
+    BaseType_t HasDropped = pdFALSE;
+    uint32_t Restored = 0;
+    uint32_t Count;
+    uint32_t Length;
+    uint32_t Sector;
+    uint32_t Block;
+    uint32_t i;
+
+    memset( DroppedSectors, 0, sizeof( DroppedSectors ) );
+
+    /* A record is programmed before its block, so the first erased record ends the journal, and a
+     * block not matching its record was being programmed: its sector is erased again. */
+    for( Count = 0; ( Count < OTA_JOURNAL_RECORDS ) && ( Records[ Count ].Offset != OTA_JOURNAL_ERASED_WORD ); Count++ )
+    {
+        if( ( ( Records[ Count ].Offset % OTA_DIGEST_CHUNK_SIZE ) != 0U ) || ( Records[ Count ].Offset >= Header->FileSize ) )
+        {
+            continue;
+        }
+
+        Length = Header->FileSize - Records[ Count ].Offset;
+
+        if( Length > OTA_DIGEST_CHUNK_SIZE )
+        {
+            Length = OTA_DIGEST_CHUNK_SIZE;
+        }
+
+        if( ulCrc32( 0U, W->BaseAddr + Records[ Count ].Offset, Length ) != Records[ Count ].Crc )
+        {
+            Sector = Records[ Count ].Offset / MFLASH_SECTOR_SIZE;
+            DroppedSectors[ Sector / 8U ] |= ( uint8_t ) ( 1U << ( Sector % 8U ) );
+            HasDropped = pdTRUE;
+        }
+    }
+
+    for( i = 0; i < Count; i++ )
+    {
+        Sector = Records[ i ].Offset / MFLASH_SECTOR_SIZE;
+        Block = Records[ i ].Offset / OTA_DIGEST_CHUNK_SIZE;
+
+        if( ( ( Records[ i ].Offset % OTA_DIGEST_CHUNK_SIZE ) != 0U ) ||
+            ( Records[ i ].Offset >= Header->FileSize ) ||
+            ( ( DroppedSectors[ Sector / 8U ] & ( 1U << ( Sector % 8U ) ) ) != 0U ) ||
+            ( ( pFileContext->pRxBlockBitmap[ Block / 8U ] & ( 1U << ( Block % 8U ) ) ) == 0U ) )
+        {
+            continue;
+        }
+
+        Length = Header->FileSize - Records[ i ].Offset;
+
+        if( Length > OTA_DIGEST_CHUNK_SIZE )
+        {
+            Length = OTA_DIGEST_CHUNK_SIZE;
+        }
+
+        /* The sector holds blocks already, its missing blocks are still erased. */
+        W->ErasedSectors[ Sector / 8U ] |= ( uint8_t ) ( 1U << ( Sector % 8U ) );
+        pFileContext->pRxBlockBitmap[ Block / 8U ] &= ( uint8_t ) ~( 1U << ( Block % 8U ) );
+        pFileContext->blocksRemaining--;
+        Restored++;
+
+        if( prvPAL_Decompressor.IsActive == pdTRUE )
+        {
+            prvPAL_Decompressor.ReceivedBlocks[ Block / 8U ] |= ( uint8_t ) ( 1U << ( Block % 8U ) );
+        }
+        else
+        {
+            vImageDigestBlockWritten( Records[ i ].Offset, Length );
+        }
+    }
+
+    prvPAL_Journal.IsOpen = pdTRUE;
+    prvPAL_Journal.NextRecord = Count;
+
+    if( HasDropped == pdTRUE )
+    {
+        /* The sectors dropped are programmed again, rewrite the journal without their records. */
+        if( 0 == prvPAL_JournalCreate( Header ) )
+        {
+            for( Block = 0; Block * OTA_DIGEST_CHUNK_SIZE < Header->FileSize; Block++ )
+            {
+                if( ( pFileContext->pRxBlockBitmap[ Block / 8U ] & ( 1U << ( Block % 8U ) ) ) == 0U )
+                {
+                    Length = Header->FileSize - Block * OTA_DIGEST_CHUNK_SIZE;
+
+                    if( Length > OTA_DIGEST_CHUNK_SIZE )
+                    {
+                        Length = OTA_DIGEST_CHUNK_SIZE;
+                    }
+
+                    prvPAL_JournalRecord( Block * OTA_DIGEST_CHUNK_SIZE, W->BaseAddr + Block * OTA_DIGEST_CHUNK_SIZE, Length );
+                }
+            }
+        }
+    }
+
+    if( ( Restored > 0U ) && ( prvPAL_Decompressor.IsActive == pdTRUE ) )
+    {
+        ( void ) prvPAL_DecompressExtend();
+    }
+
+    if( ( Restored > 0U ) && ( pFileContext->blocksRemaining == 0U ) )
+    {
+        /* The file is closed when its last block is received, so one block is requested again. */
+        Block = ( Header->FileSize - 1U ) / OTA_DIGEST_CHUNK_SIZE;
+        pFileContext->pRxBlockBitmap[ Block / 8U ] |= ( uint8_t ) ( 1U << ( Block % 8U ) );
+        pFileContext->blocksRemaining = 1;
+        Restored--;
+    }
+
+    return Restored;
+}
+
+static void prvPAL_JournalOpen( OtaFileContext_t * const pFileContext )
+{
+    const LL_JournalHeader_t * Journal = ( const LL_JournalHeader_t * ) OTA_JOURNAL_ADDR;
+    LL_JournalHeader_t Header;
+    uint32_t Restored;
+
+    prvPAL_Journal.IsOpen = pdFALSE;
+
+    if( ( pFileContext->pSignature == NULL ) || ( pFileContext->pSignature->size == 0U ) )
+    {
+        /* Nothing tells this file apart, a journal left by another download must not be resumed. */
+        prvPAL_JournalClose();
+        return;
+    }
+
+    memset( &Header, 0, sizeof( Header ) );
+    Header.Magic = OTA_JOURNAL_MAGIC;
+    Header.Version = OTA_JOURNAL_VERSION;
+    Header.BlockSize = OTA_DIGEST_CHUNK_SIZE;
+    Header.BaseAddr = ( uint32_t ) prvPAL_WriteCache.BaseAddr;
+    Header.FileSize = pFileContext->fileSize;
+    Header.FileType = pFileContext->fileType;
+    Header.Key = ulCrc32( 0U, pFileContext->pSignature->data, pFileContext->pSignature->size );
+    Header.Commit = OTA_JOURNAL_COMMITTED;
+    Header.Closed = OTA_JOURNAL_ERASED_WORD;
+
+    if( memcmp( Journal, &Header, sizeof( Header ) ) == 0 )
+    {
+        Restored = prvPAL_JournalRestore( pFileContext, &Header );
+        PRINTF( "[OTA-NXP] Download resumed, %u blocks restored, %u remaining\r\n",
+                Restored,
+                pFileContext->blocksRemaining );
+    }
+    else if( 0 != prvPAL_JournalCreate( &Header ) )
+    {
+        /* Not fatal, the download is only not resumable after a reset. */
+        PRINTF( "[OTA-NXP] Failed to create download journal\r\n" );
+        prvPAL_JournalClose();
+    }
+}
+
+static void prvPAL_JournalRecord( uint32_t Offset,
+                                  const uint8_t * Data,
+                                  uint32_t Length )
+{
+    LL_JournalRecord_t * Records = ( LL_JournalRecord_t * ) ( OTA_JOURNAL_ADDR + sizeof( LL_JournalHeader_t ) );
+    LL_JournalRecord_t Record;
+
+    if( prvPAL_Journal.IsOpen == pdFALSE )
+    {
+        return;
+    }
+
+    Record.Offset = Offset;
+    Record.Crc = ulCrc32( 0U, Data, Length );
+
+    /* A block programmed without its record would be taken as erased when resuming, so the journal
+     * is closed rather than left incomplete. */
+    if( ( prvPAL_Journal.NextRecord >= OTA_JOURNAL_RECORDS ) ||
+        ( 0 != mflash_drv_program( &Records[ prvPAL_Journal.NextRecord ], ( const uint8_t * ) &Record, sizeof( Record ) ) ) )
+    {
+        PRINTF( "[OTA-NXP] Download journal closed at block %x\r\n", Offset );
+        prvPAL_JournalClose();
+        return;
+    }
+
+    prvPAL_Journal.NextRecord++;
+}
+
+static void prvPAL_JournalClose( void )
+{
+    LL_JournalHeader_t * Journal = ( LL_JournalHeader_t * ) OTA_JOURNAL_ADDR;
+    uint32_t Closed = 0;
+
+    prvPAL_Journal.IsOpen = pdFALSE;
+
+    if( ( Journal->Magic == OTA_JOURNAL_MAGIC ) && ( Journal->Closed == OTA_JOURNAL_ERASED_WORD ) )
+    {
+        if( 0 != mflash_drv_program( &Journal->Closed, ( const uint8_t * ) &Closed, sizeof( Closed ) ) )
+        {
+            PRINTF( "[OTA-NXP] Failed to close download journal\r\n" );
+        }
+    }
+}
+
+static int32_t prvPAL_OutputFlush( LL_ImageOutput_t * Output )
+{
+    uint8_t * SectorAddr = Output->BaseAddr + Output->Written;
+    uint32_t offset;
+    uint32_t length;
+
+    if( ( 0 != mflash_drv_erase( SectorAddr, MFLASH_SECTOR_SIZE ) ) ||
+        ( 0 != mflash_drv_program( SectorAddr, ( uint8_t * ) prvPAL_SectorBuffer, Output->Fill ) ) )
+    {
+        return -1;
+    }
+
+    for( offset = 0; offset < Output->Fill; offset += OTA_DIGEST_CHUNK_SIZE )
+    {
+        length = Output->Fill - offset;
+
+        if( length > OTA_DIGEST_CHUNK_SIZE )
+        {
+            length = OTA_DIGEST_CHUNK_SIZE;
+        }
+
+        vImageDigestBlockWritten( Output->Written + offset, length );
+    }
+
+    Output->Written += Output->Fill;
+    Output->Fill = 0;
+
+    return 0;
+}
+
+static int32_t prvPAL_OutputWrite( LL_ImageOutput_t * Output,
+                                   const uint8_t * Data,
+                                   uint32_t Length )
+{
+    uint32_t chunk;
+
+    while( Length > 0 )
+    {
+        chunk = MFLASH_SECTOR_SIZE - Output->Fill;
+
+        if( chunk > Length )
+        {
+            chunk = Length;
+        }
+
+        memcpy( ( uint8_t * ) prvPAL_SectorBuffer + Output->Fill, Data, chunk );
+        Output->Fill += chunk;
+        Data += chunk;
+        Length -= chunk;
+
+        if( ( Output->Fill == MFLASH_SECTOR_SIZE ) && ( 0 != prvPAL_OutputFlush( Output ) ) )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int32_t prvPAL_OutputCopy( LL_ImageOutput_t * Output,
+                                  uint32_t Distance,
+                                  uint32_t Length )
+{
+    uint8_t * Sector = ( uint8_t * ) prvPAL_SectorBuffer;
+    uint32_t Position;
+    uint32_t Source;
+    uint32_t chunk;
 
-/**
- * @brief The maximum size of each image slots.
- * Flash memory is divided in such a way there are 3 slots one for the current image
- * being executed, one for new image being written to and one for the backup image.
- */
-#define OTA_IMAGE_SLOT_SIZE      ( 0x200000 )
+    while( Length > 0 )
+    {
+        Position = Output->Written + Output->Fill;
 
-/**
- * @brief The flash address where the new image will be written to.
- */
-#define OTA_UPDATE_IMAGE_ADDR    ( BOOT_EXEC_IMAGE_ADDR + 1 * OTA_IMAGE_SLOT_SIZE )
+        if( ( Distance == 0 ) || ( Distance > Position ) )
+        {
+            return -1;
+        }
 
-/**
- * @brief The flash address where the backup image will be stored for rollback.
- */
-#define OTA_BACKUP_IMAGE_ADDR    ( BOOT_EXEC_IMAGE_ADDR + 2 * OTA_IMAGE_SLOT_SIZE )
+        Source = Position - Distance;
 
-/**
- * @brief Maximum size an offset of a firmware image can go in flash.
- */
-#define OTA_MAX_IMAGE_SIZE       ( OTA_IMAGE_SLOT_SIZE )
+        /* Copy at most the distance at once so that an overlapping match repeats its pattern, and stop
+         * at the end of the sector buffer, which is written to flash before the copy goes on. */
+        chunk = MFLASH_SECTOR_SIZE - Output->Fill;
 
-/**
- * @brief Pointer representation of the new firmware image in flash
- */
-#define OTA_UPDATE_IMAGE_PTR     ( ( void * ) OTA_UPDATE_IMAGE_ADDR )
+        if( chunk > Length )
+        {
+            chunk = Length;
+        }
 
-/**
- * @brief Pointer representation of the backup firmware image in flash
- */
-#define OTA_BACKUP_IMAGE_PTR     ( ( void * ) OTA_BACKUP_IMAGE_ADDR )
+        if( chunk > Distance )
+        {
+            chunk = Distance;
+        }
+
+        if( Source >= Output->Written )
+        {
+            memcpy( Sector + Output->Fill, Sector + ( Source - Output->Written ), chunk );
+        }
+        else
+        {
+            if( chunk > Output->Written - Source )
+            {
+                chunk = Output->Written - Source;
+            }
 
+            memcpy( Sector + Output->Fill, Output->BaseAddr + Source, chunk );
+        }
 
+        Output->Fill += chunk;
+        Length -= chunk;
 
-/* low level file context structure */
-typedef struct
+        if( ( Output->Fill == MFLASH_SECTOR_SIZE ) && ( 0 != prvPAL_OutputFlush( Output ) ) )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static BaseType_t prvPAL_Lz4ReadLength( const uint8_t * Input,
+                                        uint32_t * Position,
+                                        uint32_t * Length )
 {
-    const OtaFileContext_t * FileXRef;
-    uint8_t * BaseAddr;
-    uint32_t Size;
-} LL_FileContext_t;
+    uint8_t Extension;
 
-/**
- * @brief Get the low level PAL file context from OTA file context.
- *
- * @param[in] Pointer to OTA file context.
- */
-static LL_FileContext_t * prvPAL_GetLLFileContext( OtaFileContext_t * const C );
+    if( *Length == 15U )
+    {
+        do
+        {
+            if( *Position >= prvPAL_Decompressor.Available )
+            {
+                return pdFALSE;
+            }
 
-/* Specify the OTA signature algorithm we support on this platform. */
-const char OTA_JsonFileSignatureKey[ OTA_FILE_SIG_KEY_STR_MAX_LENGTH ] = "sig-sha256-ecdsa";
+            Extension = Input[ ( *Position )++ ];
+            *Length += Extension;
+        } while( Extension == 255U );
+    }
 
-static LL_FileContext_t prvPAL_CurrentFileContext;
+    return pdTRUE;
+}
 
-static LL_FileContext_t * prvPAL_GetLLFileContext( OtaFileContext_t * const C )
+static int32_t prvPAL_DecompressAvailable( void )
 {
-    LL_FileContext_t * FileContext;
+    LL_Decompressor_t * D = &prvPAL_Decompressor;
+    const uint8_t * Input = ( const uint8_t * ) OTA_STAGING_ADDR;
+    uint32_t Position;
+    uint32_t Produced;
+    uint32_t LiteralsStart;
+    uint32_t Literals;
+    uint32_t Distance;
+    uint32_t Match;
+    uint8_t Token;
+
+    if( D->ImageSize == 0 )
+    {
+        if( D->Available < OTA_LZ4_HEADER_SIZE )
+        {
+            return 0;
+        }
 
-    if( ( C == NULL ) || ( C->pFile == NULL ) )
+        D->ImageSize = prvPAL_Read32( Input + 4 );
+
+        if( ( prvPAL_Read32( Input ) != OTA_LZ4_MAGIC ) ||
+            ( D->ImageSize == 0 ) ||
+            ( D->ImageSize > OTA_MAX_IMAGE_SIZE ) )
+        {
+            PRINTF( "[OTA-NXP] Unsupported compressed image\r\n" );
+            return -1;
+        }
+
+        D->Consumed = OTA_LZ4_HEADER_SIZE;
+
+        /* The digest covers the image as it is decoded, not the compressed file. */
+        ( void ) xImageDigestStart( D->Output.BaseAddr, D->ImageSize );
+    }
+
+    Produced = D->Output.Written + D->Output.Fill;
+
+    /* A sequence is decoded only once received completely, otherwise it is decoded again from its
+     * token when the next block arrives. The last sequence has literals only. */
+    while( ( Produced < D->ImageSize ) && ( D->Consumed < D->Available ) )
     {
-        return NULL;
+        Position = D->Consumed;
+        Token = Input[ Position++ ];
+        Literals = Token >> 4;
+        Match = Token & 0x0FU;
+        Distance = 0;
+
+        if( ( prvPAL_Lz4ReadLength( Input, &Position, &Literals ) == pdFALSE ) ||
+            ( Literals > D->Available - Position ) )
+        {
+            break;
+        }
+
+        if( Literals > D->ImageSize - Produced )
+        {
+            return -1;
+        }
+
+        LiteralsStart = Position;
+        Position += Literals;
+
+        if( Produced + Literals < D->ImageSize )
+        {
+            if( D->Available - Position < 2U )
+            {
+                break;
+            }
+
+            Distance = ( uint32_t ) Input[ Position ] | ( ( uint32_t ) Input[ Position + 1 ] << 8 );
+            Position += 2U;
+
+            if( prvPAL_Lz4ReadLength( Input, &Position, &Match ) == pdFALSE )
+            {
+                break;
+            }
+
+            Match += OTA_LZ4_MIN_MATCH;
+
+            if( Match > D->ImageSize - Produced - Literals )
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            Match = 0;
+        }
+
+        if( ( 0 != prvPAL_OutputWrite( &D->Output, Input + LiteralsStart, Literals ) ) ||
+            ( ( Match > 0 ) && ( 0 != prvPAL_OutputCopy( &D->Output, Distance, Match ) ) ) )
+        {
+            return -1;
+        }
+
+        D->Consumed = Position;
+        Produced += Literals + Match;
     }
 
-    FileContext = ( LL_FileContext_t * ) C->pFile;
+    if( ( Produced == D->ImageSize ) && ( D->Output.Fill > 0 ) )
+    {
+        /* Write the last, partial sector, which completes the digest. */
+        return prvPAL_OutputFlush( &D->Output );
+    }
 
-    if( ( FileContext == NULL ) || ( FileContext->FileXRef != C ) )
+    return 0;
+}
+
+static int32_t prvPAL_DecompressBlock( uint32_t Offset,
+                                       uint8_t * const Data,
+                                       uint32_t BlockSize )
+{
+    LL_Decompressor_t * D = &prvPAL_Decompressor;
+    uint32_t Block = Offset / OTA_DIGEST_CHUNK_SIZE;
+
+    if( D->HasFailed == pdTRUE )
     {
-        return NULL;
+        return -1;
     }
 
-    return FileContext;
+    /* The decoder reads the compressed file from flash, so the block is programmed right away: its
+     * sector is still erased only once, when its first block is received. */
+    if( ( 0 != prvPAL_CacheWrite( Offset, Data, BlockSize ) ) || ( 0 != prvPAL_CacheFlush() ) )
+    {
+        D->HasFailed = pdTRUE;
+        return -1;
+    }
+
+    D->ReceivedBlocks[ Block / 8U ] |= ( uint8_t ) ( 1U << ( Block % 8U ) );
+
+    return prvPAL_DecompressExtend();
+}
+
+static int32_t prvPAL_DecompressExtend( void )
+{
+    LL_Decompressor_t * D = &prvPAL_Decompressor;
+    uint32_t Block;
+
+    /* Extend the contiguous prefix with the blocks received ahead of it. */
+    while( D->Available < D->InputSize )
+    {
+        Block = D->Available / OTA_DIGEST_CHUNK_SIZE;
+
+        if( ( D->ReceivedBlocks[ Block / 8U ] & ( 1U << ( Block % 8U ) ) ) == 0U )
+        {
+            break;
+        }
+
+        D->Available += ( D->InputSize - D->Available > OTA_DIGEST_CHUNK_SIZE ) ?
+                        OTA_DIGEST_CHUNK_SIZE : ( D->InputSize - D->Available );
+    }
+
+    if( 0 != prvPAL_DecompressAvailable() )
+    {
+        PRINTF( "[OTA-NXP] Compressed image rejected at offset %x\r\n", D->Consumed );
+        D->HasFailed = pdTRUE;
+        vImageDigestAbort();
+        return -1;
+    }
+
+    return 0;
+}
+
+static OtaPalStatus_t prvPAL_ApplyPatch( LL_FileContext_t * FileContext )
+{
+    const uint8_t * Patch = ( const uint8_t * ) OTA_STAGING_ADDR;
+    const uint8_t * Source = ( const uint8_t * ) boot_exec_image();
+    const uint8_t * Cursor;
+    const uint8_t * End;
+    LL_ImageOutput_t Output = { 0 };
+    uint32_t PatchSize = FileContext->Size;
+    uint32_t SourceSize;
+    uint32_t TargetSize;
+    uint32_t Offset;
+    uint32_t Length;
+    uint8_t Command = OTA_PATCH_CMD_END;
+    TickType_t StartTicks = xTaskGetTickCount();
+    int32_t result = 0;
+
+    SourceSize = prvPAL_Read32( FileContext->BaseAddr + 8 );
+    TargetSize = prvPAL_Read32( FileContext->BaseAddr + 12 );
+
+    if( ( ( prvPAL_Read32( FileContext->BaseAddr + 4 ) & 0xFFFFU ) != OTA_PATCH_VERSION ) ||
+        ( ( prvPAL_Read32( FileContext->BaseAddr + 4 ) >> 16 ) != OTA_PATCH_HEADER_SIZE ) ||
+        ( SourceSize > OTA_IMAGE_SLOT_SIZE ) ||
+        ( TargetSize == 0 ) ||
+        ( TargetSize > OTA_MAX_IMAGE_SIZE ) ||
+        ( PatchSize > OTA_STAGING_SIZE ) )
+    {
+        PRINTF( "[OTA-NXP] Unsupported patch\r\n" );
+        return OTA_PAL_COMBINE_ERR( OtaPalFileClose, 0 );
+    }
+
+    /* The digest started when the file was created covers the patch, not the image. */
+    vImageDigestAbort();
+
+    if( 0 != prvPAL_StagePatch( FileContext ) )
+    {
+        PRINTF( "[OTA-NXP] FLASH operation failed while staging patch\r\n" );
+        return OTA_PAL_COMBINE_ERR( OtaPalFileClose, 0 );
+    }
+
+    ( void ) xImageDigestStart( FileContext->BaseAddr, TargetSize );
+
+    Output.BaseAddr = FileContext->BaseAddr;
+    Cursor = Patch + OTA_PATCH_HEADER_SIZE;
+    End = Patch + PatchSize;
+
+    /* The patch cannot tell whether it was made against the running image: a patch applied to another
+     * image produces an image whose signature does not verify. */
+    while( ( result == 0 ) && ( Cursor < End ) )
+    {
+        Command = *Cursor++;
+
+        if( Command == OTA_PATCH_CMD_END )
+        {
+            break;
+        }
+        else if( ( Command == OTA_PATCH_CMD_COPY ) && ( ( End - Cursor ) >= 8 ) )
+        {
+            Offset = prvPAL_Read32( Cursor );
+            Length = prvPAL_Read32( Cursor + 4 );
+            Cursor += 8;
+
+            if( ( Length > SourceSize ) || ( Offset > SourceSize - Length ) ||
+                ( Length > TargetSize - ( Output.Written + Output.Fill ) ) )
+            {
+                result = -1;
+            }
+            else
+            {
+                result = prvPAL_OutputWrite( &Output, Source + Offset, Length );
+            }
+        }
+        else if( ( Command == OTA_PATCH_CMD_INSERT ) && ( ( End - Cursor ) >= 4 ) )
+        {
+            Length = prvPAL_Read32( Cursor );
+            Cursor += 4;
+
+            if( ( Length > ( uint32_t ) ( End - Cursor ) ) ||
+                ( Length > TargetSize - ( Output.Written + Output.Fill ) ) )
+            {
+                result = -1;
+            }
+            else
+            {
+                result = prvPAL_OutputWrite( &Output, Cursor, Length );
+                Cursor += Length;
+            }
+        }
+        else
+        {
+            result = -1;
+        }
+    }
+
+    if( ( result == 0 ) && ( Output.Fill > 0 ) )
+    {
+        result = prvPAL_OutputFlush( &Output );
+    }
+
+    if( ( result != 0 ) || ( Command != OTA_PATCH_CMD_END ) || ( Output.Written != TargetSize ) )
+    {
+        PRINTF( "[OTA-NXP] Patch rejected at image offset %x\r\n", Output.Written + Output.Fill );
+        vImageDigestAbort();
+        return OTA_PAL_COMBINE_ERR( OtaPalFileClose, 0 );
+    }
+
+    FileContext->Size = TargetSize;
+
+    PRINTF( "[OTA-NXP] Patch of %u bytes applied to a %u byte image in %u ms\r\n",
+            PatchSize,
+            TargetSize,
+            ( uint32_t ) ( ( xTaskGetTickCount() - StartTicks ) * portTICK_PERIOD_MS ) );
+
+    return OtaPalSuccess;
 }
 
 
@@ -129,6 +1626,43 @@ OtaPalImageState_t xOtaPalGetPlatformImageState( OtaFileContext_t * const pFileC
     return OtaPalImageStateInvalid;
 }
 
+static int32_t prvPAL_CancelNewImage( struct boot_ucb * Ucb )
+{
+    struct boot_ucb ucbCheck;
+    void * CancelledImage = Ucb->update_img;
+    int32_t result = 0;
+
+    if( ( Ucb->flags & BOOT_UCB_FLAG_SLOTS ) == 0U )
+    {
+        /* In the void state the bootloader executes 'update_img', the image of the rollback slot runs now. */
+        Ucb->update_img = Ucb->rollback_img;
+        Ucb->update_img_size = Ucb->rollback_img_size;
+    }
+
+    Ucb->state = BOOT_STATE_VOID;
+
+    if( 0 != boot_ucb_write( Ucb ) )
+    {
+        result = -1;
+    }
+    else if( ( Ucb->flags & BOOT_UCB_FLAG_SLOTS ) == 0U )
+    {
+        if( ( 0 != boot_ucb_read( &ucbCheck ) ) ||
+            ( ucbCheck.state != BOOT_STATE_VOID ) ||
+            ( ucbCheck.update_img == CancelledImage ) )
+        {
+            PRINTF( "[OTA-NXP] Cancelled image in slot %p is still selected for boot\r\n", CancelledImage );
+            result = -1;
+        }
+    }
+    else
+    {
+        /* The update is copied over the running image only when booted, nothing selects it anymore. */
+    }
+
+    return result;
+}
+
 OtaPalStatus_t xOtaPalSetPlatformImageState( OtaFileContext_t * const pFileContext,
                                              OtaImageState_t eState )
 {
@@ -199,9 +1733,7 @@ OtaPalStatus_t xOtaPalSetPlatformImageState( OtaFileContext_t * const pFileConte
             }
             else if( ucb.state == BOOT_STATE_NEW )
             {
-                ucb.state = BOOT_STATE_VOID;
-
-                if( 0 != boot_ucb_write( &ucb ) )
+                if( 0 != prvPAL_CancelNewImage( &ucb ) )
                 {
                     PRINTF( "[OTA-NXP] FLASH operation failed during reject\r\n" );
                     result = OTA_PAL_COMBINE_ERR( OtaPalRejectFailed, 0 );
@@ -230,9 +1762,7 @@ OtaPalStatus_t xOtaPalSetPlatformImageState( OtaFileContext_t * const pFileConte
             }
             else if( ucb.state == BOOT_STATE_NEW )
             {
-                ucb.state = BOOT_STATE_VOID;
-
-                if( 0 != boot_ucb_write( &ucb ) )
+                if( 0 != prvPAL_CancelNewImage( &ucb ) )
                 {
                     PRINTF( "[OTA-NXP] FLASH operation failed during abort\r\n" );
                     result = OTA_PAL_COMBINE_ERR( OtaPalAbortFailed, 0 );
@@ -261,9 +1791,28 @@ OtaPalStatus_t xOtaPalResetDevice( OtaFileContext_t * const pFileContext )
 
 OtaPalStatus_t xOtaPalActivateNewImage( OtaFileContext_t * const pFileContext )
 {
+    void * UpdateImage = OTA_UPDATE_IMAGE_PTR;
+    int32_t result;
+
     PRINTF( "[OTA-NXP] ActivateNewImage\r\n" );
 
-    if( 0 != boot_update_request( OTA_UPDATE_IMAGE_PTR, OTA_BACKUP_IMAGE_PTR ) )
+    if( 0 == boot_image_check( UpdateImage, UpdateImage ) )
+    {
+        /* Linked for its slot: executed in place, the running image stays in its slot for rollback. */
+        result = boot_slot_request( UpdateImage );
+    }
+    else if( UpdateImage != ( void * ) BOOT_EXEC_IMAGE_ADDR )
+    {
+        /* Linked for the execution address: copied over the running image once it is backed up. */
+        result = boot_update_request( UpdateImage, OTA_BACKUP_IMAGE_PTR );
+    }
+    else
+    {
+        PRINTF( "[OTA-NXP] Image is not linked for slot %p\r\n", UpdateImage );
+        result = -1;
+    }
+
+    if( 0 != result )
     {
         return OTA_PAL_COMBINE_ERR( OtaPalActivateFailed, 0 );
     }
@@ -290,7 +1839,16 @@ int16_t xOtaPalWriteBlock( OtaFileContext_t * const pFileContext,
         return -1;
     }
 
-    result = mflash_drv_write( ( void * ) ( FileContext->BaseAddr + offset ), pData, blockSize );
+    if( prvPAL_Decompressor.IsActive == pdTRUE )
+    {
+        /* Compressed image, written and hashed in the update slot as it is decoded. */
+        result = prvPAL_DecompressBlock( offset, pData, blockSize );
+    }
+    else
+    {
+        /* Written to flash, and hashed, once its sector is complete. */
+        result = prvPAL_CacheWrite( offset, pData, blockSize );
+    }
 
     if( result == 0 )
     {
@@ -320,6 +1878,54 @@ OtaPalStatus_t xOtaPalCloseFile( OtaFileContext_t * const pFileContext )
         return OTA_PAL_COMBINE_ERR( OtaPalFileClose, 0 );
     }
 
+    prvPAL_PreEraseStop();
+
+    if( 0 != prvPAL_CacheFlush() )
+    {
+        PRINTF( "[OTA-NXP] FLASH operation failed while closing file\r\n" );
+        vImageDigestAbort();
+        result = OTA_PAL_COMBINE_ERR( OtaPalFileClose, 0 );
+    }
+    else
+    {
+        PRINTF( "[OTA-NXP] %u sectors erased, %u written back before complete\r\n",
+                prvPAL_WriteCache.SectorsErased,
+                prvPAL_WriteCache.PartialWriteBacks );
+    }
+
+    /* Whatever the outcome, the download is over. */
+    prvPAL_JournalClose();
+
+    if( ( result == OtaPalSuccess ) && ( prvPAL_Decompressor.IsActive == pdTRUE ) )
+    {
+        if( ( prvPAL_Decompressor.HasFailed == pdTRUE ) ||
+            ( prvPAL_Decompressor.ImageSize == 0 ) ||
+            ( prvPAL_Decompressor.Consumed != prvPAL_Decompressor.InputSize ) ||
+            ( prvPAL_Decompressor.Output.Written != prvPAL_Decompressor.ImageSize ) )
+        {
+            PRINTF( "[OTA-NXP] Compressed image incomplete\r\n" );
+            vImageDigestAbort();
+            result = OTA_PAL_COMBINE_ERR( OtaPalFileClose, 0 );
+        }
+        else
+        {
+            PRINTF( "[OTA-NXP] Decompressed %u bytes into a %u byte image\r\n",
+                    prvPAL_Decompressor.InputSize,
+                    prvPAL_Decompressor.ImageSize );
+
+            /* From now on the file is the image rebuilt in the update slot. */
+            FileContext->Size = prvPAL_Decompressor.ImageSize;
+        }
+    }
+
+    prvPAL_Decompressor.IsActive = pdFALSE;
+
+    if( ( result == OtaPalSuccess ) && ( prvPAL_IsPatch( FileContext ) == pdTRUE ) )
+    {
+        /* A delta update, rebuild the new image before it is validated. */
+        result = prvPAL_ApplyPatch( FileContext );
+    }
+
     pFileContext->pFile = NULL;
     FileContext->FileXRef = NULL;
     return result;
@@ -336,12 +1942,39 @@ OtaPalStatus_t xOtaPalCreateFileForRx( OtaFileContext_t * const pFileContext )
         return OTA_PAL_COMBINE_ERR( OtaPalRxFileTooLarge, 0 );
     }
 
+    /* A task left erasing for a previous file must not see the write cache set up for this one. */
+    prvPAL_PreEraseStop();
+
     FileContext->FileXRef = pFileContext; /* cross reference for integrity check */
     FileContext->BaseAddr = OTA_UPDATE_IMAGE_PTR;
     FileContext->Size = 0;
 
     pFileContext->pFile = ( uint8_t * ) FileContext;
 
+    memset( &prvPAL_Decompressor, 0, sizeof( prvPAL_Decompressor ) );
+
+    if( pFileContext->fileType == OTA_FILE_TYPE_LZ4 )
+    {
+        /* The image digest is started once the size of the image is decoded. */
+        PRINTF( "[OTA-NXP] Receiving compressed image\r\n" );
+        prvPAL_Decompressor.IsActive = pdTRUE;
+        prvPAL_Decompressor.InputSize = pFileContext->fileSize;
+        prvPAL_Decompressor.Output.BaseAddr = FileContext->BaseAddr;
+        prvPAL_CacheInit( ( uint8_t * ) OTA_STAGING_ADDR, pFileContext->fileSize, pdFALSE );
+    }
+    else
+    {
+        ( void ) xImageDigestStart( FileContext->BaseAddr, pFileContext->fileSize );
+        prvPAL_CacheInit( FileContext->BaseAddr, pFileContext->fileSize, pdTRUE );
+    }
+
+    /* After a reset, the blocks already in flash are not requested again. */
+    prvPAL_JournalOpen( pFileContext );
+
+    /* Blocks are only requested once the file is created, the flash is erased meanwhile and while
+     * the tasks receiving them wait for the network. */
+    prvPAL_PreEraseStart( pFileContext->fileSize );
+
     return OtaPalSuccess;
 }
 
@@ -353,6 +1986,19 @@ OtaPalStatus_t xOtaPalAbort( OtaFileContext_t * const pFileContext )
 
     PRINTF( "[OTA-NXP] Abort\r\n" );
 
+    vImageDigestAbort();
+    prvPAL_Decompressor.IsActive = pdFALSE;
+    prvPAL_PreEraseStop();
+
+    /* Leave the flash holding every block received. */
+    if( 0 != prvPAL_CacheFlush() )
+    {
+        result = OTA_PAL_COMBINE_ERR( OtaPalAbortFailed, 0 );
+    }
+
+    prvPAL_JournalClose();
+    prvPAL_CacheInit( NULL, 0, pdFALSE );
+
     pFileContext->pFile = NULL;
     return result;
 }
@@ -390,9 +2036,11 @@ int32_t xOtaPalReadBlock( OtaFileContext_t * const pContext,
         bytesToRead = ( FileContext->Size - offset );
     }
 
-    if( bytesToRead > 0 )
+    /* Copied by the DMA controller, the CPU is left to the other tasks during the verification. */
+    if( ( bytesToRead > 0 ) &&
+        ( 0 != mflash_drv_read( pData, ( void * ) ( FileContext->BaseAddr + offset ), bytesToRead ) ) )
     {
-        memcpy( pData, ( void * ) ( FileContext->BaseAddr + offset ), bytesToRead );
+        return -1;
     }
 
     return ( int32_t ) ( bytesToRead );
@@ -22,6 +22,8 @@
  * http://aws.amazon.com/freertos
  * http://www.FreeRTOS.org
  */
+#include <string.h>
+
 #include "FreeRTOS.h"
 #include "task.h"
 
@@ -47,6 +49,38 @@
  */
 #define OTA_IMAGE_BLOCK_LENGTH    ( 4096 )
 
+/**
+ * @brief Size of the blocks tracked by the incremental digest, the OTA file block size.
+ */
+#define OTA_DIGEST_BLOCK_SIZE        ( 1UL << otaconfigLOG2_FILE_BLOCK_SIZE )
+
+/**
+ * @brief Largest image hashed while its blocks are written, the size of an update slot.
+ * Larger images are hashed when the file is closed.
+ */
+#define OTA_DIGEST_MAX_IMAGE_SIZE    ( 0x200000UL )
+
+/**
+ * @brief Number of blocks of the largest image hashed while its blocks are written.
+ */
+#define OTA_DIGEST_MAX_BLOCKS        ( OTA_DIGEST_MAX_IMAGE_SIZE / OTA_DIGEST_BLOCK_SIZE )
+
+/**
+ * @brief State of the SHA256 digest computed while the image is written.
+ * Blocks are hashed from flash in order. A block written ahead of the hashed prefix is only marked in
+ * the bitmap, and hashed once all the blocks before it are written.
+ */
+typedef struct ImageDigest
+{
+    BaseType_t isActive;                                     /**< pdTRUE while the digest operation is in progress. */
+    CK_SESSION_HANDLE session;                               /**< Session holding the digest operation. */
+    CK_FUNCTION_LIST_PTR functionList;                       /**< PKCS11 function list. */
+    const uint8_t * pImage;                                  /**< Image in memory mapped flash. */
+    uint32_t imageSize;                                      /**< Size of the whole image. */
+    uint32_t hashedLength;                                   /**< Length of the prefix of the image already hashed. */
+    uint8_t writtenBlocks[ ( OTA_DIGEST_MAX_BLOCKS + 7U ) / 8U ]; /**< Bitmap of the blocks written. */
+} ImageDigest_t;
+
 /**
  * @brief Opens a PKCS11 Session.
  *
@@ -76,6 +110,36 @@ static CK_RV prvPKCS11GetCertificateHandle( CK_SESSION_HANDLE xSession,
                                             CK_OBJECT_HANDLE_PTR pxCertHandle );
 
 
+/**
+ * @brief Finishes the digest operation of a session and verifies the signature of the digest.
+ *
+ * @param[in] session PKCS11 session with an active SHA256 digest operation.
+ * @param[in] certificateHandle Certificate handle used for signature validation.
+ * @param[in] pSignature Signature in PKCS11 format.
+ * @param[in] signatureLength Length of the signature.
+ * @return CKR_OK if the signature is valid.
+ */
+static CK_RV prvVerifyDigest( CK_SESSION_HANDLE session,
+                              CK_OBJECT_HANDLE certificateHandle,
+                              uint8_t * pSignature,
+                              size_t signatureLength );
+
+/**
+ * @brief Checks if the incremental digest covers the whole image.
+ *
+ * @return pdTRUE if only the final digest and the signature check are left.
+ */
+static BaseType_t prvIsImageDigestComplete( void );
+
+/**
+ * @brief State of the digest of the image being written.
+ */
+static ImageDigest_t imageDigest =
+{
+    .isActive = pdFALSE,
+    .session  = CK_INVALID_HANDLE
+};
+
 /**
  * @brief Verifies the firmware image signature using PKCS11 APIs.
  * Uses PKCS11 SHA256 hash APIS to calculate running checksum of the image and  verify
@@ -182,16 +246,9 @@ CK_RV xVerifyImageSignatureUsingPKCS11( CK_SESSION_HANDLE session,
                                         size_t signatureLength )
 
 {
-    /* The ECDSA mechanism will be used to verify the message digest. */
-    CK_MECHANISM mechanism = { CKM_ECDSA, NULL, 0 };
-
     /* SHA 256  will be used to calculate the digest. */
     CK_MECHANISM xDigestMechanism = { CKM_SHA256, NULL, 0 };
 
-    /* The buffer used to hold the calculated SHA25 digest of the image. */
-    CK_BYTE digestResult[ pkcs11SHA256_DIGEST_LENGTH ] = { 0 };
-    CK_ULONG digestLength = pkcs11SHA256_DIGEST_LENGTH;
-
     CK_RV result = CKR_OK;
 
     CK_FUNCTION_LIST_PTR functionList;
@@ -233,6 +290,32 @@ CK_RV xVerifyImageSignatureUsingPKCS11( CK_SESSION_HANDLE session,
         result = CKR_GENERAL_ERROR;
     }
 
+    if( result == CKR_OK )
+    {
+        result = prvVerifyDigest( session, certificateHandle, pSignature, signatureLength );
+    }
+
+    return result;
+}
+
+static CK_RV prvVerifyDigest( CK_SESSION_HANDLE session,
+                              CK_OBJECT_HANDLE certificateHandle,
+                              uint8_t * pSignature,
+                              size_t signatureLength )
+{
+    /* The ECDSA mechanism will be used to verify the message digest. */
+    CK_MECHANISM mechanism = { CKM_ECDSA, NULL, 0 };
+
+    /* The buffer used to hold the calculated SHA25 digest of the image. */
+    CK_BYTE digestResult[ pkcs11SHA256_DIGEST_LENGTH ] = { 0 };
+    CK_ULONG digestLength = pkcs11SHA256_DIGEST_LENGTH;
+
+    CK_RV result = CKR_OK;
+
+    CK_FUNCTION_LIST_PTR functionList;
+
+    result = C_GetFunctionList( &functionList );
+
     if( result == CKR_OK )
     {
         result = functionList->C_DigestFinal( session,
@@ -270,6 +353,131 @@ CK_RV xVerifyImageSignatureUsingPKCS11( CK_SESSION_HANDLE session,
 }
 
 
+static BaseType_t prvIsImageDigestComplete( void )
+{
+    return ( ( imageDigest.isActive == pdTRUE ) &&
+             ( imageDigest.hashedLength == imageDigest.imageSize ) ) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xImageDigestStart( const uint8_t * pImage,
+                              uint32_t imageSize )
+{
+    /* SHA 256  will be used to calculate the digest. */
+    CK_MECHANISM xDigestMechanism = { CKM_SHA256, NULL, 0 };
+    CK_RV result = CKR_OK;
+
+    vImageDigestAbort();
+
+    if( imageSize > OTA_DIGEST_MAX_IMAGE_SIZE )
+    {
+        result = CKR_ARGUMENTS_BAD;
+    }
+
+    if( result == CKR_OK )
+    {
+        result = C_GetFunctionList( &imageDigest.functionList );
+    }
+
+    if( result == CKR_OK )
+    {
+        result = prvOpenPKCS11Session( &imageDigest.session );
+    }
+
+    if( result == CKR_OK )
+    {
+        result = imageDigest.functionList->C_DigestInit( imageDigest.session, &xDigestMechanism );
+    }
+
+    if( result == CKR_OK )
+    {
+        imageDigest.pImage = pImage;
+        imageDigest.imageSize = imageSize;
+        imageDigest.hashedLength = 0U;
+        memset( imageDigest.writtenBlocks, 0x00, sizeof( imageDigest.writtenBlocks ) );
+        imageDigest.isActive = pdTRUE;
+    }
+    else
+    {
+        PRINTF( "Image digest not started, PKCS11 status %d. The image is hashed when closed.\r\n", result );
+        vImageDigestAbort();
+    }
+
+    return imageDigest.isActive;
+}
+
+void vImageDigestBlockWritten( uint32_t offset,
+                               uint32_t blockSize )
+{
+    uint32_t block = offset / OTA_DIGEST_BLOCK_SIZE;
+    uint32_t expectedSize;
+    uint32_t hashLength;
+    CK_RV result = CKR_OK;
+
+    if( ( imageDigest.isActive == pdTRUE ) && ( offset >= imageDigest.hashedLength ) )
+    {
+        expectedSize = imageDigest.imageSize - offset;
+
+        if( expectedSize > OTA_DIGEST_BLOCK_SIZE )
+        {
+            expectedSize = OTA_DIGEST_BLOCK_SIZE;
+        }
+
+        /* Only whole OTA blocks are tracked, anything else is left to the check at close. */
+        if( ( ( offset % OTA_DIGEST_BLOCK_SIZE ) != 0U ) ||
+            ( offset >= imageDigest.imageSize ) ||
+            ( blockSize != expectedSize ) )
+        {
+            PRINTF( "Image digest stopped by block %x : %x.\r\n", offset, blockSize );
+            result = CKR_DATA_LEN_RANGE;
+        }
+        else
+        {
+            imageDigest.writtenBlocks[ block / 8U ] |= ( uint8_t ) ( 1U << ( block % 8U ) );
+        }
+
+        /* Hash from flash every written block contiguous with the hashed prefix, which catches up
+         * with the blocks received ahead of a missing one. */
+        while( ( result == CKR_OK ) && ( imageDigest.hashedLength < imageDigest.imageSize ) )
+        {
+            block = imageDigest.hashedLength / OTA_DIGEST_BLOCK_SIZE;
+
+            if( ( imageDigest.writtenBlocks[ block / 8U ] & ( 1U << ( block % 8U ) ) ) == 0U )
+            {
+                break;
+            }
+
+            hashLength = imageDigest.imageSize - imageDigest.hashedLength;
+
+            if( hashLength > OTA_DIGEST_BLOCK_SIZE )
+            {
+                hashLength = OTA_DIGEST_BLOCK_SIZE;
+            }
+
+            result = imageDigest.functionList->C_DigestUpdate( imageDigest.session,
+                                                               ( CK_BYTE_PTR ) &imageDigest.pImage[ imageDigest.hashedLength ],
+                                                               hashLength );
+            imageDigest.hashedLength += hashLength;
+        }
+
+        if( result != CKR_OK )
+        {
+            vImageDigestAbort();
+        }
+    }
+}
+
+void vImageDigestAbort( void )
+{
+    if( imageDigest.session != CK_INVALID_HANDLE )
+    {
+        /* Closing the session also terminates its digest operation. */
+        ( void ) prvClosePKCS11Session( imageDigest.session );
+        imageDigest.session = CK_INVALID_HANDLE;
+    }
+
+    imageDigest.isActive = pdFALSE;
+}
+
 BaseType_t xValidateImageSignature( uint8_t * pFilePath,
                                     char * pCertificatePath,
                                     uint8_t * pSignature,
@@ -286,41 +494,27 @@ BaseType_t xValidateImageSignature( uint8_t * pFilePath,
 
     PRINTF( "Validating the integrity of OTA image.\r\n" );
 
-    fileContext.pFilePath = pFilePath;
-
-    status = xOtaPalOpenFileForRead( &fileContext );
-
-    if( status != OtaPalSuccess )
-    {
-        PRINTF( "Cannot open the image file for reading, error = %d.\r\n", status );
-        return pdFALSE;
-    }
-
-    if( result == pdTRUE )
+    if( PKI_mbedTLSSignatureToPkcs11Signature( pkcs11Signature, pSignature ) != 0 )
     {
-        if( PKI_mbedTLSSignatureToPkcs11Signature( pkcs11Signature, pSignature ) != 0 )
-        {
-            PRINTF( "Cannot convert signature to PKCS11 format.\r\n" );
-            result = pdFALSE;
-        }
+        PRINTF( "Cannot convert signature to PKCS11 format.\r\n" );
+        result = pdFALSE;
     }
 
-    if( result == pdTRUE )
+    if( ( result == pdTRUE ) && ( prvIsImageDigestComplete() == pdTRUE ) )
     {
-        xPKCS11Status = prvOpenPKCS11Session( &session );
+        /* The image was hashed while its blocks were written, only the signature is left to check. */
+        session = imageDigest.session;
+        imageDigest.session = CK_INVALID_HANDLE;
+        imageDigest.isActive = pdFALSE;
 
-        if( xPKCS11Status == CKR_OK )
-        {
-            xPKCS11Status = prvPKCS11GetCertificateHandle( session, pCertificatePath, &certHandle );
-        }
+        xPKCS11Status = prvPKCS11GetCertificateHandle( session, pCertificatePath, &certHandle );
 
         if( xPKCS11Status == CKR_OK )
         {
-            xPKCS11Status = xVerifyImageSignatureUsingPKCS11( session,
-                                                              certHandle,
-                                                              &fileContext,
-                                                              pkcs11Signature,
-                                                              pkcs11ECDSA_P256_SIGNATURE_LENGTH );
+            xPKCS11Status = prvVerifyDigest( session,
+                                             certHandle,
+                                             pkcs11Signature,
+                                             pkcs11ECDSA_P256_SIGNATURE_LENGTH );
         }
 
         if( xPKCS11Status != CKR_OK )
@@ -329,8 +523,52 @@ BaseType_t xValidateImageSignature( uint8_t * pFilePath,
             result = pdFALSE;
         }
     }
+    else if( result == pdTRUE )
+    {
+        /* Some blocks were not hashed as they were written, read the whole image again. */
+        vImageDigestAbort();
+
+        fileContext.pFilePath = pFilePath;
+
+        status = xOtaPalOpenFileForRead( &fileContext );
 
-    ( void ) xOtaPalCloseFile( &fileContext );
+        if( status != OtaPalSuccess )
+        {
+            PRINTF( "Cannot open the image file for reading, error = %d.\r\n", status );
+            result = pdFALSE;
+        }
+
+        if( result == pdTRUE )
+        {
+            xPKCS11Status = prvOpenPKCS11Session( &session );
+
+            if( xPKCS11Status == CKR_OK )
+            {
+                xPKCS11Status = prvPKCS11GetCertificateHandle( session, pCertificatePath, &certHandle );
+            }
+
+            if( xPKCS11Status == CKR_OK )
+            {
+                xPKCS11Status = xVerifyImageSignatureUsingPKCS11( session,
+                                                                  certHandle,
+                                                                  &fileContext,
+                                                                  pkcs11Signature,
+                                                                  pkcs11ECDSA_P256_SIGNATURE_LENGTH );
+            }
+
+            if( xPKCS11Status != CKR_OK )
+            {
+                PRINTF( "Image verification failed with PKCS11 status %d\r\n", xPKCS11Status );
+                result = pdFALSE;
+            }
+
+            ( void ) xOtaPalCloseFile( &fileContext );
+        }
+    }
+    else
+    {
+        vImageDigestAbort();
+    }
 
     if( session != CKR_SESSION_HANDLE_INVALID )
     {
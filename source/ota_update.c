@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <string.h>
 
 #include "FreeRTOS.h"
 #include "task.h"
@@ -48,6 +49,7 @@
 
 /* MQTT include. */
 #include "core_mqtt_agent.h"
+#include "mqtt_subscription_router.h"
 
 #include "core_pkcs11.h"
 
@@ -57,8 +59,11 @@
 /* OTA Library Interface include. */
 #include "ota_os_freertos.h"
 #include "ota_mqtt_interface.h"
+#include "ota_http_interface.h"
+#include "ota_http.h"
 
 #include "ota_pal.h"
+#include "mflash_drv.h"
 
 /* Include for getting provisioned thing name. */
 #include "provision_interface.h"
@@ -77,6 +82,11 @@
  */
 #define OTA_POLLING_DELAY_MS                    ( 1000U )
 
+/**
+ * @brief Delay before retrying an operation rejected because the MQTT agent in-flight window is full.
+ */
+#define OTA_AGENT_WINDOW_RETRY_DELAY_MS         ( 50U )
+
 /**
  * @brief Wildcard topic filter which matches a response from MQTT broker for a
  * job request from the device.
@@ -109,6 +119,69 @@
  */
 #define DATA_TOPIC_FILTER_LENGTH                ( ( uint16_t ) ( sizeof( DATA_TOPIC_FILTER ) - 1 ) )
 
+/**
+ * @brief End of the topic of the requests for blocks of an OTA stream, the job topics carry JSON.
+ */
+#define STREAM_REQUEST_TOPIC_SUFFIX             "/get/cbor"
+
+/**
+ * @brief Length of the stream request topic suffix.
+ */
+#define STREAM_REQUEST_TOPIC_SUFFIX_LENGTH      ( ( uint16_t ) ( sizeof( STREAM_REQUEST_TOPIC_SUFFIX ) - 1 ) )
+
+/**
+ * @brief Number of blocks requested per stream request before any request completed.
+ */
+#define OTA_REQUEST_WINDOW_INITIAL              ( 4U )
+
+/**
+ * @brief Smoothed round trip time, in multiples of the smallest one measured, above which blocks are
+ * assumed to queue on the way and the window shrinks instead of growing.
+ */
+#define OTA_REQUEST_WINDOW_RTT_FACTOR           ( 2U )
+
+/**
+ * @brief Number of blocks requested per stream request, adapted to the link like a congestion window:
+ * it grows by one block after a request fully received without drops while the round trip time stays
+ * near the smallest one measured, shrinks by one block when the round trip time rises, and halves when
+ * blocks are dropped or lost. The OTA library reads the window through otaconfigMAX_NUM_BLOCKS_REQUEST,
+ * both to encode a request and to count the blocks it waits for before sending the next one. The window
+ * is only resized when the library sends a request, after it read it, so both agree on every request.
+ */
+typedef struct OtaRequestWindow
+{
+    uint32_t size;                 /**< Window, at most otaconfigREQUEST_WINDOW_MAX. */
+    uint32_t blocks;               /**< Window capped by the free event buffers, read by the OTA library. */
+    volatile uint32_t requested;   /**< Blocks of the request in flight, zero before the first request. */
+    volatile uint32_t arrived;     /**< Blocks of the request in flight received or dropped. */
+    uint32_t droppedAtRequest;     /**< Blocks dropped by the demo and the OTA agent when the request was sent. */
+    TickType_t requestTicks;       /**< Time the request was sent. */
+    uint32_t smoothedRttMs;        /**< Smoothed time from a request to its first block, zero until measured. */
+    uint32_t minRttMs;             /**< Smallest time measured from a request to its first block. */
+} OtaRequestWindow_t;
+
+/**
+ * @brief Maximum number of topic filters subscribed by the OTA agent at the same time: the two job
+ * topics and the data topic of the stream being downloaded.
+ */
+#define OTA_MAX_SUBSCRIPTIONS                   ( 3U )
+
+/**
+ * @brief Size of the topic filters kept to subscribe again, the longest topic accepted by AWS IoT.
+ */
+#define OTA_MAX_TOPIC_FILTER_SIZE               ( 256U )
+
+/**
+ * @brief Topic filter subscribed by the OTA agent, kept to subscribe again when the broker does not
+ * resume the session after a reconnection.
+ */
+typedef struct OtaSubscription
+{
+    char topicFilter[ OTA_MAX_TOPIC_FILTER_SIZE ]; /**< NUL terminated topic filter. */
+    uint16_t topicFilterLength;                    /**< Length of the topic filter, zero for a free entry. */
+    uint8_t qos;                                   /**< QoS of the subscription. */
+} OtaSubscription_t;
+
 
 /**
  * @brief Function used by OTA agent to publish control packets with the MQTT broker.
@@ -161,6 +234,15 @@ static OtaMqttStatus_t mqttUnsubscribe( const char * pTopicFilter,
                                         uint16_t topicFilterLength,
                                         uint8_t qos );
 
+/**
+ * @brief Enqueues an operation on the control lane of the MQTT agent, retrying while the agent
+ * in-flight window is full.
+ *
+ * @param[in] pOperation The operation to enqueue.
+ * @return pdTRUE if the operation was enqueued, pdFALSE otherwise.
+ */
+static BaseType_t enqueueOperation( MQTTOperation_t * pOperation );
+
 /**
  * @brief User application callback registerd with OTA agent to receive OTA notifications
  * Application callback can be extended to perform additional self test validations if needed
@@ -175,20 +257,70 @@ static void otaAppCallback( OtaJobEvent_t event,
 /**
  * @brief Function used to submit a job document received event  to OTA agent.
  * Function allocates an event buffer from the pool and enqueues it with OTA agent task for processing.
- * Function is invoked from the main OTA MQTT packet handler function after matching the respective topic filter.
+ * Function is registered with the MQTT subscription router for the job topic filters.
  *
  * @param[in] pPublishInfo MQTT publish structure that contains the job document as payload.
+ * @param[in] pHandlerContext Unused.
  */
-static void mqttJobCallback( MQTTPublishInfo_t * pPublishInfo );
+static void mqttJobCallback( MQTTPublishInfo_t * pPublishInfo,
+                             void * pHandlerContext );
 
 /**
  * @brief Function used to submit firmware block received event to OTA agent.
- * Function allocates an event from the buffer pool and enqueues it with OTA agent task for processing.
- * Function is invoked from the main OTA MQTT packet handler function after matching the respective topic filter.
+ * Function is registered with the MQTT subscription router as the stream handler of the stream data
+ * topic filter. A block normally arrives in the event buffer loaned by mqttDataLoanCallback() and is
+ * enqueued as it is. Otherwise the function allocates an event from the buffer pool on the first fragment
+ * of a block, copies each fragment into it, and enqueues it once the block is complete.
+ *
+ * @param[in] pFragment Fragment of the MQTT publish that contains the firmware block as payload.
+ * @param[in] pHandlerContext Unused.
+ */
+static void mqttDataCallback( const MQTTRouteFragment_t * pFragment,
+                              void * pHandlerContext );
+
+/**
+ * @brief Function loaning an event buffer to the MQTT agent, which reads the firmware block of a stream
+ * data publish directly into it.
+ *
+ * @param[in] pFragment MQTT publish about to be read.
+ * @param[in] pHandlerContext Unused.
+ * @return The data of the event buffer, or NULL if no buffer is free or the block is too large.
+ */
+static uint8_t * mqttDataLoanCallback( const MQTTRouteFragment_t * pFragment,
+                                       void * pHandlerContext );
+
+/**
+ * @brief Takes an event buffer, the one recycled by the MQTT agent task or one from the free list.
+ * Only called from the MQTT agent task.
+ *
+ * @return A free event buffer, or NULL if all of them are used.
+ */
+OtaEventData_t * otaEventBufferGet( void );
+
+/**
+ * @brief Takes an event buffer from the free list. Called from the MQTT agent task, and from the OTA
+ * agent task for the blocks downloaded over HTTP.
+ *
+ * @return A free event buffer, or NULL if the free list is empty.
+ */
+static OtaEventData_t * otaEventBufferTake( void );
+
+/**
+ * @brief Gives back to the free list an event buffer processed by the OTA agent. Only called from
+ * the OTA agent task.
+ *
+ * @param[in] pxBuffer The event buffer.
+ */
+static void otaEventBufferFree( OtaEventData_t * const pxBuffer );
+
+/**
+ * @brief Gives back an event buffer taken by the MQTT agent task and not passed to the OTA agent.
+ * The buffer is kept aside for the next otaEventBufferGet(), so that the free list is only written
+ * by the OTA agent task.
  *
- * @param[in] pPublishInfo MQTT publish structure that contains the firmware block as payload.
+ * @param[in] pxBuffer The event buffer.
  */
-static void mqttDataCallback( MQTTPublishInfo_t * pPublishInfo );
+static void otaEventBufferRecycle( OtaEventData_t * const pxBuffer );
 
 /**
  * @brief Application defined callback registered with OTA agent invoked when closing an firmware image.
@@ -199,6 +331,95 @@ static void mqttDataCallback( MQTTPublishInfo_t * pPublishInfo );
  */
 static OtaPalStatus_t appCloseFileCallback( OtaFileContext_t * const pFileContext );
 
+/**
+ * @brief Starts measuring the stream or HTTP request the OTA library is sending, with the window it read,
+ * and resizes the window of the next request from the outcome of the previous one. A request sent
+ * before all the blocks of the previous one arrived means that the library timed out waiting for them.
+ * Only called from the OTA agent task.
+ */
+static void requestWindowStart( void );
+
+/**
+ * @brief Accounts a block of the request in flight received or dropped. Called from the MQTT agent task,
+ * or from the OTA agent task for the blocks downloaded over HTTP.
+ *
+ * @param[in] isDropped pdTRUE if the block was dropped.
+ */
+static void requestWindowBlockDone( BaseType_t isDropped );
+
+/**
+ * @brief Keeps a topic filter subscribed by the OTA agent, unless it is already kept.
+ *
+ * @param[in] pTopicFilter Topic filter.
+ * @param[in] topicFilterLength Length of the topic filter.
+ * @param[in] qos QoS of the subscription.
+ */
+static void subscriptionAdd( const char * pTopicFilter,
+                             uint16_t topicFilterLength,
+                             uint8_t qos );
+
+/**
+ * @brief Forgets a topic filter unsubscribed by the OTA agent.
+ *
+ * @param[in] pTopicFilter Topic filter.
+ * @param[in] topicFilterLength Length of the topic filter.
+ */
+static void subscriptionRemove( const char * pTopicFilter,
+                                uint16_t topicFilterLength );
+
+/**
+ * @brief Function used by OTA agent to start the download of a file over HTTP.
+ * Connects to the server of the pre-signed URL of the file.
+ *
+ * @param[in] pUrl URL of the file.
+ * @return OtaHttpSuccess if connected, OtaHttpInitFailed otherwise.
+ */
+static OtaHttpStatus_t httpInit( char * pUrl );
+
+/**
+ * @brief Function used by OTA agent to request a block of the file over HTTP.
+ * The OTA agent asks for the first missing block, and then waits for the blocks of the request window
+ * before asking again, as over MQTT. So the missing blocks of the window are downloaded, starting
+ * with the one asked for, each into an event buffer sent to the OTA agent as a received block. The
+ * blocks which follow are already requested on the connection by the HTTP client.
+ *
+ * @param[in] rangeStart Offset of the first byte of the block.
+ * @param[in] rangeEnd Offset of the last byte of the block.
+ * @return OtaHttpSuccess if at least the block asked for was received, OtaHttpRequestFailed otherwise.
+ */
+static OtaHttpStatus_t httpRequest( uint32_t rangeStart,
+                                    uint32_t rangeEnd );
+
+/**
+ * @brief Function used by OTA agent to end the download of a file over HTTP.
+ *
+ * @return OtaHttpSuccess.
+ */
+static OtaHttpStatus_t httpDeinit( void );
+
+/**
+ * @brief Application defined callback registered with OTA agent invoked when creating a file.
+ * Starts measuring the download of the file.
+ *
+ * @param[in] pFileContext Context of the file.
+ * @return Status of xOtaPalCreateFileForRx().
+ */
+static OtaPalStatus_t appCreateFileCallback( OtaFileContext_t * const pFileContext );
+
+/**
+ * @brief Application defined callback registered with OTA agent invoked when writing a block.
+ * Counts the bytes downloaded.
+ *
+ * @param[in] pFileContext Context of the file.
+ * @param[in] offset Offset of the block in the file.
+ * @param[in] pData Block.
+ * @param[in] blockSize Size of the block.
+ * @return Result of xOtaPalWriteBlock().
+ */
+static int16_t appWriteBlockCallback( OtaFileContext_t * const pFileContext,
+                                      uint32_t offset,
+                                      uint8_t * const pData,
+                                      uint32_t blockSize );
 
 /**
  * @brief Structure used to encode OTA application firmware version.
@@ -216,11 +437,6 @@ const AppVersion32_t appFirmwareVersion =
  */
 static TimerHandle_t otaStatsTimer = NULL;
 
-/**
- * @brief Mutex used to handle thread safety while fetching and freeing OTA event buffers.
- */
-static SemaphoreHandle_t bufferMutex;
-
 /**
  * @breif Semaphore used to wait for completion of an MQTT operation by the MQTT aagent.
  */
@@ -249,6 +465,18 @@ static uint8_t certFilePath[ OTA_MAX_FILE_PATH_SIZE ];
  */
 static uint8_t streamName[ OTA_MAX_STREAM_NAME_SIZE ];
 
+/**
+ * @brief Application allocated buffer used to store the pre-signed URL of the file downloaded over HTTP.
+ * Buffer is passed to the OTA agent and is used internally by OTA agent.
+ */
+static uint8_t updateUrl[ OTA_MAX_URL_SIZE ];
+
+/**
+ * @brief Application allocated buffer used to store the authentication scheme of the URL.
+ * Buffer is passed to the OTA agent and is used internally by OTA agent.
+ */
+static uint8_t authScheme[ OTA_MAX_AUTH_SCHEME_SIZE ];
+
 /**
  * @brief Application allocated buffer used internally by OTA agent to decode a packet received from broker.
  */
@@ -266,6 +494,96 @@ static uint8_t bitmap[ OTA_MAX_BLOCK_BITMAP_SIZE ];
  */
 static OtaEventData_t eventBuffer[ otaconfigMAX_NUM_OTA_DATA_BUFFERS ];
 
+/**
+ * @brief Free list of the event buffers, a ring of indexes in eventBuffer.
+ * Buffers are only released by the OTA agent task, which advances the head without a critical section.
+ * They are taken by the MQTT agent task, and by the OTA agent task during HTTP downloads, so the tail
+ * advances in a critical section.
+ */
+static volatile uint8_t freeEventBuffers[ otaconfigMAX_NUM_OTA_DATA_BUFFERS ];
+
+/**
+ * @brief Number of event buffers released to the free list, written by the OTA agent task.
+ */
+static volatile uint32_t freeEventBuffersHead = otaconfigMAX_NUM_OTA_DATA_BUFFERS;
+
+/**
+ * @brief Number of event buffers taken from the free list.
+ */
+static volatile uint32_t freeEventBuffersTail = 0U;
+
+/**
+ * @brief Event buffer given back by the MQTT agent task, reused by the next otaEventBufferGet().
+ */
+static OtaEventData_t * pSpareEventBuffer = NULL;
+
+/**
+ * @brief Firmware blocks dropped because no event buffer was free or the OTA agent queue was full.
+ */
+static uint32_t droppedDataBlocks = 0U;
+
+/**
+ * @brief Job documents dropped because no event buffer was free or the OTA agent queue was full.
+ */
+static uint32_t droppedJobDocuments = 0U;
+
+/**
+ * @brief Firmware blocks read by the MQTT agent directly into an event buffer.
+ */
+static uint32_t loanedDataBlocks = 0U;
+
+/**
+ * @brief Event buffer receiving the fragments of the firmware block being streamed, NULL otherwise.
+ * Only used from the MQTT agent task.
+ */
+static OtaEventData_t * pStreamedBlock = NULL;
+
+/**
+ * @brief File being downloaded, whose bitmap tells the blocks still missing.
+ */
+static OtaFileContext_t * pDownloadFile = NULL;
+
+/**
+ * @brief Credentials of the HTTP downloads, without the ALPN protocols of the MQTT connection.
+ */
+static NetworkCredentials_t httpCredentials;
+
+/**
+ * @brief pdTRUE if credentials were given for the HTTP downloads.
+ */
+static BaseType_t isHttpEnabled = pdFALSE;
+
+/**
+ * @brief pdTRUE if the file being received is downloaded over HTTP, pdFALSE over MQTT.
+ */
+static BaseType_t isHttpDownload = pdFALSE;
+
+/**
+ * @brief Time the file being received was created.
+ */
+static TickType_t downloadStartTicks = 0U;
+
+/**
+ * @brief Bytes of the file being received written since it was created, excluding the blocks resumed
+ * from an interrupted download.
+ */
+static uint32_t downloadedBytes = 0U;
+
+/**
+ * @brief Window of the stream requests.
+ */
+static OtaRequestWindow_t requestWindow =
+{
+    .size   = OTA_REQUEST_WINDOW_INITIAL,
+    .blocks = OTA_REQUEST_WINDOW_INITIAL
+};
+
+/**
+ * @brief Topic filters currently subscribed by the OTA agent. Updated by the OTA agent task, and read
+ * by xResubscribeOTAUpdate() while the agent is suspended.
+ */
+static OtaSubscription_t subscriptions[ OTA_MAX_SUBSCRIPTIONS ];
+
 /**
  * @brief structure used to pass application allocated buffers to OTA agent.
  */
@@ -280,7 +598,11 @@ static OtaAppBuffer_t otaBuffer =
     .pDecodeMemory      = decodeMem,
     .decodeMemorySize   = ( 1U << otaconfigLOG2_FILE_BLOCK_SIZE ),
     .pFileBitmap        = bitmap,
-    .fileBitmapSize     = OTA_MAX_BLOCK_BITMAP_SIZE
+    .fileBitmapSize     = OTA_MAX_BLOCK_BITMAP_SIZE,
+    .pUrl               = updateUrl,
+    .urlSize            = OTA_MAX_URL_SIZE,
+    .pAuthScheme        = authScheme,
+    .authSchemeSize     = OTA_MAX_AUTH_SCHEME_SIZE
 };
 
 static OtaInterfaces_t otaInterface =
@@ -301,15 +623,20 @@ static OtaInterfaces_t otaInterface =
     .mqtt.publish              = mqttPublish,
     .mqtt.unsubscribe          = mqttUnsubscribe,
 
+    /* Initialize the OTA library HTTP Interface.*/
+    .http.init                 = httpInit,
+    .http.request              = httpRequest,
+    .http.deinit               = httpDeinit,
+
     /* Initialize the OTA library PAL Interface.*/
     .pal.getPlatformImageState = xOtaPalGetPlatformImageState,
     .pal.setPlatformImageState = xOtaPalSetPlatformImageState,
-    .pal.writeBlock            = xOtaPalWriteBlock,
+    .pal.writeBlock            = appWriteBlockCallback,
     .pal.activate              = xOtaPalActivateNewImage,
     .pal.closeFile             = appCloseFileCallback,
     .pal.reset                 = xOtaPalResetDevice,
     .pal.abort                 = xOtaPalAbort,
-    .pal.createFile            = xOtaPalCreateFileForRx
+    .pal.createFile            = appCreateFileCallback
 };
 
 /*-----------------------------------------------------------*/
@@ -317,41 +644,66 @@ static OtaInterfaces_t otaInterface =
 
 static void otaEventBufferFree( OtaEventData_t * const pxBuffer )
 {
-    if( xSemaphoreTake( bufferMutex, portMAX_DELAY ) == pdTRUE )
+    uint32_t head = freeEventBuffersHead;
+
+    pxBuffer->bufferUsed = false;
+
+    /* The index is stored before the head moves past it. */
+    freeEventBuffers[ head % otaconfigMAX_NUM_OTA_DATA_BUFFERS ] = ( uint8_t ) ( pxBuffer - eventBuffer );
+    freeEventBuffersHead = head + 1U;
+}
+
+/*-----------------------------------------------------------*/
+
+static void otaEventBufferRecycle( OtaEventData_t * const pxBuffer )
+{
+    configASSERT( pSpareEventBuffer == NULL );
+    pSpareEventBuffer = pxBuffer;
+}
+
+/*-----------------------------------------------------------*/
+
+OtaEventData_t * otaEventBufferGet( void )
+{
+    OtaEventData_t * pFreeBuffer = NULL;
+
+    if( pSpareEventBuffer != NULL )
     {
-        pxBuffer->bufferUsed = false;
-        ( void ) xSemaphoreGive( bufferMutex );
+        pFreeBuffer = pSpareEventBuffer;
+        pSpareEventBuffer = NULL;
+        pFreeBuffer->bufferUsed = true;
     }
     else
     {
-        PRINTF( "Failed to get buffer semaphore in free" );
+        pFreeBuffer = otaEventBufferTake();
     }
+
+    return pFreeBuffer;
 }
 
 /*-----------------------------------------------------------*/
 
-OtaEventData_t * otaEventBufferGet( void )
+static OtaEventData_t * otaEventBufferTake( void )
 {
-    uint32_t ulIndex = 0;
     OtaEventData_t * pFreeBuffer = NULL;
+    uint32_t tail;
 
-    if( xSemaphoreTake( bufferMutex, portMAX_DELAY ) == pdTRUE )
+    taskENTER_CRITICAL();
     {
-        for( ulIndex = 0; ulIndex < otaconfigMAX_NUM_OTA_DATA_BUFFERS; ulIndex++ )
+        tail = freeEventBuffersTail;
+
+        if( tail != freeEventBuffersHead )
         {
-            if( eventBuffer[ ulIndex ].bufferUsed == false )
-            {
-                eventBuffer[ ulIndex ].bufferUsed = true;
-                pFreeBuffer = &eventBuffer[ ulIndex ];
-                break;
-            }
+            /* The index is read before the tail moves past it. */
+            pFreeBuffer = &eventBuffer[ freeEventBuffers[ tail % otaconfigMAX_NUM_OTA_DATA_BUFFERS ] ];
+            freeEventBuffersTail = tail + 1U;
         }
-
-        ( void ) xSemaphoreGive( bufferMutex );
     }
-    else
+    taskEXIT_CRITICAL();
+
+    if( pFreeBuffer != NULL )
     {
-        PRINTF( "Failed to get buffer semaphore in get" );
+        pFreeBuffer->bufferUsed = true;
     }
 
     return pFreeBuffer;
@@ -415,14 +767,28 @@ static void otaAppCallback( OtaJobEvent_t event,
 
 /*-----------------------------------------------------------*/
 
-static void mqttJobCallback( MQTTPublishInfo_t * pPublishInfo )
+static void mqttJobCallback( MQTTPublishInfo_t * pPublishInfo,
+                             void * pHandlerContext )
 {
     OtaEventData_t * pData;
     OtaEventMsg_t eventMsg = { 0 };
 
+    ( void ) pHandlerContext;
+
     pData = otaEventBufferGet();
 
-    if( pData != NULL )
+    if( pData == NULL )
+    {
+        PRINTF( "No OTA data buffers available.\r\n" );
+        droppedJobDocuments++;
+    }
+    else if( pPublishInfo->payloadLength > sizeof( pData->data ) )
+    {
+        PRINTF( "OTA job document of %u bytes is too large.\r\n", ( unsigned int ) pPublishInfo->payloadLength );
+        otaEventBufferRecycle( pData );
+        droppedJobDocuments++;
+    }
+    else
     {
         memcpy( pData->data, pPublishInfo->pPayload, pPublishInfo->payloadLength );
         pData->dataLength = pPublishInfo->payloadLength;
@@ -430,102 +796,126 @@ static void mqttJobCallback( MQTTPublishInfo_t * pPublishInfo )
         eventMsg.pEventData = pData;
 
         /* Send job document received event. */
-        OTA_SignalEvent( &eventMsg );
-    }
-    else
-    {
-        PRINTF( "No OTA data buffers available.\r\n" );
+        if( OTA_SignalEvent( &eventMsg ) != true )
+        {
+            otaEventBufferRecycle( pData );
+            droppedJobDocuments++;
+        }
     }
 }
 
 /*-----------------------------------------------------------*/
 
-static void mqttDataCallback( MQTTPublishInfo_t * pPublishInfo )
+static uint8_t * mqttDataLoanCallback( const MQTTRouteFragment_t * pFragment,
+                                       void * pHandlerContext )
 {
-    OtaEventData_t * pData;
-    OtaEventMsg_t eventMsg = { 0 };
+    uint8_t * pLoan = NULL;
 
-    pData = otaEventBufferGet();
+    ( void ) pHandlerContext;
 
-    if( pData != NULL )
+    if( pStreamedBlock != NULL )
     {
-        memcpy( pData->data, pPublishInfo->pPayload, pPublishInfo->payloadLength );
-        pData->dataLength = pPublishInfo->payloadLength;
-        eventMsg.eventId = OtaAgentEventReceivedFileBlock;
-        eventMsg.pEventData = pData;
+        /* A block left incomplete, which cannot happen as the agent aborts the blocks it cannot finish. */
+        otaEventBufferRecycle( pStreamedBlock );
+        pStreamedBlock = NULL;
+    }
 
-        /* Send job document received event. */
-        OTA_SignalEvent( &eventMsg );
+    if( pFragment->payloadLength <= sizeof( pStreamedBlock->data ) )
+    {
+        pStreamedBlock = otaEventBufferGet();
     }
-    else
+
+    if( pStreamedBlock != NULL )
     {
-        PRINTF( "No OTA data buffers available.\r\n" );
+        pLoan = pStreamedBlock->data;
     }
+
+    /* Without a loan, the block comes in fragments and mqttDataCallback() reports the drop. */
+    return pLoan;
 }
 
 /*-----------------------------------------------------------*/
 
-BaseType_t xOTAProcessMQTTEvent( MQTTContext_t * pMQTTContext,
-                                 struct MQTTPacketInfo * pPacketInfo,
-                                 struct MQTTDeserializedInfo * pDeserializedInfo )
+static void mqttDataCallback( const MQTTRouteFragment_t * pFragment,
+                              void * pHandlerContext )
 {
-    BaseType_t result = pdFALSE;
-    bool isMatched = false;
+    OtaEventMsg_t eventMsg = { 0 };
+    BaseType_t isLoaned;
+
+    ( void ) pHandlerContext;
 
-    assert( pMQTTContext != NULL );
-    assert( pPacketInfo != NULL );
-    assert( pDeserializedInfo != NULL );
+    isLoaned = ( ( pStreamedBlock != NULL ) && ( pFragment->pData == pStreamedBlock->data ) ) ? pdTRUE : pdFALSE;
 
-    /* Handle incoming publish. The lower 4 bits of the publish packet
-     * type is used for the dup, QoS, and retain flags. Hence masking
-     * out the lower bits to check if the packet is publish. */
-    if( ( pPacketInfo->type & 0xF0U ) == MQTT_PACKET_TYPE_PUBLISH )
+    if( ( pFragment->offset == 0U ) && ( pFragment->isAborted == pdFALSE ) && ( isLoaned == pdFALSE ) )
     {
-        assert( pDeserializedInfo->pPublishInfo != NULL );
-        /* Handle incoming publish. */
-        MQTT_MatchTopic( pDeserializedInfo->pPublishInfo->pTopicName,
-                         pDeserializedInfo->pPublishInfo->topicNameLength,
-                         JOB_RESPONSE_TOPIC_FILTER,
-                         JOB_RESPONSE_TOPIC_FILTER_LENGTH, &isMatched );
+        /* A new block starts; the previous one was either complete or aborted. */
+        pStreamedBlock = otaEventBufferGet();
 
-        if( isMatched == true )
+        if( pStreamedBlock == NULL )
         {
-            mqttJobCallback( pDeserializedInfo->pPublishInfo );
-            result = pdTRUE;
+            PRINTF( "No OTA data buffers available.\r\n" );
+            droppedDataBlocks++;
+            requestWindowBlockDone( pdTRUE );
         }
-
-        if( isMatched == false )
+        else if( pFragment->payloadLength > sizeof( pStreamedBlock->data ) )
         {
-            MQTT_MatchTopic( pDeserializedInfo->pPublishInfo->pTopicName,
-                             pDeserializedInfo->pPublishInfo->topicNameLength,
-                             JOB_NOTIFICATION_TOPIC_FILTER,
-                             JOB_NOTIFICATION_TOPIC_FILTER_LENGTH, &isMatched );
-
-            if( isMatched == true )
-            {
-                mqttJobCallback( pDeserializedInfo->pPublishInfo );
-                result = pdTRUE;
-            }
+            PRINTF( "OTA data block of %u bytes is too large.\r\n", ( unsigned int ) pFragment->payloadLength );
+            otaEventBufferRecycle( pStreamedBlock );
+            pStreamedBlock = NULL;
+            droppedDataBlocks++;
+            requestWindowBlockDone( pdTRUE );
+        }
+        else
+        {
+            /* Empty else marker. */
         }
+    }
 
-        if( isMatched == false )
+    if( pStreamedBlock != NULL )
+    {
+        if( pFragment->isAborted == pdTRUE )
         {
-            MQTT_MatchTopic( pDeserializedInfo->pPublishInfo->pTopicName,
-                             pDeserializedInfo->pPublishInfo->topicNameLength,
-                             DATA_TOPIC_FILTER,
-                             DATA_TOPIC_FILTER_LENGTH, &isMatched );
+            /* The block is requested again by the OTA agent. */
+            otaEventBufferRecycle( pStreamedBlock );
+            pStreamedBlock = NULL;
+        }
+        else
+        {
+            if( isLoaned == pdFALSE )
+            {
+                memcpy( &pStreamedBlock->data[ pFragment->offset ], pFragment->pData, pFragment->dataLength );
+            }
+            else
+            {
+                loanedDataBlocks++;
+            }
 
-            if( isMatched == true )
+            if( ( pFragment->offset + pFragment->dataLength ) == pFragment->payloadLength )
             {
-                mqttDataCallback( pDeserializedInfo->pPublishInfo );
-                result = pdTRUE;
+                pStreamedBlock->dataLength = pFragment->payloadLength;
+                eventMsg.eventId = OtaAgentEventReceivedFileBlock;
+                eventMsg.pEventData = pStreamedBlock;
+
+                /* Send file block received event. */
+                if( OTA_SignalEvent( &eventMsg ) != true )
+                {
+                    otaEventBufferRecycle( pStreamedBlock );
+                    droppedDataBlocks++;
+                    requestWindowBlockDone( pdTRUE );
+                }
+                else
+                {
+                    requestWindowBlockDone( pdFALSE );
+                }
+
+                pStreamedBlock = NULL;
             }
         }
     }
-
-    return result;
 }
 
+/*-----------------------------------------------------------*/
+
 static void mqttOperationCallback( struct MQTTOperation * pOperation,
                                    MQTTStatus_t status )
 {
@@ -533,6 +923,28 @@ static void mqttOperationCallback( struct MQTTOperation * pOperation,
     xSemaphoreGive( opSemaphore );
 }
 
+/*-----------------------------------------------------------*/
+
+static BaseType_t enqueueOperation( MQTTOperation_t * pOperation )
+{
+    MQTTAgentStatus_t status;
+
+    for( ; ; )
+    {
+        /* OTA job messages and subscriptions must not wait behind telemetry. */
+        status = MQTTAgent_EnqueueOnLane( pOperation, MQTTAgentLaneControl, portMAX_DELAY );
+
+        if( status != MQTTAgentWindowFull )
+        {
+            break;
+        }
+
+        vTaskDelay( pdMS_TO_TICKS( OTA_AGENT_WINDOW_RETRY_DELAY_MS ) );
+    }
+
+    return ( status == MQTTAgentSuccess ) ? pdTRUE : pdFALSE;
+}
+
 
 /*-----------------------------------------------------------*/
 
@@ -563,7 +975,7 @@ static OtaMqttStatus_t mqttSubscribe( const char * pTopicFilter,
     operation.callback = mqttOperationCallback;
 
     /* Send SUBSCRIBE packet. */
-    status = MQTTAgent_Enqueue( &operation, portMAX_DELAY );
+    status = enqueueOperation( &operation );
 
     if( status != pdTRUE )
     {
@@ -585,6 +997,7 @@ static OtaMqttStatus_t mqttSubscribe( const char * pTopicFilter,
         {
             PRINTF( "Subscribed to topic %s.\r\n",
                     pTopicFilter );
+            subscriptionAdd( pTopicFilter, topicFilterLength, qos );
         }
     }
 
@@ -611,11 +1024,20 @@ static OtaMqttStatus_t mqttPublish( const char * const pacTopic,
     publishInfo.pPayload = pMsg;
     publishInfo.payloadLength = msgSize;
 
+    /* A stream request asks for the blocks of the window, which the library already read. */
+    if( ( topicLen > STREAM_REQUEST_TOPIC_SUFFIX_LENGTH ) &&
+        ( strncmp( &pacTopic[ topicLen - STREAM_REQUEST_TOPIC_SUFFIX_LENGTH ],
+                   STREAM_REQUEST_TOPIC_SUFFIX,
+                   STREAM_REQUEST_TOPIC_SUFFIX_LENGTH ) == 0 ) )
+    {
+        requestWindowStart();
+    }
+
     operation.type = MQTT_OP_PUBLISH;
     operation.info.pPublishInfo = &publishInfo;
     operation.callback = mqttOperationCallback;
 
-    status = MQTTAgent_Enqueue( &operation, portMAX_DELAY );
+    status = enqueueOperation( &operation );
 
     if( status != pdTRUE )
     {
@@ -665,9 +1087,10 @@ static OtaMqttStatus_t mqttUnsubscribe( const char * pTopicFilter,
     operation.type = MQTT_OP_UNSUBSCRIBE;
     operation.info.subscriptionInfo.numSubscriptions = 1;
     operation.info.subscriptionInfo.pSubscriptionList = pSubscriptionList;
+    operation.callback = mqttOperationCallback;
 
     /* Send UNSUBSCRIBE packet. */
-    status = MQTTAgent_Enqueue( &operation, portMAX_DELAY );
+    status = enqueueOperation( &operation );
 
     if( status != pdTRUE )
     {
@@ -688,17 +1111,80 @@ static OtaMqttStatus_t mqttUnsubscribe( const char * pTopicFilter,
         {
             PRINTF( "Unsubsribe topic %s to broker.\r\n",
                     pTopicFilter );
+            subscriptionRemove( pTopicFilter, topicFilterLength );
         }
     }
 
     return otaRet;
 }
 
+/*-----------------------------------------------------------*/
+
+static void subscriptionAdd( const char * pTopicFilter,
+                             uint16_t topicFilterLength,
+                             uint8_t qos )
+{
+    OtaSubscription_t * pEntry = NULL;
+    uint32_t index;
+
+    /* Reuse the entry of the same topic filter, subscribed again after a reconnection, or a free one. */
+    for( index = 0U; index < OTA_MAX_SUBSCRIPTIONS; index++ )
+    {
+        if( ( subscriptions[ index ].topicFilterLength == topicFilterLength ) &&
+            ( strncmp( subscriptions[ index ].topicFilter, pTopicFilter, topicFilterLength ) == 0 ) )
+        {
+            pEntry = &subscriptions[ index ];
+            break;
+        }
+        else if( ( pEntry == NULL ) && ( subscriptions[ index ].topicFilterLength == 0U ) )
+        {
+            pEntry = &subscriptions[ index ];
+        }
+        else
+        {
+            /* Entry used by another topic filter. */
+        }
+    }
+
+    if( ( pEntry == NULL ) || ( topicFilterLength >= OTA_MAX_TOPIC_FILTER_SIZE ) )
+    {
+        PRINTF( "Topic %s will not be subscribed again if the MQTT session is lost.\r\n", pTopicFilter );
+    }
+    else
+    {
+        /* When subscribed again, the topic filter is the copy held by the entry. */
+        memmove( pEntry->topicFilter, pTopicFilter, topicFilterLength );
+        pEntry->topicFilter[ topicFilterLength ] = '\0';
+        pEntry->topicFilterLength = topicFilterLength;
+        pEntry->qos = qos;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void subscriptionRemove( const char * pTopicFilter,
+                                uint16_t topicFilterLength )
+{
+    uint32_t index;
+
+    for( index = 0U; index < OTA_MAX_SUBSCRIPTIONS; index++ )
+    {
+        if( ( subscriptions[ index ].topicFilterLength == topicFilterLength ) &&
+            ( strncmp( subscriptions[ index ].topicFilter, pTopicFilter, topicFilterLength ) == 0 ) )
+        {
+            subscriptions[ index ].topicFilterLength = 0U;
+        }
+    }
+}
+
 /*-----------------------------------------------------------*/
 static void prvOTAStatsTimerCallback( TimerHandle_t xTimer )
 {
     /* OTA library packet statistics per job.*/
     OtaAgentStatistics_t otaStatistics = { 0 };
+    OTAHttpStats_t httpStats = { 0 };
+    uint32_t flashLatencyUs = 0;
+    uint32_t flashSuspends = 0;
 
     if( OTA_GetState() != OtaAgentStateStopped )
     {
@@ -710,19 +1196,285 @@ static void prvOTAStatsTimerCallback( TimerHandle_t xTimer )
                 otaStatistics.otaPacketsQueued,
                 otaStatistics.otaPacketsProcessed,
                 otaStatistics.otaPacketsDropped );
+
+        PRINTF( " Zero copy blocks: %u   Dropped blocks: %u   Dropped job documents: %u \r\n",
+                loanedDataBlocks,
+                droppedDataBlocks,
+                droppedJobDocuments );
+
+        if( isHttpDownload == pdTRUE )
+        {
+            OTAHttp_GetStats( &httpStats );
+
+            PRINTF( " HTTP connections: %u   Requests: %u   Discarded: %u   Bytes: %u \r\n",
+                    httpStats.connections,
+                    httpStats.requests,
+                    httpStats.discarded,
+                    httpStats.bodyBytes );
+        }
+        else
+        {
+            PRINTF( " Request window: %u blocks   RTT: %u ms   Min RTT: %u ms \r\n",
+                    requestWindow.size,
+                    requestWindow.smoothedRttMs,
+                    requestWindow.minRttMs );
+        }
+
+        mflash_drv_get_stats( &flashLatencyUs, &flashSuspends );
+
+        PRINTF( " Flash interrupt latency: %u us   Suspends: %u \r\n",
+                flashLatencyUs,
+                flashSuspends );
+    }
+}
+
+uint32_t ulOTAGetRequestWindow( void )
+{
+    return requestWindow.blocks;
+}
+
+/*-----------------------------------------------------------*/
+
+static void requestWindowStart( void )
+{
+    OtaAgentStatistics_t otaStatistics = { 0 };
+    uint32_t dropped;
+    uint32_t freeBuffers;
+
+    OTA_GetStatistics( &otaStatistics );
+    dropped = droppedDataBlocks + otaStatistics.otaPacketsDropped;
+
+    if( requestWindow.requested > 0U )
+    {
+        if( ( requestWindow.arrived < requestWindow.requested ) || ( dropped != requestWindow.droppedAtRequest ) )
+        {
+            /* Blocks were dropped, or the OTA agent timed out waiting for them. */
+            requestWindow.size = ( requestWindow.size > 1U ) ? ( requestWindow.size / 2U ) : 1U;
+        }
+        else if( ( requestWindow.minRttMs > 0U ) &&
+                 ( requestWindow.smoothedRttMs > requestWindow.minRttMs * OTA_REQUEST_WINDOW_RTT_FACTOR ) )
+        {
+            if( requestWindow.size > 1U )
+            {
+                requestWindow.size--;
+            }
+        }
+        else if( requestWindow.size < otaconfigREQUEST_WINDOW_MAX )
+        {
+            requestWindow.size++;
+        }
+        else
+        {
+            /* Empty else marker. */
+        }
+    }
+
+    /* This request asks for the blocks the library read before sending it. */
+    requestWindow.droppedAtRequest = dropped;
+    requestWindow.requestTicks = xTaskGetTickCount();
+    requestWindow.arrived = 0U;
+    requestWindow.requested = requestWindow.blocks;
+
+    /* The blocks of the next window must fit in the free event buffers, one of them kept for a job
+     * document. Buffers still held by the OTA agent mean it does not write the blocks as fast as they come. */
+    freeBuffers = freeEventBuffersHead - freeEventBuffersTail;
+    requestWindow.blocks = requestWindow.size;
+
+    if( requestWindow.blocks >= freeBuffers )
+    {
+        requestWindow.blocks = ( freeBuffers > 1U ) ? ( freeBuffers - 1U ) : 1U;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void requestWindowBlockDone( BaseType_t isDropped )
+{
+    uint32_t rttMs;
+
+    if( ( requestWindow.requested == 0U ) || ( requestWindow.arrived >= requestWindow.requested ) )
+    {
+        return;
+    }
+
+    if( ( requestWindow.arrived == 0U ) && ( isDropped == pdFALSE ) )
+    {
+        rttMs = ( uint32_t ) ( ( xTaskGetTickCount() - requestWindow.requestTicks ) * portTICK_PERIOD_MS );
+
+        if( ( requestWindow.minRttMs == 0U ) || ( rttMs < requestWindow.minRttMs ) )
+        {
+            requestWindow.minRttMs = ( rttMs > 0U ) ? rttMs : 1U;
+        }
+
+        requestWindow.smoothedRttMs = ( requestWindow.smoothedRttMs == 0U ) ? rttMs :
+                                      ( ( 7U * requestWindow.smoothedRttMs + rttMs ) / 8U );
+    }
+
+    requestWindow.arrived++;
+}
+
+/*-----------------------------------------------------------*/
+
+static OtaHttpStatus_t httpInit( char * pUrl )
+{
+    OtaHttpStatus_t status = OtaHttpSuccess;
+
+    isHttpDownload = pdTRUE;
+
+    if( ( isHttpEnabled == pdFALSE ) ||
+        ( OTAHttp_Connect( pUrl, &httpCredentials, OTA_HTTP_PIPELINE_DEPTH ) != pdTRUE ) )
+    {
+        PRINTF( "Failed to start the OTA download over HTTP.\r\n" );
+        status = OtaHttpInitFailed;
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static OtaHttpStatus_t httpRequest( uint32_t rangeStart,
+                                    uint32_t rangeEnd )
+{
+    OtaHttpStatus_t status = OtaHttpSuccess;
+    OtaEventMsg_t eventMsg = { 0 };
+    OtaEventData_t * pBuffer;
+    const uint32_t blockSize = ( 1UL << otaconfigLOG2_FILE_BLOCK_SIZE );
+    uint32_t fileBlocks = ( pDownloadFile->fileSize + blockSize - 1U ) / blockSize;
+    uint32_t block = rangeStart / blockSize;
+    uint32_t blocks = 0U;
+    uint32_t blockEnd;
+    int32_t received;
+
+    /* The OTA agent read the window to count the blocks it waits for. */
+    requestWindowStart();
+
+    while( ( blocks < requestWindow.requested ) && ( block < fileBlocks ) )
+    {
+        /* Bits are set for the blocks not received yet. The one asked for is always downloaded. */
+        while( ( blocks > 0U ) && ( block < fileBlocks ) &&
+               ( ( pDownloadFile->pRxBlockBitmap[ block / 8U ] & ( 1U << ( block % 8U ) ) ) == 0U ) )
+        {
+            block++;
+        }
+
+        if( block == fileBlocks )
+        {
+            break;
+        }
+
+        /* The last block ends with the file. */
+        blockEnd = ( block + 1U ) * blockSize;
+
+        if( blockEnd > pDownloadFile->fileSize )
+        {
+            blockEnd = pDownloadFile->fileSize;
+        }
+
+        pBuffer = otaEventBufferTake();
+
+        if( pBuffer == NULL )
+        {
+            /* The OTA agent requests the missing blocks again once its request timer expires. */
+            PRINTF( "No OTA data buffers available for the HTTP download.\r\n" );
+            break;
+        }
+
+        received = OTAHttp_GetRange( block * blockSize,
+                                     ( blocks == 0U ) ? rangeEnd : ( blockEnd - 1U ),
+                                     pBuffer->data,
+                                     ( uint32_t ) sizeof( pBuffer->data ) );
+
+        if( received < 0 )
+        {
+            PRINTF( "Failed to download the block %u over HTTP.\r\n", block );
+            otaEventBufferFree( pBuffer );
+            break;
+        }
+
+        pBuffer->dataLength = ( uint32_t ) received;
+        eventMsg.eventId = OtaAgentEventReceivedFileBlock;
+        eventMsg.pEventData = pBuffer;
+
+        if( OTA_SignalEvent( &eventMsg ) != true )
+        {
+            otaEventBufferFree( pBuffer );
+            break;
+        }
+
+        requestWindowBlockDone( pdFALSE );
+        blocks++;
+        block++;
+    }
+
+    if( blocks == 0U )
+    {
+        status = OtaHttpRequestFailed;
     }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static OtaHttpStatus_t httpDeinit( void )
+{
+    OTAHttp_Disconnect();
+
+    return OtaHttpSuccess;
+}
+
+/*-----------------------------------------------------------*/
+
+static OtaPalStatus_t appCreateFileCallback( OtaFileContext_t * const pFileContext )
+{
+    /* The download protocol is chosen after the file is created. */
+    isHttpDownload = pdFALSE;
+    pDownloadFile = pFileContext;
+    downloadedBytes = 0U;
+    downloadStartTicks = xTaskGetTickCount();
+
+    return xOtaPalCreateFileForRx( pFileContext );
+}
+
+/*-----------------------------------------------------------*/
+
+static int16_t appWriteBlockCallback( OtaFileContext_t * const pFileContext,
+                                      uint32_t offset,
+                                      uint8_t * const pData,
+                                      uint32_t blockSize )
+{
+    int16_t written = xOtaPalWriteBlock( pFileContext, offset, pData, blockSize );
+
+    if( written > 0 )
+    {
+        downloadedBytes += ( uint32_t ) written;
+    }
+
+    return written;
 }
 
+/*-----------------------------------------------------------*/
+
 static OtaPalStatus_t appCloseFileCallback( OtaFileContext_t * const pFileContext )
 {
     OtaPalStatus_t status = OtaPalSuccess;
+    uint32_t downloadMs = ( uint32_t ) ( ( xTaskGetTickCount() - downloadStartTicks ) * portTICK_PERIOD_MS );
+
+    /* Throughput of the download, to compare the data protocols. */
+    PRINTF( "OTA file downloaded over %s: %u bytes in %u ms, %u B/s.\r\n",
+            ( isHttpDownload == pdTRUE ) ? "HTTP" : "MQTT",
+            downloadedBytes,
+            downloadMs,
+            ( uint32_t ) ( ( ( uint64_t ) downloadedBytes * 1000U ) / ( ( downloadMs > 0U ) ? downloadMs : 1U ) ) );
 
     /* First close the file for writing. */
     status = xOtaPalCloseFile( pFileContext );
 
     if( status == OtaPalSuccess )
     {
-        /* Validate the signature of the image. */
+        /* Validate the signature of the image. The image was hashed as its blocks were written,
+         * so this normally only finishes the digest and verifies the signature. */
 
         if( xValidateImageSignature( pFileContext->pFilePath,
                                      ( char * ) pFileContext->pCertFilepath,
@@ -742,7 +1494,7 @@ static OtaPalStatus_t appCloseFileCallback( OtaFileContext_t * const pFileContex
 
 /*-----------------------------------------------------------*/
 
-BaseType_t xStartOTAUpdateDemo( void )
+BaseType_t xStartOTAUpdateDemo( const NetworkCredentials_t * pHttpCredentials )
 {
     BaseType_t result = pdTRUE;
 
@@ -759,6 +1511,8 @@ BaseType_t xStartOTAUpdateDemo( void )
 
     CK_RV pkcsllRet;
 
+    uint32_t ulIndex;
+
     if( ( pkcsllRet = ulGetThingName( &pThingName, &thingNameLength ) ) != CKR_OK )
     {
         PRINTF( "Cannot get thing name for initializing OTA, pkcs11 error = %d.\r\n", pkcsllRet );
@@ -775,12 +1529,41 @@ BaseType_t xStartOTAUpdateDemo( void )
         }
     }
 
+    /* The pre-signed URLs of the HTTP downloads are served by Amazon S3, which does not negotiate the
+     * ALPN protocol of AWS IoT. */
+    if( pHttpCredentials != NULL )
+    {
+        httpCredentials = *pHttpCredentials;
+        httpCredentials.pAlpnProtos = NULL;
+        isHttpEnabled = pdTRUE;
+    }
+
     if( result == pdTRUE )
     {
-        bufferMutex = xSemaphoreCreateMutex();
+        for( ulIndex = 0; ulIndex < otaconfigMAX_NUM_OTA_DATA_BUFFERS; ulIndex++ )
+        {
+            freeEventBuffers[ ulIndex ] = ( uint8_t ) ulIndex;
+        }
+    }
 
-        if( bufferMutex == NULL )
+    /* Route the job and stream data publishes to the OTA agent. */
+    if( result == pdTRUE )
+    {
+        if( ( MQTTRouter_AddRoute( JOB_RESPONSE_TOPIC_FILTER,
+                                   JOB_RESPONSE_TOPIC_FILTER_LENGTH,
+                                   mqttJobCallback,
+                                   NULL ) != pdTRUE ) ||
+            ( MQTTRouter_AddRoute( JOB_NOTIFICATION_TOPIC_FILTER,
+                                   JOB_NOTIFICATION_TOPIC_FILTER_LENGTH,
+                                   mqttJobCallback,
+                                   NULL ) != pdTRUE ) ||
+            ( MQTTRouter_AddLoanRoute( DATA_TOPIC_FILTER,
+                                       DATA_TOPIC_FILTER_LENGTH,
+                                       mqttDataLoanCallback,
+                                       mqttDataCallback,
+                                       NULL ) != pdTRUE ) )
         {
+            PRINTF( "Failed to register OTA topic routes.\r\n" );
             result = pdFALSE;
         }
     }
@@ -852,7 +1635,7 @@ BaseType_t xStartOTAUpdateDemo( void )
 BaseType_t xSuspendOTAUpdate( void )
 {
     OtaErr_t otaRet;
-    BaseType_t result;
+    BaseType_t result = pdTRUE;
 
     /* Suspend OTA operations. */
 
@@ -899,3 +1682,23 @@ BaseType_t xResumeOTAUpdate( void )
 
     return result;
 }
+
+BaseType_t xResubscribeOTAUpdate( void )
+{
+    BaseType_t result = pdTRUE;
+    uint32_t index;
+
+    /* The OTA agent is suspended, so it neither changes the subscriptions nor waits on opSemaphore. */
+    for( index = 0U; index < OTA_MAX_SUBSCRIPTIONS; index++ )
+    {
+        if( ( subscriptions[ index ].topicFilterLength > 0U ) &&
+            ( mqttSubscribe( subscriptions[ index ].topicFilter,
+                             subscriptions[ index ].topicFilterLength,
+                             subscriptions[ index ].qos ) != OtaMqttSuccess ) )
+        {
+            result = pdFALSE;
+        }
+    }
+
+    return result;
+}
@@ -30,6 +30,7 @@
 #include "FreeRTOS.h"
 
 #include "core_mqtt.h"
+#include "tls_freertos_pkcs11.h"
 
 /**
  * @brief Flag which enables or disables OTA update demo.
@@ -42,23 +43,35 @@
  * Prerequisite: A valid MQTT connection should be established with AWS IoT core and the context
  * passed in as the parameter.
  *
- * @pram[in] pMQTTContext The context for MQTT connection with AWS IoT core.
+ * @param[in] pHttpCredentials Credentials of the TLS connections of the files downloaded over HTTP,
+ * copied by the function, or NULL to only download over MQTT.
  * @return pdTRUE if the OTA update task was successfully created.
  */
-BaseType_t xStartOTAUpdateDemo( void );
+BaseType_t xStartOTAUpdateDemo( const NetworkCredentials_t * pHttpCredentials );
 
 /**
- * @brief Handles an MQTT packet for OTA.
- * Filters out  MQTT control and data packets for OTA and queues appropirate events for OTA agent to process them.
+ * @brief Suspends the OTA agent, for instance while the MQTT connection is lost.
+ * Blocks until the agent is suspended.
  *
- * @param[in] pMQTTContext The MQTT context passed from library
- * @param[in] pPacketInfo  Pointer to the MQTT packet information
- * @param[in] pDeserializedInfo Pointer to the deserialized publish packet information.
- * @return pdTRUE if the packet was successfully processed.
+ * @return pdTRUE if the OTA agent was suspended.
  */
-BaseType_t xOTAProcessMQTTEvent( MQTTContext_t * pMQTTContext,
-                                 struct MQTTPacketInfo * pPacketInfo,
-                                 struct MQTTDeserializedInfo * pDeserializedInfo );
+BaseType_t xSuspendOTAUpdate( void );
+
+/**
+ * @brief Resumes a suspended OTA agent once the MQTT connection is back.
+ * Blocks until the agent is resumed; does nothing if the agent is not suspended.
+ *
+ * @return pdTRUE if the OTA agent was resumed or was not suspended.
+ */
+BaseType_t xResumeOTAUpdate( void );
+
+/**
+ * @brief Subscribes again to the topics of a suspended OTA agent, after a reconnection in which the
+ * broker did not resume the MQTT session. Call it before xResumeOTAUpdate().
+ *
+ * @return pdTRUE if all the topics were subscribed.
+ */
+BaseType_t xResubscribeOTAUpdate( void );
 
 /**
  * @brief Validate the integrity of the new image to be activated.
@@ -72,5 +85,30 @@ BaseType_t xValidateImageSignature( uint8_t * pFilePath,
                                     uint8_t * pSignature,
                                     size_t signatureLength );
 
+/**
+ * @brief Starts the SHA256 digest of a new image, computed while the image is written.
+ * Called when the file is created. If the digest cannot be started, the image is hashed when closed.
+ * @param[in] pImage Image in memory mapped flash.
+ * @param[in] imageSize Size of the whole image.
+ * @return pdTRUE if the digest was started.
+ */
+BaseType_t xImageDigestStart( const uint8_t * pImage,
+                              uint32_t imageSize );
+
+/**
+ * @brief Adds a block committed to flash to the digest of the image.
+ * Blocks can be written in any order: the digest covers the contiguous prefix of written blocks and
+ * catches up with the blocks written ahead as soon as the missing ones are written.
+ * @param[in] offset Offset of the block in the image.
+ * @param[in] blockSize Size of the block.
+ */
+void vImageDigestBlockWritten( uint32_t offset,
+                               uint32_t blockSize );
+
+/**
+ * @brief Stops the digest of the image being written, for instance when the update is aborted.
+ */
+void vImageDigestAbort( void );
+
 
 #endif /* ifndef OTA_UPDATE_H */
@@ -0,0 +1,438 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+#include <string.h>
+
+#include "mflash_drv.h"
+#include "nor_model.h"
+
+/* Status register bits */
+#define STATUS_WIP (0x01)
+#define STATUS_WEL (0x02)
+
+/* Quad enable bits */
+#define MACRONIX_ID    (0xC2)
+#define MACRONIX_QE    (0x40)
+#define WINBOND_QE     (0x02)
+
+nor_model_t g_nor_model;
+
+static bool nor_model_busy(void)
+{
+    return g_nor_model.now_ns < g_nor_model.busy_until_ns;
+}
+
+static uint8_t nor_model_suspend_opcode(void)
+{
+    return (g_nor_model.jedec_id[0] == MACRONIX_ID) ? 0xB0 : 0x75;
+}
+
+static uint8_t nor_model_resume_opcode(void)
+{
+    return (g_nor_model.jedec_id[0] == MACRONIX_ID) ? 0x30 : 0x7A;
+}
+
+bool nor_model_quad_enabled(void)
+{
+    if (g_nor_model.jedec_id[0] == MACRONIX_ID)
+    {
+        return (g_nor_model.status & MACRONIX_QE) != 0;
+    }
+    return (g_nor_model.status2 & WINBOND_QE) != 0;
+}
+
+/* Lines of the non serial fields */
+static uint32_t nor_model_width(const mflash_nor_cmd_t *cmd)
+{
+    if (cmd->lines == kMflashNor_1_1_1)
+    {
+        return 1;
+    }
+    return g_nor_model.quad ? 4 : 2;
+}
+
+/* Whether the data of 'cmd' go through unchanged */
+static bool nor_model_lines_ok(const mflash_nor_cmd_t *cmd)
+{
+    if (cmd->lines == kMflashNor_1_1_1)
+    {
+        return true;
+    }
+    return g_nor_model.quad && g_nor_model.io23_connected && nor_model_quad_enabled();
+}
+
+/* Whether a read command returns the flash content */
+static bool nor_model_read_ok(const mflash_nor_cmd_t *cmd)
+{
+    switch (cmd->opcode)
+    {
+        case 0x0B:
+            return (cmd->lines == kMflashNor_1_1_1) && (cmd->dummy_len == 1);
+        case 0xEB:
+            return (cmd->lines == kMflashNor_1_4_4) && (cmd->dummy_len == 3) && nor_model_lines_ok(cmd);
+        default:
+            return false;
+    }
+}
+
+static void nor_model_clock(uint64_t clocks)
+{
+    g_nor_model.clocks += clocks;
+    g_nor_model.now_ns += (clocks * 1000U) / NOR_MODEL_CLOCK_MHZ;
+}
+
+/* Clocks of the opcode, the address and the intermediate bytes */
+static uint64_t nor_model_header_clocks(const mflash_nor_cmd_t *cmd)
+{
+    uint32_t address_width = (cmd->lines == kMflashNor_1_4_4) ? nor_model_width(cmd) : 1;
+
+    return 8U + (((uint32_t)cmd->addr_len + cmd->dummy_len) * 8U) / address_width;
+}
+
+static uint64_t nor_model_data_clocks(const mflash_nor_cmd_t *cmd, uint32_t len)
+{
+    return ((uint64_t)len * 8U) / nor_model_width(cmd);
+}
+
+void nor_model_init(const uint8_t jedec_id[3])
+{
+    memset(&g_nor_model, 0, sizeof(g_nor_model));
+    memcpy(g_nor_model.jedec_id, jedec_id, sizeof(g_nor_model.jedec_id));
+    memset(g_nor_model.flash, 0xFF, sizeof(g_nor_model.flash));
+    g_nor_model.io23_connected    = true;
+    g_nor_model.sector_erase_us   = 45000;
+    g_nor_model.block_erase_us    = 400000;
+    g_nor_model.page_program_us   = 600;
+    g_nor_model.register_write_us = 10000;
+    g_nor_model.suspend_us        = 20;
+}
+
+void nor_model_interrupts(uint32_t period_us, uint32_t isr_us, bool reads_flash)
+{
+    g_nor_model.irq_period_us      = period_us;
+    g_nor_model.isr_us             = isr_us;
+    g_nor_model.irq_reads_flash    = reads_flash;
+    g_nor_model.irq_pending        = false;
+    g_nor_model.irq_next_ns        = g_nor_model.now_ns + (uint64_t)period_us * 1000U;
+    g_nor_model.irq_max_latency_ns = 0;
+    g_nor_model.irq_served         = 0;
+    g_nor_model.irq_bad_reads      = 0;
+}
+
+/* Raise the interrupt when its time has come */
+static void nor_model_raise(void)
+{
+    if ((g_nor_model.irq_period_us != 0) && (false == g_nor_model.irq_pending) &&
+        (g_nor_model.now_ns >= g_nor_model.irq_next_ns))
+    {
+        g_nor_model.irq_pending   = true;
+        g_nor_model.irq_raised_ns = g_nor_model.irq_next_ns;
+        g_nor_model.irq_next_ns += (uint64_t)g_nor_model.irq_period_us * 1000U;
+    }
+}
+
+void nor_model_serve(void)
+{
+    uint64_t latency_ns;
+
+    nor_model_raise();
+    if (false == g_nor_model.irq_pending)
+    {
+        return;
+    }
+
+    latency_ns = g_nor_model.now_ns - g_nor_model.irq_raised_ns;
+    if (latency_ns > g_nor_model.irq_max_latency_ns)
+    {
+        g_nor_model.irq_max_latency_ns = latency_ns;
+    }
+
+    /* The code of the ISR is fetched from the flash */
+    if (g_nor_model.irq_reads_flash && ((false == g_nor_model.memory_mode) || nor_model_busy()))
+    {
+        g_nor_model.irq_bad_reads++;
+    }
+
+    g_nor_model.now_ns += (uint64_t)g_nor_model.isr_us * 1000U;
+    g_nor_model.irq_pending = false;
+    g_nor_model.irq_served++;
+
+    /* Interrupts raised while the ISR ran are served after it */
+    if (g_nor_model.irq_next_ns < g_nor_model.now_ns)
+    {
+        g_nor_model.irq_next_ns = g_nor_model.now_ns;
+    }
+}
+
+static void nor_model_reset(void)
+{
+    g_nor_model.memory_mode = false;
+}
+
+static void nor_model_set_quad(bool quad)
+{
+    g_nor_model.quad = quad;
+}
+
+static void nor_model_erase(uint32_t addr, uint32_t size, uint32_t time_us)
+{
+    addr &= ~(size - 1U);
+    if (addr + size <= NOR_MODEL_SIZE)
+    {
+        memset(&g_nor_model.flash[addr], 0xFF, size);
+    }
+    g_nor_model.busy_until_ns = g_nor_model.now_ns + (uint64_t)time_us * 1000U;
+}
+
+static void nor_model_command(const mflash_nor_cmd_t *cmd, uint32_t addr)
+{
+    nor_model_clock(nor_model_header_clocks(cmd) + nor_model_data_clocks(cmd, cmd->data_len));
+
+    g_nor_model.cmd  = *cmd;
+    g_nor_model.addr = addr;
+
+    if (g_nor_model.memory_mode ||
+        (nor_model_busy() && (cmd->opcode != 0x05) && (cmd->opcode != nor_model_suspend_opcode())) ||
+        (g_nor_model.suspended && (cmd->opcode == 0x06)))
+    {
+        g_nor_model.errors++;
+        g_nor_model.cmd.opcode = 0;
+        return;
+    }
+
+    if (cmd->opcode == nor_model_suspend_opcode())
+    {
+        /* The flash can be read once it is done suspending */
+        if (nor_model_busy() && (false == g_nor_model.suspended))
+        {
+            g_nor_model.suspended     = true;
+            g_nor_model.remaining_ns  = g_nor_model.busy_until_ns - g_nor_model.now_ns;
+            g_nor_model.busy_until_ns = g_nor_model.now_ns + (uint64_t)g_nor_model.suspend_us * 1000U;
+        }
+        return;
+    }
+
+    if (cmd->opcode == nor_model_resume_opcode())
+    {
+        /* Ignored when nothing is suspended */
+        if (g_nor_model.suspended)
+        {
+            g_nor_model.suspended     = false;
+            g_nor_model.busy_until_ns = g_nor_model.now_ns + g_nor_model.remaining_ns;
+        }
+        return;
+    }
+
+    switch (cmd->opcode)
+    {
+        case 0x06:
+            g_nor_model.wel = true;
+            break;
+        case 0x20:
+        case 0x52:
+        case 0xD8:
+            if (false == g_nor_model.wel)
+            {
+                g_nor_model.errors++;
+                break;
+            }
+            nor_model_erase(addr, (cmd->opcode == 0x20) ? 0x1000 : ((cmd->opcode == 0x52) ? 0x8000 : 0x10000),
+                            (cmd->opcode == 0x20) ? g_nor_model.sector_erase_us : g_nor_model.block_erase_us);
+            g_nor_model.wel = false;
+            break;
+        case 0x01:
+        case 0x31:
+        case 0x02:
+        case 0x32:
+        case 0x38:
+            /* Carried out with the data written */
+            if (false == g_nor_model.wel)
+            {
+                g_nor_model.errors++;
+            }
+            break;
+        case 0x05:
+        case 0x35:
+        case 0x15:
+        case 0x9F:
+        case 0x0B:
+        case 0xEB:
+            /* Answered with the data read */
+            break;
+        default:
+            g_nor_model.errors++;
+            break;
+    }
+}
+
+static void nor_model_write(const uint8_t *data, uint32_t len)
+{
+    const mflash_nor_cmd_t *cmd = &g_nor_model.cmd;
+    uint32_t page                = g_nor_model.addr & ~(uint32_t)(MFLASH_PAGE_SIZE - 1);
+    uint8_t byte;
+
+    if (false == g_nor_model.wel)
+    {
+        return;
+    }
+
+    switch (cmd->opcode)
+    {
+        case 0x02:
+        case 0x32:
+        case 0x38:
+            for (uint32_t i = 0; i < len; i++)
+            {
+                byte = nor_model_lines_ok(cmd) ? data[i] : (uint8_t)(data[i] ^ 0x5A);
+                /* The address wraps within the page */
+                g_nor_model.flash[page + ((g_nor_model.addr + i) & (MFLASH_PAGE_SIZE - 1))] &= byte;
+            }
+            g_nor_model.busy_until_ns = g_nor_model.now_ns + (uint64_t)g_nor_model.page_program_us * 1000U;
+            break;
+        case 0x01:
+            g_nor_model.status = data[0] & ~(STATUS_WIP | STATUS_WEL);
+            /* A single byte clears the configuration register of a Macronix flash */
+            if (g_nor_model.jedec_id[0] == MACRONIX_ID)
+            {
+                g_nor_model.config = (len > 1) ? data[1] : 0;
+            }
+            g_nor_model.qe_writes++;
+            g_nor_model.busy_until_ns = g_nor_model.now_ns + (uint64_t)g_nor_model.register_write_us * 1000U;
+            break;
+        case 0x31:
+            g_nor_model.status2 = data[0];
+            g_nor_model.qe_writes++;
+            g_nor_model.busy_until_ns = g_nor_model.now_ns + (uint64_t)g_nor_model.register_write_us * 1000U;
+            break;
+        default:
+            break;
+    }
+    g_nor_model.wel = false;
+}
+
+static void nor_model_read(uint8_t *data, uint32_t len)
+{
+    const mflash_nor_cmd_t *cmd = &g_nor_model.cmd;
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        switch (cmd->opcode)
+        {
+            case 0x05:
+                data[i] = g_nor_model.status | (g_nor_model.wel ? STATUS_WEL : 0) | (nor_model_busy() ? STATUS_WIP : 0);
+                break;
+            case 0x35:
+                data[i] = g_nor_model.status2;
+                break;
+            case 0x15:
+                data[i] = g_nor_model.config;
+                break;
+            case 0x9F:
+                data[i] = (i < sizeof(g_nor_model.jedec_id)) ? g_nor_model.jedec_id[i] : 0xFF;
+                break;
+            case 0x0B:
+            case 0xEB:
+                data[i] = g_nor_model.flash[(g_nor_model.addr + i) % NOR_MODEL_SIZE];
+                if (false == nor_model_read_ok(cmd))
+                {
+                    data[i] ^= 0xFF;
+                }
+                break;
+            default:
+                data[i] = 0xFF;
+                break;
+        }
+    }
+}
+
+static void nor_model_wait(void)
+{
+}
+
+static void nor_model_memory_mode(const mflash_nor_cmd_t *cmd)
+{
+    g_nor_model.memory_mode = true;
+    g_nor_model.memory_cmd  = *cmd;
+}
+
+void nor_model_memory_read(uint32_t addr, uint8_t *data, uint32_t len, uint32_t line)
+{
+    const mflash_nor_cmd_t *cmd = &g_nor_model.memory_cmd;
+    uint32_t offset;
+
+    if ((false == g_nor_model.memory_mode) || nor_model_busy())
+    {
+        g_nor_model.errors++;
+    }
+
+    for (offset = 0; offset < len; offset += line)
+    {
+        nor_model_clock(nor_model_header_clocks(cmd) + nor_model_data_clocks(cmd, line));
+    }
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        data[i] = g_nor_model.flash[(addr + i) % NOR_MODEL_SIZE];
+        if (false == nor_model_read_ok(cmd))
+        {
+            data[i] ^= 0xFF;
+        }
+    }
+}
+
+static bool nor_model_pending(void)
+{
+    nor_model_raise();
+    return g_nor_model.irq_pending;
+}
+
+static void nor_model_service(void)
+{
+    nor_model_serve();
+}
+
+static uint32_t nor_model_timestamp(void)
+{
+    return (uint32_t)(g_nor_model.now_ns / 1000U);
+}
+
+static uint32_t nor_model_elapsed_us(uint32_t since)
+{
+    return nor_model_timestamp() - since;
+}
+
+mflash_nor_ops_t g_nor_model_ops = {
+    .reset       = nor_model_reset,
+    .set_quad    = nor_model_set_quad,
+    .command     = nor_model_command,
+    .write       = nor_model_write,
+    .read        = nor_model_read,
+    .wait        = nor_model_wait,
+    .memory_mode = nor_model_memory_mode,
+    .pending     = nor_model_pending,
+    .service     = nor_model_service,
+    .timestamp   = nor_model_timestamp,
+    .elapsed_us  = nor_model_elapsed_us,
+};
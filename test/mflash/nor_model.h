@@ -0,0 +1,108 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+#ifndef __NOR_MODEL_H__
+#define __NOR_MODEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mflash_nor.h"
+
+/* Host model of the SPIFI controller and of a serial NOR flash, driven by the command
+ * sequences of 'mflash_nor.c' through 'g_nor_model_ops'. Time advances with the bus clocks
+ * of the commands, at NOR_MODEL_CLOCK_MHZ, with the erase and program times of the flash,
+ * and with the interrupts served. The flash suspends an erase or a program with the opcodes
+ * of its vendor. Interrupts are raised periodically and record how long they waited. */
+
+#define NOR_MODEL_SIZE (0x40000)
+
+/* Bus clock of the model, the SPIFI clock of the board */
+#define NOR_MODEL_CLOCK_MHZ (96)
+
+typedef struct _nor_model
+{
+    /* Flash */
+    uint8_t jedec_id[3];
+    bool io23_connected;  /* IO2 and IO3 wired, quad transfers are garbled otherwise */
+    uint8_t status;       /* status register, WIP is computed */
+    uint8_t status2;      /* second status register of Winbond and GigaDevice */
+    uint8_t config;       /* configuration register of Macronix */
+    bool wel;             /* write enable latch */
+    uint64_t busy_until_ns;
+    uint8_t flash[NOR_MODEL_SIZE];
+    uint32_t sector_erase_us;
+    uint32_t block_erase_us;
+    uint32_t page_program_us;
+    uint32_t register_write_us;
+    uint32_t suspend_us;  /* time for a suspended erase or program to let the flash be read */
+    bool suspended;
+    uint64_t remaining_ns; /* of the suspended erase or program */
+
+    /* Interrupts, raised every 'irq_period_us' when not 0, running 'isr_us' */
+    uint32_t irq_period_us;
+    uint32_t isr_us;
+    bool irq_reads_flash; /* the ISRs are in flash, as for an XIP image */
+    bool irq_pending;
+    uint64_t irq_next_ns;
+    uint64_t irq_raised_ns;
+    uint64_t irq_max_latency_ns;
+    uint32_t irq_served;
+    uint32_t irq_bad_reads; /* ISRs which read the flash while it could not be read */
+
+    /* Controller */
+    bool quad;            /* four lines for the non serial fields, two otherwise */
+    bool memory_mode;
+    mflash_nor_cmd_t memory_cmd;
+    mflash_nor_cmd_t cmd; /* command in progress in command mode */
+    uint32_t addr;        /* address of the next data byte of the command */
+
+    /* Accounting */
+    uint64_t now_ns;
+    uint64_t clocks;      /* bus clocks of all the commands */
+    uint32_t qe_writes;   /* writes of the quad enable register */
+    uint32_t errors;      /* commands sent in memory mode, or to a busy flash */
+} nor_model_t;
+
+extern nor_model_t g_nor_model;
+extern mflash_nor_ops_t g_nor_model_ops;
+
+/* Erased flash with 'jedec_id', the controller in command mode and dual mode */
+void nor_model_init(const uint8_t jedec_id[3]);
+
+/* Raise an interrupt every 'period_us', which runs for 'isr_us' and reads the flash when
+ * 'reads_flash' is set */
+void nor_model_interrupts(uint32_t period_us, uint32_t isr_us, bool reads_flash);
+
+/* Serve the interrupt waiting, as when the driver unmasks the interrupts at the end of an operation */
+void nor_model_serve(void);
+
+/* Read the flash in memory mode, the way the CPU does in 'line' bytes wide cache lines */
+void nor_model_memory_read(uint32_t addr, uint8_t *data, uint32_t len, uint32_t line);
+
+/* Whether the quad enable bit of the flash is set */
+bool nor_model_quad_enabled(void);
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/* Unit tests of the copy scheduling of 'mflash_dma.c' against an emulated DMA controller:
+ * chunking and item widths, completion, errors and abort, the hold of the controller off the
+ * flash during an erase, and the timeout of 'mflash_drv_read' across a 64 KB block erase. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mflash_dma.h"
+#include "unit_test.h"
+
+/* Emulated controller, moving the items of the transfer started when 'dma_model_run' is called */
+typedef struct _dma_model
+{
+    uint8_t *dst;
+    const uint8_t *src;
+    uint32_t count;
+    uint32_t width;
+    bool running;
+    bool ended;         /* the interrupt of the transfer is waiting */
+    bool dead;          /* never ends a transfer */
+    uint32_t starts;
+    uint32_t max_count;
+    uint32_t aborts;
+    uint32_t busy_polls; /* polls of 'busy' before the running transfer ends */
+} dma_model_t;
+
+static dma_model_t g_dma_model;
+static mflash_dma_t g_dma;
+
+static void dma_model_start(void *dst, const void *src, uint32_t count, uint32_t width)
+{
+    CHECK(false == g_dma_model.running);
+    CHECK((count > 0) && (count <= MFLASH_DMA_MAX_COUNT));
+    CHECK(((uintptr_t)dst % width) == 0);
+    CHECK(((uintptr_t)src % width) == 0);
+
+    g_dma_model.dst     = (uint8_t *)dst;
+    g_dma_model.src     = (const uint8_t *)src;
+    g_dma_model.count   = count;
+    g_dma_model.width   = width;
+    g_dma_model.running = true;
+    g_dma_model.starts++;
+    if (count > g_dma_model.max_count)
+    {
+        g_dma_model.max_count = count;
+    }
+}
+
+/* Move the items of the running transfer */
+static void dma_model_move(void)
+{
+    memcpy(g_dma_model.dst, g_dma_model.src, g_dma_model.count * g_dma_model.width);
+    g_dma_model.running = false;
+    g_dma_model.ended   = true;
+}
+
+static bool dma_model_busy(void)
+{
+    if (g_dma_model.running && (false == g_dma_model.dead))
+    {
+        if (g_dma_model.busy_polls == 0)
+        {
+            dma_model_move();
+        }
+        else
+        {
+            g_dma_model.busy_polls--;
+        }
+    }
+    return g_dma_model.running;
+}
+
+static void dma_model_abort(void)
+{
+    g_dma_model.running = false;
+    g_dma_model.ended   = false;
+    g_dma_model.aborts++;
+}
+
+static const mflash_dma_ops_t g_dma_model_ops = {
+    .start = dma_model_start,
+    .busy  = dma_model_busy,
+    .abort = dma_model_abort,
+};
+
+/* End the running transfer and call the completion as the interrupt does,
+ * returns the result of the completion */
+static bool dma_model_run(bool error)
+{
+    CHECK(g_dma_model.running);
+    if (false == error)
+    {
+        dma_model_move();
+    }
+    g_dma_model.running = false;
+    g_dma_model.ended   = false;
+    return mflash_dma_complete(&g_dma, error);
+}
+
+static void setup(void)
+{
+    memset(&g_dma_model, 0, sizeof(g_dma_model));
+    mflash_dma_init(&g_dma, &g_dma_model_ops);
+}
+
+static uint8_t g_flash[0x10000 + 8];
+static uint8_t g_ram[0x10000 + 8];
+
+static void fill(void)
+{
+    for (uint32_t i = 0; i < sizeof(g_flash); i++)
+    {
+        g_flash[i] = (uint8_t)(i ^ (i >> 8));
+    }
+    memset(g_ram, 0, sizeof(g_ram));
+}
+
+/* Copy to completion, returns the number of transfers */
+static uint32_t copy(uint32_t dst_offset, uint32_t src_offset, uint32_t len)
+{
+    uint32_t transfers = 0;
+
+    setup();
+    fill();
+    CHECK(mflash_dma_copy(&g_dma, &g_ram[dst_offset], &g_flash[src_offset], len));
+    while (g_dma_model.running)
+    {
+        transfers++;
+        if (dma_model_run(false))
+        {
+            break;
+        }
+    }
+
+    CHECK(g_dma.status == kMflashDma_Done);
+    CHECK(memcmp(&g_ram[dst_offset], &g_flash[src_offset], len) == 0);
+    CHECK(g_ram[dst_offset + len] == 0);
+    CHECK((dst_offset == 0) || (g_ram[dst_offset - 1] == 0));
+
+    return transfers;
+}
+
+static void test_chunking(void)
+{
+    /* Aligned, words of at most MFLASH_DMA_MAX_COUNT items */
+    CHECK(copy(0, 0, 0x10000) == 16);
+    CHECK(g_dma_model.width == 4);
+    CHECK(g_dma_model.max_count == MFLASH_DMA_MAX_COUNT);
+
+    CHECK(copy(0, 0, 10000) == 3);
+    CHECK(g_dma_model.width == 4);
+
+    /* Half words, then bytes, when the addresses or the length allow no wider items */
+    CHECK(copy(2, 0, 0x1000) == 2);
+    CHECK(g_dma_model.width == 2);
+    CHECK(copy(0, 4, 0x1002) == 3);
+    CHECK(g_dma_model.width == 2);
+    CHECK(copy(1, 0, 2500) == 3);
+    CHECK(g_dma_model.width == 1);
+    CHECK(copy(0, 0, 513) == 1);
+    CHECK(g_dma_model.width == 1);
+}
+
+static void test_empty_and_busy(void)
+{
+    setup();
+    fill();
+    CHECK(mflash_dma_copy(&g_dma, g_ram, g_flash, 0));
+    CHECK(g_dma.status == kMflashDma_Done);
+    CHECK(g_dma_model.starts == 0);
+
+    /* A second copy is refused while the first one runs */
+    CHECK(mflash_dma_copy(&g_dma, g_ram, g_flash, 0x2000));
+    CHECK(false == mflash_dma_copy(&g_dma, g_ram, g_flash, 0x2000));
+    CHECK(g_dma_model.starts == 1);
+}
+
+static void test_error(void)
+{
+    setup();
+    fill();
+    CHECK(mflash_dma_copy(&g_dma, g_ram, g_flash, 0x3000));
+    CHECK(false == dma_model_run(false));
+    CHECK(dma_model_run(true));
+    CHECK(g_dma.status == kMflashDma_Error);
+    CHECK(g_dma.errors == 1);
+    CHECK(false == g_dma_model.running);
+
+    /* The next copy starts afresh */
+    CHECK(mflash_dma_copy(&g_dma, g_ram, g_flash, 0x1000));
+    CHECK(dma_model_run(false));
+    CHECK(g_dma.status == kMflashDma_Done);
+}
+
+static void test_abort(void)
+{
+    setup();
+    fill();
+    CHECK(mflash_dma_copy(&g_dma, g_ram, g_flash, 0x3000));
+    mflash_dma_abort(&g_dma);
+    CHECK(g_dma_model.aborts == 1);
+    CHECK(g_dma.status == kMflashDma_Error);
+    CHECK(g_dma.errors == 1);
+
+    /* A late interrupt of the aborted transfer is ignored */
+    CHECK(false == mflash_dma_complete(&g_dma, false));
+    CHECK(g_dma.status == kMflashDma_Error);
+
+    /* Nothing to abort once the copy is over */
+    mflash_dma_abort(&g_dma);
+    CHECK(g_dma_model.aborts == 1);
+    CHECK(g_dma.errors == 1);
+}
+
+static void test_hold(void)
+{
+    setup();
+    fill();
+    CHECK(mflash_dma_copy(&g_dma, g_ram, g_flash, 0x3000));
+
+    /* The hold waits for the transfer running, its completion then starts no other one */
+    g_dma_model.busy_polls = 10;
+    mflash_dma_hold(&g_dma);
+    CHECK(false == g_dma_model.running);
+    CHECK(g_dma_model.ended);
+    g_dma_model.ended = false;
+    CHECK(false == mflash_dma_complete(&g_dma, false));
+    CHECK(g_dma.deferred);
+    CHECK(g_dma_model.starts == 1);
+
+    /* The release starts the next one */
+    mflash_dma_release(&g_dma);
+    CHECK(g_dma_model.starts == 2);
+    CHECK(false == dma_model_run(false));
+    CHECK(dma_model_run(false));
+    CHECK(g_dma.status == kMflashDma_Done);
+    CHECK(memcmp(g_ram, g_flash, 0x3000) == 0);
+
+    /* A copy requested while held starts on release */
+    setup();
+    mflash_dma_hold(&g_dma);
+    CHECK(mflash_dma_copy(&g_dma, g_ram, g_flash, 0x1000));
+    CHECK(g_dma_model.starts == 0);
+    CHECK(g_dma.deferred);
+    mflash_dma_release(&g_dma);
+    CHECK(g_dma_model.starts == 1);
+    CHECK(dma_model_run(false));
+    CHECK(g_dma.status == kMflashDma_Done);
+}
+
+/* 'mflash_drv_read' with a timeout of 'timeout_ms', while an erase of 'erase_ms' holds the
+ * controller from 'erase_at_ms'. Each transfer takes 1 ms. Returns the final status. */
+static uint8_t read_during_erase(uint32_t timeout_ms, uint32_t erase_at_ms, uint32_t erase_ms, uint32_t *elapsed_ms)
+{
+    uint32_t progress;
+    uint32_t now_ms      = 0;
+    uint32_t deadline_ms = timeout_ms;
+    bool held            = false;
+
+    fill();
+    CHECK(mflash_dma_copy(&g_dma, g_ram, g_flash, 0x10000));
+    progress = g_dma.transfers;
+
+    while (g_dma.status == kMflashDma_Busy)
+    {
+        now_ms++;
+
+        if ((false == held) && (now_ms == erase_at_ms))
+        {
+            mflash_dma_hold(&g_dma);
+            held = true;
+        }
+        if (held && (now_ms == erase_at_ms + erase_ms))
+        {
+            mflash_dma_release(&g_dma);
+        }
+
+        /* The transfer running ends, or ended when the hold waited for it, and its interrupt is served */
+        if (g_dma_model.running && (false == g_dma_model.dead))
+        {
+            dma_model_move();
+        }
+        if (g_dma_model.ended)
+        {
+            g_dma_model.ended = false;
+            (void)mflash_dma_complete(&g_dma, false);
+        }
+
+        /* The semaphore wait times out */
+        if ((g_dma.status == kMflashDma_Busy) && (now_ms >= deadline_ms))
+        {
+            if (mflash_dma_stalled(&g_dma, &progress))
+            {
+                mflash_dma_abort(&g_dma);
+            }
+            deadline_ms = now_ms + timeout_ms;
+        }
+    }
+
+    *elapsed_ms = now_ms;
+    return g_dma.status;
+}
+
+static void test_read_across_block_erase(void)
+{
+    uint32_t elapsed_ms;
+
+    /* A 400 ms block erase in the middle of the copy does not make it fail */
+    setup();
+    CHECK(read_during_erase(100, 5, 400, &elapsed_ms) == kMflashDma_Done);
+    CHECK(memcmp(g_ram, g_flash, 0x10000) == 0);
+    CHECK(elapsed_ms >= 400);
+    CHECK(g_dma.errors == 0);
+
+    /* Nor one starting right with the copy */
+    setup();
+    CHECK(read_during_erase(100, 1, 400, &elapsed_ms) == kMflashDma_Done);
+    CHECK(g_dma.errors == 0);
+
+    /* A controller which never ends a transfer is aborted after one timeout */
+    setup();
+    g_dma_model.dead = true;
+    CHECK(read_during_erase(100, 1000, 0, &elapsed_ms) == kMflashDma_Error);
+    CHECK(elapsed_ms == 100);
+    CHECK(g_dma_model.aborts == 1);
+
+    printf("  64 KB read across a 400 ms block erase with a 100 ms timeout: done\n");
+}
+
+int main(void)
+{
+    RUN(test_chunking);
+    RUN(test_empty_and_busy);
+    RUN(test_error);
+    RUN(test_abort);
+    RUN(test_hold);
+    RUN(test_read_across_block_erase);
+
+    return unit_test_report();
+}
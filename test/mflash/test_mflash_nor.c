@@ -0,0 +1,231 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/* Unit tests of the command sequences of 'mflash_nor.c' against the SPIFI and NOR model:
+ * quad probe, serial fallback, erase and program, and the bus clocks of the serial and quad
+ * commands. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mflash_drv.h"
+#include "mflash_nor.h"
+#include "nor_model.h"
+#include "unit_test.h"
+
+static const uint8_t g_macronix_id[3] = {0xC2, 0x20, 0x18};
+static const uint8_t g_winbond_id[3]  = {0xEF, 0x40, 0x18};
+static const uint8_t g_micron_id[3]   = {0x20, 0xBA, 0x18};
+
+static mflash_nor_t g_nor;
+
+/* Probe the flash as 'mflash_drv_init' does, returns whether the quad commands are used */
+static bool probe(void)
+{
+    bool quad;
+
+    mflash_nor_init(&g_nor, &g_nor_model_ops, true);
+    mflash_nor_probe(&g_nor);
+    quad = mflash_nor_probe_quad(&g_nor, 0);
+    mflash_nor_read_mode(&g_nor);
+
+    return quad;
+}
+
+static void fill_check_area(void)
+{
+    for (uint32_t i = 0; i < MFLASH_NOR_CHECK_SIZE; i++)
+    {
+        g_nor_model.flash[i] = (uint8_t)(i * 7U);
+    }
+}
+
+static void test_macronix_quad(void)
+{
+    nor_model_init(g_macronix_id);
+    g_nor_model.config = 0x07;
+    fill_check_area();
+
+    CHECK(probe());
+    CHECK(g_nor.quad);
+    CHECK(g_nor.read.opcode == 0xEB);
+    CHECK(g_nor.program.opcode == 0x38);
+    CHECK(g_nor.program.lines == kMflashNor_1_4_4);
+    CHECK(nor_model_quad_enabled());
+    CHECK(g_nor_model.config == 0x07);
+    CHECK(g_nor_model.qe_writes == 1);
+    CHECK(g_nor_model.memory_mode);
+    CHECK(g_nor_model.errors == 0);
+
+    /* The quad enable bit is non volatile, it is not written again */
+    CHECK(probe());
+    CHECK(g_nor_model.qe_writes == 1);
+}
+
+static void test_winbond_quad(void)
+{
+    nor_model_init(g_winbond_id);
+    fill_check_area();
+
+    CHECK(probe());
+    CHECK(g_nor.read.opcode == 0xEB);
+    CHECK(g_nor.program.opcode == 0x32);
+    CHECK(g_nor.program.lines == kMflashNor_1_1_4);
+    CHECK((g_nor_model.status2 & 0x02) != 0);
+    CHECK(g_nor_model.errors == 0);
+}
+
+static void test_unknown_flash_stays_serial(void)
+{
+    nor_model_init(g_micron_id);
+    fill_check_area();
+
+    CHECK(false == probe());
+    CHECK(g_nor.vendor == NULL);
+    CHECK(g_nor.read.opcode == 0x0B);
+    CHECK(g_nor.program.opcode == 0x02);
+    CHECK(false == g_nor_model.quad);
+    CHECK(g_nor_model.qe_writes == 0);
+}
+
+static void test_missing_io23_falls_back(void)
+{
+    uint8_t data[MFLASH_NOR_CHECK_SIZE];
+
+    nor_model_init(g_macronix_id);
+    g_nor_model.io23_connected = false;
+    fill_check_area();
+
+    CHECK(false == probe());
+    CHECK(false == g_nor.quad);
+    CHECK(g_nor.read.opcode == 0x0B);
+    CHECK(g_nor.program.opcode == 0x02);
+    CHECK(false == g_nor_model.quad);
+
+    nor_model_memory_read(0, data, sizeof(data), 32);
+    CHECK(memcmp(data, g_nor_model.flash, sizeof(data)) == 0);
+}
+
+static void check_program_erase(const uint8_t jedec_id[3])
+{
+    uint8_t page[MFLASH_PAGE_SIZE];
+    uint8_t data[MFLASH_SECTOR_SIZE];
+
+    nor_model_init(jedec_id);
+    fill_check_area();
+    probe();
+
+    for (uint32_t i = 0; i < sizeof(page); i++)
+    {
+        page[i] = (uint8_t)(0xA5 ^ i);
+    }
+
+    mflash_nor_program(&g_nor, 0x1100, page, sizeof(page));
+    mflash_nor_program(&g_nor, 0x1210, page, 16);
+    mflash_nor_read_mode(&g_nor);
+    nor_model_memory_read(0x1100, data, sizeof(page), 32);
+    CHECK(memcmp(data, page, sizeof(page)) == 0);
+    nor_model_memory_read(0x1210, data, 16, 32);
+    CHECK(memcmp(data, page, 16) == 0);
+    CHECK(g_nor_model.flash[0x120F] == 0xFF);
+    CHECK(g_nor_model.flash[0x1220] == 0xFF);
+
+    mflash_nor_erase(&g_nor, 0x1000, kMflashNor_EraseSector);
+    mflash_nor_read_mode(&g_nor);
+    nor_model_memory_read(0x1000, data, sizeof(data), 32);
+    for (uint32_t i = 0; i < sizeof(data); i++)
+    {
+        CHECK(data[i] == 0xFF);
+    }
+    CHECK(g_nor_model.errors == 0);
+}
+
+static void test_program_erase(void)
+{
+    check_program_erase(g_macronix_id);
+    check_program_erase(g_winbond_id);
+    check_program_erase(g_micron_id);
+}
+
+/* Bus clocks of 64 KB of page programs and of reads in 32 bytes cache lines */
+static void measure(const uint8_t jedec_id[3], bool io23_connected, uint64_t *program_clocks, uint64_t *read_clocks)
+{
+    static uint8_t data[0x10000];
+    uint64_t clocks;
+
+    nor_model_init(jedec_id);
+    g_nor_model.io23_connected = io23_connected;
+    /* Only the bus is measured, the flash is never busy */
+    g_nor_model.page_program_us = 0;
+    fill_check_area();
+    probe();
+
+    memset(data, 0x3C, sizeof(data));
+    clocks = g_nor_model.clocks;
+    for (uint32_t addr = 0; addr < sizeof(data); addr += MFLASH_PAGE_SIZE)
+    {
+        mflash_nor_program(&g_nor, 0x10000 + addr, &data[addr], MFLASH_PAGE_SIZE);
+    }
+    *program_clocks = g_nor_model.clocks - clocks;
+
+    mflash_nor_read_mode(&g_nor);
+    clocks = g_nor_model.clocks;
+    nor_model_memory_read(0x10000, data, sizeof(data), 32);
+    *read_clocks = g_nor_model.clocks - clocks;
+
+    CHECK(data[0] == 0x3C);
+    CHECK(g_nor_model.errors == 0);
+}
+
+static void test_bus_clocks(void)
+{
+    uint64_t serial_program;
+    uint64_t serial_read;
+    uint64_t quad_program;
+    uint64_t quad_read;
+
+    measure(g_macronix_id, false, &serial_program, &serial_read);
+    measure(g_macronix_id, true, &quad_program, &quad_read);
+
+    printf("  64 KB program: %llu clocks serial, %llu quad (%.1fx)\n", (unsigned long long)serial_program,
+           (unsigned long long)quad_program, (double)serial_program / (double)quad_program);
+    printf("  64 KB read in 32 byte lines: %llu clocks serial, %llu quad (%.1fx)\n", (unsigned long long)serial_read,
+           (unsigned long long)quad_read, (double)serial_read / (double)quad_read);
+
+    CHECK(serial_program > 3U * quad_program);
+    CHECK(serial_read > 3U * quad_read);
+}
+
+int main(void)
+{
+    RUN(test_macronix_quad);
+    RUN(test_winbond_quad);
+    RUN(test_unknown_flash_stays_serial);
+    RUN(test_missing_io23_falls_back);
+    RUN(test_program_erase);
+    RUN(test_bus_clocks);
+
+    return unit_test_report();
+}
@@ -0,0 +1,215 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+/* Unit tests of the erase and program suspend/resume of 'mflash_nor.c' against the simulated
+ * NOR flash, with injected erase timings and interrupts reading the flash while it is busy.
+ * The latencies printed are the ones of the host model, not measured on a board. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mflash_drv.h"
+#include "mflash_nor.h"
+#include "nor_model.h"
+#include "unit_test.h"
+
+static const uint8_t g_macronix_id[3] = {0xC2, 0x20, 0x18};
+static const uint8_t g_winbond_id[3]  = {0xEF, 0x40, 0x18};
+static const uint8_t g_micron_id[3]   = {0x20, 0xBA, 0x18};
+
+static mflash_nor_t g_nor;
+
+/* Interrupt run time of the model */
+#define ISR_US (5)
+
+static void setup(const uint8_t jedec_id[3], bool xip, bool serve)
+{
+    nor_model_init(jedec_id);
+    memset(g_nor_model.flash, 0x00, sizeof(g_nor_model.flash));
+    mflash_nor_init(&g_nor, &g_nor_model_ops, xip);
+    g_nor.serve = serve;
+    mflash_nor_probe(&g_nor);
+    mflash_nor_read_mode(&g_nor);
+}
+
+static bool is_erased(uint32_t addr, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        if (g_nor_model.flash[addr + i] != 0xFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Erase 64 KB at 0x10000 in sectors or with a block erase, interrupts being raised every
+ * 'period_us'. Returns the longest time an interrupt waited, in microseconds. */
+static uint32_t erase_64k(bool block, uint32_t period_us)
+{
+    uint64_t start_ns = g_nor_model.now_ns;
+
+    nor_model_interrupts(period_us, ISR_US, g_nor.xip);
+
+    if (block)
+    {
+        mflash_nor_erase(&g_nor, 0x10000, kMflashNor_EraseBlock64);
+        mflash_nor_read_mode(&g_nor);
+        nor_model_serve();
+    }
+    else
+    {
+        for (uint32_t addr = 0x10000; addr < 0x20000; addr += MFLASH_SECTOR_SIZE)
+        {
+            mflash_nor_erase(&g_nor, addr, kMflashNor_EraseSector);
+            mflash_nor_read_mode(&g_nor);
+            /* Interrupts are unmasked between the sectors */
+            nor_model_serve();
+        }
+    }
+
+    CHECK(is_erased(0x10000, 0x10000));
+    CHECK(g_nor_model.flash[0xFFFF] == 0x00);
+    CHECK(g_nor_model.flash[0x20000] == 0x00);
+    CHECK(g_nor_model.irq_bad_reads == 0);
+    CHECK(g_nor_model.errors == 0);
+    CHECK(false == g_nor_model.suspended);
+
+    printf("  %s, %u us interrupts: worst latency %llu us, %u suspends, %u interrupts, %llu ms\n",
+           block ? "64 KB block erase" : "64 KB in sectors", period_us,
+           (unsigned long long)(g_nor_model.irq_max_latency_ns / 1000U), g_nor.suspends, g_nor_model.irq_served,
+           (unsigned long long)((g_nor_model.now_ns - start_ns) / 1000000U));
+
+    return (uint32_t)(g_nor_model.irq_max_latency_ns / 1000U);
+}
+
+/* Interrupts masked for the whole operation, as with MFLASH_SUSPEND_ENABLE set to 0 */
+static void test_masked_latency(void)
+{
+    setup(g_macronix_id, true, false);
+    CHECK(erase_64k(false, 1000) >= 44000);
+    CHECK(g_nor.suspends == 0);
+    /* The driver measures the same latency as the interrupts */
+    CHECK(g_nor.max_latency_us >= 44000);
+
+    setup(g_macronix_id, true, false);
+    CHECK(erase_64k(true, 1000) >= 399000);
+}
+
+static void test_suspend_sector_erase(void)
+{
+    setup(g_macronix_id, true, true);
+    CHECK(erase_64k(false, 1000) < 200);
+    CHECK(g_nor.suspends > 0);
+    CHECK(g_nor.max_latency_us < 200);
+
+    setup(g_winbond_id, true, true);
+    CHECK(erase_64k(false, 1000) < 200);
+    CHECK(g_nor.suspends > 0);
+}
+
+static void test_suspend_block_erase(void)
+{
+    setup(g_macronix_id, true, true);
+    CHECK(erase_64k(true, 1000) < 200);
+    CHECK(g_nor.suspends >= 390);
+}
+
+/* An image in SRAM serves the interrupts while the flash is busy, without suspending */
+static void test_sram_image(void)
+{
+    setup(g_macronix_id, false, true);
+    CHECK(erase_64k(false, 1000) < 50);
+    CHECK(g_nor.suspends == 0);
+}
+
+/* Interrupts coming faster than MFLASH_NOR_RESUME_TIME_US still let the erase progress */
+static void test_interrupt_storm(void)
+{
+    uint64_t quiet_ns;
+    uint64_t storm_ns;
+
+    setup(g_macronix_id, true, true);
+    erase_64k(false, 0);
+    quiet_ns = g_nor_model.now_ns;
+
+    setup(g_macronix_id, true, true);
+    CHECK(erase_64k(false, 50) < 200);
+    storm_ns = g_nor_model.now_ns;
+
+    printf("  50 us interrupts: total time +%llu%%\n", (unsigned long long)(((storm_ns - quiet_ns) * 100U) / quiet_ns));
+    CHECK(storm_ns < 2U * quiet_ns);
+}
+
+/* A flash without known suspend opcodes keeps the interrupts waiting for the end of the operation */
+static void test_unknown_flash_not_suspended(void)
+{
+    setup(g_micron_id, true, true);
+    CHECK(erase_64k(false, 1000) >= 44000);
+    CHECK(g_nor.suspends == 0);
+}
+
+/* Interrupts reading the flash in the middle of page programs */
+static void test_suspend_program(void)
+{
+    uint8_t page[MFLASH_PAGE_SIZE];
+
+    setup(g_macronix_id, true, true);
+    memset(g_nor_model.flash, 0xFF, sizeof(g_nor_model.flash));
+    g_nor_model.page_program_us = 3000;
+    nor_model_interrupts(250, ISR_US, true);
+
+    for (uint32_t i = 0; i < sizeof(page); i++)
+    {
+        page[i] = (uint8_t)(i * 3U);
+    }
+
+    for (uint32_t addr = 0; addr < 0x1000; addr += MFLASH_PAGE_SIZE)
+    {
+        mflash_nor_program(&g_nor, addr, page, sizeof(page));
+        mflash_nor_read_mode(&g_nor);
+        nor_model_serve();
+        CHECK(memcmp(&g_nor_model.flash[addr], page, sizeof(page)) == 0);
+    }
+
+    CHECK(g_nor.suspends > 0);
+    CHECK(g_nor_model.irq_max_latency_ns < 200000U);
+    CHECK(g_nor_model.irq_bad_reads == 0);
+    CHECK(g_nor_model.errors == 0);
+}
+
+int main(void)
+{
+    RUN(test_masked_latency);
+    RUN(test_suspend_sector_erase);
+    RUN(test_suspend_block_erase);
+    RUN(test_sram_image);
+    RUN(test_interrupt_storm);
+    RUN(test_unknown_flash_not_suspended);
+    RUN(test_suspend_program);
+
+    return unit_test_report();
+}
@@ -0,0 +1,59 @@
+/*
+ * FreeRTOS version 202012.00-LTS
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://aws.amazon.com/freertos
+ * http://www.FreeRTOS.org
+ */
+
+#ifndef __UNIT_TEST_H__
+#define __UNIT_TEST_H__
+
+#include <stdio.h>
+
+/* Smallest test harness: CHECK reports a failed condition and goes on, RUN runs a test,
+ * unit_test_report gives the exit status of the test program */
+
+static unsigned int g_unit_test_failures;
+
+#define CHECK(cond)                                                            \
+    do                                                                         \
+    {                                                                          \
+        if (!(cond))                                                           \
+        {                                                                      \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+            g_unit_test_failures++;                                            \
+        }                                                                      \
+    } while (0)
+
+#define RUN(test)                    \
+    do                               \
+    {                                \
+        printf("%s\n", #test);       \
+        test();                      \
+    } while (0)
+
+static inline int unit_test_report(void)
+{
+    printf("%s: %u failed checks\n", (g_unit_test_failures == 0) ? "PASS" : "FAIL", g_unit_test_failures);
+    return (g_unit_test_failures == 0) ? 0 : 1;
+}
+
+#endif
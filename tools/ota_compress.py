@@ -0,0 +1,165 @@
+# Copyright 2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+# Licensed under the Apache License, Version 2.0 (the "License").
+# You may not use this file except in compliance with the License.
+# A copy of the License is located at
+#     http://www.apache.org/licenses/LICENSE-2.0
+# or in the "license" file accompanying this file. This file is distributed
+# on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+# express or implied. See the License for the specific language governing
+# permissions and limitations under the License.
+#
+# OTA Image Compressor
+# Important Note: Requires Python 3
+#
+# Compresses a firmware image, or a delta patch created by ota_delta.py, for an OTA job created with
+# the file type OTA_FILE_TYPE (see source/ota_pal.c). The device decompresses the blocks into the update
+# slot as they are received and verifies the signature of the decompressed file, so the OTA job must carry
+# the signature of the image, not of the compressed file.
+#
+# Compressed file format:
+#   header  magic "NXLZ", uint32 little endian size of the decompressed file
+#   LZ4 block format sequences, the last sequence having literals only
+
+import struct
+import sys, argparse
+import time
+
+COMPRESS_MAGIC = b"NXLZ"
+COMPRESS_HEADER = struct.Struct("<4sI")
+
+# File type of compressed files in the OTA job.
+OTA_FILE_TYPE = 1
+
+# LZ4 block format limits: offsets are 16 bit, the last match starts at least 12 bytes before the end
+# and the last 5 bytes are literals.
+MIN_MATCH = 4
+MAX_DISTANCE = 65535
+MF_LIMIT = 12
+LAST_LITERALS = 5
+
+
+def encode_length(value):
+    out = bytearray()
+    while value >= 255:
+        out.append(255)
+        value -= 255
+    out.append(value)
+    return out
+
+
+def encode_sequence(literals, distance, match):
+    literal_code = min(len(literals), 15)
+    out = bytearray()
+    if match:
+        match_code = min(match - MIN_MATCH, 15)
+        out.append((literal_code << 4) | match_code)
+    else:
+        out.append(literal_code << 4)
+    if literal_code == 15:
+        out += encode_length(len(literals) - 15)
+    out += literals
+    if match:
+        out += struct.pack("<H", distance)
+        if match_code == 15:
+            out += encode_length(match - MIN_MATCH - 15)
+    return out
+
+
+def compress(data):
+    table = {}
+    out = bytearray(COMPRESS_HEADER.pack(COMPRESS_MAGIC, len(data)))
+    anchor = 0
+    pos = 0
+    limit = len(data) - MF_LIMIT
+
+    while pos < limit:
+        key = data[pos:pos + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = pos
+
+        if candidate is None or pos - candidate > MAX_DISTANCE:
+            pos += 1
+            continue
+
+        match = MIN_MATCH
+        match_limit = len(data) - LAST_LITERALS - pos
+        while match < match_limit and data[candidate + match] == data[pos + match]:
+            match += 1
+
+        out += encode_sequence(data[anchor:pos], pos - candidate, match)
+        pos += match
+        anchor = pos
+
+    out += encode_sequence(data[anchor:], 0, 0)
+    return bytes(out)
+
+
+def decompress(data):
+    magic, size = COMPRESS_HEADER.unpack_from(data)
+    if magic != COMPRESS_MAGIC:
+        raise ValueError("not a compressed file")
+
+    out = bytearray()
+    pos = COMPRESS_HEADER.size
+
+    def read_length(value):
+        nonlocal pos
+        if value == 15:
+            while True:
+                extension = data[pos]
+                pos += 1
+                value += extension
+                if extension != 255:
+                    break
+        return value
+
+    while len(out) < size:
+        token = data[pos]
+        pos += 1
+        literals = read_length(token >> 4)
+        out += data[pos:pos + literals]
+        pos += literals
+        if len(out) >= size:
+            break
+        distance, = struct.unpack_from("<H", data, pos)
+        pos += 2
+        match = read_length(token & 15) + MIN_MATCH
+        if distance == 0 or distance > len(out):
+            raise ValueError("invalid match distance %d" % distance)
+        for i in range(match):
+            out.append(out[-distance])
+
+    if len(out) != size or pos != len(data):
+        raise ValueError("invalid compressed file")
+    return bytes(out)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description='Script to compress an OTA image')
+    parser.add_argument("--input", help="Binary image or delta patch to compress", required=True)
+    parser.add_argument("--out", help="Compressed file to create", required=True)
+    args = parser.parse_args(argv)
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+
+    start = time.time()
+    compressed = compress(data)
+    compress_time = time.time() - start
+
+    if decompress(compressed) != data:
+        print("Error: compressed file does not decompress to %s" % args.input)
+        sys.exit(1)
+
+    with open(args.out, "wb") as f:
+        f.write(compressed)
+
+    print("######################################################")
+    print("Input size:         %d bytes" % len(data))
+    print("Compressed size:    %d bytes (%.1f%%)" % (len(compressed), 100.0 * len(compressed) / len(data)))
+    print("Compressed in:      %.2f s" % compress_time)
+    print("######################################################")
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
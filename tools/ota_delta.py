@@ -0,0 +1,170 @@
+# Copyright 2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+# Licensed under the Apache License, Version 2.0 (the "License").
+# You may not use this file except in compliance with the License.
+# A copy of the License is located at
+#     http://www.apache.org/licenses/LICENSE-2.0
+# or in the "license" file accompanying this file. This file is distributed
+# on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+# express or implied. See the License for the specific language governing
+# permissions and limitations under the License.
+#
+# OTA Delta Patch Generator
+# Important Note: Requires Python 3
+#
+# Creates a patch rebuilding a new firmware image from the image running on the device. The device
+# applies the patch when the OTA file is closed (see source/ota_pal.c), then verifies the signature of
+# the rebuilt image, so the OTA job must carry the signature of the new image, not of the patch.
+#
+# Patch format, all values little endian:
+#   header  magic "NXDP", uint16 version, uint16 header size, uint32 source size, uint32 target size
+#   0x01    COPY   uint32 source offset, uint32 length
+#   0x02    INSERT uint32 length, followed by the literal bytes
+#   0x00    END
+
+import struct
+import sys, argparse
+import time
+
+PATCH_MAGIC = b"NXDP"
+PATCH_VERSION = 1
+PATCH_HEADER = struct.Struct("<4sHHII")
+
+CMD_END = 0
+CMD_COPY = 1
+CMD_INSERT = 2
+
+# Bytes indexed to find matches in the old image, and shortest match worth a COPY command.
+MATCH_KEY_SIZE = 8
+MIN_COPY_SIZE = 16
+
+# OTA file block size, see otaconfigLOG2_FILE_BLOCK_SIZE in source/ota_config.h.
+OTA_BLOCK_SIZE = 1024
+
+
+def create_patch(old, new):
+    index = {}
+    for offset in range(len(old) - MATCH_KEY_SIZE, -1, -1):
+        index[old[offset:offset + MATCH_KEY_SIZE]] = offset
+
+    commands = []
+    literal = bytearray()
+    expected = None
+    pos = 0
+
+    def match_length(src):
+        length = 0
+        limit = min(len(old) - src, len(new) - pos)
+        while length < limit and old[src + length] == new[pos + length]:
+            length += 1
+        return length
+
+    while pos < len(new):
+        best_src, best_len = 0, 0
+
+        # Code moved by an insertion usually continues to match right after the previous copy.
+        candidates = [index.get(bytes(new[pos:pos + MATCH_KEY_SIZE]))]
+        if expected is not None and expected < len(old):
+            candidates.insert(0, expected)
+
+        for src in candidates:
+            if src is not None:
+                length = match_length(src)
+                if length > best_len:
+                    best_src, best_len = src, length
+
+        if best_len >= MIN_COPY_SIZE:
+            if literal:
+                commands.append(struct.pack("<BI", CMD_INSERT, len(literal)) + bytes(literal))
+                literal = bytearray()
+            commands.append(struct.pack("<BII", CMD_COPY, best_src, best_len))
+            pos += best_len
+            expected = best_src + best_len
+        else:
+            literal.append(new[pos])
+            pos += 1
+            if expected is not None:
+                expected += 1
+
+    if literal:
+        commands.append(struct.pack("<BI", CMD_INSERT, len(literal)) + bytes(literal))
+    commands.append(struct.pack("<B", CMD_END))
+
+    header = PATCH_HEADER.pack(PATCH_MAGIC, PATCH_VERSION, PATCH_HEADER.size, len(old), len(new))
+    return header + b"".join(commands)
+
+
+def apply_patch(old, patch):
+    magic, version, header_size, source_size, target_size = PATCH_HEADER.unpack_from(patch)
+    if magic != PATCH_MAGIC or version != PATCH_VERSION or source_size != len(old):
+        raise ValueError("patch does not apply to this image")
+
+    new = bytearray()
+    pos = header_size
+    while True:
+        command = patch[pos]
+        pos += 1
+        if command == CMD_END:
+            break
+        elif command == CMD_COPY:
+            src, length = struct.unpack_from("<II", patch, pos)
+            pos += 8
+            new += old[src:src + length]
+        elif command == CMD_INSERT:
+            length, = struct.unpack_from("<I", patch, pos)
+            pos += 4
+            new += patch[pos:pos + length]
+            pos += length
+        else:
+            raise ValueError("unknown patch command %d" % command)
+
+    if len(new) != target_size:
+        raise ValueError("patch produced %d bytes instead of %d" % (len(new), target_size))
+    return bytes(new)
+
+
+def bytes_on_air(size, block_overhead):
+    blocks = (size + OTA_BLOCK_SIZE - 1) // OTA_BLOCK_SIZE
+    return blocks, size + blocks * block_overhead
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description='Script to create an OTA delta patch')
+    parser.add_argument("--old", help="Binary image running on the device", required=True)
+    parser.add_argument("--new", help="Binary image to update to", required=True)
+    parser.add_argument("--out", help="Patch file to create", required=True)
+    parser.add_argument("--block-overhead", help="Estimated MQTT and CBOR bytes per OTA block", type=int, default=100, required=False)
+    args = parser.parse_args(argv)
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+
+    start = time.time()
+    patch = create_patch(old, new)
+    create_time = time.time() - start
+
+    start = time.time()
+    if apply_patch(old, patch) != new:
+        print("Error: patch does not rebuild %s" % args.new)
+        sys.exit(1)
+    apply_time = time.time() - start
+
+    with open(args.out, "wb") as f:
+        f.write(patch)
+
+    full_blocks, full_air = bytes_on_air(len(new), args.block_overhead)
+    delta_blocks, delta_air = bytes_on_air(len(patch), args.block_overhead)
+
+    print("######################################################")
+    print("Image size:         %d bytes" % len(new))
+    print("Patch size:         %d bytes" % len(patch))
+    print("Full update:        %d blocks, ~%d bytes on air" % (full_blocks, full_air))
+    print("Delta update:       %d blocks, ~%d bytes on air (%.1f%%)" % (delta_blocks, delta_air, 100.0 * delta_air / full_air))
+    print("Patch created in:   %.2f s, verified on host in %.2f s" % (create_time, apply_time))
+    print("The device logs its apply time when the OTA file is closed.")
+    print("######################################################")
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -0,0 +1,149 @@
+# Copyright 2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+# Licensed under the Apache License, Version 2.0 (the "License").
+# You may not use this file except in compliance with the License.
+# A copy of the License is located at
+#     http://www.apache.org/licenses/LICENSE-2.0
+# or in the "license" file accompanying this file. This file is distributed
+# on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+# express or implied. See the License for the specific language governing
+# permissions and limitations under the License.
+#
+# OTA HTTPS File Server
+# Important Note: Requires Python 3
+#
+# Serves a file over HTTPS with HTTP/1.1 range requests and kept alive connections, standing in for the
+# pre-signed S3 URL of an OTA job when running the HTTP download benchmark of the device (see
+# OTA_HTTP_BENCHMARK_ENABLED in source/ota_http.h). Pipelined requests are answered in order, and the
+# throughput of every connection is printed when it is closed.
+#
+# Without --cert and --key, a self-signed certificate is created for --host with openssl, and printed as
+# the C string to define as OTA_HTTP_BENCHMARK_ROOT_CA_PEM.
+
+import http.server
+import os
+import re
+import ssl
+import subprocess
+import sys, argparse
+import tempfile
+import time
+
+RANGE_PATTERN = re.compile(r"bytes=(\d+)-(\d*)$")
+
+
+class RangeRequestHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def setup(self):
+        super().setup()
+        self.requests = 0
+        self.body_bytes = 0
+        self.start = time.time()
+
+    def finish(self):
+        super().finish()
+        elapsed = time.time() - self.start
+        if self.requests:
+            print("%s: %d requests, %d bytes in %.2f s (%d B/s)" %
+                  (self.client_address[0], self.requests, self.body_bytes, elapsed,
+                   self.body_bytes / elapsed if elapsed > 0 else 0))
+
+    def do_GET(self):
+        data = self.server.data
+        self.requests += 1
+
+        if self.path.split("?")[0] != self.server.path:
+            self.send_error(404)
+            return
+
+        match = RANGE_PATTERN.match(self.headers.get("Range", ""))
+        if match is None:
+            self.send_response(200)
+            body = data
+        else:
+            start = int(match.group(1))
+            end = int(match.group(2)) if match.group(2) else len(data) - 1
+            end = min(end, len(data) - 1)
+            if start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(data))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, len(data)))
+            body = data[start:end + 1]
+
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+        self.body_bytes += len(body)
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            super().log_message(format, *args)
+
+
+def create_certificate(host, directory):
+    cert = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    san = "IP:%s" % host if re.match(r"^[\d.]+$", host) else "DNS:%s" % host
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1",
+                    "-nodes", "-days", "365", "-subj", "/CN=%s" % host, "-addext", "subjectAltName=%s" % san,
+                    "-addext", "basicConstraints=critical,CA:TRUE", "-keyout", key, "-out", cert],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+def print_c_string(cert):
+    with open(cert) as f:
+        lines = f.read().splitlines()
+    print("#define OTA_HTTP_BENCHMARK_ROOT_CA_PEM \\")
+    for line in lines:
+        print("    \"%s\\n\" \\" % line)
+    print("    \"\"")
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description='Script to serve an OTA file over HTTPS')
+    parser.add_argument("--file", help="File to serve", required=True)
+    parser.add_argument("--host", help="Address of this host as seen by the device", required=True)
+    parser.add_argument("--port", help="Port to listen on", type=int, default=8443, required=False)
+    parser.add_argument("--cert", help="Certificate of the server, created if not given", required=False)
+    parser.add_argument("--key", help="Private key of the server", required=False)
+    parser.add_argument("--verbose", help="Log every request", action="store_true", required=False)
+    args = parser.parse_args(argv)
+
+    with open(args.file, "rb") as f:
+        data = f.read()
+
+    with tempfile.TemporaryDirectory() as directory:
+        if args.cert is None:
+            cert, key = create_certificate(args.host, directory)
+        else:
+            cert, key = args.cert, args.key
+
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(cert, key)
+
+        server = http.server.ThreadingHTTPServer(("", args.port), RangeRequestHandler)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+        server.data = data
+        server.path = "/" + os.path.basename(args.file)
+        server.verbose = args.verbose
+
+        print("######################################################")
+        print_c_string(cert)
+        print("#define OTA_HTTP_BENCHMARK_URL \"https://%s:%d%s\"" % (args.host, args.port, server.path))
+        print("Serving %d bytes, press Ctrl+C to stop." % len(data))
+        print("######################################################")
+
+        try:
+            server.serve_forever()
+        except KeyboardInterrupt:
+            pass
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
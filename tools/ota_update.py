@@ -21,6 +21,8 @@ from botocore.exceptions import ClientError
 import sys, argparse
 import subprocess
 import json
+import ota_delta
+import ota_compress
 
 parser = argparse.ArgumentParser(description='Script to start OTA update')
 parser.add_argument("--thing-name", help="Name of thing",required=True)
@@ -28,6 +30,9 @@ parser.add_argument("--s3bucket", help="S3 bucket to store firmware updates", re
 parser.add_argument("--otasigningprofile", help="Signing profile to be created or used", required=True)
 parser.add_argument("--signingcertificateid", help="certificate id (not arn) to be used", required=True)
 parser.add_argument("--codelocation", help="base folder location (can be relative)",default="../", required=False)
+parser.add_argument("--delta-from", help="binary image running on the device, sends a delta patch against it instead of the whole image", required=False)
+parser.add_argument("--compress", help="compress the image or delta patch sent to the device", action="store_true", required=False)
+parser.add_argument("--signingkey", help="OTA code signing private key, used to sign the image of a delta or compressed update",default="ecdsasigner.key", required=False)
 args=parser.parse_args()
 
 
@@ -147,6 +152,38 @@ class AWS_IoT_OTA:
         
         print("Prepared BIN file at %s" % str(self.IMAGE_PATH))
 
+    # Create the delta patch against the image running on the device
+    def PrepareDeltaFile(self):
+        ota_delta.main(["--old", args.delta_from, "--new", str(self.IMAGE_PATH), "--out", str(self.PATCH_PATH)])
+        self.UPLOAD_PATH = self.PATCH_PATH
+        print("Prepared delta patch at %s" % str(self.PATCH_PATH))
+
+    # Compress the image or the delta patch
+    def PrepareCompressedFile(self):
+        ota_compress.main(["--input", str(self.UPLOAD_PATH), "--out", str(self.COMPRESSED_PATH)])
+        self.UPLOAD_PATH = self.COMPRESSED_PATH
+        print("Prepared compressed file at %s" % str(self.COMPRESSED_PATH))
+
+    # The device verifies the signature of the image it rebuilds, so the image is signed here rather than
+    # the uploaded file by the signing profile.
+    def SignImage(self):
+        command = "openssl dgst -sha256 -sign " + args.signingkey + " " + str(self.IMAGE_PATH)
+
+        try:
+            result = subprocess.run(
+                command,
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE,
+                shell=True,
+                timeout=30,
+            )
+            if result.returncode != 0 or len(result.stdout) == 0:
+                raise Exception(result.stderr.decode())
+            self.signature = result.stdout
+        except Exception as e:
+            print("Error signing image %s: %s" % (str(self.IMAGE_PATH), e))
+            sys.exit()
+
 
     # Copy the file to the s3 bucket
     def CopyFirmwareFileToS3(self):
@@ -165,7 +202,7 @@ class AWS_IoT_OTA:
                 VersioningConfiguration={
                     'MFADelete': 'Disabled',
                     'Status': 'Enabled'})
-            self.s3.meta.client.upload_file(str(self.IMAGE_PATH), args.s3bucket, self.IMAGE_NAME)
+            self.s3.meta.client.upload_file(str(self.UPLOAD_PATH), args.s3bucket, self.IMAGE_NAME)
         except Exception as e:
             print("Error uploading file to s3: %s", e)
             sys.exit()
@@ -305,6 +342,23 @@ class AWS_IoT_OTA:
             target="arn:aws:iot:"+args.region+":"+args.account+":"+args.devicetype+"/"+args.thing_name
             updateId="nxp-"+str(randomValue)
 
+            if args.compress:
+                files[0]['fileType'] = ota_compress.OTA_FILE_TYPE
+
+            if args.delta_from or args.compress:
+                files[0]['codeSigning'] = {
+                    'customCodeSigning':{
+                        'signature':{
+                            'inlineDocument': self.signature
+                        },
+                        'certificateChain':{
+                            'certificateName': 'Code Verify Key'
+                        },
+                        'hashAlgorithm': 'SHA256',
+                        'signatureAlgorithm': 'ECDSA'
+                    }
+                }
+
             print ("Files for update: %s" % files)
             
             ota_update=iot.create_ota_update(
@@ -346,14 +400,24 @@ class AWS_IoT_OTA:
         self.BUILD_PATH = Path(args.codelocation) / Path("Debug/")
         self.IMAGE_NAME = "lpc54018iotmodule_freertos_sesip.bin"
         self.IMAGE_PATH = self.BUILD_PATH / Path(self.IMAGE_NAME)
+        self.PATCH_PATH = self.BUILD_PATH / Path("lpc54018iotmodule_freertos_sesip_patch.bin")
+        self.COMPRESSED_PATH = self.BUILD_PATH / Path("lpc54018iotmodule_freertos_sesip_lz4.bin")
+        self.UPLOAD_PATH = self.IMAGE_PATH
     
 
     def DoUpdate(self):
         self.PrepareBinFile()
+        if args.delta_from:
+            self.PrepareDeltaFile()
+        if args.compress:
+            self.PrepareCompressedFile()
+        if args.delta_from or args.compress:
+            self.SignImage()
         self.CopyFirmwareFileToS3()
         self.GetLatestS3FileVersion()
         self.CreateRole()
-        self.CreateSigningProfile()
+        if not (args.delta_from or args.compress):
+            self.CreateSigningProfile()
         self.CreateOTAJob()
 
 